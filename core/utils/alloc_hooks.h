@@ -0,0 +1,104 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "nvbit.h"
+#include "alloc_registry.h"
+
+/* Keeps an AllocRegistry up to date, to be called from nvbit_at_cuda_event
+ * with the same arguments. The device pointer of an allocation is only known
+ * once the call returned, so allocations and frees are both recorded at exit
+ * (is_exit), and only if the driver call succeeded. Returns the kind of
+ * event: 1 allocation, -1 free, 0 anything else; info, if not NULL,
+ * describes the allocation. */
+static inline int alloc_hooks_cuda_event(AllocRegistry &registry,
+                                         int is_exit, nvbit_api_cuda_t cbid,
+                                         void *params, CUresult *pStatus,
+                                         alloc_info_t *info) {
+    if (!is_exit || (pStatus != NULL && *pStatus != CUDA_SUCCESS)) {
+        return 0;
+    }
+    uint64_t base = 0;
+    uint64_t size = 0;
+    int32_t kind = ALLOC_DEVICE;
+    switch (cbid) {
+        case API_CUDA_cuMemAlloc_v2: {
+            cuMemAlloc_v2_params *p = (cuMemAlloc_v2_params *)params;
+            base = *p->dptr;
+            size = p->bytesize;
+            break;
+        }
+        case API_CUDA_cuMemAlloc: {
+            cuMemAlloc_params *p = (cuMemAlloc_params *)params;
+            base = *p->dptr;
+            size = p->bytesize;
+            break;
+        }
+        case API_CUDA_cuMemAllocManaged: {
+            cuMemAllocManaged_params *p = (cuMemAllocManaged_params *)params;
+            base = *p->dptr;
+            size = p->bytesize;
+            kind = ALLOC_MANAGED;
+            break;
+        }
+        case API_CUDA_cuMemAllocPitch_v2: {
+            cuMemAllocPitch_v2_params *p = (cuMemAllocPitch_v2_params *)params;
+            base = *p->dptr;
+            size = (uint64_t)*p->pPitch * p->Height;
+            kind = ALLOC_PITCH;
+            break;
+        }
+        case API_CUDA_cuMemAllocPitch: {
+            cuMemAllocPitch_params *p = (cuMemAllocPitch_params *)params;
+            base = *p->dptr;
+            size = (uint64_t)*p->pPitch * p->Height;
+            kind = ALLOC_PITCH;
+            break;
+        }
+        case API_CUDA_cuMemFree_v2:
+            return registry.remove(((cuMemFree_v2_params *)params)->dptr,
+                                   info)
+                       ? -1
+                       : 0;
+        case API_CUDA_cuMemFree:
+            return registry.remove(((cuMemFree_params *)params)->dptr, info)
+                       ? -1
+                       : 0;
+        default:
+            return 0;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    int32_t id = registry.add(base, size, kind);
+    if (info != NULL) {
+        alloc_info_t a = {base, size, id, kind};
+        *info = a;
+    }
+    return 1;
+}
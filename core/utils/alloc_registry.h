@@ -0,0 +1,155 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+#include <map>
+
+/* Registry of the live device allocations of an application, to find which
+ * allocation an address belongs to. Every allocation gets an id, assigned in
+ * allocation order starting from 0 and never reused, which is the same in
+ * every run of a deterministic application.
+ *
+ * Live allocations never overlap, so the interval tree is a balanced tree of
+ * the allocations ordered by base address (std::map): the allocation holding
+ * an address is the last one starting at or before it, found in O(log n).
+ * The last allocation found is cached since consecutive accesses mostly hit
+ * the same one. All the methods are thread safe, lookup_many() takes the
+ * lock once for a whole batch of addresses.
+ *
+ * Nothing here touches CUDA, alloc_hooks.h feeds the registry from the
+ * nvbit_at_cuda_event callback. */
+
+#define ALLOC_ID_NONE (-1)
+
+enum { ALLOC_DEVICE, ALLOC_MANAGED, ALLOC_PITCH };
+
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+    int32_t id;
+    int32_t kind;
+} alloc_info_t;
+
+class AllocRegistry {
+  private:
+    std::map<uint64_t, alloc_info_t> allocs;
+    int32_t next_id;
+    /* last allocation found, NULL if none */
+    const alloc_info_t *last;
+    mutable pthread_mutex_t mutex;
+
+    const alloc_info_t *find(uint64_t addr) {
+        if (last != NULL && addr - last->base < last->size) {
+            return last;
+        }
+        auto it = allocs.upper_bound(addr);
+        if (it == allocs.begin()) {
+            return NULL;
+        }
+        --it;
+        if (addr - it->second.base >= it->second.size) {
+            return NULL;
+        }
+        last = &it->second;
+        return last;
+    }
+
+  public:
+    AllocRegistry() : next_id(0), last(NULL) {
+        pthread_mutex_init(&mutex, NULL);
+    }
+
+    /* returns the id of the new allocation, an allocation already at base
+     * (a missed free) is replaced */
+    int32_t add(uint64_t base, uint64_t size, int32_t kind = ALLOC_DEVICE) {
+        pthread_mutex_lock(&mutex);
+        alloc_info_t info = {base, size, next_id++, kind};
+        allocs[base] = info;
+        last = NULL;
+        pthread_mutex_unlock(&mutex);
+        return info.id;
+    }
+
+    /* returns false if there is no allocation at base */
+    bool remove(uint64_t base, alloc_info_t *info = NULL) {
+        pthread_mutex_lock(&mutex);
+        auto it = allocs.find(base);
+        bool found = it != allocs.end();
+        if (found) {
+            if (info != NULL) {
+                *info = it->second;
+            }
+            allocs.erase(it);
+            last = NULL;
+        }
+        pthread_mutex_unlock(&mutex);
+        return found;
+    }
+
+    /* allocation holding addr, false if none */
+    bool lookup(uint64_t addr, alloc_info_t *info) {
+        pthread_mutex_lock(&mutex);
+        const alloc_info_t *a = find(addr);
+        if (a != NULL) {
+            *info = *a;
+        }
+        pthread_mutex_unlock(&mutex);
+        return a != NULL;
+    }
+
+    /* ids[i] is the id of the allocation holding addrs[i], ALLOC_ID_NONE
+     * if none */
+    void lookup_many(const uint64_t *addrs, int n, int32_t *ids) {
+        pthread_mutex_lock(&mutex);
+        for (int i = 0; i < n; i++) {
+            const alloc_info_t *a = find(addrs[i]);
+            ids[i] = a != NULL ? a->id : ALLOC_ID_NONE;
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    /* calls f(const alloc_info_t &) on every live allocation, in address
+     * order, f must not call back into the registry */
+    template <typename F>
+    void for_each(F f) const {
+        pthread_mutex_lock(&mutex);
+        for (auto &it : allocs) {
+            f(it.second);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    size_t size() const {
+        pthread_mutex_lock(&mutex);
+        size_t n = allocs.size();
+        pthread_mutex_unlock(&mutex);
+        return n;
+    }
+};
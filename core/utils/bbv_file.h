@@ -0,0 +1,318 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* Sparse binary format of the basic block vectors (BBVs) written by bbv_count
+ * and bbv_count_tb, and the host side writer/reader for it. This file only
+ * depends on the C/C++ standard library so that offline tools (see
+ * tools/bbv_count/bbv_to_simpoint.cpp) can be built without CUDA.
+ *
+ * Layout (all fixed size integers little endian):
+ *
+ *   bbv_file_header_t
+ *   kernel record 0 .. N-1, one per kernel launch, each made of
+ *     bbv_kernel_header_t
+ *     name                         name_size bytes, not '\0' terminated
+ *     payload                      payload_size bytes, varint encoded
+ *
+ * The payload holds the number of instructions of each of the num_bbs basic
+ * blocks, followed by num_rows rows (one per CTA or per warp). A row is the
+ * number of basic blocks executed by it followed by (bb id delta, count)
+ * pairs of those basic blocks in increasing bb id order, where count is the
+ * number of times the basic block was executed. All of them are unsigned
+ * LEB128 varints, so most rows of large grids take a few bytes.
+ *
+ * Records are appended as launches complete, so a file is readable up to the
+ * last complete record even if the application did not terminate cleanly. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define BBV_FILE_MAGIC "NVBITBBV"
+#define BBV_FILE_VERSION 1
+#define BBV_KERNEL_MAGIC 0x4c4e524bu /* "KRNL" */
+
+/* what a row of a kernel record is the basic block vector of */
+enum { BBV_ROW_CTA = 0, BBV_ROW_WARP = 1 };
+
+/* payload encodings, only plain varints for now */
+enum { BBV_CODEC_VARINT = 0 };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} bbv_file_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t kernel_id;
+    uint32_t row_kind;
+    uint32_t codec;
+    uint32_t num_rows;
+    uint32_t num_bbs;
+    uint32_t name_size;
+    uint32_t reserved;
+    uint64_t payload_size;
+} bbv_kernel_header_t;
+
+static inline void bbv_put_varint(std::vector<uint8_t> &buf, uint64_t v) {
+    while (v >= 0x80) {
+        buf.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    buf.push_back((uint8_t)v);
+}
+
+/* decode a varint from [*p, end), returns false if truncated or too long */
+static inline bool bbv_get_varint(const uint8_t **p, const uint8_t *end,
+                                  uint64_t *v) {
+    uint64_t r = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        uint8_t b = *(*p)++;
+        r |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            *v = r;
+            return true;
+        }
+    }
+    return false;
+}
+
+class BBVFileWriter {
+  private:
+    FILE *f;
+    std::vector<uint8_t> payload;
+
+  public:
+    BBVFileWriter() : f(NULL) {}
+
+    bool open(const char *path) {
+        f = fopen(path, "wb");
+        if (f == NULL) {
+            return false;
+        }
+        bbv_file_header_t hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, BBV_FILE_MAGIC, sizeof(hdr.magic));
+        hdr.version = BBV_FILE_VERSION;
+        if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+            fclose(f);
+            f = NULL;
+            return false;
+        }
+        return true;
+    }
+
+    bool is_open() const { return f != NULL; }
+
+    /* append the BBVs of a kernel launch, counts is the dense num_rows x
+     * num_bbs matrix of basic block execution counts (row major) and
+     * bb_sizes the number of instructions of each basic block */
+    template <typename T>
+    bool write_kernel(const char *name, uint32_t kernel_id, uint32_t row_kind,
+                      uint32_t num_rows, uint32_t num_bbs,
+                      const int *bb_sizes, const T *counts) {
+        payload.clear();
+        for (uint32_t bb = 0; bb < num_bbs; bb++) {
+            bbv_put_varint(payload, bb_sizes[bb]);
+        }
+        for (uint32_t r = 0; r < num_rows; r++) {
+            const T *row = counts + (size_t)r * num_bbs;
+            uint32_t nnz = 0;
+            for (uint32_t bb = 0; bb < num_bbs; bb++) {
+                nnz += row[bb] != 0;
+            }
+            bbv_put_varint(payload, nnz);
+            uint32_t prev = 0;
+            for (uint32_t bb = 0; bb < num_bbs; bb++) {
+                if (row[bb] != 0) {
+                    bbv_put_varint(payload, bb - prev);
+                    bbv_put_varint(payload, (uint64_t)row[bb]);
+                    prev = bb;
+                }
+            }
+        }
+
+        bbv_kernel_header_t hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = BBV_KERNEL_MAGIC;
+        hdr.kernel_id = kernel_id;
+        hdr.row_kind = row_kind;
+        hdr.codec = BBV_CODEC_VARINT;
+        hdr.num_rows = num_rows;
+        hdr.num_bbs = num_bbs;
+        hdr.name_size = strlen(name);
+        hdr.payload_size = payload.size();
+        if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+            fwrite(name, 1, hdr.name_size, f) != hdr.name_size ||
+            fwrite(payload.data(), 1, payload.size(), f) != payload.size()) {
+            return false;
+        }
+        /* keep the file readable up to this launch */
+        return fflush(f) == 0;
+    }
+
+    /* returns false if any write failed, including the ones of the data
+     * still buffered, since a failed flush is forgotten by fclose */
+    bool close() {
+        if (f == NULL) {
+            return false;
+        }
+        bool ok = !ferror(f);
+        ok = fclose(f) == 0 && ok;
+        f = NULL;
+        return ok;
+    }
+};
+
+/* one non zero entry of a basic block vector */
+typedef struct {
+    uint32_t bb;
+    uint64_t count;
+} bbv_entry_t;
+
+/* sequential reader, next_kernel() moves to the next record and next_row()
+ * decodes its rows one at a time */
+class BBVFileReader {
+  private:
+    FILE *f;
+    bbv_kernel_header_t hdr;
+    std::string name;
+    std::vector<int> bb_sizes;
+    std::vector<uint8_t> payload;
+    const uint8_t *pos;
+    uint32_t rows_left;
+    bool malformed;
+
+  public:
+    BBVFileReader() : f(NULL), pos(NULL), rows_left(0), malformed(false) {}
+
+    bool open(const char *path) {
+        rows_left = 0;
+        malformed = false;
+        f = fopen(path, "rb");
+        if (f == NULL) {
+            return false;
+        }
+        bbv_file_header_t fhdr;
+        if (fread(&fhdr, sizeof(fhdr), 1, f) != 1 ||
+            memcmp(fhdr.magic, BBV_FILE_MAGIC, sizeof(fhdr.magic)) != 0 ||
+            fhdr.version != BBV_FILE_VERSION) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (f != NULL) {
+            fclose(f);
+            f = NULL;
+        }
+    }
+
+    /* returns false at the end of the file or on a malformed record, which
+     * is_malformed() tells apart */
+    bool next_kernel() {
+        rows_left = 0;
+        size_t n = fread(&hdr, 1, sizeof(hdr), f);
+        if (n == 0) {
+            return false;
+        }
+        if (n != sizeof(hdr) || hdr.magic != BBV_KERNEL_MAGIC ||
+            hdr.codec != BBV_CODEC_VARINT) {
+            malformed = true;
+            return false;
+        }
+        name.resize(hdr.name_size);
+        payload.resize(hdr.payload_size);
+        if ((hdr.name_size != 0 &&
+             fread(&name[0], 1, hdr.name_size, f) != hdr.name_size) ||
+            fread(payload.data(), 1, payload.size(), f) != payload.size()) {
+            malformed = true;
+            return false;
+        }
+
+        pos = payload.data();
+        const uint8_t *end = pos + payload.size();
+        bb_sizes.resize(hdr.num_bbs);
+        for (uint32_t bb = 0; bb < hdr.num_bbs; bb++) {
+            uint64_t v;
+            if (!bbv_get_varint(&pos, end, &v)) {
+                malformed = true;
+                return false;
+            }
+            bb_sizes[bb] = (int)v;
+        }
+        rows_left = hdr.num_rows;
+        return true;
+    }
+
+    bool is_malformed() const { return malformed; }
+
+    const bbv_kernel_header_t &kernel() const { return hdr; }
+    const std::string &kernel_name() const { return name; }
+    const std::vector<int> &get_bb_sizes() const { return bb_sizes; }
+
+    /* decode the next row of the current kernel, returns false once all the
+     * rows have been read or if the payload is corrupted */
+    bool next_row(std::vector<bbv_entry_t> &row) {
+        row.clear();
+        if (rows_left == 0) {
+            return false;
+        }
+        const uint8_t *end = payload.data() + payload.size();
+        uint64_t nnz;
+        if (!bbv_get_varint(&pos, end, &nnz)) {
+            malformed = true;
+            return false;
+        }
+        uint64_t bb = 0;
+        for (uint64_t n = 0; n < nnz; n++) {
+            uint64_t delta, count;
+            if (!bbv_get_varint(&pos, end, &delta) ||
+                !bbv_get_varint(&pos, end, &count)) {
+                malformed = true;
+                return false;
+            }
+            bb += delta;
+            if (bb >= hdr.num_bbs) {
+                malformed = true;
+                return false;
+            }
+            bbv_entry_t e = {(uint32_t)bb, count};
+            row.push_back(e);
+        }
+        rows_left--;
+        return true;
+    }
+};
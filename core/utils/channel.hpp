@@ -34,132 +34,357 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include "channel_ring.h"
 #include "utils.h"
+#include "warp_copy.h"
+#include "channel_staging.h"
 
 #define ULL unsigned long long int
 
+/* What a push does when the consumer falls behind and no buffer is free:
+ * CHANNEL_BLOCK     the pushing warps wait for the host (no loss)
+ * CHANNEL_DROP      the warp flushing the channel waits, the packets pushed
+ *                   meanwhile are dropped
+ * CHANNEL_ADAPTIVE  the channel only accepts the pushes of about 1 warp out
+ *                   of 2^sample_shift, picked by a hash of the global warp
+ *                   id (no shared counter to update), the shift goes up
+ *                   every time a flush finds the host behind and down when
+ *                   it does not, the rest is sampled out. It needs at least
+ *                   2 buffers, with one the host is always behind
+ * Dropped and sampled out packets are counted per SM, see
+ * MultiChannelHost::get_overflow_counts. Pushes that must not be lost
+ * (i.e. end of kernel markers) always block. */
+enum {
+    CHANNEL_BLOCK = 0,
+    CHANNEL_DROP = 1,
+    CHANNEL_ADAPTIVE = 2
+};
+#define CHANNEL_MAX_SMS 1024
+#define CHANNEL_MAX_SAMPLE_SHIFT 16
+
+/* Optional per SM telemetry of the device side of the channels, see
+ * MultiChannelHost::get_telemetry. pushes and bytes count the channel
+ * reservations (one per staging buffer when staging is used), the wait
+ * cycles are clock64 cycles spent spinning: on the head while another warp
+ * flushes, on the tail for the writers of a full buffer before flushing it
+ * and on the doorbell of the next buffer while the host drains it. */
+typedef struct {
+    ULL pushes;
+    ULL bytes;
+    ULL flushes;
+    ULL head_wait_cycles;
+    ULL tail_wait_cycles;
+    ULL doorbell_wait_cycles;
+} channel_telemetry_t;
+
+/* host side counters of a channel, updated by the thread receiving from it */
+typedef struct {
+    uint64_t recvs;
+    uint64_t bytes;
+    /* time spent copying the received bytes from the device */
+    uint64_t recv_ns;
+    uint64_t max_recv_ns;
+} channel_host_stats_t;
+
 class ChannelDev {
   private:
     int id;
-    volatile int *doorbell;
 
+    /* one doorbell per buffer of the ring, in mapped host memory */
+    volatile int *doorbells;
+
+    /* ring of num_buffs buffers of buff_size bytes each */
     uint8_t *buff;
-    uint8_t *buff_end;
+    uint32_t buff_size;
+    int num_buffs;
+
+    /* buffer of the ring currently being filled */
+    volatile int curr_buff;
 
-    /* head/tail pointers */
-    uint8_t *volatile buff_write_head_ptr;
-    uint8_t *volatile buff_write_tail_ptr;
+    /* head/tail offsets inside the current buffer */
+    volatile ULL buff_write_head;
+    volatile ULL buff_write_tail;
+
+    /* overflow policy, CHANNEL_ADAPTIVE state and the per SM counts of
+     * dropped packets followed by the sampled out ones (CHANNEL_MAX_SMS
+     * each, shared by all the channels) */
+    int overflow_policy;
+    volatile uint32_t sample_shift;
+    ULL *overflow_counts;
+
+    /* CHANNEL_MAX_SMS entries shared by all the channels, NULL if the
+     * telemetry is off */
+    channel_telemetry_t *telemetry;
 
   public:
     ChannelDev() {}
 
-    __device__ __forceinline__ void push(void *packet, uint32_t nbytes) {
-        assert(nbytes != 0);
+    /* can_drop is false for the packets the overflow policy must not
+     * drop */
+    __device__ __forceinline__ void push(void *packet, uint32_t nbytes,
+                                         bool can_drop = true) {
+        uint8_t *curr_ptr = reserve(nbytes, can_drop);
+        if (curr_ptr == NULL) {
+            return;
+        }
+        memcpy(curr_ptr, packet, nbytes);
+        atomicAdd((ULL *)&buff_write_tail, (ULL)nbytes);
+    }
+
+    /* Push of a packet every active lane of the warp holds a copy of, the
+     * lanes call it together with the same packet (nbytes multiple of 8).
+     * The first active lane reserves the space with a single atomic and the
+     * lanes store their slices of the packet with 16 byte stores (see
+     * warp_copy.h) instead of one lane copying it all. npackets is the number
+     * of records the bytes hold, for the overflow accounting. */
+    __device__ __forceinline__ void push_warp(const void *packet,
+                                              uint32_t nbytes,
+                                              uint32_t npackets = 1) {
+        const int active_mask = __ballot(1);
+        const int laneid = get_laneid();
+        const int first_laneid = __ffs(active_mask) - 1;
+
+        uint64_t curr_ptr = 0;
+        if (laneid == first_laneid) {
+            curr_ptr = (uint64_t)reserve(nbytes, true, npackets);
+        }
+        curr_ptr = __shfl(curr_ptr, first_laneid);
+        if (curr_ptr == 0) {
+            return;
+        }
 
-        uint8_t *curr_ptr = NULL;
+        warp_copy_slice((uint8_t *)curr_ptr, (const uint64_t *)packet, nbytes,
+                        warp_rank(active_mask, laneid), __popc(active_mask));
 
-        while (curr_ptr == NULL) {
-            curr_ptr =
-                (uint8_t *)atomicAdd((ULL *)&buff_write_head_ptr, (ULL)nbytes);
+        /* every lane stores are visible before the tail covers them */
+        __threadfence();
+        __ballot(1);
+        if (laneid == first_laneid) {
+            atomicAdd((ULL *)&buff_write_tail, (ULL)nbytes);
+        }
+    }
 
-            /* if the current position plus nbytes is after buff_end, the
-             * buffer is full.
+    /* reserves nbytes in the current buffer, flushing it if full, the
+     * caller bumps the tail once they are written. Returns NULL if the
+     * overflow policy drops the npackets it holds (only if can_drop). */
+    __device__ __forceinline__ uint8_t *reserve(uint32_t nbytes,
+                                                bool can_drop,
+                                                uint32_t npackets = 1) {
+        assert(nbytes != 0 && nbytes <= buff_size);
+
+        if (can_drop && overflow_policy == CHANNEL_ADAPTIVE &&
+            sample_shift != 0) {
+            /* the warps kept at a shift are a subset of the ones kept at
+             * the shift below, so a warp keeps its packets until the
+             * shift crosses its hash. The warp id is salted so the choice
+             * is independent of the warp sampling of the tools, which
+             * hashes it too */
+            uint32_t warp = get_global_warp_id();
+            if (hd_mix32(warp ^ 0x9e3779b9) & ((1u << sample_shift) - 1)) {
+                atomicAdd(&overflow_counts[CHANNEL_MAX_SMS +
+                                           get_smid() % CHANNEL_MAX_SMS],
+                          (ULL)npackets);
+                return NULL;
+            }
+        }
+
+        channel_telemetry_t *t = NULL;
+        if (telemetry != NULL) {
+            t = &telemetry[get_smid() % CHANNEL_MAX_SMS];
+        }
+
+        ULL curr_off = 0;
+        bool reserved = false;
+
+        while (!reserved) {
+            curr_off = atomicAdd((ULL *)&buff_write_head, (ULL)nbytes);
+
+            /* if the current position plus nbytes is after the end of the
+             * buffer, the buffer is full.
              * Many warps could find condition true, but only the first warp
              * will find true the condition after. */
-            if (curr_ptr + nbytes > buff_end) {
+            if (curr_off + nbytes > buff_size) {
                 /* I am the first warp that found the buffer full and
                  * I am the one responsible for flushing the buffer out */
-                if (curr_ptr <= buff_end) {
+                if (curr_off <= buff_size) {
                     /* wait until everyone completed to write */
-                    while (buff_write_tail_ptr != curr_ptr) {
+                    long long start = clock64();
+                    while (buff_write_tail != curr_off) {
+                    }
+                    if (t != NULL) {
+                        atomicAdd(&t->tail_wait_cycles,
+                                  (ULL)(clock64() - start));
                     }
 
                     /* flush buffer */
                     flush();
+                } else if (can_drop && overflow_policy == CHANNEL_DROP) {
+                    /* the buffer is being flushed, drop the packet */
+                    atomicAdd(&overflow_counts[get_smid() % CHANNEL_MAX_SMS],
+                              (ULL)npackets);
+                    return NULL;
                 } else {
                     /* waiting for buffer to flush */
-                    while (buff_write_head_ptr > buff_end) {
+                    long long start = clock64();
+                    while (buff_write_head > buff_size) {
+                    }
+                    if (t != NULL) {
+                        atomicAdd(&t->head_wait_cycles,
+                                  (ULL)(clock64() - start));
                     }
                 }
-                curr_ptr = NULL;
+            } else {
+                reserved = true;
             }
         }
 
-        memcpy(curr_ptr, packet, nbytes);
-        atomicAdd((ULL *)&buff_write_tail_ptr, (ULL)nbytes);
+        if (t != NULL) {
+            atomicAdd(&t->pushes, 1ULL);
+            atomicAdd(&t->bytes, (ULL)nbytes);
+        }
+
+        /* the current buffer can not change until we bump the tail, so it is
+         * safe to read it after the reservation */
+        return buff + (ULL)curr_buff * buff_size + curr_off;
     }
 
     __device__ __forceinline__ void flush() {
-        uint32_t nbytes = (uint32_t)(buff_write_tail_ptr - buff);
+        uint32_t nbytes = (uint32_t)buff_write_tail;
         // printf("FLUSH CHANNEL#%d: buffer bytes %d\n", id, nbytes);
         if (nbytes == 0) {
             return;
         }
 
+        channel_telemetry_t *t = NULL;
+        if (telemetry != NULL) {
+            t = &telemetry[get_smid() % CHANNEL_MAX_SMS];
+            atomicAdd(&t->flushes, 1ULL);
+        }
+
         /* make sure everything is visible in memory */
         __threadfence_system();
 
-        assert(*doorbell == 0);
+        int full_buff = curr_buff;
+        assert(doorbells[full_buff] == 0);
         /* notify current buffer has something*/
-        *doorbell = nbytes;
+        doorbells[full_buff] = nbytes;
         __threadfence_system();
 
-        /* wait for host to release the doorbell */
-        while (*doorbell != 0)
-            ;
+        /* switch to the next buffer of the ring, we only have to wait if the
+         * host has not drained it yet (always the case with one buffer) */
+        int next_buff = (full_buff + 1) % num_buffs;
+        if (doorbells[next_buff] != 0) {
+            if (overflow_policy == CHANNEL_ADAPTIVE &&
+                sample_shift < CHANNEL_MAX_SAMPLE_SHIFT) {
+                sample_shift++;
+            }
+            long long start = clock64();
+            while (doorbells[next_buff] != 0)
+                ;
+            if (t != NULL) {
+                atomicAdd(&t->doorbell_wait_cycles, (ULL)(clock64() - start));
+            }
+        } else if (overflow_policy == CHANNEL_ADAPTIVE && sample_shift > 0) {
+            sample_shift--;
+        }
+        curr_buff = next_buff;
 
         /* reset head/tail */
-        buff_write_tail_ptr = buff;
+        buff_write_tail = 0;
         __threadfence();
-        buff_write_head_ptr = buff;
+        buff_write_head = 0;
 
         //  printf("FLUSH CHANNEL#%d: DONE\n", id);
     }
 
   private:
-    /* called by the ChannelHost init */
-    void init(int id, int *h_doorbell, int buff_size) {
-        CUDA_SAFECALL(cudaHostGetDevicePointer((void **)&doorbell,
-                                               (void *)h_doorbell, 0));
-
-        /* allocate large buffer */
-        CUDA_SAFECALL(cudaMalloc((void **)&buff, buff_size));
+    /* called by the ChannelHost init, the ring is in device memory unless
+     * h_buff, mapped pinned host memory, is given */
+    void init(int id, int *h_doorbells, int buff_size, int num_buffs,
+              uint8_t *h_buff) {
+        CUDA_SAFECALL(cudaHostGetDevicePointer((void **)&doorbells,
+                                               (void *)h_doorbells, 0));
+
+        /* allocate large buffer holding the whole ring */
+        if (h_buff != NULL) {
+            CUDA_SAFECALL(
+                cudaHostGetDevicePointer((void **)&buff, (void *)h_buff, 0));
+        } else {
+            CUDA_SAFECALL(
+                cudaMalloc((void **)&buff, (size_t)buff_size * num_buffs));
+        }
 
-        buff_write_head_ptr = buff;
-        buff_write_tail_ptr = buff;
-        buff_end = buff + buff_size;
+        this->buff_size = buff_size;
+        this->num_buffs = num_buffs;
+        curr_buff = 0;
+        buff_write_head = 0;
+        buff_write_tail = 0;
         this->id = id;
+        overflow_policy = CHANNEL_BLOCK;
+        sample_shift = 0;
+        overflow_counts = NULL;
+        telemetry = NULL;
+    }
+
+    /* called by the MultiChannelHost init, d_counts is in device memory */
+    void set_overflow_policy(int policy, ULL *d_counts) {
+        overflow_policy = policy;
+        overflow_counts = d_counts;
+    }
+
+    /* called by the MultiChannelHost init, d_telemetry is in device memory */
+    void set_telemetry(channel_telemetry_t *d_telemetry) {
+        telemetry = d_telemetry;
     }
 
     friend class ChannelHost;
+    friend class MultiChannelHost;
 };
 
 class ChannelHost {
   private:
-    volatile int *doorbell;
+    volatile int *doorbells;
+    ChannelRing ring;
 
     cudaStream_t stream;
     ChannelDev *ch_dev;
 
-    /* pointers to device buffer */
-    uint8_t *dev_buff_read_head;
+    /* pointer to device buffer */
     uint8_t *dev_buff;
 
+    /* in zero copy mode the ring lives in mapped pinned host memory, the
+     * device writes the packets straight into it and they are read in
+     * place, see recv_in_place */
+    uint8_t *host_buff;
+
     /* receiving thread */
     pthread_t thread;
     volatile bool thread_started;
 
+    channel_host_stats_t stats;
+
   public:
     int id;
     int buff_size;
+    int num_buffs;
 
   public:
     ChannelHost() {}
 
+    /* buff_size is the size of each of the num_buffs buffers of the ring,
+     * with num_buffs > 1 the device keeps pushing into the next buffer
+     * while the host drains the previous one. With zero_copy the ring is
+     * allocated in mapped pinned host memory. It is not write combined since
+     * the host reads it in place, and the device stores reach it over the
+     * bus as they are issued, without a copy per flush. */
     void init(int id, int buff_size, ChannelDev *ch_dev,
-              void *(*thread_fun)(ChannelHost *)) {
+              void *(*thread_fun)(ChannelHost *), int num_buffs = 2,
+              bool zero_copy = false) {
         this->buff_size = buff_size;
+        this->num_buffs = num_buffs;
         this->id = id;
         /* get device properties */
         cudaDeviceProp prop;
@@ -176,18 +401,26 @@ class ChannelHost {
         CUDA_SAFECALL(cudaStreamCreateWithPriority(
             &stream, cudaStreamNonBlocking, priority_high));
 
-        /* create doorbell */
-        CUDA_SAFECALL(cudaHostAlloc((void **)&doorbell, sizeof(int),
+        /* create doorbells, one per buffer */
+        CUDA_SAFECALL(cudaHostAlloc((void **)&doorbells,
+                                    sizeof(int) * num_buffs,
                                     cudaHostAllocMapped));
-        /* set doorbell to zero */
-        *doorbell = 0;
+        /* set doorbells to zero */
+        ring.init(doorbells, num_buffs, buff_size);
+
+        memset(&stats, 0, sizeof(stats));
+        host_buff = NULL;
+        if (zero_copy) {
+            CUDA_SAFECALL(cudaHostAlloc((void **)&host_buff,
+                                        (size_t)buff_size * num_buffs,
+                                        cudaHostAllocMapped));
+        }
 
         /* initialize device channel */
         this->ch_dev = ch_dev;
-        ch_dev->init(id, (int *)doorbell, buff_size);
+        ch_dev->init(id, (int *)doorbells, buff_size, num_buffs, host_buff);
 
         dev_buff = ch_dev->buff;
-        dev_buff_read_head = dev_buff;
         if (thread_fun != NULL) {
             thread_started = true;
             pthread_create(&thread, NULL, (void *(*)(void *))thread_fun,
@@ -208,42 +441,72 @@ class ChannelHost {
         }
         if (dealloc) {
             CUDA_SAFECALL(cudaStreamDestroy(stream));
-            CUDA_SAFECALL(cudaFree((int *)doorbell));
-            CUDA_SAFECALL(cudaFree(ch_dev->buff));
+            CUDA_SAFECALL(cudaFreeHost((int *)doorbells));
+            if (host_buff != NULL) {
+                CUDA_SAFECALL(cudaFreeHost(host_buff));
+            } else {
+                CUDA_SAFECALL(cudaFree(ch_dev->buff));
+            }
         }
     }
 
     bool is_active() { return thread_started; }
 
+    bool is_zero_copy() { return host_buff != NULL; }
+
     uint32_t recv(void *buff, uint32_t max_buff_size) {
-        assert(max_buff_size > 0);
-        assert(doorbell != NULL);
-        uint32_t buff_nbytes = *doorbell;
-        if (buff_nbytes == 0) {
+        uint64_t offset;
+        uint32_t nbytes = ring.poll(max_buff_size, &offset);
+        if (nbytes == 0) {
             return 0;
         }
-        int nbytes = buff_nbytes;
 
-        if (buff_nbytes > max_buff_size) {
-            nbytes = max_buff_size;
-        }
-        CUDA_SAFECALL(cudaMemcpyAsync(buff, dev_buff_read_head, nbytes,
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        CUDA_SAFECALL(cudaMemcpyAsync(buff, dev_buff + offset, nbytes,
                                       cudaMemcpyDeviceToHost, stream));
         CUDA_SAFECALL(cudaStreamSynchronize(stream));
-        int bytes_left = buff_nbytes - nbytes;
-        assert(bytes_left >= 0);
-        if (bytes_left > 0) {
-            dev_buff_read_head += nbytes;
-        } else {
-            dev_buff_read_head = dev_buff;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000ull +
+                      end.tv_nsec - start.tv_nsec;
+        stats.recvs++;
+        stats.bytes += nbytes;
+        stats.recv_ns += ns;
+        if (ns > stats.max_recv_ns) {
+            stats.max_recv_ns = ns;
         }
 
-        *doorbell = bytes_left;
-        // printf("HOST RECEIVED nbytes %d - bytes left %d\n", nbytes,
-        // bytes_left);
+        ring.release(nbytes);
+        // printf("HOST RECEIVED nbytes %d\n", nbytes);
         return nbytes;
     }
 
+    /* zero copy mode only: points data at the next bytes the device pushed,
+     * which stay valid until they are given back with release(), and
+     * returns their number (0 if none). The doorbell of a buffer is rung
+     * after a system fence, so the bytes it covers are all visible. */
+    uint32_t recv_in_place(uint8_t **data, uint32_t max_buff_size) {
+        assert(host_buff != NULL);
+        uint64_t offset;
+        uint32_t nbytes = ring.poll(max_buff_size, &offset);
+        if (nbytes != 0) {
+            *data = host_buff + offset;
+            stats.recvs++;
+            stats.bytes += nbytes;
+        }
+        return nbytes;
+    }
+
+    /* counters since the last call, which clears them. Only consistent while
+     * the channel does not receive, i.e. between kernels */
+    channel_host_stats_t get_stats() {
+        channel_host_stats_t s = stats;
+        memset(&stats, 0, sizeof(stats));
+        return s;
+    }
+
+    void release(uint32_t nbytes) { ring.release(nbytes); }
+
     pthread_t get_thread() { return thread; }
 
     friend class MultiChannelHost;
@@ -254,22 +517,136 @@ class MultiChannelDev {
     int num_channels;
     ChannelDev *d_chs;
 
+    /* optional staging buffer of staging_size bytes per SM in front of the
+     * channels (see channel_staging.h), 0 if not used. The tools can not use
+     * shared memory, so they are in global memory, but the warps of an SM
+     * only contend on the head of their own buffer and the channel sees a
+     * single push per staging buffer. */
+    uint32_t staging_size;
+    int staging_num_sms;
+    uint8_t *staging_buffs;
+    channel_staging_t *staging;
+
   public:
     MultiChannelDev() {}
 
-    void init(int num_channels) {
+    void init(int num_channels, uint32_t staging_size = 0) {
         this->num_channels = num_channels;
         CUDA_SAFECALL(cudaMallocManaged((void **)&d_chs,
                                         sizeof(ChannelDev) * num_channels));
+
+        this->staging_size = staging_size;
+        staging_num_sms = 0;
+        staging_buffs = NULL;
+        staging = NULL;
+        if (staging_size != 0) {
+            int device;
+            CUDA_SAFECALL(cudaGetDevice(&device));
+            CUDA_SAFECALL(cudaDeviceGetAttribute(
+                &staging_num_sms, cudaDevAttrMultiProcessorCount, device));
+            CUDA_SAFECALL(cudaMalloc((void **)&staging_buffs,
+                                     (size_t)staging_size * staging_num_sms));
+            CUDA_SAFECALL(
+                cudaMalloc((void **)&staging,
+                           sizeof(channel_staging_t) * staging_num_sms));
+            CUDA_SAFECALL(cudaMemset(
+                staging, 0, sizeof(channel_staging_t) * staging_num_sms));
+        }
     }
 
-    void destroy() { CUDA_SAFECALL(cudaFree(d_chs)); }
+    void destroy() {
+        CUDA_SAFECALL(cudaFree(d_chs));
+        if (staging_size != 0) {
+            CUDA_SAFECALL(cudaFree(staging_buffs));
+            CUDA_SAFECALL(cudaFree(staging));
+        }
+    }
 
     __device__ __forceinline__ void push(void *packet, uint32_t nbytes) {
         int ch_id = get_smid() % num_channels;
         d_chs[ch_id].push(packet, nbytes);
     }
 
+    /* see ChannelDev::push_warp, all the lanes run on the same SM. With
+     * staging the packet goes to the staging buffer of the SM, and the warp
+     * that fills it up moves it to the channel. A packet that does not fit
+     * in a staging buffer goes straight to the channel, ahead of the packets
+     * staged on the SM. */
+    __device__ __forceinline__ void push_warp(const void *packet,
+                                              uint32_t nbytes) {
+        int smid = get_smid();
+        int ch_id = smid % num_channels;
+        if (staging_size == 0 || nbytes > staging_size) {
+            d_chs[ch_id].push_warp(packet, nbytes);
+            return;
+        }
+
+        smid %= staging_num_sms;
+        channel_staging_t *s = &staging[smid];
+        uint8_t *staging_buff = staging_buffs + (size_t)smid * staging_size;
+
+        const int active_mask = __ballot(1);
+        const int laneid = get_laneid();
+        const int first_laneid = __ffs(active_mask) - 1;
+
+        while (true) {
+            int status = 0;
+            uint64_t off = 0;
+            if (laneid == first_laneid) {
+                status = staging_reserve(s, staging_size, nbytes, &off);
+            }
+            status = __shfl(status, first_laneid);
+            off = __shfl(off, first_laneid);
+
+            if (status == STAGING_RESERVED) {
+                warp_copy_slice(staging_buff + off, (const uint64_t *)packet,
+                                nbytes, warp_rank(active_mask, laneid),
+                                __popc(active_mask));
+                __threadfence();
+                __ballot(1);
+                if (laneid == first_laneid) {
+                    staging_commit(s, nbytes);
+                }
+                return;
+            }
+
+            if (status == STAGING_FLUSH) {
+                uint32_t npackets = 0;
+                if (laneid == first_laneid) {
+                    npackets = staging_wait_writers(s, off);
+                }
+                npackets = __shfl(npackets, first_laneid);
+                d_chs[ch_id].push_warp(staging_buff, off, npackets);
+                if (laneid == first_laneid) {
+                    staging_reset(s);
+                }
+            }
+        }
+    }
+
+    /* moves what is left in the staging buffers to the channels, to be
+     * called by a single thread once the kernels are completed and before
+     * the end of kernel markers */
+    __device__ __forceinline__ void flush_staging() {
+        for (int i = 0; i < staging_num_sms; i++) {
+            channel_staging_t *s = &staging[i];
+            if (s->tail != 0) {
+                d_chs[i % num_channels].push(
+                    staging_buffs + (size_t)i * staging_size, s->tail, false);
+                staging_init(s);
+            }
+        }
+    }
+
+    /* push on a given channel, i.e. to send a marker on every channel,
+     * never dropped */
+    __device__ __forceinline__ void push(int ch_id, void *packet,
+                                         uint32_t nbytes) {
+        d_chs[ch_id].push(packet, nbytes, false);
+    }
+
+    __device__ __forceinline__ int get_num_channels() { return num_channels; }
+
     __device__ __forceinline__ void flush() {
         for (int i = 0; i < num_channels; i++) {
             d_chs[i].flush();
@@ -291,21 +668,75 @@ class MultiChannelHost {
     ChannelHost *h_chs;
     MultiChannelDev *d_mch;
 
+    /* per SM dropped and sampled out packets of all the channels */
+    ULL *overflow_counts;
+
+    /* per SM telemetry of all the channels, NULL if off */
+    channel_telemetry_t *telemetry;
+
   public:
     MultiChannelHost() {}
 
+    /* overflow_policy is one of the CHANNEL_* policies, CHANNEL_ADAPTIVE
+     * needs num_buffs >= 2 */
+    /* staging_size, if not 0, is the size of the per SM staging buffers,
+     * at most channel_size */
     void init(int num_channels, int channel_size, MultiChannelDev *d_mch,
-              void *(*func)(ChannelHost *)) {
+              void *(*func)(ChannelHost *), int num_buffs = 2,
+              bool zero_copy = false, int overflow_policy = CHANNEL_BLOCK,
+              uint32_t staging_size = 0, bool telemetry = false) {
+        assert(staging_size <= (uint32_t)channel_size);
+        assert(overflow_policy != CHANNEL_ADAPTIVE || num_buffs >= 2);
         this->num_channels = num_channels;
         this->d_mch = d_mch;
 
+        size_t counts_nbytes = 2 * CHANNEL_MAX_SMS * sizeof(ULL);
+        CUDA_SAFECALL(cudaMalloc((void **)&overflow_counts, counts_nbytes));
+        CUDA_SAFECALL(cudaMemset(overflow_counts, 0, counts_nbytes));
+
+        this->telemetry = NULL;
+        if (telemetry) {
+            size_t nbytes = CHANNEL_MAX_SMS * sizeof(channel_telemetry_t);
+            CUDA_SAFECALL(cudaMalloc((void **)&this->telemetry, nbytes));
+            CUDA_SAFECALL(cudaMemset(this->telemetry, 0, nbytes));
+        }
+
         h_chs = new ChannelHost[num_channels];
-        d_mch->init(num_channels);
+        d_mch->init(num_channels, staging_size);
         for (int i = 0; i < num_channels; i++) {
-            h_chs[i].init(i, channel_size, &(d_mch->d_chs[i]), func);
+            h_chs[i].init(i, channel_size, &(d_mch->d_chs[i]), func,
+                          num_buffs, zero_copy);
+            d_mch->d_chs[i].set_overflow_policy(overflow_policy,
+                                                overflow_counts);
+            d_mch->d_chs[i].set_telemetry(this->telemetry);
         }
     }
 
+    /* copies the packets dropped on each SM since the last call in dropped
+     * and the ones sampled out in sampled_out (CHANNEL_MAX_SMS entries each)
+     * and clears the counts, the GPU must be idle */
+    void get_overflow_counts(uint64_t *dropped, uint64_t *sampled_out) {
+        size_t nbytes = CHANNEL_MAX_SMS * sizeof(ULL);
+        CUDA_SAFECALL(cudaMemcpy(dropped, overflow_counts, nbytes,
+                                 cudaMemcpyDeviceToHost));
+        CUDA_SAFECALL(cudaMemcpy(sampled_out,
+                                 overflow_counts + CHANNEL_MAX_SMS, nbytes,
+                                 cudaMemcpyDeviceToHost));
+        CUDA_SAFECALL(cudaMemset(overflow_counts, 0, 2 * nbytes));
+    }
+
+    bool has_telemetry() { return telemetry != NULL; }
+
+    /* copies the telemetry of each SM since the last call in t
+     * (CHANNEL_MAX_SMS entries) and clears it, the GPU must be idle */
+    void get_telemetry(channel_telemetry_t *t) {
+        assert(telemetry != NULL);
+        size_t nbytes = CHANNEL_MAX_SMS * sizeof(channel_telemetry_t);
+        CUDA_SAFECALL(
+            cudaMemcpy(t, telemetry, nbytes, cudaMemcpyDeviceToHost));
+        CUDA_SAFECALL(cudaMemset(telemetry, 0, nbytes));
+    }
+
     void destroy() {
         d_mch->destroy();
         for (int i = 0; i < num_channels; i++) {
@@ -319,6 +750,15 @@ class MultiChannelHost {
         return h_chs[i].thread;
     }
 
+    int get_num_channels() { return num_channels; }
+
+    /* used to drain the channels from threads not owned by the channels,
+     * see ChannelConsumerPool in channel_pool.h */
+    ChannelHost *get_channel(int i) {
+        assert(i < num_channels);
+        return &h_chs[i];
+    }
+
     void flush() {
         ker_flush<<<1, 1>>>(d_mch->d_chs, num_channels);
         CUDA_SAFECALL(cudaDeviceSynchronize());
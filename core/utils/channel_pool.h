@@ -0,0 +1,247 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <atomic>
+#include <vector>
+
+#include "lockfree_queue.h"
+
+/* a block of bytes received from one channel */
+typedef struct {
+    int channel_id;
+    uint32_t nbytes;
+    uint8_t *data;
+    /* set by the process function (see set_process), opaque to the pool */
+    uint64_t user;
+} channel_batch_t;
+
+/* Pool of host threads draining a set of channels.
+ *
+ * Channel is any type with a "uint32_t recv(void *buff, uint32_t max)"
+ * method (ChannelHost in channel.hpp), plus, in place mode,
+ * "uint32_t recv_in_place(uint8_t **data, uint32_t max)" and
+ * "void release(uint32_t nbytes)". In place, a batch points inside the
+ * channel (i.e. a zero copy ChannelHost) instead of holding a copy, and
+ * releasing the batch releases those bytes of the channel; a channel then has
+ * at most one batch in flight and is skipped by its consumer until that
+ * batch comes back, which also keeps the channel state single threaded.
+ * Each channel is owned by exactly one
+ * consumer thread (thread i drains channels i, i + num_threads, ...) since a
+ * channel must be drained in order. Received data is handed, as batches, to a
+ * lock free queue from which downstream stages pop() them; batches have to be
+ * given back with release() once processed. An optional process function
+ * runs on each batch in its consumer thread before it is queued, so the work
+ * that only depends on one channel (i.e. validating or decoding the records)
+ * is spread over the consumers instead of being done downstream. When no free
+ * batch is available
+ * the consumers stop draining, which in turn back-pressures the GPU.
+ *
+ * Only depends on pthreads, so it can be driven on the CPU with producer
+ * threads writing into the channels. */
+template <typename Channel>
+class ChannelConsumerPool {
+  private:
+    Channel **channels;
+    int num_channels;
+    int num_threads;
+    uint32_t batch_size;
+
+    std::vector<channel_batch_t> batches;
+    std::vector<uint8_t *> buffers;
+    LockFreeQueue<channel_batch_t *> free_queue;
+    LockFreeQueue<channel_batch_t *> ready_queue;
+
+    std::vector<pthread_t> threads;
+    volatile bool running;
+
+    void (*process)(channel_batch_t *, void *);
+    void *process_arg;
+
+    /* in place mode, whether each channel has a batch in flight */
+    bool in_place;
+    std::vector<std::atomic<bool> > in_flight;
+
+    struct thread_arg_t {
+        ChannelConsumerPool *pool;
+        int tid;
+    };
+    std::vector<thread_arg_t> args;
+
+    static void *consumer_fun(void *arg) {
+        thread_arg_t *a = (thread_arg_t *)arg;
+        a->pool->consume(a->tid);
+        return NULL;
+    }
+
+    void consume(int tid) {
+        channel_batch_t *batch = NULL;
+        while (running) {
+            bool idle = true;
+            for (int c = tid; c < num_channels; c += num_threads) {
+                if (batch == NULL && !free_queue.pop(&batch)) {
+                    /* downstream is behind */
+                    batch = NULL;
+                    break;
+                }
+                uint32_t nbytes;
+                if (in_place) {
+                    if (in_flight[c].load(std::memory_order_acquire)) {
+                        continue;
+                    }
+                    nbytes = channels[c]->recv_in_place(&batch->data,
+                                                        batch_size);
+                    if (nbytes != 0) {
+                        in_flight[c].store(true, std::memory_order_relaxed);
+                    }
+                } else {
+                    nbytes = channels[c]->recv(batch->data, batch_size);
+                }
+                if (nbytes == 0) {
+                    continue;
+                }
+                batch->channel_id = c;
+                batch->nbytes = nbytes;
+                batch->user = 0;
+                if (process != NULL) {
+                    process(batch, process_arg);
+                }
+                /* cannot fail, there are as many slots as batches */
+                bool pushed = ready_queue.push(batch);
+                assert(pushed);
+                (void)pushed;
+                batch = NULL;
+                idle = false;
+            }
+            if (idle) {
+                sched_yield();
+            }
+        }
+        if (batch != NULL) {
+            /* not holding channel data */
+            bool pushed = free_queue.push(batch);
+            assert(pushed);
+            (void)pushed;
+        }
+    }
+
+  public:
+    ChannelConsumerPool()
+        : running(false), process(NULL), process_arg(NULL), in_place(false) {}
+
+    /* batch_size must be large enough to receive a whole channel buffer so
+     * that records are never split across batches, num_batches is rounded
+     * up to a power of two */
+    void init(Channel **channels, int num_channels, int num_threads,
+              uint32_t batch_size, int num_batches, bool in_place = false) {
+        assert(num_channels > 0 && num_threads > 0);
+        this->channels = channels;
+        this->num_channels = num_channels;
+        this->num_threads = num_threads < num_channels ? num_threads
+                                                       : num_channels;
+        this->batch_size = batch_size;
+        this->in_place = in_place;
+        std::vector<std::atomic<bool> > flags(num_channels);
+        for (auto &f : flags) f.store(false);
+        in_flight.swap(flags);
+
+        size_t capacity = 2;
+        while (capacity < (size_t)num_batches) capacity *= 2;
+        free_queue.init(capacity);
+        ready_queue.init(capacity);
+        batches.resize(capacity);
+        buffers.resize(capacity);
+        for (size_t i = 0; i < capacity; i++) {
+            buffers[i] = in_place ? NULL : (uint8_t *)malloc(batch_size);
+            batches[i].data = buffers[i];
+            free_queue.push(&batches[i]);
+        }
+    }
+
+    /* set before start(), process(batch, arg) is called by the consumer thread
+     * owning batch->channel_id, so per channel state needs no lock. The
+     * queue orders it before the downstream pop() of the batch */
+    void set_process(void (*process)(channel_batch_t *, void *), void *arg) {
+        this->process = process;
+        this->process_arg = arg;
+    }
+
+    void start() {
+        running = true;
+        threads.resize(num_threads);
+        args.resize(num_threads);
+        for (int i = 0; i < num_threads; i++) {
+            args[i].pool = this;
+            args[i].tid = i;
+            pthread_create(&threads[i], NULL, consumer_fun, &args[i]);
+        }
+    }
+
+    void stop() {
+        if (!running) return;
+        running = false;
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    void destroy() {
+        stop();
+        for (size_t i = 0; i < buffers.size(); i++) {
+            free(buffers[i]);
+        }
+        buffers.clear();
+        batches.clear();
+    }
+
+    /* returns NULL if no batch is ready */
+    channel_batch_t *pop() {
+        channel_batch_t *batch;
+        return ready_queue.pop(&batch) ? batch : NULL;
+    }
+
+    void release(channel_batch_t *batch) {
+        if (in_place) {
+            int c = batch->channel_id;
+            channels[c]->release(batch->nbytes);
+            /* the channel state is updated before its consumer sees it */
+            in_flight[c].store(false, std::memory_order_release);
+        }
+        bool pushed = free_queue.push(batch);
+        assert(pushed);
+        (void)pushed;
+    }
+
+    int get_num_threads() const { return num_threads; }
+    pthread_t get_thread(int i) const { return threads[i]; }
+};
@@ -0,0 +1,108 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Host side state machine of the doorbell protocol used by ChannelDev and
+ * ChannelHost.
+ *
+ * The device buffer of a channel is split in num_buffs buffers of buff_size
+ * bytes each, used as a ring. Each buffer has its own doorbell in host
+ * memory. The device fills buffer "i", rings doorbell[i] with the number of
+ * valid bytes and moves on to buffer (i + 1) % num_buffs as soon as its
+ * doorbell reads zero. The host drains the buffers in the same order and
+ * releases each one by writing back the number of bytes still to be read
+ * (zero once the buffer is fully consumed).
+ *
+ * This class only tracks that state, moving the data is left to the caller,
+ * so the protocol can be driven on the CPU with a thread standing in for the
+ * GPU producer. */
+class ChannelRing {
+  private:
+    volatile int *doorbells;
+    int num_buffs;
+    uint32_t buff_size;
+
+    /* buffer currently being drained and read position inside it */
+    int read_buff;
+    uint32_t read_offset;
+
+  public:
+    ChannelRing() : doorbells(NULL), num_buffs(0), buff_size(0) {}
+
+    void init(volatile int *doorbells, int num_buffs, uint32_t buff_size) {
+        assert(num_buffs > 0);
+        this->doorbells = doorbells;
+        this->num_buffs = num_buffs;
+        this->buff_size = buff_size;
+        read_buff = 0;
+        read_offset = 0;
+        for (int i = 0; i < num_buffs; i++) {
+            doorbells[i] = 0;
+        }
+    }
+
+    /* returns how many bytes (at most max_nbytes) can be read from the ring
+     * and, in offset, where they start from the beginning of the ring.
+     * Returns 0 if the device has not rung the current doorbell yet */
+    uint32_t poll(uint32_t max_nbytes, uint64_t *offset) const {
+        assert(max_nbytes > 0);
+        assert(doorbells != NULL);
+        uint32_t buff_nbytes = doorbells[read_buff];
+        if (buff_nbytes == 0) {
+            return 0;
+        }
+        *offset = (uint64_t)read_buff * buff_size + read_offset;
+        return buff_nbytes > max_nbytes ? max_nbytes : buff_nbytes;
+    }
+
+    /* mark nbytes returned by the last poll() as consumed, once the current
+     * buffer is empty its doorbell is cleared and the device can refill it */
+    void release(uint32_t nbytes) {
+        int bytes_left = doorbells[read_buff] - nbytes;
+        assert(bytes_left >= 0);
+        if (bytes_left > 0) {
+            read_offset += nbytes;
+            doorbells[read_buff] = bytes_left;
+        } else {
+            int curr_buff = read_buff;
+            read_offset = 0;
+            read_buff = (read_buff + 1) % num_buffs;
+            /* make sure all reads of the buffer are done before handing it
+             * back to the device */
+            __sync_synchronize();
+            doorbells[curr_buff] = 0;
+        }
+    }
+
+    int get_num_buffs() const { return num_buffs; }
+    uint32_t get_buff_size() const { return buff_size; }
+};
@@ -0,0 +1,112 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* Bookkeeping of a staging buffer placed in front of a channel, see
+ * MultiChannelDev::push_warp. Warps append their packets to the staging
+ * buffer of their SM with the same head/tail protocol the channel buffers
+ * use: a reservation bumps the head, a completed copy bumps the tail. The
+ * warp whose reservation overflows the buffer owns the flush: it waits for
+ * the writers before it, moves the staged bytes to the channel in a single
+ * push and resets the buffer, while the warps that overflow after it wait
+ * for the reset and retry. The channel then sees one reservation per buffer
+ * of packets instead of one per packet.
+ *
+ * The functions below are the steps of that protocol, the data movement is
+ * left to the caller, so the protocol can be exercised on the CPU with
+ * threads standing in for the warps. */
+
+#include <stdint.h>
+
+#include "host_device.h"
+
+typedef struct {
+    volatile uint64_t head;
+    volatile uint64_t tail;
+    /* packets in the buffer, counted before the tail is bumped */
+    volatile uint64_t npackets;
+} channel_staging_t;
+
+enum {
+    /* the packet goes at the returned offset */
+    STAGING_RESERVED = 0,
+    /* the buffer is full and the caller flushes the returned number of
+     * bytes, then retries */
+    STAGING_FLUSH = 1,
+    /* somebody else flushed the buffer, retry */
+    STAGING_RETRY = 2
+};
+
+HOST_DEVICE_INLINE void staging_init(channel_staging_t *s) {
+    s->head = 0;
+    s->tail = 0;
+    s->npackets = 0;
+}
+
+/* tries to reserve nbytes in a buffer of size bytes, nbytes must be at most
+ * size: a larger packet would get STAGING_FLUSH with nothing to flush */
+HOST_DEVICE_INLINE int staging_reserve(channel_staging_t *s, uint32_t size,
+                                       uint32_t nbytes, uint64_t *off) {
+    uint64_t o = hd_atomic_add(&s->head, nbytes);
+    *off = o;
+    if (o + nbytes <= size) {
+        return STAGING_RESERVED;
+    }
+    /* only the first reservation past the end finds this true */
+    if (o <= size) {
+        return STAGING_FLUSH;
+    }
+    while (s->head > size) {
+    }
+    return STAGING_RETRY;
+}
+
+/* the nbytes reserved have been written */
+HOST_DEVICE_INLINE void staging_commit(channel_staging_t *s, uint32_t nbytes) {
+    hd_atomic_add(&s->npackets, 1);
+    hd_threadfence();
+    hd_atomic_add(&s->tail, nbytes);
+}
+
+/* flush owner: waits until the nbytes before its reservation are written
+ * and returns how many packets they hold */
+HOST_DEVICE_INLINE uint32_t staging_wait_writers(channel_staging_t *s,
+                                                 uint64_t nbytes) {
+    while (s->tail != nbytes) {
+    }
+    hd_threadfence();
+    return (uint32_t)s->npackets;
+}
+
+/* flush owner: the staged bytes are in the channel, reopen the buffer */
+HOST_DEVICE_INLINE void staging_reset(channel_staging_t *s) {
+    s->npackets = 0;
+    s->tail = 0;
+    hd_threadfence();
+    s->head = 0;
+}
@@ -0,0 +1,73 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* Sizing policy of buffers that are reused across kernel launches and only
+ * reallocated when a launch needs more than what is available. The capacity
+ * grows geometrically so that a sequence of growing launches only causes a
+ * logarithmic number of reallocations. It only does the bookkeeping, the
+ * owner of the buffer (re)allocates it when reserve() returns true. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+class GeometricGrowth {
+  private:
+    size_t capacity;
+    size_t min_capacity;
+    size_t growth_factor;
+
+  public:
+    GeometricGrowth(size_t min_capacity = 1 << 16, size_t growth_factor = 2)
+        : capacity(0),
+          min_capacity(min_capacity),
+          growth_factor(growth_factor < 2 ? 2 : growth_factor) {}
+
+    size_t get_capacity() const { return capacity; }
+
+    /* make room for n elements, returns true if the capacity had to grow, in
+     * which case the buffer must be reallocated to get_capacity() elements */
+    bool reserve(size_t n) {
+        if (n <= capacity) {
+            return false;
+        }
+        size_t c = capacity < min_capacity ? min_capacity : capacity;
+        while (c < n) {
+            if (c > SIZE_MAX / growth_factor) {
+                c = n;
+                break;
+            }
+            c *= growth_factor;
+        }
+        capacity = c;
+        return true;
+    }
+
+    /* forget the current capacity, i.e. after the buffer is freed */
+    void reset() { capacity = 0; }
+};
@@ -0,0 +1,192 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+/* Collects kernel launches that complete asynchronously (i.e. through a
+ * cudaStreamAddCallback on the launch stream) and reports them, from a
+ * dedicated thread, in the order they were launched.
+ *
+ * Launch is a tool defined per-launch context (kernel id, counter slot,
+ * ...). submit() must be called in launch order, complete() can be called
+ * from any thread and in any order, the report function is called once per
+ * launch, in submit order, only after that launch and all the previous ones
+ * have completed. Nothing here touches CUDA, so the ordering can be driven on
+ * the CPU with a fake completion source. */
+template <typename Launch>
+class LaunchCollector {
+  private:
+    struct node_t {
+        Launch *launch;
+        bool done;
+    };
+
+    std::deque<node_t *> pending;
+    uint64_t num_submitted;
+    uint64_t num_reported;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool running;
+    void (*report)(Launch *);
+
+    static void *collector_fun(void *arg) {
+        ((LaunchCollector *)arg)->collect();
+        return NULL;
+    }
+
+    void collect() {
+        pthread_mutex_lock(&mutex);
+        while (true) {
+            while (running && (pending.empty() || !pending.front()->done)) {
+                pthread_cond_wait(&cond, &mutex);
+            }
+            if (pending.empty() || !pending.front()->done) {
+                /* stopped */
+                break;
+            }
+            node_t *node = pending.front();
+            pending.pop_front();
+
+            /* report without holding the lock, it can be slow */
+            pthread_mutex_unlock(&mutex);
+            report(node->launch);
+            delete node;
+            pthread_mutex_lock(&mutex);
+
+            num_reported++;
+            pthread_cond_broadcast(&cond);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+  public:
+    typedef node_t *handle_t;
+
+    LaunchCollector() : num_submitted(0), num_reported(0), running(false) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+
+    void start(void (*report)(Launch *)) {
+        this->report = report;
+        running = true;
+        pthread_create(&thread, NULL, collector_fun, this);
+    }
+
+    /* register a launch, must be called in launch order */
+    handle_t submit(Launch *launch) {
+        node_t *node = new node_t;
+        node->launch = launch;
+        node->done = false;
+        pthread_mutex_lock(&mutex);
+        pending.push_back(node);
+        num_submitted++;
+        pthread_mutex_unlock(&mutex);
+        return node;
+    }
+
+    /* mark a launch as completed */
+    void complete(handle_t node) {
+        pthread_mutex_lock(&mutex);
+        node->done = true;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    /* wait until every submitted launch has been reported */
+    void drain() {
+        pthread_mutex_lock(&mutex);
+        while (num_reported < num_submitted) {
+            pthread_cond_wait(&cond, &mutex);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void stop() {
+        if (!running) return;
+        drain();
+        pthread_mutex_lock(&mutex);
+        running = false;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+        pthread_join(thread, NULL);
+    }
+};
+
+/* Fixed set of slot indexes (i.e. per-launch counter buffers) handed out to
+ * in-flight launches, acquire() blocks until a slot is released, which bounds
+ * the number of launches in flight. */
+class SlotPool {
+  private:
+    std::vector<int> free_slots;
+    int num_slots;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+  public:
+    SlotPool() : num_slots(0) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+
+    void init(int num_slots) {
+        this->num_slots = num_slots;
+        free_slots.clear();
+        for (int i = num_slots - 1; i >= 0; i--) {
+            free_slots.push_back(i);
+        }
+    }
+
+    int get_num_slots() const { return num_slots; }
+
+    int acquire() {
+        pthread_mutex_lock(&mutex);
+        while (free_slots.empty()) {
+            pthread_cond_wait(&cond, &mutex);
+        }
+        int slot = free_slots.back();
+        free_slots.pop_back();
+        pthread_mutex_unlock(&mutex);
+        return slot;
+    }
+
+    void release(int slot) {
+        assert(slot >= 0 && slot < num_slots);
+        pthread_mutex_lock(&mutex);
+        free_slots.push_back(slot);
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+};
@@ -0,0 +1,613 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* Host side SimPoint style clustering of basic block vectors, fed while the
+ * application runs so that simulation points are known at the end of the run
+ * without storing the BBVs. It only depends on the C/C++ standard library and
+ * pthreads so it can be exercised on the CPU with synthetic BBVs.
+ *
+ * Each BBV (one per kernel launch or per CTA/warp) is normalized and reduced
+ * to a few dimensions with a random projection, as SimPoint does, so the
+ * number of distinct basic blocks does not matter. The projection matrix is
+ * never stored, its entries are a hash of (basic block, dimension).
+ *
+ * Projected points are kept in a bounded pool. When the pool is full it is
+ * compressed by clustering it into a quarter of its size with k-means++
+ * seeding, every new point standing for the points merged into it (count and
+ * weight are added up, the representative is the merged point closest to
+ * the center, and the scatter of the merged points around it is kept so the
+ * BIC still sees the variance lost by merging). At the end the pool is
+ * compressed the same way if needed and clustered with weighted k-means for
+ * every k up to max_k, and the smallest k whose BIC score reaches
+ * SIMPOINT_BIC_THRESHOLD of the range of scores is picked, as SimPoint does.
+ * The representative of each cluster is the simulation point, its weight the
+ * fraction of the total weight (i.e. instructions) in the cluster.
+ *
+ * add() only queues the BBV, the projection and pool maintenance run on a
+ * background thread once start() is called, or inline otherwise. */
+
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <deque>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#define SIMPOINT_DEFAULT_DIMS 15
+#define SIMPOINT_DEFAULT_MAX_POINTS 8192
+#define SIMPOINT_BIC_THRESHOLD 0.9
+#define SIMPOINT_KMEANS_SEEDS 5
+#define SIMPOINT_KMEANS_MAX_ITERS 100
+
+/* one non zero entry of a basic block vector */
+typedef struct {
+    uint64_t dim;
+    double count;
+} simpoint_entry_t;
+
+/* a simulation point */
+typedef struct {
+    /* id of the BBV given to add() */
+    uint64_t id;
+    /* fraction of the total weight represented by this point */
+    double weight;
+    int cluster;
+} simpoint_t;
+
+/* a point of the pool, it stands for "count" BBVs */
+typedef struct {
+    std::vector<double> x;
+    double count;
+    double weight;
+    uint64_t rep_id;
+    /* weighted squared distance of the merged BBVs to x */
+    double scatter;
+} simpoint_point_t;
+
+/* result of a k-means run */
+typedef struct {
+    std::vector<std::vector<double> > centers;
+    std::vector<int> assign;
+    double sse;
+} simpoint_kmeans_t;
+
+static inline uint64_t simpoint_hash(uint64_t x) {
+    /* splitmix64 finalizer */
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/* entry (dim, j) of the projection matrix, uniform in [-1, 1) */
+static inline double simpoint_projection(uint64_t seed, uint64_t dim,
+                                         uint32_t j) {
+    uint64_t h = simpoint_hash(seed ^ simpoint_hash(dim * 64 + j));
+    return (double)(h >> 11) * (2.0 / 9007199254740992.0) - 1.0;
+}
+
+static inline double simpoint_dist2(const std::vector<double> &a,
+                                    const std::vector<double> &b) {
+    double d = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        d += (a[i] - b[i]) * (a[i] - b[i]);
+    }
+    return d;
+}
+
+/* normalize the BBV so its counts add up to one and project it */
+static inline std::vector<double> simpoint_project(
+    const std::vector<simpoint_entry_t> &bbv, uint32_t dims, uint64_t seed) {
+    std::vector<double> x(dims, 0.0);
+    double sum = 0;
+    for (auto &e : bbv) {
+        sum += e.count;
+    }
+    if (sum == 0) {
+        return x;
+    }
+    for (auto &e : bbv) {
+        double v = e.count / sum;
+        for (uint32_t j = 0; j < dims; j++) {
+            x[j] += v * simpoint_projection(seed, e.dim, j);
+        }
+    }
+    return x;
+}
+
+/* nearest center of x, its squared distance in *d2 */
+static inline int simpoint_nearest(
+    const std::vector<std::vector<double> > &centers,
+    const std::vector<double> &x, double *d2) {
+    int best = 0;
+    double best_d2 = DBL_MAX;
+    for (size_t c = 0; c < centers.size(); c++) {
+        double d = simpoint_dist2(centers[c], x);
+        if (d < best_d2) {
+            best_d2 = d;
+            best = c;
+        }
+    }
+    *d2 = best_d2;
+    return best;
+}
+
+/* k-means++ seeding, with each point weighted by its weight */
+static inline std::vector<std::vector<double> > simpoint_seed(
+    const std::vector<simpoint_point_t> &pts, int k, std::mt19937_64 &rng) {
+    std::vector<std::vector<double> > centers;
+    std::vector<double> d2(pts.size(), DBL_MAX);
+    std::uniform_real_distribution<double> uni(0.0, 1.0);
+
+    double tot = 0;
+    for (auto &p : pts) {
+        tot += p.weight;
+    }
+    /* first center drawn proportionally to the weights, then
+     * proportionally to weight times squared distance */
+    double r = uni(rng) * tot;
+    size_t first = 0;
+    for (; first + 1 < pts.size() && r >= pts[first].weight; first++) {
+        r -= pts[first].weight;
+    }
+    centers.push_back(pts[first].x);
+
+    while ((int)centers.size() < k) {
+        double sum = 0;
+        for (size_t i = 0; i < pts.size(); i++) {
+            double d = simpoint_dist2(pts[i].x, centers.back());
+            if (d < d2[i]) {
+                d2[i] = d;
+            }
+            sum += pts[i].weight * d2[i];
+        }
+        if (sum == 0) {
+            /* fewer distinct points than k */
+            break;
+        }
+        r = uni(rng) * sum;
+        size_t next = 0;
+        for (; next + 1 < pts.size() && r >= pts[next].weight * d2[next];
+             next++) {
+            r -= pts[next].weight * d2[next];
+        }
+        centers.push_back(pts[next].x);
+    }
+    return centers;
+}
+
+/* weighted Lloyd iterations from the given centers */
+static inline simpoint_kmeans_t simpoint_lloyd(
+    const std::vector<simpoint_point_t> &pts,
+    std::vector<std::vector<double> > centers, int max_iters) {
+    simpoint_kmeans_t res;
+    size_t dims = pts.empty() ? 0 : pts[0].x.size();
+    res.assign.assign(pts.size(), -1);
+
+    for (int it = 0; it < max_iters; it++) {
+        bool changed = false;
+        for (size_t i = 0; i < pts.size(); i++) {
+            double d2;
+            int c = simpoint_nearest(centers, pts[i].x, &d2);
+            if (c != res.assign[i]) {
+                res.assign[i] = c;
+                changed = true;
+            }
+        }
+        if (!changed) {
+            break;
+        }
+        std::vector<std::vector<double> > sums(
+            centers.size(), std::vector<double>(dims, 0.0));
+        std::vector<double> w(centers.size(), 0.0);
+        for (size_t i = 0; i < pts.size(); i++) {
+            int c = res.assign[i];
+            for (size_t j = 0; j < dims; j++) {
+                sums[c][j] += pts[i].weight * pts[i].x[j];
+            }
+            w[c] += pts[i].weight;
+        }
+        for (size_t c = 0; c < centers.size(); c++) {
+            /* empty clusters keep their center */
+            if (w[c] > 0) {
+                for (size_t j = 0; j < dims; j++) {
+                    centers[c][j] = sums[c][j] / w[c];
+                }
+            }
+        }
+    }
+
+    res.sse = 0;
+    for (size_t i = 0; i < pts.size(); i++) {
+        res.sse += pts[i].scatter +
+                   pts[i].weight * simpoint_dist2(pts[i].x,
+                                                  centers[res.assign[i]]);
+    }
+    res.centers = centers;
+    return res;
+}
+
+/* best of SIMPOINT_KMEANS_SEEDS weighted k-means runs */
+static inline simpoint_kmeans_t simpoint_kmeans(
+    const std::vector<simpoint_point_t> &pts, int k, uint64_t seed) {
+    simpoint_kmeans_t best;
+    best.sse = DBL_MAX;
+    for (int s = 0; s < SIMPOINT_KMEANS_SEEDS; s++) {
+        std::mt19937_64 rng(simpoint_hash(seed + s));
+        simpoint_kmeans_t res = simpoint_lloyd(
+            pts, simpoint_seed(pts, k, rng), SIMPOINT_KMEANS_MAX_ITERS);
+        if (res.sse < best.sse) {
+            best = res;
+        }
+    }
+    return best;
+}
+
+/* Bayesian information criterion of a clustering, as used by SimPoint
+ * (Pelleg and Moore, X-means). The weights are scaled so they add up to the
+ * number of BBVs, which is the number of samples R of the formula. */
+static inline double simpoint_bic(const std::vector<simpoint_point_t> &pts,
+                                  const simpoint_kmeans_t &res) {
+    int k = res.centers.size();
+    double M = pts.empty() ? 0 : pts[0].x.size();
+    double R = 0, W = 0;
+    for (auto &p : pts) {
+        R += p.count;
+        W += p.weight;
+    }
+    if (R <= k || W == 0) {
+        return -DBL_MAX;
+    }
+    double scale = R / W;
+    std::vector<double> Rn(k, 0.0);
+    for (size_t i = 0; i < pts.size(); i++) {
+        Rn[res.assign[i]] += pts[i].weight * scale;
+    }
+    double var = res.sse * scale / (R - k);
+    if (var < 1e-12) {
+        var = 1e-12;
+    }
+    double ll = 0;
+    for (int c = 0; c < k; c++) {
+        if (Rn[c] <= 0) {
+            continue;
+        }
+        ll += Rn[c] * log(Rn[c]) - Rn[c] * log(R) -
+              Rn[c] / 2 * log(2 * M_PI) - Rn[c] * M / 2 * log(var) -
+              (Rn[c] - k) / 2;
+    }
+    double params = (k - 1) + M * k + 1;
+    return ll - params / 2 * log(R);
+}
+
+class SimPointEngine {
+  private:
+    typedef struct {
+        uint64_t id;
+        double weight;
+        std::vector<simpoint_entry_t> bbv;
+    } item_t;
+
+    int max_k;
+    uint32_t dims;
+    size_t max_points;
+    uint64_t seed;
+
+    std::vector<simpoint_point_t> points;
+    std::map<std::string, uint64_t> dim_offsets;
+    uint64_t num_dims;
+
+    /* queue of BBVs to project, consumed by the background thread */
+    std::deque<item_t> queue;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool thread_started;
+    bool done;
+
+    void insert(const item_t &item) {
+        simpoint_point_t p;
+        p.x = simpoint_project(item.bbv, dims, seed);
+        p.count = 1;
+        p.weight = item.weight;
+        p.rep_id = item.id;
+        p.scatter = 0;
+        points.push_back(p);
+        if (points.size() >= max_points) {
+            compress();
+        }
+    }
+
+    /* cluster the pool in a quarter of its size, no Lloyd iterations */
+    void compress() {
+        std::mt19937_64 rng(simpoint_hash(seed + points.size()));
+        std::vector<std::vector<double> > centers =
+            simpoint_seed(points, max_points / 4, rng);
+        std::vector<simpoint_point_t> merged(centers.size());
+        std::vector<double> rep_d2(centers.size(), DBL_MAX);
+        std::vector<int> assign(points.size());
+        for (size_t c = 0; c < centers.size(); c++) {
+            merged[c].x.assign(dims, 0.0);
+            merged[c].count = 0;
+            merged[c].weight = 0;
+            merged[c].scatter = 0;
+        }
+        for (size_t i = 0; i < points.size(); i++) {
+            const simpoint_point_t &p = points[i];
+            double d2;
+            int c = simpoint_nearest(centers, p.x, &d2);
+            assign[i] = c;
+            simpoint_point_t &m = merged[c];
+            for (uint32_t j = 0; j < dims; j++) {
+                m.x[j] += p.weight * p.x[j];
+            }
+            m.count += p.count;
+            m.weight += p.weight;
+            if (d2 < rep_d2[c]) {
+                rep_d2[c] = d2;
+                m.rep_id = p.rep_id;
+            }
+        }
+        for (auto &m : merged) {
+            for (uint32_t j = 0; j < dims; j++) {
+                m.x[j] = m.weight > 0 ? m.x[j] / m.weight : 0;
+            }
+        }
+        for (size_t i = 0; i < points.size(); i++) {
+            simpoint_point_t &m = merged[assign[i]];
+            m.scatter += points[i].scatter +
+                         points[i].weight * simpoint_dist2(points[i].x, m.x);
+        }
+        points.clear();
+        for (auto &m : merged) {
+            if (m.count != 0) {
+                points.push_back(m);
+            }
+        }
+    }
+
+    static void *thread_fun(void *arg) {
+        SimPointEngine *e = (SimPointEngine *)arg;
+        pthread_mutex_lock(&e->mutex);
+        while (true) {
+            while (e->queue.empty() && !e->done) {
+                pthread_cond_wait(&e->cond, &e->mutex);
+            }
+            if (e->queue.empty()) {
+                break;
+            }
+            item_t item;
+            item.id = e->queue.front().id;
+            item.weight = e->queue.front().weight;
+            item.bbv.swap(e->queue.front().bbv);
+            e->queue.pop_front();
+            pthread_mutex_unlock(&e->mutex);
+            e->insert(item);
+            pthread_mutex_lock(&e->mutex);
+        }
+        pthread_mutex_unlock(&e->mutex);
+        return NULL;
+    }
+
+  public:
+    SimPointEngine() : thread_started(false) {}
+
+    /* max_k: largest number of clusters considered, dims: dimensions of the
+     * projection, max_points: size of the pool of points */
+    void init(int max_k, uint32_t dims = SIMPOINT_DEFAULT_DIMS,
+              size_t max_points = SIMPOINT_DEFAULT_MAX_POINTS,
+              uint64_t seed = 1) {
+        assert(max_k > 0 && dims > 0 && max_points >= 8);
+        this->max_k = max_k;
+        this->dims = dims;
+        this->max_points = max_points;
+        this->seed = seed;
+        num_dims = 0;
+        done = false;
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+
+    /* process BBVs on a background thread from now on */
+    void start() {
+        thread_started = true;
+        pthread_create(&thread, NULL, thread_fun, this);
+    }
+
+    /* first dimension of the basic blocks of a kernel, basic blocks of
+     * different kernels must not share dimensions */
+    uint64_t get_dim_offset(const std::string &name, uint32_t num_bbs) {
+        auto it = dim_offsets.find(name);
+        if (it == dim_offsets.end()) {
+            it = dim_offsets.insert(std::make_pair(name, num_dims)).first;
+            num_dims += num_bbs;
+        }
+        return it->second;
+    }
+
+    /* add a BBV of the given weight (i.e. number of instructions) */
+    void add(uint64_t id, double weight, std::vector<simpoint_entry_t> &bbv) {
+        item_t item;
+        item.id = id;
+        item.weight = weight;
+        item.bbv.swap(bbv);
+        if (!thread_started) {
+            insert(item);
+            return;
+        }
+        pthread_mutex_lock(&mutex);
+        queue.push_back(item);
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    /* add row r of a dense num_rows x num_bbs matrix of basic block
+     * execution counts, weighting each count by the basic block size as
+     * SimPoint does; returns false if the row is empty */
+    template <typename T>
+    bool add_dense(uint64_t id, uint64_t dim_offset, const T *row,
+                   const int *bb_sizes, uint32_t num_bbs) {
+        std::vector<simpoint_entry_t> bbv;
+        double weight = 0;
+        for (uint32_t bb = 0; bb < num_bbs; bb++) {
+            if (row[bb] != 0) {
+                simpoint_entry_t e = {dim_offset + bb,
+                                      (double)row[bb] * bb_sizes[bb]};
+                bbv.push_back(e);
+                weight += e.count;
+            }
+        }
+        if (weight == 0) {
+            return false;
+        }
+        add(id, weight, bbv);
+        return true;
+    }
+
+    /* add the BBVs of a kernel launch from the dense num_rows x num_bbs
+     * matrix of basic block execution counts of its CTAs or warps, either
+     * as a single BBV of id launch_id or one BBV per row of id
+     * (launch_id << 32 | row) */
+    template <typename T>
+    void add_kernel(uint32_t launch_id, const std::string &name,
+                    uint32_t num_rows, uint32_t num_bbs, const int *bb_sizes,
+                    const T *counts, bool per_row) {
+        uint64_t dim_offset = get_dim_offset(name, num_bbs);
+        if (per_row) {
+            for (uint32_t r = 0; r < num_rows; r++) {
+                add_dense(((uint64_t)launch_id << 32) | r, dim_offset,
+                          counts + (size_t)r * num_bbs, bb_sizes, num_bbs);
+            }
+            return;
+        }
+        std::vector<double> sum(num_bbs, 0.0);
+        for (uint32_t r = 0; r < num_rows; r++) {
+            for (uint32_t bb = 0; bb < num_bbs; bb++) {
+                sum[bb] += counts[(size_t)r * num_bbs + bb];
+            }
+        }
+        add_dense(launch_id, dim_offset, sum.data(), bb_sizes, num_bbs);
+    }
+
+    /* wait for the queued BBVs and pick the simulation points, sorted by
+     * cluster */
+    std::vector<simpoint_t> finish() {
+        if (thread_started) {
+            pthread_mutex_lock(&mutex);
+            done = true;
+            pthread_cond_signal(&cond);
+            pthread_mutex_unlock(&mutex);
+            pthread_join(thread, NULL);
+            thread_started = false;
+        }
+
+        std::vector<simpoint_t> res;
+        if (points.empty()) {
+            return res;
+        }
+        /* bound the cost of the max_k clusterings */
+        if (points.size() > max_points / 4) {
+            compress();
+        }
+
+        /* BIC of every k, keep the clusterings to pick from */
+        std::vector<simpoint_kmeans_t> runs;
+        std::vector<double> bics;
+        double min_bic = DBL_MAX, max_bic = -DBL_MAX;
+        for (int k = 1; k <= max_k && k <= (int)points.size(); k++) {
+            runs.push_back(simpoint_kmeans(points, k, seed + k));
+            bics.push_back(simpoint_bic(points, runs.back()));
+            min_bic = fmin(min_bic, bics.back());
+            max_bic = fmax(max_bic, bics.back());
+        }
+        size_t pick = 0;
+        while (pick + 1 < runs.size() &&
+               bics[pick] - min_bic <
+                   SIMPOINT_BIC_THRESHOLD * (max_bic - min_bic)) {
+            pick++;
+        }
+        const simpoint_kmeans_t &best = runs[pick];
+
+        /* representative and weight of every non empty cluster */
+        double tot = 0;
+        for (auto &p : points) {
+            tot += p.weight;
+        }
+        for (size_t c = 0; c < best.centers.size(); c++) {
+            double w = 0, rep_d2 = DBL_MAX;
+            uint64_t rep = 0;
+            for (size_t i = 0; i < points.size(); i++) {
+                if (best.assign[i] != (int)c) {
+                    continue;
+                }
+                w += points[i].weight;
+                double d2 = simpoint_dist2(points[i].x, best.centers[c]);
+                if (d2 < rep_d2) {
+                    rep_d2 = d2;
+                    rep = points[i].rep_id;
+                }
+            }
+            if (rep_d2 != DBL_MAX) {
+                simpoint_t sp = {rep, tot > 0 ? w / tot : 0,
+                                 (int)res.size()};
+                res.push_back(sp);
+            }
+        }
+        return res;
+    }
+
+    /* number of points currently in the pool */
+    size_t get_num_points() const { return points.size(); }
+};
+
+/* write the simulation points in the SimPoint format, one
+ * "<id> <cluster>" line per point in <prefix>.simpoints and one
+ * "<weight> <cluster>" line in <prefix>.weights */
+static inline bool simpoint_write(const std::string &prefix,
+                                  const std::vector<simpoint_t> &sps) {
+    FILE *fs = fopen((prefix + ".simpoints").c_str(), "w");
+    FILE *fw = fopen((prefix + ".weights").c_str(), "w");
+    if (fs == NULL || fw == NULL) {
+        if (fs) fclose(fs);
+        if (fw) fclose(fw);
+        return false;
+    }
+    for (auto &sp : sps) {
+        fprintf(fs, "%lu %d\n", (unsigned long)sp.id, sp.cluster);
+        fprintf(fw, "%f %d\n", sp.weight, sp.cluster);
+    }
+    fclose(fs);
+    fclose(fw);
+    return true;
+}
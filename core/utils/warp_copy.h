@@ -0,0 +1,79 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* Warp cooperative copy of a packet into a channel buffer, used by
+ * ChannelDev::push_warp. Every active lane holds the same packet and stores
+ * its own slice of it, so a packet of n 16 byte chunks is written by n lanes
+ * with one vector store each instead of by a single lane. Kept free of CUDA
+ * types so the split can be checked on the host. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "host_device.h"
+
+/* unit of the vector stores */
+struct alignas(16) warp_copy_chunk_t {
+    uint64_t w[2];
+};
+
+/* rank of lane among the lanes set in mask */
+HOST_DEVICE_INLINE int warp_rank(uint32_t mask, int lane) {
+    return hd_popc(mask & ((1u << lane) - 1));
+}
+
+/* Stores the part of the nbytes packet at src that the lane of rank `rank`
+ * out of nactive active lanes is in charge of. dst and nbytes are multiples
+ * of 8, as every channel packet: if dst is not 16 bytes aligned its first
+ * word is a separate 8 byte store, as is the last word when an odd number is
+ * left, both done by rank 0; the 16 byte aligned chunks in between are dealt
+ * round robin to the lanes. */
+HOST_DEVICE_INLINE void warp_copy_slice(uint8_t *dst, const uint64_t *src,
+                                        uint32_t nbytes, int rank,
+                                        int nactive) {
+    uint64_t *d = (uint64_t *)dst;
+    uint32_t words = nbytes / sizeof(uint64_t);
+    uint32_t head = ((uintptr_t)dst & 15) != 0 && words > 0 ? 1 : 0;
+    uint32_t chunks = (words - head) / 2;
+
+    if (rank == 0) {
+        if (head) {
+            d[0] = src[0];
+        }
+        if ((words - head) & 1) {
+            d[words - 1] = src[words - 1];
+        }
+    }
+    for (uint32_t i = rank; i < chunks; i += nactive) {
+        warp_copy_chunk_t c;
+        c.w[0] = src[head + 2 * i];
+        c.w[1] = src[head + 2 * i + 1];
+        *(warp_copy_chunk_t *)(d + head + 2 * i) = c;
+    }
+}
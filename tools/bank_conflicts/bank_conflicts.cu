@@ -0,0 +1,396 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+/* every tool needs to include this once */
+#include "nvbit_tool.h"
+
+/* nvbit interface file */
+#include "nvbit.h"
+
+/* for _cuda_safe and GET_VAR* macros */
+#include "macros.h"
+
+/* provide some __device__ functions */
+#include "utils/utils.h"
+
+/* for in launch order reporting of asynchronously completed kernels */
+#include "utils/launch_collector.h"
+
+/* conflict degree of a warp level shared memory access */
+#include "bank_conflicts.h"
+
+/* Shared memory bank conflict analyzer. Every shared memory load, store and
+ * atomic is instrumented with a function that computes, on the GPU, how
+ * many wavefronts the warp access takes (see bank_conflicts.h) and
+ * accumulates them per static instruction. No address leaves the GPU: the
+ * per instruction counters of a launch are read back once when it completes
+ * and the instructions with the most conflicts are printed.
+ *
+ * As in opcode_hist every launch in flight owns a slot of MAX_INSTRS
+ * counters, whose address is passed with nvbit_set_at_launch, and the used
+ * part of a slot is reset after it is copied back, so free slots are always
+ * zero. */
+#define MAX_INSTRS (16 * 1024)
+#define NUM_SLOTS 16
+bank_counters_t *dev_slots;
+bank_counters_t *host_slots;
+SlotPool slots;
+
+/* static shared memory instructions, indexed by instruction id */
+struct instr_info_t {
+    std::string func_name;
+    uint32_t offset;
+    std::string opcode;
+    /* "file:line" if the application has line information */
+    std::string source;
+};
+std::vector<instr_info_t> instr_infos;
+
+/* per launch context, from the launch until it is reported */
+struct launch_t {
+    uint32_t kernel_id;
+    int slot;
+    /* number of instructions known at the end of the launch, i.e.
+     * counters to copy */
+    int num_instrs;
+    std::string func_name;
+    LaunchCollector<launch_t>::handle_t handle;
+};
+
+/* reports completed launches in launch order */
+LaunchCollector<launch_t> collector;
+
+/* launch issued by the calling thread, between the entry and the exit
+ * callback of the launch */
+static __thread launch_t *curr_launch = NULL;
+
+/* kernel id counter, maintained in system memory */
+uint32_t kernel_id = 0;
+
+/* global control variables for this tool */
+uint32_t instr_begin_interval = 0;
+uint32_t instr_end_interval = UINT32_MAX;
+uint32_t ker_begin_interval = 0;
+uint32_t ker_end_interval = UINT32_MAX;
+int verbose = 0;
+int top_instrs = 10;
+
+/* a pthread mutex, held from the entry to the exit callback of a launch, as
+ * in opcode_hist: the launch value and the instrumented flag are per
+ * function and must not be changed by another thread before the launch */
+pthread_mutex_t launch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* a pthread mutex, protecting instr_infos */
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Instrumentation function that we want to inject, please note the use of
+ * 1. extern "C" __device__ __noinline__ dev_func
+ *    to prevent code elimination by the compiler.
+ * 2. NVBIT_EXPORT_FUNC(dev_func)
+ *    to notify nvbit the name of the function we want to inject.
+ *    This name must match exactly the function name.
+ */
+extern "C" __device__ __noinline__ void count_conflicts(
+    int pred, uint32_t reg_high, uint32_t reg_low, int32_t imm,
+    int instr_id, int nwords, uint64_t pslot) {
+    if (!pred) {
+        return;
+    }
+
+    uint64_t addr = ((((uint64_t)reg_high) << 32) | ((uint64_t)reg_low)) + imm;
+
+    const int active_mask = __ballot(1);
+    const int laneid = get_laneid();
+    const int first_laneid = __ffs(active_mask) - 1;
+
+    /* every lane needs the addresses of the whole warp */
+    uint64_t addrs[32];
+    for (int i = 0; i < 32; i++) {
+        addrs[i] = __shfl(addr, i);
+    }
+
+    /* which words are accessed first by each lane, then how many distinct
+     * words the phase of each lane accesses in its banks */
+    uint32_t first[BANK_MAX_WORDS];
+    for (int k = 0; k < BANK_MAX_WORDS; k++) {
+        first[k] = __ballot(k < nwords && bank_is_first(addrs, active_mask,
+                                                         laneid, k, nwords));
+    }
+    int degree = bank_lane_degree(addrs, first, laneid, nwords);
+
+    int degrees[32];
+    for (int i = 0; i < 32; i++) {
+        degrees[i] = __shfl(degree, i);
+    }
+
+    /* only the first active thread will perform the atomics */
+    if (first_laneid == laneid) {
+        int ideal;
+        int wavefronts = bank_sum_phases(degrees, active_mask, nwords, &ideal);
+        bank_counters_t *c = (bank_counters_t *)pslot + instr_id;
+        atomicAdd((unsigned long long *)&c->requests, 1);
+        atomicAdd((unsigned long long *)&c->wavefronts, wavefronts);
+        atomicAdd((unsigned long long *)&c->ideal_wavefronts, ideal);
+    }
+}
+NVBIT_EXPORT_FUNC(count_conflicts);
+
+void nvbit_at_init() {
+    /* just make sure all managed variables are allocated on GPU */
+    setenv("CUDA_MANAGED_FORCE_DEVICE_ALLOC", "1", 1);
+
+    GET_VAR_INT(
+        instr_begin_interval, "INSTR_BEGIN", 0,
+        "Beginning of the instruction interval where to apply instrumentation");
+    GET_VAR_INT(
+        instr_end_interval, "INSTR_END", UINT32_MAX,
+        "End of the instruction interval where to apply instrumentation");
+    GET_VAR_INT(ker_begin_interval, "KERNEL_BEGIN", 0,
+                "Beginning of the kernel launch interval where to apply "
+                "instrumentation");
+    GET_VAR_INT(
+        ker_end_interval, "KERNEL_END", UINT32_MAX,
+        "End of the kernel launch interval where to apply instrumentation");
+    GET_VAR_INT(top_instrs, "TOP_INSTRS", 10,
+                "Number of instructions with the most conflicts printed per "
+                "kernel");
+    GET_VAR_INT(verbose, "TOOL_VERBOSE", 0, "Enable verbosity inside the tool");
+
+    std::string pad(100, '-');
+    printf("%s\n", pad.c_str());
+}
+
+/* instrument every shared memory instruction */
+void nvbit_at_function_first_load(CUcontext ctx, CUfunction func) {
+    const std::vector<Instr *> &instrs = nvbit_get_instrs(ctx, func);
+    std::string func_name = nvbit_get_func_name(ctx, func);
+    if (verbose) {
+        printf("inspecting %s - number of instructions %ld\n",
+               func_name.c_str(), instrs.size());
+    }
+
+    pthread_mutex_lock(&mutex);
+    for (auto i : instrs) {
+        if (i->getIdx() < instr_begin_interval ||
+            i->getIdx() >= instr_end_interval ||
+            i->getMemOpType() != Instr::SHARED) {
+            continue;
+        }
+        if (instr_infos.size() >= MAX_INSTRS) {
+            printf("Error: more than %d shared memory instructions, the rest "
+                   "of %s is not analyzed\n",
+                   MAX_INSTRS, func_name.c_str());
+            break;
+        }
+        if (verbose) {
+            i->print();
+        }
+
+        for (int n = 0; n < i->getNumOperands(); n++) {
+            const Instr::operand_t *op = i->getOperand(n);
+            if (op->type != Instr::MREF) {
+                continue;
+            }
+
+            instr_info_t info;
+            info.func_name = func_name;
+            info.offset = i->getOffset();
+            info.opcode = i->getOpcode();
+            char *file_name, *dir_name;
+            uint32_t line;
+            if (nvbit_get_line_info(ctx, func, i->getOffset(), &file_name,
+                                    &dir_name, &line)) {
+                info.source = std::string(file_name) + ":" +
+                              std::to_string(line);
+            } else {
+                info.source = "?";
+            }
+            int instr_id = instr_infos.size();
+            instr_infos.push_back(info);
+
+            nvbit_insert_call(i, "count_conflicts", IPOINT_BEFORE);
+            nvbit_add_call_arg_pred_val(i);
+            if (i->isExtended()) {
+                nvbit_add_call_arg_reg_val(i, (int)op->value[0] + 1);
+            } else {
+                nvbit_add_call_arg_reg_val(i, (int)Instr::RZ);
+            }
+            nvbit_add_call_arg_reg_val(i, (int)op->value[0]);
+            nvbit_add_call_arg_const_val32(i, (int)op->value[1]);
+            nvbit_add_call_arg_const_val32(i, instr_id);
+            nvbit_add_call_arg_const_val32(i, bank_num_words(i->getSize()));
+            /* add pointer to the counter slot of the launch */
+            nvbit_add_call_arg_launch_val64(i, 0);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+/* stream on which the launch described by cbid/params is issued */
+cudaStream_t get_launch_stream(nvbit_api_cuda_t cbid, void *params) {
+    if (cbid == API_CUDA_cuLaunchKernel_ptsz) {
+        cuLaunchKernel_ptsz_params *p = (cuLaunchKernel_ptsz_params *)params;
+        return p->hStream != NULL ? p->hStream : cudaStreamPerThread;
+    } else if (cbid == API_CUDA_cuLaunchKernel) {
+        return ((cuLaunchKernel_params *)params)->hStream;
+    } else if (cbid == API_CUDA_cuLaunchGridAsync) {
+        return ((cuLaunchGridAsync_params *)params)->hStream;
+    }
+    return 0;
+}
+
+/* stream callback, the kernel and the copy of its counter slot are done */
+void CUDART_CB launch_done(cudaStream_t stream, cudaError_t status,
+                           void *data) {
+    launch_t *l = (launch_t *)data;
+    collector.complete(l->handle);
+}
+
+/* called by the collector thread, in launch order */
+void report_launch(launch_t *l) {
+    const bank_counters_t *counters = &host_slots[(size_t)l->slot * MAX_INSTRS];
+
+    bank_counters_t total = {0, 0, 0};
+    std::vector<int> ids;
+    for (int i = 0; i < l->num_instrs; i++) {
+        const bank_counters_t &c = counters[i];
+        total.requests += c.requests;
+        total.wavefronts += c.wavefronts;
+        total.ideal_wavefronts += c.ideal_wavefronts;
+        if (c.wavefronts > c.ideal_wavefronts) {
+            ids.push_back(i);
+        }
+    }
+    printf(
+        "kernel %d - %s - shared requests %ld, wavefronts %ld, ideal "
+        "wavefronts %ld, wavefronts/ideal %.2f\n",
+        l->kernel_id, l->func_name.c_str(), total.requests, total.wavefronts,
+        total.ideal_wavefronts,
+        total.ideal_wavefronts
+            ? (double)total.wavefronts / total.ideal_wavefronts
+            : 0.0);
+
+    /* worst instructions first, by wavefronts lost to conflicts */
+    std::sort(ids.begin(), ids.end(), [counters](int a, int b) {
+        return counters[a].wavefronts - counters[a].ideal_wavefronts >
+               counters[b].wavefronts - counters[b].ideal_wavefronts;
+    });
+    if ((int)ids.size() > top_instrs) {
+        ids.resize(top_instrs);
+    }
+    pthread_mutex_lock(&mutex);
+    for (int id : ids) {
+        const bank_counters_t &c = counters[id];
+        const instr_info_t &info = instr_infos[id];
+        printf(
+            "  %s+0x%x %s - %s - requests %ld, wavefronts/request %.2f, "
+            "conflict wavefronts %ld\n",
+            info.func_name.c_str(), info.offset, info.opcode.c_str(),
+            info.source.c_str(), c.requests,
+            (double)c.wavefronts / c.requests,
+            c.wavefronts - c.ideal_wavefronts);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    slots.release(l->slot);
+    delete l;
+}
+
+/* The counter slot of a launch is copied back after the kernel and reset on
+ * the launch stream, the collector thread reports the launches in order as
+ * in opcode_hist. The number of instructions is only read at the exit
+ * callback, the function of a first launch is instrumented after the entry
+ * callback. */
+void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
+                         const char *name, void *params, CUresult *pStatus) {
+    if (cbid == API_CUDA_cuLaunch || cbid == API_CUDA_cuLaunchKernel_ptsz ||
+        cbid == API_CUDA_cuLaunchGrid || cbid == API_CUDA_cuLaunchGridAsync ||
+        cbid == API_CUDA_cuLaunchKernel) {
+        cuLaunch_params *p = (cuLaunch_params *)params;
+        cudaStream_t stream = get_launch_stream(cbid, params);
+
+        if (!is_exit) {
+            launch_t *l = new launch_t;
+            l->slot = slots.acquire();
+            l->func_name = nvbit_get_func_name(ctx, p->f);
+
+            pthread_mutex_lock(&launch_mutex);
+            l->kernel_id = kernel_id++;
+            if (l->kernel_id >= ker_begin_interval &&
+                l->kernel_id < ker_end_interval) {
+                nvbit_enable_instrumented(ctx, p->f, true);
+            } else {
+                nvbit_enable_instrumented(ctx, p->f, false);
+            }
+            bank_counters_t *pslot = &dev_slots[(size_t)l->slot * MAX_INSTRS];
+            nvbit_set_at_launch(ctx, p->f, &pslot, sizeof(pslot));
+            l->handle = collector.submit(l);
+            curr_launch = l;
+        } else {
+            launch_t *l = curr_launch;
+            curr_launch = NULL;
+            assert(l != NULL);
+            pthread_mutex_lock(&mutex);
+            l->num_instrs = instr_infos.size();
+            pthread_mutex_unlock(&mutex);
+
+            size_t offset = (size_t)l->slot * MAX_INSTRS;
+            CUDA_SAFECALL(cudaMemcpyAsync(
+                &host_slots[offset], &dev_slots[offset],
+                sizeof(bank_counters_t) * l->num_instrs,
+                cudaMemcpyDeviceToHost, stream));
+            CUDA_SAFECALL(cudaMemsetAsync(
+                &dev_slots[offset], 0,
+                sizeof(bank_counters_t) * l->num_instrs, stream));
+            CUDA_SAFECALL(cudaStreamAddCallback(stream, launch_done, l, 0));
+            pthread_mutex_unlock(&launch_mutex);
+        }
+    }
+}
+
+void nvbit_at_ctx_init(CUcontext ctx) {
+    size_t nbytes = sizeof(bank_counters_t) * MAX_INSTRS * NUM_SLOTS;
+    CUDA_SAFECALL(cudaMalloc((void **)&dev_slots, nbytes));
+    CUDA_SAFECALL(cudaMemset(dev_slots, 0, nbytes));
+    CUDA_SAFECALL(cudaMallocHost((void **)&host_slots, nbytes));
+    slots.init(NUM_SLOTS);
+    collector.start(report_launch);
+}
+
+void nvbit_at_ctx_term(CUcontext ctx) {
+    /* print whatever is still in flight */
+    collector.stop();
+}
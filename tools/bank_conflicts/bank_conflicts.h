@@ -0,0 +1,154 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "utils/host_device.h"
+
+/* Bank conflicts of warp level shared memory accesses, assuming 32 banks 4
+ * bytes wide. Lanes accessing the same 4 byte word are served by a single
+ * broadcast, lanes accessing different words of the same bank are
+ * serialized. Accesses wider than 4 bytes are split in phases as on Maxwell
+ * and later: 8 byte accesses in two phases of 16 lanes, 16 byte accesses in
+ * four phases of 8 lanes; each lane then touches 2 or 4 consecutive words.
+ *
+ * A phase takes as many wavefronts as the largest number of distinct words
+ * accessed in one bank, so a request costs at least one wavefront per phase
+ * with an active lane (the ideal) and the excess are the conflicts.
+ *
+ * The device computes this cooperatively: every lane evaluates
+ * bank_is_first for its words (combined across the warp with ballots into
+ * the first masks) and then bank_lane_degree for itself, and one lane sums
+ * the phases with bank_sum_phases. bank_wavefronts does the same steps
+ * serially on the host. Addresses are assumed naturally aligned. */
+
+#define BANK_NUM_BANKS 32
+#define BANK_WORD_SHIFT 2
+#define BANK_MAX_WORDS 4
+
+/* per static instruction totals, accumulated on the device */
+typedef struct {
+    /* warp level executions */
+    uint64_t requests;
+    uint64_t wavefronts;
+    /* wavefronts without conflicts */
+    uint64_t ideal_wavefronts;
+} bank_counters_t;
+
+/* 4 byte words touched by each lane for an access of size bytes */
+HOST_DEVICE_INLINE int bank_num_words(uint32_t size) {
+    if (size <= 4) return 1;
+    if (size >= 16) return BANK_MAX_WORDS;
+    return size >> BANK_WORD_SHIFT;
+}
+
+HOST_DEVICE_INLINE uint64_t bank_word(const uint64_t *addrs, int lane,
+                                      int k) {
+    return (addrs[lane] >> BANK_WORD_SHIFT) + k;
+}
+
+/* true if word k of lane is not accessed by a lower active lane of the same
+ * phase (the words of a lane are all different) */
+HOST_DEVICE_INLINE bool bank_is_first(const uint64_t *addrs, uint32_t mask,
+                                      int lane, int k, int nwords) {
+    int width = 32 / nwords;
+    uint64_t word = bank_word(addrs, lane, k);
+    for (int j = lane - lane % width; j < lane; j++) {
+        if (!((mask >> j) & 1)) continue;
+        for (int kk = 0; kk < nwords; kk++) {
+            if (bank_word(addrs, j, kk) == word) return false;
+        }
+    }
+    return true;
+}
+
+/* largest number of distinct words that the phase of lane accesses in the
+ * banks lane touches. first[k] has bit j set if word k of lane j is
+ * bank_is_first (so only active lanes). */
+HOST_DEVICE_INLINE int bank_lane_degree(const uint64_t *addrs,
+                                        const uint32_t *first, int lane,
+                                        int nwords) {
+    int width = 32 / nwords;
+    int start = lane - lane % width;
+    int degree = 0;
+    for (int k = 0; k < nwords; k++) {
+        uint64_t bank = bank_word(addrs, lane, k) % BANK_NUM_BANKS;
+        int n = 0;
+        for (int j = start; j < start + width; j++) {
+            for (int kk = 0; kk < nwords; kk++) {
+                if (((first[kk] >> j) & 1) &&
+                    bank_word(addrs, j, kk) % BANK_NUM_BANKS == bank) {
+                    n++;
+                }
+            }
+        }
+        degree = n > degree ? n : degree;
+    }
+    return degree;
+}
+
+/* wavefronts of a request from the degree of each lane, the number of
+ * phases with an active lane goes in ideal */
+HOST_DEVICE_INLINE int bank_sum_phases(const int *degrees, uint32_t mask,
+                                       int nwords, int *ideal) {
+    int width = 32 / nwords;
+    int wavefronts = 0;
+    *ideal = 0;
+    for (int start = 0; start < 32; start += width) {
+        int phase = 0;
+        for (int j = start; j < start + width; j++) {
+            if (((mask >> j) & 1) && degrees[j] > phase) phase = degrees[j];
+        }
+        if (phase > 0) {
+            wavefronts += phase;
+            (*ideal)++;
+        }
+    }
+    return wavefronts;
+}
+
+/* host version of the whole computation */
+HOST_DEVICE_INLINE int bank_wavefronts(const uint64_t *addrs, uint32_t mask,
+                                       uint32_t size, int *ideal) {
+    int nwords = bank_num_words(size);
+    uint32_t first[BANK_MAX_WORDS] = {0, 0, 0, 0};
+    for (int k = 0; k < nwords; k++) {
+        for (int lane = 0; lane < 32; lane++) {
+            if (((mask >> lane) & 1) &&
+                bank_is_first(addrs, mask, lane, k, nwords)) {
+                first[k] |= 1u << lane;
+            }
+        }
+    }
+    int degrees[32];
+    for (int lane = 0; lane < 32; lane++) {
+        degrees[lane] = bank_lane_degree(addrs, first, lane, nwords);
+    }
+    return bank_sum_phases(degrees, mask, nwords, ideal);
+}
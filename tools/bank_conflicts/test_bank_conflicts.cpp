@@ -0,0 +1,173 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host test of the shared memory bank conflict model (bank_conflicts.h):
+ * the wavefronts of the usual access patterns for 4, 8 and 16 byte
+ * accesses, and the cooperative computation the device does against a
+ * straightforward reference on random warps. */
+
+#include <stdint.h>
+#include <map>
+#include <random>
+#include <set>
+
+#include "bank_conflicts.h"
+#include "utils/host_test.h"
+
+/* per phase, the largest number of distinct words in one bank */
+static int reference_wavefronts(const uint64_t *addrs, uint32_t mask,
+                                uint32_t size, int *ideal) {
+    int nwords = size <= 4 ? 1 : (size >= 16 ? 4 : size / 4);
+    int width = 32 / nwords, total = 0;
+    *ideal = 0;
+    for (int start = 0; start < 32; start += width) {
+        std::map<int, std::set<uint64_t> > banks;
+        bool active = false;
+        for (int j = start; j < start + width; j++) {
+            if (!((mask >> j) & 1)) continue;
+            active = true;
+            for (int k = 0; k < nwords; k++) {
+                uint64_t word = (addrs[j] >> 2) + k;
+                banks[word % 32].insert(word);
+            }
+        }
+        size_t phase = 0;
+        for (auto &b : banks) {
+            phase = b.second.size() > phase ? b.second.size() : phase;
+        }
+        total += phase;
+        *ideal += active;
+    }
+    return total;
+}
+
+static void strided(uint64_t *addrs, uint64_t base, uint64_t stride) {
+    for (int lane = 0; lane < 32; lane++) {
+        addrs[lane] = base + stride * lane;
+    }
+}
+
+static int wavefronts(const uint64_t *addrs, uint32_t mask, uint32_t size,
+                      int expected_ideal) {
+    int ideal = -1;
+    int w = bank_wavefronts(addrs, mask, size, &ideal);
+    CHECK(ideal == expected_ideal);
+    return w;
+}
+
+static void test_patterns() {
+    uint64_t a[32];
+    CHECK(bank_num_words(1) == 1 && bank_num_words(4) == 1);
+    CHECK(bank_num_words(8) == 2 && bank_num_words(16) == 4);
+
+    /* 4 byte words */
+    strided(a, 0, 4);
+    CHECK(wavefronts(a, ~0u, 4, 1) == 1);
+    strided(a, 0, 8);
+    CHECK(wavefronts(a, ~0u, 4, 1) == 2);
+    strided(a, 0, 128);
+    CHECK(wavefronts(a, ~0u, 4, 1) == 32);
+    /* the usual padding of a 32 x 32 tile: no conflict */
+    strided(a, 0, 132);
+    CHECK(wavefronts(a, ~0u, 4, 1) == 1);
+    /* broadcast */
+    strided(a, 64, 0);
+    CHECK(wavefronts(a, ~0u, 4, 1) == 1);
+    /* two words per bank, half of the lanes on each: 2 wavefronts */
+    for (int l = 0; l < 32; l++) a[l] = (l % 2) * 128;
+    CHECK(wavefronts(a, ~0u, 4, 1) == 2);
+    /* a single lane, or inactive lanes that would conflict */
+    strided(a, 0, 128);
+    CHECK(wavefronts(a, 0x1, 4, 1) == 1);
+    CHECK(wavefronts(a, 0x3, 4, 1) == 2);
+    CHECK(wavefronts(a, 0, 4, 0) == 0);
+
+    /* 8 byte words, two phases of 16 lanes */
+    strided(a, 0, 8);
+    CHECK(wavefronts(a, ~0u, 8, 2) == 2);
+    strided(a, 0, 16);
+    CHECK(wavefronts(a, ~0u, 8, 2) == 4);
+    /* only the second half active */
+    strided(a, 0, 8);
+    CHECK(wavefronts(a, 0xffff0000, 8, 1) == 1);
+
+    /* 16 byte words, four phases of 8 lanes */
+    strided(a, 0, 16);
+    CHECK(wavefronts(a, ~0u, 16, 4) == 4);
+    strided(a, 0, 32);
+    CHECK(wavefronts(a, ~0u, 16, 4) == 8);
+    strided(a, 0, 0);
+    CHECK(wavefronts(a, ~0u, 16, 4) == 4);
+}
+
+/* the device steps: ballots of bank_is_first, then a degree per lane */
+static int device_wavefronts(const uint64_t *addrs, uint32_t mask,
+                             uint32_t size, int *ideal) {
+    int nwords = bank_num_words(size);
+    uint32_t first[BANK_MAX_WORDS] = {0, 0, 0, 0};
+    for (int lane = 0; lane < 32; lane++) {
+        if (!((mask >> lane) & 1)) continue;
+        for (int k = 0; k < nwords; k++) {
+            first[k] |= (uint32_t)bank_is_first(addrs, mask, lane, k, nwords)
+                        << lane;
+        }
+    }
+    int degrees[32] = {0};
+    for (int lane = 0; lane < 32; lane++) {
+        if ((mask >> lane) & 1) {
+            degrees[lane] = bank_lane_degree(addrs, first, lane, nwords);
+        }
+    }
+    return bank_sum_phases(degrees, mask, nwords, ideal);
+}
+
+static void test_random() {
+    std::mt19937_64 rng(3);
+    uint64_t a[32];
+    for (int t = 0; t < 100000; t++) {
+        uint32_t mask = t % 7 == 0 ? ~0u : (uint32_t)rng();
+        uint32_t size = 4 << (t % 3);
+        /* small spans so lanes share words and banks */
+        uint64_t span = t % 5 == 0 ? 64 : (t % 5 == 1 ? 4096 : 1 << 16);
+        for (int l = 0; l < 32; l++) {
+            a[l] = (rng() % span) & ~(uint64_t)(size - 1);
+        }
+        int ideal, ref_ideal, dev_ideal;
+        int w = bank_wavefronts(a, mask, size, &ideal);
+        CHECK(w == reference_wavefronts(a, mask, size, &ref_ideal));
+        CHECK(ideal == ref_ideal);
+        CHECK(w == device_wavefronts(a, mask, size, &dev_ideal));
+        CHECK(ideal == dev_ideal);
+        CHECK(w >= ideal);
+    }
+}
+
+int main() {
+    test_patterns();
+    test_random();
+    return host_test_done("test_bank_conflicts");
+}
@@ -0,0 +1,114 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host utility converting the sparse BBV files written by bbv_count and
+ * bbv_count_tb (see utils/bbv_file.h) to the SimPoint .bb text format.
+ *
+ * usage: bbv_to_simpoint <bbv file> [rows]
+ *
+ * By default every kernel launch is one SimPoint interval, whose vector is
+ * the sum of the rows (CTAs or warps) of the launch. With "rows" every row is
+ * an interval of its own. Basic blocks of different kernels get different
+ * dimensions, assigned in order of first appearance of the kernel name, and
+ * counts are weighted by the number of instructions of the basic block as
+ * SimPoint expects. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "utils/bbv_file.h"
+
+/* print one interval, dims are 1-based in the .bb format */
+static void print_interval(uint64_t dim_offset, const std::vector<int> &sizes,
+                           const std::map<uint32_t, uint64_t> &counts) {
+    printf("T");
+    for (auto &c : counts) {
+        printf(":%lu:%lu ", (unsigned long)(dim_offset + c.first + 1),
+               (unsigned long)(c.second * sizes[c.first]));
+    }
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3 || (argc == 3 && strcmp(argv[2], "rows"))) {
+        fprintf(stderr, "usage: %s <bbv file> [rows]\n", argv[0]);
+        return 1;
+    }
+    bool per_row = argc == 3;
+
+    BBVFileReader reader;
+    if (!reader.open(argv[1])) {
+        fprintf(stderr, "%s: can not read %s\n", argv[0], argv[1]);
+        return 1;
+    }
+
+    /* first dimension of every kernel */
+    std::map<std::string, uint64_t> dim_offsets;
+    uint64_t num_dims = 0;
+
+    std::vector<bbv_entry_t> row;
+    std::map<uint32_t, uint64_t> counts;
+    while (reader.next_kernel()) {
+        const bbv_kernel_header_t &k = reader.kernel();
+        auto it = dim_offsets.find(reader.kernel_name());
+        if (it == dim_offsets.end()) {
+            it = dim_offsets.insert(std::make_pair(reader.kernel_name(),
+                                                   num_dims)).first;
+            num_dims += k.num_bbs;
+        }
+
+        counts.clear();
+        uint32_t r;
+        for (r = 0; r < k.num_rows && reader.next_row(row); r++) {
+            for (auto &e : row) {
+                counts[e.bb] += e.count;
+            }
+            if (per_row) {
+                print_interval(it->second, reader.get_bb_sizes(), counts);
+                counts.clear();
+            }
+        }
+        if (r != k.num_rows) {
+            fprintf(stderr, "%s: kernel %u has a malformed record\n",
+                    argv[0], k.kernel_id);
+            return 1;
+        }
+        if (!per_row) {
+            print_interval(it->second, reader.get_bb_sizes(), counts);
+        }
+    }
+    if (reader.is_malformed()) {
+        fprintf(stderr, "%s: %s is truncated or corrupted\n", argv[0],
+                argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,392 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* Host test of the BBV file format (utils/bbv_file.h): varints at the
+ * boundaries of their encoded sizes, a round trip of a few kernel records
+ * through BBVFileWriter and BBVFileReader, records cut at every byte or
+ * corrupted, and write errors reported by write_kernel and close. */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "utils/bbv_file.h"
+#include "utils/host_test.h"
+
+static void test_varint() {
+    const uint64_t values[] = {0,
+                               1,
+                               127,
+                               128,
+                               16383,
+                               16384,
+                               (1ull << 21) - 1,
+                               1ull << 21,
+                               INT_MAX,
+                               UINT32_MAX,
+                               1ull << 35,
+                               (1ull << 56) - 1,
+                               1ull << 63,
+                               UINT64_MAX};
+    for (uint64_t v : values) {
+        std::vector<uint8_t> buf;
+        bbv_put_varint(buf, v);
+        size_t expected = 1;
+        for (uint64_t r = v >> 7; r != 0; r >>= 7) {
+            expected++;
+        }
+        CHECK(buf.size() == expected);
+
+        const uint8_t *p = buf.data();
+        uint64_t got = 0;
+        CHECK(bbv_get_varint(&p, buf.data() + buf.size(), &got));
+        CHECK(got == v);
+        CHECK(p == buf.data() + buf.size());
+
+        /* missing its last byte */
+        p = buf.data();
+        CHECK(!bbv_get_varint(&p, buf.data() + buf.size() - 1, &got));
+    }
+
+    /* more than 64 bits worth of continuation bytes */
+    std::vector<uint8_t> buf(11, 0x80);
+    buf.back() = 0;
+    const uint8_t *p = buf.data();
+    uint64_t got;
+    CHECK(!bbv_get_varint(&p, buf.data() + buf.size(), &got));
+}
+
+typedef struct {
+    std::string name;
+    uint32_t kernel_id;
+    uint32_t row_kind;
+    uint32_t num_rows;
+    uint32_t num_bbs;
+    std::vector<int> bb_sizes;
+    std::vector<uint64_t> counts;
+} record_t;
+
+static std::vector<record_t> make_records() {
+    std::vector<record_t> rs(3);
+
+    /* sparse rows with counts and bb id deltas at the varint boundaries */
+    record_t &r = rs[0];
+    r.name = "_Z6kernelPfi";
+    r.kernel_id = 0;
+    r.row_kind = BBV_ROW_WARP;
+    r.num_bbs = 20000;
+    r.num_rows = 4;
+    for (uint32_t bb = 0; bb < r.num_bbs; bb++) {
+        r.bb_sizes.push_back(bb % 3 == 0 ? 1 : bb);
+    }
+    r.bb_sizes[1] = INT_MAX;
+    r.bb_sizes[2] = 0;
+    r.counts.assign((size_t)r.num_rows * r.num_bbs, 0);
+    uint64_t *row = &r.counts[0];
+    row[0] = 127;
+    row[128] = 128;
+    row[128 + 16383] = 16383;
+    row[r.num_bbs - 1] = 16384;
+    row = &r.counts[r.num_bbs];
+    row[5] = UINT32_MAX;
+    row[6] = (uint64_t)UINT32_MAX + 1;
+    row[7] = UINT64_MAX;
+    /* row 2 is empty */
+    row = &r.counts[3 * r.num_bbs];
+    for (uint32_t bb = 0; bb < r.num_bbs; bb++) {
+        row[bb] = bb + 1;
+    }
+
+    /* no basic block at all, only empty rows */
+    rs[1].name = "empty";
+    rs[1].kernel_id = 1;
+    rs[1].row_kind = BBV_ROW_CTA;
+    rs[1].num_rows = 3;
+    rs[1].num_bbs = 0;
+
+    /* dense small rows, no row */
+    rs[2].name = "";
+    rs[2].kernel_id = UINT32_MAX;
+    rs[2].row_kind = BBV_ROW_CTA;
+    rs[2].num_rows = 0;
+    rs[2].num_bbs = 3;
+    rs[2].bb_sizes = {4, 5, 6};
+    return rs;
+}
+
+static bool write_records(const char *path,
+                          const std::vector<record_t> &rs) {
+    BBVFileWriter w;
+    if (!w.open(path)) {
+        return false;
+    }
+    bool ok = true;
+    for (auto &r : rs) {
+        ok &= w.write_kernel(r.name.c_str(), r.kernel_id, r.row_kind,
+                             r.num_rows, r.num_bbs, r.bb_sizes.data(),
+                             r.counts.data());
+    }
+    return w.close() && ok;
+}
+
+/* the next record of rd is r, rows included */
+static bool read_record(BBVFileReader &rd, const record_t &r) {
+    if (!rd.next_kernel()) {
+        return false;
+    }
+    const bbv_kernel_header_t &h = rd.kernel();
+    bool ok = h.kernel_id == r.kernel_id && h.row_kind == r.row_kind &&
+              h.num_rows == r.num_rows && h.num_bbs == r.num_bbs &&
+              rd.kernel_name() == r.name && rd.get_bb_sizes() == r.bb_sizes;
+    std::vector<bbv_entry_t> row;
+    for (uint32_t i = 0; i < r.num_rows && ok; i++) {
+        ok = rd.next_row(row);
+        std::vector<bbv_entry_t> expected;
+        for (uint32_t bb = 0; bb < r.num_bbs; bb++) {
+            uint64_t c = r.counts[(size_t)i * r.num_bbs + bb];
+            if (c != 0) {
+                bbv_entry_t e = {bb, c};
+                expected.push_back(e);
+            }
+        }
+        ok = ok && row.size() == expected.size();
+        for (size_t j = 0; j < row.size() && ok; j++) {
+            ok = row[j].bb == expected[j].bb &&
+                 row[j].count == expected[j].count;
+        }
+    }
+    return ok && !rd.next_row(row) && row.empty() && !rd.is_malformed();
+}
+
+static void test_round_trip(const char *path,
+                            const std::vector<record_t> &rs) {
+    CHECK(write_records(path, rs));
+    BBVFileReader rd;
+    CHECK(rd.open(path));
+    for (auto &r : rs) {
+        CHECK(read_record(rd, r));
+    }
+    CHECK(!rd.next_kernel());
+    CHECK(!rd.is_malformed());
+    rd.close();
+
+    /* int counts, as written by the tools */
+    BBVFileWriter w;
+    CHECK(w.open(path));
+    const int sizes[2] = {3, 7};
+    const int counts[4] = {0, INT_MAX, 1, 0};
+    CHECK(w.write_kernel("k", 9, BBV_ROW_CTA, 2, 2, sizes, counts));
+    CHECK(w.close());
+    CHECK(!w.close());
+    CHECK(rd.open(path));
+    CHECK(rd.next_kernel());
+    std::vector<bbv_entry_t> row;
+    CHECK(rd.next_row(row) && row.size() == 1 && row[0].bb == 1 &&
+          row[0].count == INT_MAX);
+    CHECK(rd.next_row(row) && row.size() == 1 && row[0].bb == 0 &&
+          row[0].count == 1);
+    CHECK(!rd.next_kernel() && !rd.is_malformed());
+    rd.close();
+}
+
+static std::vector<uint8_t> read_file(const char *path) {
+    std::vector<uint8_t> data;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return data;
+    }
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(f);
+    return data;
+}
+
+static void write_file(const char *path, const std::vector<uint8_t> &d,
+                       size_t n) {
+    FILE *f = fopen(path, "wb");
+    CHECK(f != NULL);
+    if (f != NULL) {
+        CHECK(fwrite(d.data(), 1, n, f) == n);
+        fclose(f);
+    }
+}
+
+/* size of the first record of the file */
+static size_t record_size(const std::vector<uint8_t> &d) {
+    bbv_kernel_header_t h;
+    memcpy(&h, d.data() + sizeof(bbv_file_header_t), sizeof(h));
+    return sizeof(h) + h.name_size + h.payload_size;
+}
+
+static void test_truncated(const char *path, const char *copy,
+                           const std::vector<record_t> &rs) {
+    CHECK(write_records(path, rs));
+    std::vector<uint8_t> good = read_file(path);
+    size_t first = sizeof(bbv_file_header_t);
+    size_t second = first + record_size(good);
+    CHECK(second < good.size());
+    if (second >= good.size()) {
+        return;
+    }
+
+    BBVFileReader rd;
+    write_file(copy, good, first - 1);
+    CHECK(!rd.open(copy));
+
+    /* cut anywhere in the second record, the first still reads back */
+    size_t cuts[] = {second,
+                     second + 1,
+                     second + sizeof(bbv_kernel_header_t) - 1,
+                     second + sizeof(bbv_kernel_header_t),
+                     second + record_size(std::vector<uint8_t>(
+                                  good.begin() + second - first,
+                                  good.end())) -
+                         1};
+    for (size_t cut : cuts) {
+        write_file(copy, good, cut);
+        CHECK(rd.open(copy));
+        CHECK(read_record(rd, rs[0]));
+        CHECK(!rd.next_kernel());
+        CHECK(rd.is_malformed() == (cut != second));
+        rd.close();
+    }
+
+    /* a payload cut short, its header still claiming the full size, is
+     * found once its rows are decoded */
+    bbv_kernel_header_t h;
+    memcpy(&h, good.data() + first, sizeof(h));
+    for (size_t cut = first + sizeof(h) + h.name_size; cut < second;
+         cut += 997) {
+        std::vector<uint8_t> d(good.begin(), good.begin() + cut);
+        h.payload_size = cut - first - sizeof(h) - h.name_size;
+        memcpy(d.data() + first, &h, sizeof(h));
+        write_file(copy, d, d.size());
+        CHECK(rd.open(copy));
+        bool ok = rd.next_kernel();
+        std::vector<bbv_entry_t> row;
+        while (ok && rd.next_row(row)) {
+        }
+        CHECK(rd.is_malformed());
+        rd.close();
+    }
+}
+
+static void test_corrupt(const char *path, const char *copy,
+                         const std::vector<record_t> &rs) {
+    CHECK(write_records(path, rs));
+    const std::vector<uint8_t> good = read_file(path);
+    size_t first = sizeof(bbv_file_header_t);
+    BBVFileReader rd;
+
+    std::vector<uint8_t> d = good;
+    d[0] = 'X';
+    write_file(copy, d, d.size());
+    CHECK(!rd.open(copy));
+    d = good;
+    d[8] = BBV_FILE_VERSION + 1;
+    write_file(copy, d, d.size());
+    CHECK(!rd.open(copy));
+
+    bbv_kernel_header_t h;
+    memcpy(&h, good.data() + first, sizeof(h));
+    bbv_kernel_header_t b = h;
+    b.magic++;
+    d = good;
+    memcpy(d.data() + first, &b, sizeof(b));
+    write_file(copy, d, d.size());
+    CHECK(rd.open(copy));
+    CHECK(!rd.next_kernel() && rd.is_malformed());
+    rd.close();
+
+    b = h;
+    b.codec = BBV_CODEC_VARINT + 1;
+    memcpy(d.data() + first, &b, sizeof(b));
+    write_file(copy, d, d.size());
+    CHECK(rd.open(copy));
+    CHECK(!rd.next_kernel() && rd.is_malformed());
+    rd.close();
+
+    /* fewer basic blocks than the rows refer to */
+    b = h;
+    b.num_bbs = 129;
+    memcpy(d.data() + first, &b, sizeof(b));
+    write_file(copy, d, d.size());
+    CHECK(rd.open(copy));
+    CHECK(rd.next_kernel());
+    std::vector<bbv_entry_t> row;
+    CHECK(!rd.next_row(row) && rd.is_malformed());
+    rd.close();
+}
+
+/* /dev/full accepts buffered writes but fails every flush */
+static void test_write_error(const std::vector<record_t> &rs) {
+    BBVFileWriter w;
+    if (!w.open("/dev/full")) {
+        printf("skipping the write error test, cannot open /dev/full\n");
+        return;
+    }
+    const record_t &r = rs[2];
+    CHECK(!w.write_kernel(r.name.c_str(), r.kernel_id, r.row_kind,
+                          r.num_rows, r.num_bbs, r.bb_sizes.data(),
+                          r.counts.data()));
+    CHECK(!w.close());
+    CHECK(!w.is_open());
+
+    /* nothing but the header is pending on close */
+    CHECK(w.open("/dev/full"));
+    CHECK(!w.close());
+}
+
+int main() {
+    char path[] = "/tmp/test_bbv_file_XXXXXX";
+    char copy[] = "/tmp/test_bbv_file_copy_XXXXXX";
+    int fd = mkstemp(path);
+    int fd_copy = mkstemp(copy);
+    CHECK(fd >= 0 && fd_copy >= 0);
+    if (fd < 0 || fd_copy < 0) {
+        return host_test_done("test_bbv_file");
+    }
+    close(fd);
+    close(fd_copy);
+
+    std::vector<record_t> rs = make_records();
+    test_varint();
+    test_round_trip(path, rs);
+    test_truncated(path, copy, rs);
+    test_corrupt(path, copy, rs);
+    test_write_error(rs);
+
+    unlink(path);
+    unlink(copy);
+    return host_test_done("test_bbv_file");
+}
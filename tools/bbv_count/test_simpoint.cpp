@@ -0,0 +1,194 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host test of the online SimPoint clustering (utils/simpoint.h) on
+ * synthetic BBVs: three program phases must come out as three simulation
+ * points, one per phase, weighted by the instructions of each phase, both
+ * inline and on the background thread, and when the point pool has to be
+ * compressed along the way. */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "utils/host_test.h"
+#include "utils/simpoint.h"
+
+#define NUM_BBS 21
+
+/* BBV i belongs to phase 0 one time out of six, 1 and 2 otherwise */
+static int phase_of(uint64_t id) {
+    return id % 6 == 0 ? 0 : (id % 6 < 3 ? 1 : 2);
+}
+
+/* each phase mostly runs its own third of the basic blocks */
+static std::vector<simpoint_entry_t> phase_bbv(int phase,
+                                               std::mt19937_64 &rng) {
+    std::normal_distribution<double> noise(0, 0.02);
+    std::vector<simpoint_entry_t> bbv;
+    for (int bb = 0; bb < NUM_BBS; bb++) {
+        double base = bb / (NUM_BBS / 3) == phase ? 1.0 : 0.05;
+        simpoint_entry_t e = {(uint64_t)bb, fmax(0, base + noise(rng))};
+        bbv.push_back(e);
+    }
+    return bbv;
+}
+
+static void test_phases(int n, bool threaded, size_t max_points) {
+    SimPointEngine e;
+    e.init(10, SIMPOINT_DEFAULT_DIMS, max_points);
+    if (threaded) {
+        e.start();
+    }
+    std::mt19937_64 rng(5);
+    const double phase_weight[3] = {1, 2, 3};
+    double weights[3] = {0, 0, 0};
+    for (int i = 0; i < n; i++) {
+        int ph = phase_of(i);
+        std::vector<simpoint_entry_t> bbv = phase_bbv(ph, rng);
+        e.add(i, phase_weight[ph], bbv);
+        weights[ph] += phase_weight[ph];
+    }
+    std::vector<simpoint_t> sps = e.finish();
+    CHECK(e.get_num_points() <= max_points);
+
+    CHECK(sps.size() == 3);
+    double tot = weights[0] + weights[1] + weights[2], sum = 0;
+    bool seen[3] = {false, false, false};
+    for (size_t i = 0; i < sps.size(); i++) {
+        CHECK(sps[i].cluster == (int)i);
+        CHECK(sps[i].id < (uint64_t)n);
+        int ph = phase_of(sps[i].id);
+        CHECK(!seen[ph]);
+        seen[ph] = true;
+        CHECK(fabs(sps[i].weight - weights[ph] / tot) < 1e-9);
+        sum += sps[i].weight;
+    }
+    CHECK(fabs(sum - 1) < 1e-9);
+}
+
+static void test_single_phase() {
+    SimPointEngine e;
+    e.init(5);
+    CHECK(e.finish().empty());
+
+    std::mt19937_64 rng(9);
+    for (int i = 0; i < 200; i++) {
+        std::vector<simpoint_entry_t> bbv = phase_bbv(1, rng);
+        e.add(i, 1, bbv);
+    }
+    std::vector<simpoint_t> sps = e.finish();
+    CHECK(sps.size() == 1);
+    CHECK(sps[0].weight == 1);
+}
+
+/* launches of two kernels given as dense per CTA counts, the kernels do not
+ * share dimensions so they end up in different clusters */
+static void test_kernels() {
+    const uint32_t num_rows = 4, num_bbs = 3;
+    const int bb_sizes[num_bbs] = {4, 8, 2};
+    const int counts[num_rows * num_bbs] = {1, 2, 3, 1, 2, 3,
+                                            1, 2, 3, 1, 2, 3};
+    const int zeros[num_rows * num_bbs] = {0};
+
+    SimPointEngine e;
+    e.init(4);
+    CHECK(e.get_dim_offset("a", num_bbs) == 0);
+    CHECK(e.get_dim_offset("b", 7) == num_bbs);
+    CHECK(e.get_dim_offset("a", num_bbs) == 0);
+    /* empty launches are not added */
+    e.add_kernel(0, "a", num_rows, num_bbs, bb_sizes, zeros, false);
+    CHECK(e.get_num_points() == 0);
+    for (uint32_t l = 0; l < 20; l++) {
+        e.add_kernel(l, l % 4 == 0 ? "b" : "a", num_rows, num_bbs, bb_sizes,
+                     counts, false);
+    }
+    CHECK(e.get_num_points() == 20);
+    std::vector<simpoint_t> sps = e.finish();
+    CHECK(sps.size() == 2);
+    for (auto &sp : sps) {
+        /* every launch has the same number of instructions */
+        bool is_b = sp.id % 4 == 0;
+        CHECK(fabs(sp.weight - (is_b ? 0.25 : 0.75)) < 1e-9);
+    }
+
+    /* one BBV per CTA, of id (launch << 32 | cta) */
+    SimPointEngine r;
+    r.init(4);
+    r.add_kernel(3, "a", num_rows, num_bbs, bb_sizes, counts, true);
+    CHECK(r.get_num_points() == num_rows);
+    sps = r.finish();
+    CHECK(sps.size() == 1 && sps[0].id >> 32 == 3 &&
+          (sps[0].id & 0xffffffff) < num_rows);
+}
+
+static void test_write() {
+    std::vector<simpoint_t> sps;
+    simpoint_t a = {12, 0.25, 0}, b = {(uint64_t)7 << 32 | 3, 0.75, 1};
+    sps.push_back(a);
+    sps.push_back(b);
+    char prefix[] = "/tmp/test_simpoint_XXXXXX";
+    int fd = mkstemp(prefix);
+    CHECK(fd >= 0);
+    close(fd);
+    CHECK(simpoint_write(prefix, sps));
+
+    std::string p(prefix);
+    FILE *fs = fopen((p + ".simpoints").c_str(), "r");
+    FILE *fw = fopen((p + ".weights").c_str(), "r");
+    CHECK(fs != NULL && fw != NULL);
+    unsigned long id;
+    double w;
+    int c;
+    CHECK(fscanf(fs, "%lu %d", &id, &c) == 2 && id == 12 && c == 0);
+    CHECK(fscanf(fs, "%lu %d", &id, &c) == 2 && id == b.id && c == 1);
+    CHECK(fscanf(fw, "%lf %d", &w, &c) == 2 && w == 0.25 && c == 0);
+    CHECK(fscanf(fw, "%lf %d", &w, &c) == 2 && w == 0.75 && c == 1);
+    fclose(fs);
+    fclose(fw);
+    unlink((p + ".simpoints").c_str());
+    unlink((p + ".weights").c_str());
+    unlink(prefix);
+
+    CHECK(!simpoint_write("/nonexistent/dir/x", sps));
+}
+
+int main() {
+    test_phases(600, false, SIMPOINT_DEFAULT_MAX_POINTS);
+    test_phases(600, true, SIMPOINT_DEFAULT_MAX_POINTS);
+    /* the pool is compressed several times */
+    test_phases(3000, false, 64);
+    test_phases(3000, true, 64);
+    test_single_phase();
+    test_kernels();
+    test_write();
+    return host_test_done("test_simpoint");
+}
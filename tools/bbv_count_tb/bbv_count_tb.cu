@@ -47,6 +47,18 @@ using namespace std;
 /* provide some __device__ functions */
 #include "utils/utils.h"
 
+/* sparse binary BBV output */
+#include "utils/bbv_file.h"
+
+/* sizing of the BBV slots */
+#include "utils/growth_policy.h"
+
+/* clustering of the BBVs in simulation points */
+#include "utils/simpoint.h"
+
+/* for in launch order reporting of asynchronously completed kernels */
+#include "utils/launch_collector.h"
+
 /* kernel id counter, maintained in system memory */
 uint32_t kernel_id = 0;
 
@@ -57,11 +69,22 @@ uint64_t tot_app_instrs = 0;
 /* kernel instruction counter, updated by the GPU threads */
 __managed__ uint64_t counter = 0;
 
-/* pointer to memory location containing BBVs */
-__managed__ int *bbv;
-
-// Total threads of the kernel being launched
-unsigned int tot_blocks = 0;
+/* BBVs of the launches in flight. Every launch owns one slot, whose device
+ * address is passed to the instrumentation function with
+ * nvbit_set_at_launch, so kernels running concurrently on different streams
+ * do not "corrupt" each other BBVs. A slot is reused by the following
+ * launches and only reallocated when a launch needs more than its capacity.
+ * When a kernel completes the used part of its slot is copied to the pinned
+ * host copy and then reset on the launch stream, so free slots are always
+ * zero. */
+#define NUM_SLOTS 8
+struct bbv_slot_t {
+    int *dev;
+    int *host;
+    GeometricGrowth capacity;
+};
+bbv_slot_t bbv_slots[NUM_SLOTS];
+SlotPool slots;
 
 // Unique kernel ID
 unsigned int kid = 0;
@@ -70,21 +93,57 @@ unsigned int kid = 0;
 bool first = true;
 std::string fname = "bb_log_";
 
-// Total number of basic blocks to keep track of
-__managed__ unsigned int basic_blocks = 0;
+// Total number of basic blocks to keep track of, the basic block sizes are
+// never changed once inserted so a launch can keep a pointer to them
 std::map <std::string, int> kbb_map;
 std::map <std::string, std::vector<int>> kbb_insns;
 
+/* per launch context, from the launch until it is reported */
+struct launch_t {
+    unsigned int kid;
+    int slot;
+    CUcontext ctx;
+    CUfunction func;
+    std::string func_name;
+    /* one row per CTA, the number of basic blocks is only known after the
+     * first load of the function */
+    unsigned int num_rows;
+    int num_bbs;
+    const std::vector<int> *insns;
+    LaunchCollector<launch_t>::handle_t handle;
+};
+
+/* writes completed launches in launch order */
+LaunchCollector<launch_t> collector;
+
+/* launch issued by the calling thread, between the entry and the exit
+ * callback of the launch */
+static __thread launch_t *curr_launch = NULL;
+
+/* sparse binary output, unless BBV_TEXT is set */
+const char *bbv_fname = "bb_log.bbv";
+BBVFileWriter bbv_writer;
+
+/* simulation points picked while the application runs, written to
+ * bb_log.simpoints and bb_log.weights when SIMPOINT_MAX_K is set */
+SimPointEngine simpoints;
+
 /* global control variables for this tool */
 uint32_t ker_begin_interval = 0;
 uint32_t ker_end_interval = UINT32_MAX;
 int verbose = 1;
 int count_warp_level = 1;
 int exclude_pred_off = 0;
+int bbv_text = 0;
+int simpoint_max_k = 0;
+int simpoint_rows = 0;
 
-/* a pthread mutex, used to prevent multiple kernels to run concurrently and
- * therefore to "corrupt" the counter variable */
-pthread_mutex_t mutex;
+/* a pthread mutex, held from the entry to the exit callback of a launch:
+ * nvbit_set_at_launch and nvbit_enable_instrumented are per function, so a
+ * launch of the same function from another thread must not change them
+ * before the launch happens. It also keeps the kernel ids and the collector
+ * submissions in the same order. The launches themselves stay asynchronous */
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* instrumentation function that we want to inject, please note the use of
  * 1. "extern "C" __device__ __noinline__" to prevent code elimination by the
@@ -93,7 +152,10 @@ pthread_mutex_t mutex;
  * we want to inject. This name must match exactly the function name */
 extern "C" __device__ __noinline__ void count_instrs(int num_instrs,
                                                      int count_warp_level,
-                                                     int bb) {
+                                                     int bb,
+                                                     int basic_blocks,
+                                                     uint64_t pbbv) {
+    int *bbv = (int *)pbbv;
     // Get the global warp id to update the bbv
     int global_wid = get_global_warp_id();
     /* all the active threads will compute the active mask */
@@ -161,11 +223,46 @@ void nvbit_at_init() {
                 "Count warp level or thread level instructions");
     GET_VAR_INT(exclude_pred_off, "EXCLUDE_PRED_OFF", 0,
                 "Exclude predicated off instruction from count");
+    GET_VAR_INT(bbv_text, "BBV_TEXT", 0,
+                "Write dense text BBVs instead of sparse binary ones in "
+                "bb_log.bbv");
+    GET_VAR_INT(simpoint_max_k, "SIMPOINT_MAX_K", 0,
+                "Pick up to this many simulation points while running, 0 "
+                "disables");
+    GET_VAR_INT(simpoint_rows, "SIMPOINT_ROWS", 0,
+                "Cluster the BBV of every CTA instead of every kernel launch");
+    if (simpoint_max_k > 0) {
+        simpoints.init(simpoint_max_k);
+        simpoints.start();
+    }
     GET_VAR_INT(verbose, "TOOL_VERBOSE", 0, "Enable verbosity inside the tool");
     std::string pad(100, '-');
     printf("%s\n", pad.c_str());
 }
 
+/* make the slot of launch l hold its BBVs, num_bbs per row, called once the
+ * number of basic blocks of the launched function is known */
+void prepare_slot(launch_t *l, int num_bbs) {
+    l->num_bbs = num_bbs;
+    bbv_slot_t *s = &bbv_slots[l->slot];
+    size_t n = (size_t)l->num_rows * num_bbs;
+    if (s->capacity.reserve(n)) {
+        if (s->dev != NULL) {
+            CUDA_SAFECALL(cudaFree(s->dev));
+            CUDA_SAFECALL(cudaFreeHost(s->host));
+        }
+        size_t nbytes = s->capacity.get_capacity() * sizeof(int);
+        CUDA_SAFECALL(cudaMalloc((void **)&s->dev, nbytes));
+        CUDA_SAFECALL(cudaMallocHost((void **)&s->host, nbytes));
+        /* clear on the device, then wait since the launch may be on a
+         * stream that does not synchronize with the default one */
+        CUDA_SAFECALL(cudaMemset(s->dev, 0, nbytes));
+        CUDA_SAFECALL(cudaDeviceSynchronize());
+    }
+    int *pbbv = s->dev;
+    nvbit_set_at_launch(l->ctx, l->func, &pbbv, sizeof(pbbv));
+}
+
 /* nvbit_at_function_first_load() is executed every time a function is loaded
  * for the first time. Inside this call-back we typically get the vector of SASS
  * instructions composing the loaded CUfunction. We can iterate on this vector
@@ -212,12 +309,16 @@ void nvbit_at_function_first_load(CUcontext ctx, CUfunction func) {
         nvbit_add_call_arg_const_val32(i, count_warp_level);
         /* add basic block number */
         nvbit_add_call_arg_const_val32(i, local_bb++);
+        /* add number of basic blocks, i.e. the length of a BBV row */
+        nvbit_add_call_arg_const_val32(i, cfg.bbs.size());
+        /* add pointer to the BBV slot of the launch */
+        nvbit_add_call_arg_launch_val64(i, 0);
         if (verbose) {
             i->print("Inject count_instr before - ");
         }
     }
 
-    // First time seeing the kernel, allocate space here too
+    // First time seeing the kernel, remember its number of basic blocks
     kbb_map.insert(std::pair<std::string,int>(nvbit_get_func_name(ctx, func), cfg.bbs.size())); 
     
     // Add instruction counts to a vector and another map
@@ -226,14 +327,10 @@ void nvbit_at_function_first_load(CUcontext ctx, CUfunction func) {
         i_counts.push_back(bb->instrs.size());
     }
     kbb_insns.insert(std::pair<std::string,std::vector<int>>(nvbit_get_func_name(ctx, func), i_counts)); 
-    int *bbs;
-    basic_blocks = cfg.bbs.size();
-    cudaMallocManaged(&bbs, (tot_blocks) * (basic_blocks) * sizeof(int));
-
-    // Set our __managed__ pointer to our narrowly allocated region
-    bbv = bbs;
-    for(unsigned int i = 0; i < (tot_blocks) * (basic_blocks); i++){
-        bbv[i] = 0;
+
+    /* the slot of the launch that is loading the function can be sized now */
+    if (curr_launch != NULL && curr_launch->func == func) {
+        prepare_slot(curr_launch, cfg.bbs.size());
     }
 
     if (exclude_pred_off) {
@@ -255,11 +352,75 @@ void nvbit_at_function_first_load(CUcontext ctx, CUfunction func) {
     }
 }
 
+/* stream on which the launch described by cbid/params is issued */
+cudaStream_t get_launch_stream(nvbit_api_cuda_t cbid, void *params) {
+    if (cbid == API_CUDA_cuLaunchKernel_ptsz) {
+        cuLaunchKernel_ptsz_params *p = (cuLaunchKernel_ptsz_params *)params;
+        return p->hStream != NULL ? p->hStream : cudaStreamPerThread;
+    } else if (cbid == API_CUDA_cuLaunchKernel) {
+        return ((cuLaunchKernel_params *)params)->hStream;
+    } else if (cbid == API_CUDA_cuLaunchGridAsync) {
+        return ((cuLaunchGridAsync_params *)params)->hStream;
+    }
+    return 0;
+}
+
+/* stream callback, the kernel and the copy of its BBV slot are done */
+void CUDART_CB launch_done(cudaStream_t stream, cudaError_t status,
+                           void *data) {
+    launch_t *l = (launch_t *)data;
+    collector.complete(l->handle);
+}
+
+/* called by the collector thread, in launch order */
+void report_launch(launch_t *l) {
+    int *bbv = bbv_slots[l->slot].host;
+    const char *func_name = l->func_name.c_str();
+    if (simpoint_max_k > 0) {
+        simpoints.add_kernel(l->kid, func_name, l->num_rows, l->num_bbs,
+                             l->insns->data(), bbv, simpoint_rows);
+    }
+    if (!bbv_text) {
+        /* one row per CTA, the weights are the execution counts
+         * times the basic block sizes stored in the record */
+        if (bbv_writer.is_open() &&
+            !bbv_writer.write_kernel(func_name, l->kid, BBV_ROW_CTA,
+                                     l->num_rows, l->num_bbs,
+                                     l->insns->data(), bbv)) {
+            /* the file stays readable up to the previous launch */
+            fprintf(stderr,
+                    "Error: writing kernel %u to %s failed, the BBVs of "
+                    "the following launches are not written\n",
+                    l->kid, bbv_fname);
+            bbv_writer.close();
+        }
+    } else {
+        const std::vector<int> &test = *l->insns;
+        std::string kname = fname + std::to_string(l->kid) + ".txt";
+        FILE *f = fopen(kname.c_str(), "w+");
+        fprintf(f, "%s\n", func_name);
+        // For each basic block vector
+        for(unsigned int i = 0; i < l->num_rows; i++){
+            for(int j = 0; j < l->num_bbs; j++){
+                fprintf(f, "%d ", bbv[i * l->num_bbs + j] * test[j]);
+            }
+            fprintf(f, "\n");
+        }
+        fclose(f);
+    }
+
+    slots.release(l->slot);
+    delete l;
+}
+
 /* This call-back is triggered every time a CUDA driver call is encountered.
  * Here we can look for a particular CUDA driver call by checking at the
  * call back ids  which are defined in tools_cuda_api_meta.h.
  * This call back is triggered bith at entry and at exit of each CUDA driver
  * call, is_exit=0 is entry, is_exit=1 is exit.
+ * The BBV slot of a launch is copied back after the kernel and reset, both on
+ * the launch stream, so launches on different streams can still overlap. The
+ * BBVs are written in launch order by the collector thread.
  * */
 void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
                          const char *name, void *params, CUresult *pStatus) {
@@ -270,16 +431,27 @@ void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
         /* cast params to cuLaunch_params since if we are here we know these are
          * the right parameters type */
         cuLaunch_params *p = (cuLaunch_params *)params;
+        cudaStream_t stream = get_launch_stream(cbid, params);
 
         if (!is_exit) {
             /* if we are entering in a kernel launch:
-             * 1. Lock the mutex to prevent multiple kernels to run concurrently
-             * (overriding the counter) in case the user application does that
-             * 2. Select if we want to run the instrumented or original
+             * 1. Get a BBV slot for this launch (waits if too many
+             * launches are in flight), it is already zero
+             * 2. Lock the mutex until the exit callback
+             * 3. Select if we want to run the instrumented or original
              * version of the kernel
-             * 3. Reset the kernel instruction counter */
-
-            pthread_mutex_lock(&mutex);
+             * 4. Size the slot and pass its address to the instrumentation
+             * function, on the first launch of a function this happens
+             * when the function is loaded
+             * 5. Assign the kernel id and submit the launch to the
+             * collector */
+            launch_t *l = new launch_t;
+            l->slot = slots.acquire();
+            l->ctx = ctx;
+            l->func = p->f;
+            l->func_name = nvbit_get_func_name(ctx, p->f);
+            l->num_bbs = 0;
+            l->insns = NULL;
 
             // Get the launch parameters to we can narrowly allocate memory
             cuLaunchKernel_params_st *p_test = (cuLaunchKernel_params_st *)params;
@@ -288,14 +460,16 @@ void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
             unsigned int gx = p_test->gridDimX;
             unsigned int gy = p_test->gridDimY;
 
-            // Set global number of threablocks
-            tot_blocks = gx * gy;
-            
-            // Allocate some space for each warp
+            // One BBV per threadblock
+            l->num_rows = gx * gy;
+
+            pthread_mutex_lock(&mutex);
             if(first){
                 first = false;
-            }else{
-                cudaFree(bbv);
+                if (!bbv_text && !bbv_writer.open(bbv_fname)) {
+                    fprintf(stderr, "Error: can not open %s\n", bbv_fname);
+                    _exit(1);
+                }
             }
 
             if (kernel_id >= ker_begin_interval &&
@@ -304,50 +478,61 @@ void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
             } else {
                 nvbit_enable_instrumented(ctx, p->f, false);
             }
-            counter = 0;
 
-            // Allocate space here if we have called the kernel before
-            auto it = kbb_map.find(nvbit_get_func_name(ctx, p->f));
+            // Size the slot here if we have called the kernel before
+            auto it = kbb_map.find(l->func_name);
             if(it != kbb_map.end()){
-                basic_blocks = it->second;
-                int *bbs;
-                cudaMallocManaged(&bbs, tot_blocks * (basic_blocks) * sizeof(int));
-                // Set our __managed__ pointer to our narrowly allocated region
-                bbv = bbs;
-                for(unsigned int i = 0; i < tot_blocks * (basic_blocks); i++){
-                    bbv[i] = 0;
-                }
+                prepare_slot(l, it->second);
             }
-            
-
 
+            l->kid = kid++;
+            l->handle = collector.submit(l);
+            curr_launch = l;
         } else {
             /* if we are exiting a kernel launch:
-             * 1. Wait until the kernel is completed using
-             * cudaDeviceSynchronize()
-             * 2. Get number of thread blocks in the kernel
-             * 3. Print the thread instruction counters
-             * 4. Release the lock*/
-            CUDA_SAFECALL(cudaDeviceSynchronize());
-
-            // Get the launch parameters to we can narrowly allocate memory
-            cuLaunchKernel_params_st *p_test = (cuLaunchKernel_params_st *)params;
-
-            auto it = kbb_insns.find(nvbit_get_func_name(ctx, p->f));
-            std::vector<int> test = it->second;
-            FILE *f = fopen((fname + std::to_string(kid) + ".txt").c_str(), "w+");
-            kid++;
-            fprintf(f, "%s\n", nvbit_get_func_name(ctx, p->f));
-            // For each basic block vector
-            for(unsigned int i = 0; i < tot_blocks; i++){
-                for(unsigned int j = 0; j < (basic_blocks); j++){
-                    fprintf(f, "%d ", bbv[i * (basic_blocks) + j] * test[j] );
-                }
-                fprintf(f, "\n");
+             * 1. Copy the BBVs of the launch back once the kernel is done
+             * and reset them, on the launch stream, so other streams keep
+             * running
+             * 2. Hand the launch to the collector thread when the copy is
+             * done, which writes the BBVs in launch order
+             * 3. Release the lock*/
+            launch_t *l = curr_launch;
+            curr_launch = NULL;
+            assert(l != NULL);
+            /* the function is loaded by now, even on its first launch */
+            l->insns = &kbb_insns[l->func_name];
+
+            bbv_slot_t *s = &bbv_slots[l->slot];
+            size_t nbytes = (size_t)l->num_rows * l->num_bbs * sizeof(int);
+            if (nbytes > 0) {
+                CUDA_SAFECALL(cudaMemcpyAsync(s->host, s->dev, nbytes,
+                                              cudaMemcpyDeviceToHost, stream));
+                CUDA_SAFECALL(cudaMemsetAsync(s->dev, 0, nbytes, stream));
             }
-            fclose(f); 
-            
+            CUDA_SAFECALL(cudaStreamAddCallback(stream, launch_done, l, 0));
             pthread_mutex_unlock(&mutex);
         }
     }
 }
+
+void nvbit_at_ctx_init(CUcontext ctx) {
+    /* the slots are allocated by the first launch that uses them */
+    slots.init(NUM_SLOTS);
+    collector.start(report_launch);
+}
+
+void nvbit_at_ctx_term(CUcontext ctx) {
+    /* write whatever is still in flight */
+    collector.stop();
+    if (bbv_writer.is_open() && !bbv_writer.close()) {
+        fprintf(stderr, "Error: writing %s failed\n", bbv_fname);
+    }
+    if (simpoint_max_k > 0) {
+        std::vector<simpoint_t> sps = simpoints.finish();
+        if (!simpoint_write("bb_log", sps)) {
+            fprintf(stderr, "Error: can not write the simulation points\n");
+        }
+        printf("%ld simulation points written to bb_log.simpoints\n",
+               sps.size());
+    }
+}
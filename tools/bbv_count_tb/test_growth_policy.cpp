@@ -0,0 +1,103 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host test of the growth policy of the buffers reused across launches
+ * (utils/growth_policy.h): the capacity only grows when a launch needs
+ * more, by the growth factor, and a sequence of growing launches costs a
+ * logarithmic number of reallocations. */
+
+#include <stdint.h>
+#include <random>
+
+#include "utils/growth_policy.h"
+#include "utils/host_test.h"
+
+static void test_reserve() {
+    GeometricGrowth g(16, 2);
+    CHECK(g.get_capacity() == 0);
+    CHECK(!g.reserve(0));
+    CHECK(g.reserve(1) && g.get_capacity() == 16);
+    CHECK(!g.reserve(16) && g.get_capacity() == 16);
+    CHECK(g.reserve(17) && g.get_capacity() == 32);
+    CHECK(g.reserve(1000) && g.get_capacity() == 1024);
+    /* never shrinks */
+    CHECK(!g.reserve(3) && g.get_capacity() == 1024);
+
+    /* close to the limit the request itself is used */
+    CHECK(g.reserve(SIZE_MAX - 1) && g.get_capacity() == SIZE_MAX - 1);
+    CHECK(!g.reserve(SIZE_MAX - 1));
+
+    /* after the buffer is freed, start over from the minimum */
+    g.reset();
+    CHECK(g.get_capacity() == 0);
+    CHECK(g.reserve(3) && g.get_capacity() == 16);
+
+    /* a factor below 2 would not grow, it is raised to 2 */
+    GeometricGrowth g1(10, 1);
+    CHECK(g1.reserve(11) && g1.get_capacity() == 20);
+    GeometricGrowth g4(10, 4);
+    CHECK(g4.reserve(11) && g4.get_capacity() == 40);
+    CHECK(g4.reserve(41) && g4.get_capacity() == 160);
+}
+
+/* launches of growing size, as a kernel working on larger and larger
+ * inputs: at most log2(max / min) + 1 reallocations */
+static void test_growing_launches() {
+    const size_t min = 1 << 16, max = (size_t)1 << 30;
+    GeometricGrowth g(min, 2);
+    int reallocs = 0;
+    for (size_t n = 1; n <= max; n += n / 64 + 1) {
+        if (g.reserve(n)) {
+            reallocs++;
+        }
+        CHECK(g.get_capacity() >= n);
+        /* never more than twice what was asked for (or the minimum) */
+        CHECK(g.get_capacity() < 2 * n || g.get_capacity() == min);
+    }
+    CHECK(reallocs == 15);
+
+    /* random launch sizes, only a new maximum can reallocate */
+    std::mt19937_64 rng(7);
+    GeometricGrowth r(min, 2);
+    size_t max_seen = 0;
+    reallocs = 0;
+    for (int i = 0; i < 100000; i++) {
+        size_t n = rng() % max;
+        bool grew = r.reserve(n);
+        CHECK(!grew || n > max_seen);
+        if (n > max_seen) max_seen = n;
+        reallocs += grew;
+        CHECK(r.get_capacity() >= max_seen);
+    }
+    CHECK(reallocs <= 15);
+}
+
+int main() {
+    test_reserve();
+    test_growing_launches();
+    return host_test_done("test_growth_policy");
+}
@@ -0,0 +1,192 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host benchmark of the checkpoint writer (checkpoint_writer.h) on
+ * synthetic allocations: a series of snapshots of a few allocations whose
+ * content changes a little between snapshots, as the memory of an
+ * iterative application does. The time includes the copy of every
+ * allocation into the writer buffers, standing for the copy from the
+ * device. Reports the throughput of the synchronous
+ * ChunkStore::put() and of CheckpointWriter for a range of worker thread
+ * counts, with the pack size relative to the data, and checks that the
+ * last snapshot restores.
+ *
+ * usage: bench_checkpoint_writer [MB per snapshot] [snapshots] [dir] */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "checkpoint_writer.h"
+
+#define NUM_ALLOCS 4
+
+/* initial content of the allocations: floats that compress well and
+ * random bytes that do not, sizes are not multiples of the segment size */
+static std::vector<std::vector<uint8_t> > make_allocs(size_t bytes) {
+    std::vector<std::vector<uint8_t> > allocs(NUM_ALLOCS);
+    std::mt19937_64 rng(1);
+    for (int a = 0; a < NUM_ALLOCS; a++) {
+        std::vector<uint8_t> &buf = allocs[a];
+        buf.resize(bytes / NUM_ALLOCS + a * 4099);
+        if (a % 2 == 0) {
+            for (size_t i = 0; i < buf.size(); i += sizeof(float)) {
+                float f = (float)(i / sizeof(float) % 1000) * 0.5f;
+                memcpy(&buf[i], &f, std::min(sizeof(f), buf.size() - i));
+            }
+        } else {
+            for (auto &b : buf) b = rng();
+        }
+    }
+    return allocs;
+}
+
+/* content of allocation a at snapshot k, copied to buf as the tool copies
+ * it from the device: a different 1/16 of it changes at every snapshot */
+static void copy_alloc(std::vector<uint8_t> &buf,
+                       const std::vector<uint8_t> &base, int k) {
+    buf.assign(base.begin(), base.end());
+    size_t slice = buf.size() / 16;
+    size_t begin = (size_t)(k % 16) * slice;
+    for (size_t i = begin; i < begin + slice; i++) {
+        buf[i] ^= (uint8_t)(k + 1);
+    }
+}
+
+static bool check_last(ChunkStore &s, uint32_t kernel_id,
+                       const std::vector<std::vector<uint8_t> > &base) {
+    std::vector<manifest_alloc_t> m;
+    if (!s.read_manifest(kernel_id, m) || m.size() != NUM_ALLOCS) {
+        return false;
+    }
+    std::vector<uint8_t> expected, out;
+    for (int a = 0; a < NUM_ALLOCS; a++) {
+        copy_alloc(expected, base[a], kernel_id);
+        if (!s.restore(m[a], out) || out != expected) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* num_threads == 0 stores the allocations synchronously with put() */
+static bool run(const std::string &dir, int num_threads,
+                const std::vector<std::vector<uint8_t> > &base,
+                int num_snapshots) {
+    ChunkStore s;
+    if (!s.open(dir.c_str())) {
+        fprintf(stderr, "cannot open %s\n", dir.c_str());
+        return false;
+    }
+    CheckpointWriter w;
+    std::vector<uint8_t> sync_buf;
+    if (num_threads > 0) {
+        w.init(&s, num_threads);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok = true;
+    for (int k = 0; k < num_snapshots; k++) {
+        std::vector<manifest_alloc_t> allocs(NUM_ALLOCS);
+        if (num_threads > 0) {
+            w.begin_snapshot(k);
+        }
+        for (int a = 0; a < NUM_ALLOCS; a++) {
+            std::vector<uint8_t> *buf =
+                num_threads > 0 ? w.get_buffer() : &sync_buf;
+            copy_alloc(*buf, base[a], k);
+            if (num_threads > 0) {
+                w.add_alloc(a, 0x7f0000000000 + ((uint64_t)a << 32), buf);
+            } else {
+                allocs[a].number = a;
+                allocs[a].addr = 0x7f0000000000 + ((uint64_t)a << 32);
+                allocs[a].size = buf->size();
+                ok &= s.put(buf->data(), buf->size(), allocs[a].chunks);
+            }
+        }
+        if (num_threads > 0) {
+            w.end_snapshot();
+        } else {
+            ok &= s.write_manifest(k, allocs);
+        }
+    }
+    if (num_threads > 0) {
+        ok &= w.close();
+    }
+    double secs = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+
+    ok = ok && check_last(s, num_snapshots - 1, base);
+    if (num_threads == 0) {
+        printf("put()            ");
+    } else {
+        printf("writer %2d threads", num_threads);
+    }
+    printf(": %8.1f MB/s, pack %5.1f%% of the data%s\n",
+           s.get_bytes_in() / secs / 1e6,
+           100.0 * s.get_bytes_out() / s.get_bytes_in(),
+           ok ? "" : "  ERROR");
+    s.close();
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    size_t mb = argc > 1 ? strtoul(argv[1], NULL, 0) : 64;
+    int num_snapshots = argc > 2 ? atoi(argv[2]) : 4;
+    std::string dir = argc > 3 ? argv[3] : "/tmp/bench_checkpoint_writer";
+    if (mb == 0 || num_snapshots <= 0) {
+        fprintf(stderr, "usage: %s [MB per snapshot] [snapshots] [dir]\n",
+                argv[0]);
+        return 1;
+    }
+    printf("%d snapshots of %lu MB in %s, %d cpus\n", num_snapshots,
+           (unsigned long)mb, dir.c_str(),
+           (int)std::thread::hardware_concurrency());
+
+    std::vector<std::vector<uint8_t> > base = make_allocs(mb << 20);
+    bool ok = run(dir, 0, base, num_snapshots);
+    for (int t = 1; t <= 8; t *= 2) {
+        ok &= run(dir, t, base, num_snapshots);
+    }
+
+    /* leave the directory as found */
+    ChunkStore s;
+    if (s.open(dir.c_str())) {
+        s.close();
+        unlink((dir + "/chunks.pack").c_str());
+        rmdir(dir.c_str());
+    }
+    return ok ? 0 : 1;
+}
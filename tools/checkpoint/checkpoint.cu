@@ -44,20 +44,63 @@
 /* provide some __device__ functions */
 #include "utils/utils.h"
 
+/* live allocations, fed by the driver callbacks */
+#include "utils/alloc_hooks.h"
+
 // Used for tracking pointers for checkpointing
 #include <unordered_map>
 #include <algorithm>
-#include <tuple>
 #include <string>
 
-std::unordered_map<void*, std::tuple<int, size_t>> tracking_map;
+/* deduplicated storage of the snapshots */
+#include "checkpoint_writer.h"
+#include "checkpoint_restore.h"
+#include "kernel_args.h"
+#include "host_writes.h"
+#include <unordered_set>
+
+/* allocations are numbered by their registry id */
+AllocRegistry alloc_registry;
+
+/* snapshots are stored as content defined chunks in checkpoint_dir, unless
+ * checkpoint_text is set */
+std::string checkpoint_dir = "checkpoint";
+int checkpoint_text = 0;
+ChunkStore chunk_store;
+
+/* compresses and writes the snapshots in the background while the next
+ * allocations are copied from the device */
+CheckpointWriter checkpoint_writer;
+int checkpoint_threads = 2;
 
-// We only want the call-back for an allocation
-// This contains the valid device pointer
-int callback_tracker = 0;
-int free_count = 0;
-int alloc_count = 0;
-int snapshot_number = 0;
+/* if set, the launches before checkpoint_restore run without
+ * instrumentation and without snapshots, then the snapshot taken after
+ * kernel checkpoint_restore - 1 is loaded back right before that launch */
+uint32_t checkpoint_restore = 0;
+int checkpoint_remap_ptrs = 0;
+
+/* if set, a snapshot only holds the allocations that changed since the
+ * previous one: the ones passed to a kernel that stores to global memory,
+ * written by the host, or new. Only the allocations that single level
+ * pointer arguments point into are taken as written (see kernel_args.h),
+ * any other argument a writing kernel can not be decoded from marks every
+ * allocation dirty. A kernel writing through a pointer it loads from memory
+ * (i.e. a table of pointers in an allocation of a decoded pointer argument)
+ * or from a __device__ global is not seen, use CHECKPOINT_DIRTY=0 for such
+ * applications. Managed allocations are in every snapshot: the host writes
+ * them directly, without a driver call that could be tracked. */
+int checkpoint_dirty = 1;
+std::unordered_set<uint64_t> dirty_allocs;
+
+/* what is known of a kernel to find the allocations it could write */
+typedef struct {
+    /* has global, generic or atomic stores, or calls functions */
+    bool writes;
+    /* argument list could be parsed */
+    bool args_known;
+    std::vector<int> arg_kinds;
+} kernel_info_t;
+std::unordered_map<CUfunction, kernel_info_t> kernel_infos;
 
 // Vector of kernel IDs to snapshot
 //const std::vector<int> skip = {0, 1, 2, 3, 4, 5, 6, 7};
@@ -140,7 +183,35 @@ void nvbit_at_init() {
                 "Count warp level or thread level instructions");
     GET_VAR_INT(exclude_pred_off, "EXCLUDE_PRED_OFF", 0,
                 "Exclude predicated off instruction from count");
+    GET_VAR_STR(checkpoint_dir, "CHECKPOINT_DIR",
+                "Directory of the deduplicated snapshots");
+    GET_VAR_INT(checkpoint_text, "CHECKPOINT_TEXT", 0,
+                "Dump every allocation as text after every kernel instead");
+    GET_VAR_INT(checkpoint_threads, "CHECKPOINT_THREADS", 2,
+                "Number of threads compressing the snapshots");
+    GET_VAR_INT(checkpoint_restore, "CHECKPOINT_RESTORE", 0,
+                "Restore the snapshots before this kernel launch instead of "
+                "taking new ones");
+    GET_VAR_INT(checkpoint_remap_ptrs, "CHECKPOINT_REMAP_PTRS", 0,
+                "Rewrite the device pointers stored in restored allocations");
+    GET_VAR_INT(checkpoint_dirty, "CHECKPOINT_DIRTY", 1,
+                "Only snapshot the allocations a kernel could have written");
     GET_VAR_INT(verbose, "TOOL_VERBOSE", 0, "Enable verbosity inside the tool");
+    if (checkpoint_restore) {
+        checkpoint_text = 0;
+        if (!chunk_store.open_read(checkpoint_dir.c_str())) {
+            fprintf(stderr, "Error: can not open %s\n",
+                    checkpoint_dir.c_str());
+            _exit(1);
+        }
+    } else if (!checkpoint_text &&
+               !chunk_store.open(checkpoint_dir.c_str())) {
+        fprintf(stderr, "Error: can not open %s\n", checkpoint_dir.c_str());
+        _exit(1);
+    }
+    if (!checkpoint_text && !checkpoint_restore) {
+        checkpoint_writer.init(&chunk_store, checkpoint_threads);
+    }
     std::string pad(100, '-');
     printf("%s\n", pad.c_str());
 }
@@ -160,8 +231,25 @@ void nvbit_at_function_first_load(CUcontext ctx, CUfunction func) {
                nvbit_get_func_name(ctx, func), instrs.size());
     }
 
+    kernel_info_t &info = kernel_infos[func];
+    info.writes = false;
+    info.args_known =
+        kernel_arg_kinds(nvbit_get_func_name(ctx, func), info.arg_kinds);
+
     /* We iterate on the vector of instruction */
     for (auto i : instrs) {
+        std::string opcode = i->getOpcode();
+        Instr::memOpType mem = i->getMemOpType();
+        if ((i->isStore() &&
+             (mem == Instr::GLOBAL || mem == Instr::GENERIC)) ||
+            (opcode.compare(0, 4, "ATOM") == 0 &&
+             opcode.compare(0, 5, "ATOMS") != 0) ||
+            opcode.compare(0, 3, "RED") == 0 ||
+            opcode.compare(0, 3, "CAL") == 0 ||
+            opcode.compare(0, 4, "JCAL") == 0) {
+            info.writes = true;
+        }
+
         /* Check if the instruction falls in the interval where we want to
          * instrument */
         if (i->getIdx() >= instr_begin_interval &&
@@ -188,6 +276,102 @@ void nvbit_at_function_first_load(CUcontext ctx, CUfunction func) {
     }
 }
 
+/* mark dirty the allocation holding addr, if any */
+void mark_dirty_addr(uint64_t addr) {
+    alloc_info_t info;
+    if (alloc_registry.lookup(addr, &info)) {
+        dirty_allocs.insert(info.base);
+    }
+}
+
+void mark_dirty_all() {
+    alloc_registry.for_each(
+        [](const alloc_info_t &a) { dirty_allocs.insert(a.base); });
+}
+
+/* mark dirty the allocations the kernel being launched could write */
+void mark_dirty(CUfunction func, nvbit_api_cuda_t cbid, void *params) {
+    auto it = kernel_infos.find(func);
+    void **args = NULL;
+    if (cbid == API_CUDA_cuLaunchKernel ||
+        cbid == API_CUDA_cuLaunchKernel_ptsz) {
+        args = ((cuLaunchKernel_params *)params)->kernelParams;
+    }
+    if (it != kernel_infos.end() && !it->second.writes) {
+        return;
+    }
+    if (it == kernel_infos.end() || !it->second.args_known || args == NULL) {
+        /* no idea of what the arguments are, anything could be written */
+        mark_dirty_all();
+        return;
+    }
+    const std::vector<int> &kinds = it->second.arg_kinds;
+    for (size_t a = 0; a < kinds.size(); a++) {
+        if (kinds[a] == KERNEL_ARG_UNKNOWN) {
+            mark_dirty_all();
+            return;
+        }
+        if (kinds[a] == KERNEL_ARG_POINTER) {
+            mark_dirty_addr(*(uint64_t *)args[a]);
+        }
+    }
+}
+
+/* load back the state of the tracked allocations as of the snapshot taken
+ * after kernel checkpoint_restore - 1 */
+void restore_snapshot() {
+    uint32_t snap_id = checkpoint_restore - 1;
+    std::vector<manifest_alloc_t> allocs;
+    if (!checkpoint_collect(chunk_store, checkpoint_dir.c_str(), snap_id,
+                            allocs)) {
+        fprintf(stderr, "Error: no snapshot of kernel %u in %s\n", snap_id,
+                checkpoint_dir.c_str());
+        _exit(1);
+    }
+
+    std::vector<live_alloc_t> live;
+    alloc_registry.for_each([&](const alloc_info_t &a) {
+        live_alloc_t l = {a.id, a.base, a.size};
+        live.push_back(l);
+    });
+    AllocRemap remap;
+    int bad_number;
+    if (!remap.build(allocs, live, &bad_number)) {
+        fprintf(stderr,
+                "Error: allocation %d does not match snapshot %u, the "
+                "application must allocate the same way in both runs\n",
+                bad_number, snap_id);
+        _exit(1);
+    }
+
+    std::vector<uint8_t> buffer;
+    size_t restored = 0;
+    size_t patched = 0;
+    for (auto &a : allocs) {
+        uint64_t addr;
+        if (!remap.translate(a.addr, &addr)) {
+            /* freed before this launch */
+            continue;
+        }
+        if (!chunk_store.restore(a, buffer)) {
+            fprintf(stderr, "Error: can not read allocation %d of %s\n",
+                    a.number, checkpoint_dir.c_str());
+            _exit(1);
+        }
+        if (checkpoint_remap_ptrs) {
+            patched += remap.patch_pointers(buffer.data(), buffer.size());
+        }
+        CUDA_SAFECALL(cudaMemcpy((void *)addr, buffer.data(), a.size,
+                                 cudaMemcpyHostToDevice));
+        restored++;
+    }
+    if (verbose) {
+        printf("restored %zu allocations of snapshot %u, %zu pointers "
+               "patched\n",
+               restored, snap_id, patched);
+    }
+}
+
 /* This call-back is triggered every time a CUDA driver call is encountered.
  * Here we can look for a particular CUDA driver call by checking at the
  * call back ids  which are defined in tools_cuda_api_meta.h.
@@ -196,42 +380,34 @@ void nvbit_at_function_first_load(CUcontext ctx, CUfunction func) {
  * */
 void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
                          const char *name, void *params, CUresult *pStatus) {
-  
-  // Add entry for memory on and allocate
-  if(cbid == API_CUDA_cuMemAlloc_v2){
-    callback_tracker++;
-    if(callback_tracker % 2 == 0){
-      // This is the call-back, so the next will be the original call
-      cuMemAlloc_v2_params *p= (cuMemAlloc_v2_params*)params;
-      printf("Found an allocation!\n");
-      tracking_map.insert({(void*)*p->dptr, std::make_tuple(alloc_count++, p->bytesize)});
-      printf("%p, %zu\n", *p->dptr, p->bytesize);
-    }
-  }
-  
-  // Delete entry for memory on a free
-  if(cbid == API_CUDA_cuMemFree_v2){
-    callback_tracker++;
-    if(callback_tracker % 2 == 0){
-      // This is the call-back, so the next will be the original call
-      printf("Found a free!\n");
-      cuMemFree_v2_params *p= (cuMemFree_v2_params*)params;
-      tracking_map.erase((void*)p->dptr);
-      printf("%p\n", p->dptr);
-      // Test-dump the map
-      for(const auto pair : tracking_map){
-        printf("Address: %p, Number: %d, Size: %zu\n", pair.first, std::get<0>(pair.second), std::get<1>(pair.second));
-      }
+    /* track the allocations, the new ones are in the next snapshot */
+    alloc_info_t info;
+    int event = alloc_hooks_cuda_event(alloc_registry, is_exit, cbid, params,
+                                       pStatus, &info);
+    if (event == 1) {
+        dirty_allocs.insert(info.base);
+        if (verbose) {
+            printf("allocation %d - 0x%lx, %lu bytes\n", info.id, info.base,
+                   info.size);
+        }
+    } else if (event == -1) {
+        dirty_allocs.erase(info.base);
+        if (verbose) {
+            printf("free %d - 0x%lx\n", info.id, info.base);
+        }
     }
- 
-  }
 
-  // Why do I even care about HtoD?
-  if(cbid == API_CUDA_cuMemcpyHtoD_v2){
-    printf("Encountered a memcpy HtoD!\n");
-    cuMemcpyHtoD_v2_params *p= (cuMemcpyHtoD_v2_params*)params;
-    printf("%p, %p, %zu\n", p->dstDevice, p->srcHost, p->ByteCount);
-  }
+    /* the host may overwrite an allocation between two kernels, with any
+     * copy or memset to the device */
+    if (is_exit) {
+        uint64_t dst;
+        int write = host_write_dst(cbid, name, params, &dst);
+        if (write == HOST_WRITE_ADDR) {
+            mark_dirty_addr(dst);
+        } else if (write == HOST_WRITE_UNKNOWN) {
+            mark_dirty_all();
+        }
+    }
 
     /* Identify all the possible CUDA launch events */
     if (cbid == API_CUDA_cuLaunch || cbid == API_CUDA_cuLaunchKernel_ptsz ||
@@ -250,6 +426,17 @@ void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
              * 3. Reset the kernel instruction counter */
             // Lock until kernel exit (enforces serialization)
             pthread_mutex_lock(&mutex);
+
+            if (checkpoint_restore) {
+                /* fast forward to the launch to restore */
+                nvbit_enable_instrumented(ctx, p->f,
+                                          kernel_id >= checkpoint_restore);
+                if (kernel_id == checkpoint_restore) {
+                    restore_snapshot();
+                }
+            } else if (checkpoint_dirty) {
+                mark_dirty(p->f, cbid, params);
+            }
         } else {
             /* if we are exiting a kernel launch:
              * 1. Wait until the kernel is completed using
@@ -260,27 +447,58 @@ void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
             CUDA_SAFECALL(cudaDeviceSynchronize());
            
             // Only snapshot selected kernels
-            if(1){
+            if(!checkpoint_restore){
+              if (!checkpoint_text) {
+                  checkpoint_writer.begin_snapshot(kernel_id);
+              }
+              std::vector<uint8_t> buffer;
+              std::vector<alloc_info_t> allocs;
+              alloc_registry.for_each([&](const alloc_info_t &a) {
+                  if (!checkpoint_dirty || a.kind == ALLOC_MANAGED ||
+                      dirty_allocs.count(a.base)) {
+                      allocs.push_back(a);
+                  }
+              });
             // Dump a snapshot of the valid GPU memory state after each kernel
-              for(const auto pair : tracking_map){
+              for(const auto &alloc : allocs){
                 // Extract the data from the map
-                size_t bytes = std::get<1>(pair.second);
-                int alloc_number = std::get<0>(pair.second);
-                void *tmp = pair.first;
-              
-                // Open a new file for this snapshot
-                std::string name = std::to_string(kernel_id) + "_" + std::to_string(alloc_number) + ".txt";
-                FILE *f = fopen(name.c_str(), "w");
+                size_t bytes = alloc.size;
+                int alloc_number = alloc.id;
+                void *tmp = (void *)alloc.base;
+
+                if (!checkpoint_text) {
+                    /* the writer owns the buffer once queued, this copy
+                     * overlaps the compression of the previous ones */
+                    std::vector<uint8_t> *buf = checkpoint_writer.get_buffer();
+                    buf->resize(bytes);
+                    CUDA_SAFECALL(cudaMemcpy(buf->data(), tmp, bytes,
+                                             cudaMemcpyDeviceToHost));
+                    checkpoint_writer.add_alloc(alloc_number, (uint64_t)tmp,
+                                                buf);
+                    continue;
+                }
 
                 // Copy the data from the device
-                std::vector<uint8_t> buffer;
                 buffer.resize(bytes);
-                cudaMemcpy(buffer.data(), tmp, bytes, cudaMemcpyDeviceToHost);
+                CUDA_SAFECALL(cudaMemcpy(buffer.data(), tmp, bytes,
+                                         cudaMemcpyDeviceToHost));
+
+                // Open a new file for this snapshot
+                std::string name = std::to_string(kernel_id) + "_" + std::to_string(alloc_number) + ".txt";
+                FILE *f = fopen(name.c_str(), "w");
 
                 // Write the data to a file
                 for(auto i : buffer){
                   fprintf(f, "%hhu ", i);
                 }
+                fclose(f);
+              }
+
+              dirty_allocs.clear();
+              if (!checkpoint_text) {
+                  /* the manifest is written once all the allocations are
+                   * stored */
+                  checkpoint_writer.end_snapshot();
               }
             }
             // Update the kernel ID
@@ -291,3 +509,19 @@ void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
         }
     }
 }
+
+void nvbit_at_ctx_term(CUcontext ctx) {
+    if (checkpoint_text || checkpoint_restore) {
+        return;
+    }
+    /* wait for the queued snapshots to be written */
+    if (!checkpoint_writer.close()) {
+        fprintf(stderr, "Error: can not write %s\n", checkpoint_dir.c_str());
+        _exit(1);
+    }
+    chunk_store.close();
+    if (verbose) {
+        printf("checkpoint - %lu bytes written out of %lu\n",
+               chunk_store.get_bytes_out(), chunk_store.get_bytes_in());
+    }
+}
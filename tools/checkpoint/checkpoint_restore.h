@@ -0,0 +1,187 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* Restore side of the checkpoint tool. Like chunk_store.h it only depends on
+ * the C/C++ standard library and POSIX so it can be exercised on the CPU.
+ *
+ * A later run of the application does not get the same device pointers, so
+ * allocations are matched by their number (the order in which they were
+ * allocated, the same in every run of a deterministic application) and
+ * AllocRemap translates the addresses of the snapshot to the ones of the
+ * current run, i.e. to fix up device pointers stored in the data itself. */
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "chunk_store.h"
+
+/* latest content of every allocation as of the snapshot taken after
+ * kernel_id, manifests of earlier kernels fill in the allocations a
+ * snapshot does not contain. Returns false if there is no such snapshot or
+ * a manifest can not be read. */
+static inline bool checkpoint_collect(const ChunkStore &store,
+                                      const char *dir, uint32_t kernel_id,
+                                      std::vector<manifest_alloc_t> &allocs) {
+    std::vector<uint32_t> ids;
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return false;
+    }
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        char *end;
+        unsigned long id = strtoul(e->d_name, &end, 10);
+        if (end != e->d_name && strcmp(end, ".manifest") == 0 &&
+            id <= kernel_id) {
+            ids.push_back(id);
+        }
+    }
+    closedir(d);
+    std::sort(ids.begin(), ids.end());
+
+    std::map<int, manifest_alloc_t> latest;
+    for (auto id : ids) {
+        std::vector<manifest_alloc_t> snap;
+        if (!store.read_manifest(id, snap)) {
+            return false;
+        }
+        for (auto &a : snap) {
+            latest[a.number] = a;
+        }
+    }
+    allocs.clear();
+    for (auto &it : latest) {
+        allocs.push_back(it.second);
+    }
+    return !ids.empty() && ids.back() == kernel_id;
+}
+
+/* allocation of the current run */
+typedef struct {
+    int number;
+    uint64_t addr;
+    uint64_t size;
+} live_alloc_t;
+
+class AllocRemap {
+  private:
+    typedef struct {
+        uint64_t old_addr;
+        uint64_t new_addr;
+        uint64_t size;
+    } range_t;
+
+    /* sorted by old_addr, not overlapping */
+    std::vector<range_t> ranges;
+
+  public:
+    /* map every allocation of the snapshot to the live allocation with the
+     * same number, which must have the same size. Allocations of the
+     * snapshot that are not live (freed since) are left out, translate()
+     * fails on them. On failure bad_number is the number of the first
+     * allocation that does not match (-1 if the snapshot overlaps). */
+    bool build(const std::vector<manifest_alloc_t> &snap,
+               const std::vector<live_alloc_t> &live, int *bad_number) {
+        std::map<int, const live_alloc_t *> by_number;
+        for (auto &l : live) {
+            by_number[l.number] = &l;
+        }
+        ranges.clear();
+        for (auto &a : snap) {
+            auto it = by_number.find(a.number);
+            if (it == by_number.end()) {
+                continue;
+            }
+            if (it->second->size != a.size) {
+                *bad_number = a.number;
+                return false;
+            }
+            range_t r = {a.addr, it->second->addr, a.size};
+            ranges.push_back(r);
+        }
+        std::sort(ranges.begin(), ranges.end(),
+                  [](const range_t &a, const range_t &b) {
+                      return a.old_addr < b.old_addr;
+                  });
+        for (size_t i = 1; i < ranges.size(); i++) {
+            if (ranges[i - 1].old_addr + ranges[i - 1].size >
+                ranges[i].old_addr) {
+                *bad_number = -1;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /* address of the current run corresponding to old_addr, false if
+     * old_addr is not inside an allocation of the snapshot */
+    bool translate(uint64_t old_addr, uint64_t *new_addr) const {
+        /* last range starting at or before old_addr */
+        auto it = std::upper_bound(ranges.begin(), ranges.end(), old_addr,
+                                   [](uint64_t addr, const range_t &r) {
+                                       return addr < r.old_addr;
+                                   });
+        if (it == ranges.begin()) {
+            return false;
+        }
+        --it;
+        if (old_addr - it->old_addr >= it->size) {
+            return false;
+        }
+        *new_addr = it->new_addr + (old_addr - it->old_addr);
+        return true;
+    }
+
+    /* rewrite the aligned 64 bit words of data that look like a pointer
+     * into an allocation of the snapshot, returns how many were changed.
+     * Any integer that happens to fall in those ranges is rewritten too. */
+    size_t patch_pointers(uint8_t *data, size_t size) const {
+        if (ranges.empty()) {
+            return 0;
+        }
+        uint64_t lo = ranges.front().old_addr;
+        uint64_t hi = ranges.back().old_addr + ranges.back().size;
+        size_t patched = 0;
+        for (size_t off = 0; off + 8 <= size; off += 8) {
+            uint64_t v;
+            memcpy(&v, data + off, 8);
+            uint64_t n;
+            if (v >= lo && v < hi && translate(v, &n)) {
+                memcpy(data + off, &n, 8);
+                patched++;
+            }
+        }
+        return patched;
+    }
+};
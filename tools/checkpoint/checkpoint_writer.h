@@ -0,0 +1,368 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* Asynchronous writer of checkpoint snapshots into a ChunkStore.
+ *
+ * The application thread copies an allocation to a host buffer obtained with
+ * get_buffer() and hands it to add_alloc(), which returns right away, so the
+ * copy of the next allocation overlaps the processing of the previous ones.
+ * Allocations are cut in segments of CHECKPOINT_SEGMENT_SIZE bytes that a
+ * pool of worker threads chunks, hashes and compresses in parallel (chunks
+ * already in the store are not compressed). A single writer thread then
+ * appends the segments to the store in submission order, so deduplication
+ * and the content of the pack do not depend on thread timing, and writes the
+ * manifest of a snapshot once all its allocations are stored.
+ *
+ * Chunk boundaries never cross segments, which only costs one extra chunk
+ * boundary every CHECKPOINT_SEGMENT_SIZE bytes. At most max_buffers host
+ * buffers exist, get_buffer() waits for one to be released by the writer. */
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "chunk_store.h"
+
+#define CHECKPOINT_SEGMENT_SIZE (16 << 20)
+
+class CheckpointWriter {
+  private:
+    typedef struct {
+        chunk_hash_t hash;
+        uint32_t raw_size;
+        uint32_t codec;
+        /* offset of the chunk in the allocation */
+        uint64_t offset;
+        /* compressed bytes, empty if stored as is or already in the store */
+        std::vector<uint8_t> payload;
+        bool known;
+    } chunk_t;
+
+    struct snapshot_t;
+
+    typedef struct {
+        manifest_alloc_t info;
+        std::vector<uint8_t> *data;
+        int segments_left;
+    } alloc_t;
+
+    struct snapshot_t {
+        uint32_t kernel_id;
+        std::vector<alloc_t *> allocs;
+    };
+
+    /* unit of work of the workers, also used by the writer thread to mark
+     * the end of a snapshot (alloc == NULL) */
+    typedef struct {
+        snapshot_t *snap;
+        alloc_t *alloc;
+        uint64_t begin;
+        uint64_t end;
+        std::vector<chunk_t> chunks;
+        bool done;
+    } segment_t;
+
+    ChunkStore *store;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    pthread_cond_t buffer_cond;
+
+    /* segments not yet picked by a worker */
+    std::deque<segment_t *> work;
+    /* all the segments and snapshot ends not yet written, in order */
+    std::deque<segment_t *> pending;
+
+    std::vector<std::vector<uint8_t> *> free_buffers;
+    int num_buffers;
+    int max_buffers;
+
+    std::vector<pthread_t> workers;
+    pthread_t writer;
+    bool stopping;
+    bool failed;
+
+    snapshot_t *curr_snapshot;
+
+    void process(segment_t *seg) {
+        const uint8_t *data = seg->alloc->data->data();
+        std::vector<uint8_t> buf;
+        uint64_t off = seg->begin;
+        while (off < seg->end) {
+            size_t n = cdc_next_chunk(data + off, seg->end - off);
+            chunk_t c;
+            c.hash = chunk_hash(data + off, n);
+            c.raw_size = n;
+            c.offset = off;
+            chunk_ref_t ref;
+            c.known = store->lookup(c.hash, &ref);
+            c.codec = CHUNK_CODEC_NONE;
+            if (!c.known) {
+                const uint8_t *payload;
+                size_t size;
+                c.codec = chunk_encode(data + off, n, buf, &payload, &size);
+                if (c.codec != CHUNK_CODEC_NONE) {
+                    c.payload.assign(payload, payload + size);
+                }
+            }
+            seg->chunks.push_back(c);
+            off += n;
+        }
+    }
+
+    static void *worker_fun(void *arg) {
+        CheckpointWriter *w = (CheckpointWriter *)arg;
+        pthread_mutex_lock(&w->mutex);
+        while (true) {
+            while (w->work.empty() && !w->stopping) {
+                pthread_cond_wait(&w->work_cond, &w->mutex);
+            }
+            if (w->work.empty()) {
+                break;
+            }
+            segment_t *seg = w->work.front();
+            w->work.pop_front();
+            pthread_mutex_unlock(&w->mutex);
+            w->process(seg);
+            pthread_mutex_lock(&w->mutex);
+            seg->done = true;
+            pthread_cond_broadcast(&w->done_cond);
+        }
+        pthread_mutex_unlock(&w->mutex);
+        return NULL;
+    }
+
+    /* append the chunks of a segment, called by the writer thread only */
+    bool write_segment(segment_t *seg) {
+        const uint8_t *data = seg->alloc->data->data();
+        for (auto &c : seg->chunks) {
+            const uint8_t *payload = c.codec == CHUNK_CODEC_NONE
+                                         ? data + c.offset
+                                         : c.payload.data();
+            uint32_t size = c.codec == CHUNK_CODEC_NONE ? c.raw_size
+                                                        : c.payload.size();
+            /* a chunk known to the worker is still in the store and
+             * append() only returns its reference */
+            chunk_ref_t ref;
+            if (!store->append(c.hash, c.raw_size, c.codec, payload, size,
+                               &ref)) {
+                return false;
+            }
+            seg->alloc->info.chunks.push_back(ref);
+        }
+        return true;
+    }
+
+    bool write_manifest(snapshot_t *snap) {
+        std::vector<manifest_alloc_t> allocs;
+        for (auto a : snap->allocs) {
+            allocs.push_back(a->info);
+            delete a;
+        }
+        bool ok = store->write_manifest(snap->kernel_id, allocs);
+        delete snap;
+        return ok;
+    }
+
+    static void *writer_fun(void *arg) {
+        CheckpointWriter *w = (CheckpointWriter *)arg;
+        pthread_mutex_lock(&w->mutex);
+        while (true) {
+            while (!w->pending.empty() && !w->pending.front()->done) {
+                pthread_cond_wait(&w->done_cond, &w->mutex);
+            }
+            if (w->pending.empty()) {
+                if (w->stopping) {
+                    break;
+                }
+                pthread_cond_wait(&w->done_cond, &w->mutex);
+                continue;
+            }
+            segment_t *seg = w->pending.front();
+            pthread_mutex_unlock(&w->mutex);
+
+            bool ok;
+            std::vector<uint8_t> *release = NULL;
+            if (seg->alloc == NULL) {
+                ok = w->write_manifest(seg->snap);
+            } else {
+                ok = w->write_segment(seg);
+                if (--seg->alloc->segments_left == 0) {
+                    release = seg->alloc->data;
+                    seg->alloc->data = NULL;
+                }
+            }
+            delete seg;
+
+            pthread_mutex_lock(&w->mutex);
+            w->pending.pop_front();
+            w->failed = w->failed || !ok;
+            if (release != NULL) {
+                w->free_buffers.push_back(release);
+            }
+            /* wake up get_buffer() and flush() */
+            pthread_cond_broadcast(&w->buffer_cond);
+        }
+        pthread_mutex_unlock(&w->mutex);
+        return NULL;
+    }
+
+    void push(segment_t *seg, bool is_work) {
+        pthread_mutex_lock(&mutex);
+        pending.push_back(seg);
+        if (is_work) {
+            work.push_back(seg);
+            pthread_cond_signal(&work_cond);
+        } else {
+            pthread_cond_broadcast(&done_cond);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+  public:
+    CheckpointWriter() : store(NULL), curr_snapshot(NULL) {}
+
+    void init(ChunkStore *store, int num_threads, int max_buffers = 3) {
+        this->store = store;
+        this->max_buffers = max_buffers;
+        num_buffers = 0;
+        stopping = false;
+        failed = false;
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&work_cond, NULL);
+        pthread_cond_init(&done_cond, NULL);
+        pthread_cond_init(&buffer_cond, NULL);
+        workers.resize(num_threads < 1 ? 1 : num_threads);
+        for (auto &t : workers) {
+            pthread_create(&t, NULL, worker_fun, this);
+        }
+        pthread_create(&writer, NULL, writer_fun, this);
+    }
+
+    /* host buffer to copy the next allocation into, waits if max_buffers
+     * are in use */
+    std::vector<uint8_t> *get_buffer() {
+        std::vector<uint8_t> *buf = NULL;
+        pthread_mutex_lock(&mutex);
+        while (free_buffers.empty() && num_buffers >= max_buffers) {
+            pthread_cond_wait(&buffer_cond, &mutex);
+        }
+        if (!free_buffers.empty()) {
+            buf = free_buffers.back();
+            free_buffers.pop_back();
+        } else {
+            buf = new std::vector<uint8_t>;
+            num_buffers++;
+        }
+        pthread_mutex_unlock(&mutex);
+        return buf;
+    }
+
+    void begin_snapshot(uint32_t kernel_id) {
+        assert(curr_snapshot == NULL);
+        curr_snapshot = new snapshot_t;
+        curr_snapshot->kernel_id = kernel_id;
+    }
+
+    /* queue an allocation of the current snapshot, data comes from
+     * get_buffer() and is owned by the writer from now on */
+    void add_alloc(int number, uint64_t addr, std::vector<uint8_t> *data) {
+        assert(curr_snapshot != NULL);
+        alloc_t *a = new alloc_t;
+        a->info.number = number;
+        a->info.addr = addr;
+        a->info.size = data->size();
+        a->data = data;
+        a->segments_left = 0;
+        curr_snapshot->allocs.push_back(a);
+
+        std::vector<segment_t *> segs;
+        uint64_t begin = 0;
+        do {
+            segment_t *seg = new segment_t;
+            seg->snap = curr_snapshot;
+            seg->alloc = a;
+            seg->begin = begin;
+            seg->end = std::min<uint64_t>(begin + CHECKPOINT_SEGMENT_SIZE,
+                                          data->size());
+            seg->done = false;
+            segs.push_back(seg);
+            begin = seg->end;
+        } while (begin < data->size());
+        a->segments_left = segs.size();
+        for (auto seg : segs) {
+            push(seg, true);
+        }
+    }
+
+    /* the manifest is written once all the allocations are stored */
+    void end_snapshot() {
+        assert(curr_snapshot != NULL);
+        segment_t *seg = new segment_t;
+        seg->snap = curr_snapshot;
+        seg->alloc = NULL;
+        seg->done = true;
+        curr_snapshot = NULL;
+        push(seg, false);
+    }
+
+    /* wait for everything queued to be written, returns false if anything
+     * failed so far */
+    bool flush() {
+        pthread_mutex_lock(&mutex);
+        while (!pending.empty()) {
+            pthread_cond_wait(&buffer_cond, &mutex);
+        }
+        bool ok = !failed;
+        pthread_mutex_unlock(&mutex);
+        return ok;
+    }
+
+    bool close() {
+        bool ok = flush();
+        pthread_mutex_lock(&mutex);
+        stopping = true;
+        pthread_cond_broadcast(&work_cond);
+        pthread_cond_broadcast(&done_cond);
+        pthread_mutex_unlock(&mutex);
+        for (auto &t : workers) {
+            pthread_join(t, NULL);
+        }
+        pthread_join(writer, NULL);
+        for (auto b : free_buffers) {
+            delete b;
+        }
+        free_buffers.clear();
+        return ok;
+    }
+};
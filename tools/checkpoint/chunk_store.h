@@ -0,0 +1,441 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* Deduplicated storage of the GPU memory snapshots taken by the checkpoint
+ * tool. It only depends on the C/C++ standard library and POSIX so it can be
+ * exercised on the CPU.
+ *
+ * Every allocation is split in content defined chunks (a gear rolling hash
+ * picks the boundaries, as in FastCDC), so a change in a slice of a large
+ * allocation only changes the chunks around it, even when data moves. Each
+ * chunk is identified by a 128 bit hash and only chunks whose hash was never
+ * seen are appended to the pack file. A snapshot is described by a manifest
+ * listing, for every allocation, the chunks it is made of, most of them
+ * written by earlier snapshots.
+ *
+ * Chunks are compressed with the codec of lz_codec.h, unless that does not
+ * make them smaller. Layout of the checkpoint directory (all integers little
+ * endian):
+ *
+ *   chunks.pack                  unique chunks, back to back, each one
+ *     chunk_record_t
+ *     stored_size bytes
+ *   <kernel id>.manifest         one per snapshot
+ *     manifest_header_t
+ *     per allocation
+ *       manifest_alloc_header_t
+ *       chunk_ref_t[num_chunks]  in order, offsets are in chunks.pack */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "lz_codec.h"
+
+/* chunk sizes, the average is 1 << CDC_AVG_BITS */
+#define CDC_MIN_SIZE (2 * 1024)
+#define CDC_AVG_BITS 13
+#define CDC_MAX_SIZE (64 * 1024)
+
+static inline uint64_t chunk_mix64(uint64_t x) {
+    /* splitmix64 finalizer */
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static inline bool cdc_fill_gear_table(uint64_t *table) {
+    for (int i = 0; i < 256; i++) {
+        table[i] = chunk_mix64(0x9e3779b97f4a7c15ull * (i + 1));
+    }
+    return true;
+}
+
+/* random values the gear hash adds for every byte */
+static inline const uint64_t *cdc_gear_table() {
+    static uint64_t table[256];
+    static bool init = cdc_fill_gear_table(table);
+    (void)init;
+    return table;
+}
+
+/* length of the chunk starting at data, at most len */
+static inline size_t cdc_next_chunk(const uint8_t *data, size_t len) {
+    if (len <= CDC_MIN_SIZE) {
+        return len;
+    }
+    const uint64_t *gear = cdc_gear_table();
+    /* use the high bits of the hash, they depend on the most bytes */
+    const uint64_t mask = ((1ull << CDC_AVG_BITS) - 1) << (64 - CDC_AVG_BITS);
+    size_t end = len < CDC_MAX_SIZE ? len : CDC_MAX_SIZE;
+    uint64_t h = 0;
+    for (size_t i = CDC_MIN_SIZE; i < end; i++) {
+        h = (h << 1) + gear[data[i]];
+        if ((h & mask) == 0) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+typedef struct {
+    uint64_t hi;
+    uint64_t lo;
+} chunk_hash_t;
+
+static inline bool operator==(const chunk_hash_t &a, const chunk_hash_t &b) {
+    return a.hi == b.hi && a.lo == b.lo;
+}
+
+struct chunk_hash_hasher {
+    size_t operator()(const chunk_hash_t &h) const { return h.lo; }
+};
+
+/* 128 bit non cryptographic hash, two independent 64 bit lanes */
+static inline chunk_hash_t chunk_hash(const uint8_t *data, size_t len) {
+    uint64_t a = 0x243f6a8885a308d3ull ^ len;
+    uint64_t b = 0x13198a2e03707344ull ^ (len * 0x9e3779b97f4a7c15ull);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, 8);
+        a = (a ^ chunk_mix64(w)) * 0x9e3779b97f4a7c15ull;
+        b = (b + w) * 0xc2b2ae3d27d4eb4full;
+        b ^= b >> 29;
+    }
+    uint64_t w = 0;
+    memcpy(&w, data + i, len - i);
+    a = chunk_mix64(a ^ w ^ 0xa0761d6478bd642full);
+    b = chunk_mix64(b + w + 0xe7037ed1a0b428dbull);
+    chunk_hash_t h = {a, b};
+    return h;
+}
+
+#define CHUNK_RECORD_MAGIC 0x4b4e4843u /* "CHNK" */
+#define MANIFEST_MAGIC "NVBITCKP"
+#define MANIFEST_VERSION 1
+
+/* how a chunk is stored in the pack */
+enum { CHUNK_CODEC_NONE = 0, CHUNK_CODEC_LZ = 1 };
+
+typedef struct {
+    uint32_t magic;
+    uint32_t codec;
+    uint32_t raw_size;
+    uint32_t stored_size;
+    chunk_hash_t hash;
+} chunk_record_t;
+
+/* a chunk as referenced by a manifest, offset is the one of its record */
+typedef struct {
+    chunk_hash_t hash;
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+} chunk_ref_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t kernel_id;
+    uint32_t num_allocs;
+    uint32_t reserved;
+} manifest_header_t;
+
+typedef struct {
+    int32_t number;
+    uint32_t reserved;
+    uint64_t addr;
+    uint64_t size;
+    uint64_t num_chunks;
+} manifest_alloc_header_t;
+
+/* an allocation as described by a manifest */
+typedef struct {
+    int number;
+    uint64_t addr;
+    uint64_t size;
+    std::vector<chunk_ref_t> chunks;
+} manifest_alloc_t;
+
+/* compress a chunk for the pack, returns the codec used, payload points to
+ * either the chunk itself or to the compressed bytes in buf */
+static inline uint32_t chunk_encode(const uint8_t *data, size_t n,
+                                    std::vector<uint8_t> &buf,
+                                    const uint8_t **payload, size_t *size) {
+    buf.resize(lz_compress_bound(n));
+    size_t c = lz_compress(data, n, buf.data(), n > 0 ? n - 1 : 0);
+    if (c == 0) {
+        *payload = data;
+        *size = n;
+        return CHUNK_CODEC_NONE;
+    }
+    *payload = buf.data();
+    *size = c;
+    return CHUNK_CODEC_LZ;
+}
+
+/* The pack file and its index. lookup() may be called from any thread,
+ * append()/put() by a single thread at a time. */
+class ChunkStore {
+  private:
+    std::string dir;
+    int pack_fd;
+    uint64_t pack_size;
+    std::unordered_map<chunk_hash_t, chunk_ref_t, chunk_hash_hasher> index;
+    pthread_mutex_t index_mutex;
+
+    /* bytes given to put() and bytes actually written, for statistics */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+
+    static bool write_all(FILE *f, const void *p, size_t n) {
+        return fwrite(p, 1, n, f) == n;
+    }
+
+  public:
+    ChunkStore() : pack_fd(-1), pack_size(0), bytes_in(0), bytes_out(0) {
+        pthread_mutex_init(&index_mutex, NULL);
+    }
+
+    /* create (or reuse) the directory and start an empty pack file. The
+     * manifests of an earlier run in the same directory point into the
+     * pack being truncated, they are removed */
+    bool open(const char *path) {
+        dir = path;
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+        DIR *d = opendir(path);
+        if (d == NULL) {
+            return false;
+        }
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL) {
+            size_t n = strlen(e->d_name);
+            if (n > 9 && strcmp(e->d_name + n - 9, ".manifest") == 0 &&
+                unlink((dir + "/" + e->d_name).c_str()) != 0) {
+                closedir(d);
+                return false;
+            }
+        }
+        closedir(d);
+        pack_fd = ::open((dir + "/chunks.pack").c_str(),
+                         O_RDWR | O_CREAT | O_TRUNC, 0644);
+        pack_size = 0;
+        index.clear();
+        return pack_fd >= 0;
+    }
+
+    /* open an existing directory for reading */
+    bool open_read(const char *path) {
+        dir = path;
+        pack_fd = ::open((dir + "/chunks.pack").c_str(), O_RDONLY);
+        return pack_fd >= 0;
+    }
+
+    void close() {
+        if (pack_fd >= 0) {
+            ::close(pack_fd);
+            pack_fd = -1;
+        }
+    }
+
+    /* reference of an already stored chunk */
+    bool lookup(const chunk_hash_t &hash, chunk_ref_t *ref) {
+        pthread_mutex_lock(&index_mutex);
+        auto it = index.find(hash);
+        bool found = it != index.end();
+        if (found) {
+            *ref = it->second;
+        }
+        pthread_mutex_unlock(&index_mutex);
+        return found;
+    }
+
+    /* append a chunk already encoded with chunk_encode(), unless it is
+     * already stored, returns its reference in ref */
+    bool append(const chunk_hash_t &hash, uint32_t raw_size, uint32_t codec,
+                const uint8_t *payload, uint32_t stored_size,
+                chunk_ref_t *ref) {
+        bytes_in += raw_size;
+        if (lookup(hash, ref)) {
+            return true;
+        }
+        chunk_record_t rec = {CHUNK_RECORD_MAGIC, codec, raw_size,
+                              stored_size, hash};
+        if (pwrite(pack_fd, &rec, sizeof(rec), pack_size) !=
+                (ssize_t)sizeof(rec) ||
+            pwrite(pack_fd, payload, stored_size, pack_size + sizeof(rec)) !=
+                (ssize_t)stored_size) {
+            return false;
+        }
+        chunk_ref_t r = {hash, pack_size, raw_size, 0};
+        *ref = r;
+        pack_size += sizeof(rec) + stored_size;
+        bytes_out += sizeof(rec) + stored_size;
+        pthread_mutex_lock(&index_mutex);
+        index.insert(std::make_pair(hash, r));
+        pthread_mutex_unlock(&index_mutex);
+        return true;
+    }
+
+    /* split data in chunks, append the ones never seen to the pack and
+     * return the references of all of them in refs */
+    bool put(const uint8_t *data, size_t len, std::vector<chunk_ref_t> &refs) {
+        std::vector<uint8_t> buf;
+        refs.clear();
+        size_t off = 0;
+        while (off < len) {
+            size_t n = cdc_next_chunk(data + off, len - off);
+            chunk_hash_t h = chunk_hash(data + off, n);
+            chunk_ref_t ref;
+            if (!lookup(h, &ref)) {
+                const uint8_t *payload;
+                size_t size;
+                uint32_t codec = chunk_encode(data + off, n, buf, &payload,
+                                              &size);
+                if (!append(h, n, codec, payload, size, &ref)) {
+                    return false;
+                }
+            } else {
+                bytes_in += n;
+            }
+            refs.push_back(ref);
+            off += n;
+        }
+        return true;
+    }
+
+    /* read back a chunk, out must hold ref.size bytes */
+    bool get(const chunk_ref_t &ref, uint8_t *out) const {
+        chunk_record_t rec;
+        if (pread(pack_fd, &rec, sizeof(rec), ref.offset) !=
+                (ssize_t)sizeof(rec) ||
+            rec.magic != CHUNK_RECORD_MAGIC || rec.raw_size != ref.size ||
+            !(rec.hash == ref.hash)) {
+            return false;
+        }
+        uint64_t off = ref.offset + sizeof(rec);
+        if (rec.codec == CHUNK_CODEC_NONE) {
+            return rec.stored_size == rec.raw_size &&
+                   pread(pack_fd, out, ref.size, off) == (ssize_t)ref.size;
+        }
+        std::vector<uint8_t> buf(rec.stored_size);
+        return rec.codec == CHUNK_CODEC_LZ &&
+               pread(pack_fd, buf.data(), buf.size(), off) ==
+                   (ssize_t)buf.size() &&
+               lz_decompress(buf.data(), buf.size(), out, ref.size);
+    }
+
+    /* rebuild the content of an allocation */
+    bool restore(const manifest_alloc_t &alloc,
+                 std::vector<uint8_t> &out) const {
+        out.resize(alloc.size);
+        uint64_t off = 0;
+        for (auto &ref : alloc.chunks) {
+            if (off + ref.size > alloc.size || !get(ref, &out[off])) {
+                return false;
+            }
+            off += ref.size;
+        }
+        return off == alloc.size;
+    }
+
+    std::string manifest_path(uint32_t kernel_id) const {
+        return dir + "/" + std::to_string(kernel_id) + ".manifest";
+    }
+
+    bool write_manifest(uint32_t kernel_id,
+                        const std::vector<manifest_alloc_t> &allocs) const {
+        FILE *f = fopen(manifest_path(kernel_id).c_str(), "wb");
+        if (f == NULL) {
+            return false;
+        }
+        manifest_header_t hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic));
+        hdr.version = MANIFEST_VERSION;
+        hdr.kernel_id = kernel_id;
+        hdr.num_allocs = allocs.size();
+        bool ok = write_all(f, &hdr, sizeof(hdr));
+        for (auto &a : allocs) {
+            manifest_alloc_header_t ahdr = {a.number, 0, a.addr, a.size,
+                                            a.chunks.size()};
+            ok = ok && write_all(f, &ahdr, sizeof(ahdr)) &&
+                 write_all(f, a.chunks.data(),
+                           a.chunks.size() * sizeof(chunk_ref_t));
+        }
+        return (fclose(f) == 0) && ok;
+    }
+
+    bool read_manifest(uint32_t kernel_id,
+                       std::vector<manifest_alloc_t> &allocs) const {
+        allocs.clear();
+        FILE *f = fopen(manifest_path(kernel_id).c_str(), "rb");
+        if (f == NULL) {
+            return false;
+        }
+        manifest_header_t hdr;
+        bool ok = fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+                  memcmp(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic)) == 0 &&
+                  hdr.version == MANIFEST_VERSION;
+        for (uint32_t i = 0; ok && i < hdr.num_allocs; i++) {
+            manifest_alloc_header_t ahdr;
+            ok = fread(&ahdr, sizeof(ahdr), 1, f) == 1 &&
+                 ahdr.num_chunks <= ahdr.size;
+            if (!ok) {
+                break;
+            }
+            manifest_alloc_t a;
+            a.number = ahdr.number;
+            a.addr = ahdr.addr;
+            a.size = ahdr.size;
+            a.chunks.resize(ahdr.num_chunks);
+            ok = fread(a.chunks.data(), sizeof(chunk_ref_t), a.chunks.size(),
+                       f) == a.chunks.size();
+            allocs.push_back(a);
+        }
+        fclose(f);
+        return ok;
+    }
+
+    uint64_t get_bytes_in() const { return bytes_in; }
+    uint64_t get_bytes_out() const { return bytes_out; }
+};
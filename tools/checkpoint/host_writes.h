@@ -0,0 +1,148 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* Find the device memory written by a host side copy or memset, from the
+ * arguments of the driver call as passed to nvbit_at_cuda_event. The
+ * destination of the current (_v2, _ptds and _ptsz) copies and memsets to
+ * device or unified memory is decoded, copies to host memory or to arrays
+ * are ignored, and any other copy or memset, i.e. the legacy entry points
+ * with 32 bit device pointers, is reported as unknown so the caller can
+ * assume anything was written. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "nvbit.h"
+
+enum { HOST_WRITE_NONE, HOST_WRITE_ADDR, HOST_WRITE_UNKNOWN };
+
+/* destination of a 2D or 3D copy, if it is device memory */
+template <typename T>
+static inline int host_write_copy_dst(const T *c, uint64_t z, uint64_t *dst) {
+    if (c->dstMemoryType != CU_MEMORYTYPE_DEVICE &&
+        c->dstMemoryType != CU_MEMORYTYPE_UNIFIED) {
+        return HOST_WRITE_NONE;
+    }
+    *dst = c->dstDevice + c->dstXInBytes + c->dstY * c->dstPitch + z;
+    return HOST_WRITE_ADDR;
+}
+
+/* returns HOST_WRITE_ADDR and an address in the written memory in dst,
+ * HOST_WRITE_NONE if the call does not write device memory or
+ * HOST_WRITE_UNKNOWN */
+static inline int host_write_dst(nvbit_api_cuda_t cbid, const char *name,
+                                 void *params, uint64_t *dst) {
+#define HOST_WRITE_1D(api, field)                         \
+    case API_CUDA_##api:                                  \
+        *dst = ((api##_params *)params)->field;           \
+        return HOST_WRITE_ADDR;
+#define HOST_WRITE_2D(api)                                                  \
+    case API_CUDA_##api:                                                    \
+        return host_write_copy_dst(((api##_params *)params)->pCopy, 0, dst);
+#define HOST_WRITE_3D(api)                                                  \
+    case API_CUDA_##api: {                                                  \
+        const auto *c = ((api##_params *)params)->pCopy;                    \
+        return host_write_copy_dst(c, c->dstZ * c->dstHeight * c->dstPitch, \
+                                   dst);                                    \
+    }
+    switch (cbid) {
+        HOST_WRITE_1D(cuMemcpyHtoD_v2, dstDevice)
+        HOST_WRITE_1D(cuMemcpyHtoD_v2_ptds, dstDevice)
+        HOST_WRITE_1D(cuMemcpyHtoDAsync_v2, dstDevice)
+        HOST_WRITE_1D(cuMemcpyHtoDAsync_v2_ptsz, dstDevice)
+        HOST_WRITE_1D(cuMemcpyDtoD_v2, dstDevice)
+        HOST_WRITE_1D(cuMemcpyDtoD_v2_ptds, dstDevice)
+        HOST_WRITE_1D(cuMemcpyDtoDAsync_v2, dstDevice)
+        HOST_WRITE_1D(cuMemcpyDtoDAsync_v2_ptsz, dstDevice)
+        HOST_WRITE_1D(cuMemcpyAtoD_v2, dstDevice)
+        HOST_WRITE_1D(cuMemcpyAtoD_v2_ptds, dstDevice)
+        HOST_WRITE_1D(cuMemcpy, dst)
+        HOST_WRITE_1D(cuMemcpy_ptds, dst)
+        HOST_WRITE_1D(cuMemcpyAsync, dst)
+        HOST_WRITE_1D(cuMemcpyAsync_ptsz, dst)
+        HOST_WRITE_1D(cuMemcpyPeer, dstDevice)
+        HOST_WRITE_1D(cuMemcpyPeer_ptds, dstDevice)
+        HOST_WRITE_1D(cuMemcpyPeerAsync, dstDevice)
+        HOST_WRITE_1D(cuMemcpyPeerAsync_ptsz, dstDevice)
+        HOST_WRITE_1D(cuMemsetD8_v2, dstDevice)
+        HOST_WRITE_1D(cuMemsetD8_v2_ptds, dstDevice)
+        HOST_WRITE_1D(cuMemsetD16_v2, dstDevice)
+        HOST_WRITE_1D(cuMemsetD16_v2_ptds, dstDevice)
+        HOST_WRITE_1D(cuMemsetD32_v2, dstDevice)
+        HOST_WRITE_1D(cuMemsetD32_v2_ptds, dstDevice)
+        HOST_WRITE_1D(cuMemsetD2D8_v2, dstDevice)
+        HOST_WRITE_1D(cuMemsetD2D8_v2_ptds, dstDevice)
+        HOST_WRITE_1D(cuMemsetD2D16_v2, dstDevice)
+        HOST_WRITE_1D(cuMemsetD2D16_v2_ptds, dstDevice)
+        HOST_WRITE_1D(cuMemsetD2D32_v2, dstDevice)
+        HOST_WRITE_1D(cuMemsetD2D32_v2_ptds, dstDevice)
+        HOST_WRITE_1D(cuMemsetD8Async, dstDevice)
+        HOST_WRITE_1D(cuMemsetD8Async_ptsz, dstDevice)
+        HOST_WRITE_1D(cuMemsetD16Async, dstDevice)
+        HOST_WRITE_1D(cuMemsetD16Async_ptsz, dstDevice)
+        HOST_WRITE_1D(cuMemsetD32Async, dstDevice)
+        HOST_WRITE_1D(cuMemsetD32Async_ptsz, dstDevice)
+        HOST_WRITE_1D(cuMemsetD2D8Async, dstDevice)
+        HOST_WRITE_1D(cuMemsetD2D8Async_ptsz, dstDevice)
+        HOST_WRITE_1D(cuMemsetD2D16Async, dstDevice)
+        HOST_WRITE_1D(cuMemsetD2D16Async_ptsz, dstDevice)
+        HOST_WRITE_1D(cuMemsetD2D32Async, dstDevice)
+        HOST_WRITE_1D(cuMemsetD2D32Async_ptsz, dstDevice)
+        HOST_WRITE_2D(cuMemcpy2D_v2)
+        HOST_WRITE_2D(cuMemcpy2D_v2_ptds)
+        HOST_WRITE_2D(cuMemcpy2DUnaligned_v2)
+        HOST_WRITE_2D(cuMemcpy2DUnaligned_v2_ptds)
+        HOST_WRITE_2D(cuMemcpy2DAsync_v2)
+        HOST_WRITE_2D(cuMemcpy2DAsync_v2_ptsz)
+        HOST_WRITE_3D(cuMemcpy3D_v2)
+        HOST_WRITE_3D(cuMemcpy3D_v2_ptds)
+        HOST_WRITE_3D(cuMemcpy3DAsync_v2)
+        HOST_WRITE_3D(cuMemcpy3DAsync_v2_ptsz)
+        HOST_WRITE_3D(cuMemcpy3DPeer)
+        HOST_WRITE_3D(cuMemcpy3DPeer_ptds)
+        HOST_WRITE_3D(cuMemcpy3DPeerAsync)
+        HOST_WRITE_3D(cuMemcpy3DPeerAsync_ptsz)
+        default:
+            break;
+    }
+#undef HOST_WRITE_1D
+#undef HOST_WRITE_2D
+#undef HOST_WRITE_3D
+    if (strncmp(name, "cuMemcpy", 8) != 0 &&
+        strncmp(name, "cuMemset", 8) != 0) {
+        return HOST_WRITE_NONE;
+    }
+    /* copies to the host or to an array, i.e. cuMemcpyDtoH_v2, cuMemcpyAtoA,
+     * the destination is after the "to" */
+    const char *to = strstr(name, "to");
+    if (to != NULL && (to[2] == 'H' || to[2] == 'A')) {
+        return HOST_WRITE_NONE;
+    }
+    return HOST_WRITE_UNKNOWN;
+}
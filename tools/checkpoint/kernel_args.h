@@ -0,0 +1,144 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* Classify the arguments of a kernel from the prototype returned by
+ * nvbit_get_func_name(), i.e. "vecAdd(double*, double*, double*, int)", so
+ * the pointers among the kernelParams of a launch can be found. Only a
+ * single level pointer to a built-in scalar is KERNEL_ARG_POINTER: through
+ * it a kernel only reaches the allocation it points into. A pointer to a
+ * pointer, to a struct (which may hold pointers) or to void, and anything
+ * else that is not a built-in scalar (a struct passed by value may hold
+ * pointers) is KERNEL_ARG_UNKNOWN. */
+
+#include <string.h>
+#include <string>
+#include <vector>
+
+enum { KERNEL_ARG_SCALAR, KERNEL_ARG_POINTER, KERNEL_ARG_UNKNOWN };
+
+/* true if every word of type is a built-in scalar type or a qualifier */
+static inline bool kernel_arg_is_scalar(const std::string &type) {
+    static const char *scalars[] = {
+        "bool",  "char",     "signed", "unsigned", "short", "int",
+        "long",  "float",    "double", "const",    "volatile",
+        "__int128", "__half", NULL};
+    /* every word must be one of the above */
+    bool has_type = false;
+    size_t i = 0;
+    while (i < type.size()) {
+        size_t j = type.find(' ', i);
+        if (j == std::string::npos) {
+            j = type.size();
+        }
+        if (j > i) {
+            std::string word = type.substr(i, j - i);
+            bool found = false;
+            for (int k = 0; scalars[k] != NULL && !found; k++) {
+                found = word == scalars[k];
+            }
+            if (!found) {
+                return false;
+            }
+            has_type |= word != "const" && word != "volatile";
+        }
+        i = j + 1;
+    }
+    return has_type;
+}
+
+static inline int kernel_arg_kind(const std::string &arg) {
+    size_t star = arg.find('*');
+    if (star == std::string::npos) {
+        return kernel_arg_is_scalar(arg) ? KERNEL_ARG_SCALAR
+                                         : KERNEL_ARG_UNKNOWN;
+    }
+    /* one level only, the pointer itself may be qualified, i.e.
+     * "float const* __restrict__" */
+    if (arg.find('*', star + 1) != std::string::npos) {
+        return KERNEL_ARG_UNKNOWN;
+    }
+    std::string quals = arg.substr(star + 1);
+    for (const char *q : {"const", "volatile", "__restrict__", "__restrict"}) {
+        size_t at;
+        while ((at = quals.find(q)) != std::string::npos) {
+            quals.erase(at, strlen(q));
+        }
+    }
+    if (quals.find_first_not_of(' ') != std::string::npos) {
+        return KERNEL_ARG_UNKNOWN;
+    }
+    return kernel_arg_is_scalar(arg.substr(0, star)) ? KERNEL_ARG_POINTER
+                                                     : KERNEL_ARG_UNKNOWN;
+}
+
+/* false if the prototype has no argument list (i.e. extern "C" kernels are
+ * reported by name only) */
+static inline bool kernel_arg_kinds(const char *proto,
+                                    std::vector<int> &kinds) {
+    kinds.clear();
+    /* the argument list is the parenthesis closed last, the name may hold
+     * some too, i.e. "(anonymous namespace)::kernel(int*)" */
+    const char *end = strrchr(proto, ')');
+    if (end == NULL) {
+        return false;
+    }
+    const char *begin = end;
+    int d = 1;
+    while (d > 0 && begin > proto) {
+        begin--;
+        d += *begin == ')' ? 1 : *begin == '(' ? -1 : 0;
+    }
+    if (d > 0) {
+        return false;
+    }
+    int depth = 0;
+    std::string arg;
+    for (const char *c = begin + 1; *c != '\0'; c++) {
+        if (depth == 0 && (*c == ',' || *c == ')')) {
+            size_t b = arg.find_first_not_of(' ');
+            size_t e = arg.find_last_not_of(' ');
+            arg = b == std::string::npos ? "" : arg.substr(b, e - b + 1);
+            if (!arg.empty() && arg != "void") {
+                kinds.push_back(kernel_arg_kind(arg));
+            }
+            if (*c == ')') {
+                return true;
+            }
+            arg.clear();
+            continue;
+        }
+        if (*c == '<' || *c == '(' || *c == '[') {
+            depth++;
+        } else if (*c == '>' || *c == ')' || *c == ']') {
+            depth--;
+        }
+        arg += *c;
+    }
+    return false;
+}
@@ -0,0 +1,178 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* Small LZ77 codec used to compress checkpoint chunks, in the spirit of LZ4:
+ * greedy matching through a hash table of 4 byte sequences and a byte
+ * oriented format, so both directions run at several hundred MB/s per core
+ * without external dependencies.
+ *
+ * A compressed block is a sequence of
+ *   token                  literal length (high 4 bits), match length - 4
+ *                          (low 4 bits), 15 means more length bytes follow
+ *   [literal length bytes] each one added, 255 means one more follows
+ *   literals
+ *   match offset           2 bytes little endian, absent in the last sequence
+ *   [match length bytes]   same as literal length bytes
+ * The last sequence only has literals and ends the block. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+/* worst case size of the compression of n bytes */
+static inline size_t lz_compress_bound(size_t n) { return n + n / 255 + 16; }
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+/* write a length extension, returns false if it does not fit */
+static inline bool lz_put_len(uint8_t **op, const uint8_t *oend, size_t len) {
+    while (len >= 255) {
+        if (*op >= oend) return false;
+        *(*op)++ = 255;
+        len -= 255;
+    }
+    if (*op >= oend) return false;
+    *(*op)++ = (uint8_t)len;
+    return true;
+}
+
+static inline bool lz_put_sequence(uint8_t **op, const uint8_t *oend,
+                                   const uint8_t *lit, size_t lit_len,
+                                   size_t offset, size_t match_len) {
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+    if (*op >= oend) return false;
+    uint8_t *token = (*op)++;
+    *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+    if (lit_len >= 15 && !lz_put_len(op, oend, lit_len - 15)) return false;
+    if ((size_t)(oend - *op) < lit_len) return false;
+    memcpy(*op, lit, lit_len);
+    *op += lit_len;
+    if (match_len == 0) {
+        return true;
+    }
+    *token |= (uint8_t)(ml < 15 ? ml : 15);
+    if (oend - *op < 2) return false;
+    *(*op)++ = (uint8_t)offset;
+    *(*op)++ = (uint8_t)(offset >> 8);
+    if (ml >= 15 && !lz_put_len(op, oend, ml - 15)) return false;
+    return true;
+}
+
+/* compress n bytes of src in dst, returns the compressed size or 0 if it
+ * does not fit in cap bytes */
+static inline size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst,
+                                 size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + cap;
+    size_t anchor = 0, i = 0;
+
+    while (i + LZ_MIN_MATCH <= n) {
+        uint32_t seq = lz_read32(src + i);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t cand = table[h];
+        table[h] = (uint32_t)i;
+        if (cand < i && i - cand <= LZ_MAX_OFFSET &&
+            lz_read32(src + cand) == seq) {
+            size_t len = LZ_MIN_MATCH;
+            while (i + len < n && src[cand + len] == src[i + len]) {
+                len++;
+            }
+            if (!lz_put_sequence(&op, oend, src + anchor, i - anchor,
+                                 i - cand, len)) {
+                return 0;
+            }
+            i += len;
+            anchor = i;
+        } else {
+            /* skip faster through data that does not compress */
+            i += 1 + ((i - anchor) >> 6);
+        }
+    }
+    if (!lz_put_sequence(&op, oend, src + anchor, n - anchor, 0, 0)) {
+        return 0;
+    }
+    return op - dst;
+}
+
+/* decompress a block of n bytes in dst, which must be exactly raw_size
+ * bytes, returns false if the block is malformed */
+static inline bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst,
+                                 size_t raw_size) {
+    const uint8_t *ip = src, *iend = src + n;
+    size_t op = 0;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return false;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if ((size_t)(iend - ip) < lit || raw_size - op < lit) return false;
+        memcpy(dst + op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t ml = token & 15;
+        if (ml == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return false;
+                b = *ip++;
+                ml += b;
+            } while (b == 255);
+        }
+        ml += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || raw_size - op < ml) return false;
+        /* byte by byte, the match can overlap what it produces */
+        for (size_t k = 0; k < ml; k++, op++) {
+            dst[op] = dst[op - offset];
+        }
+    }
+    return op == raw_size;
+}
@@ -0,0 +1,196 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host test of the restore side of the checkpoint tool
+ * (checkpoint_restore.h): collecting the latest content of every
+ * allocation from partial snapshots, matching the allocations of a new run
+ * by number, and translating and patching the device pointers stored in
+ * the data. */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "checkpoint_restore.h"
+#include "utils/host_test.h"
+
+static const uint64_t addr_of[3] = {0x7000000000ull, 0x7000100000ull,
+                                    0x7000200000ull};
+
+/* write a snapshot of the given allocations (number, data) */
+static void snapshot(ChunkStore &s, uint32_t kernel_id,
+                     const std::vector<std::pair<int, std::vector<uint8_t> *> >
+                         &allocs) {
+    std::vector<manifest_alloc_t> m;
+    for (auto &x : allocs) {
+        manifest_alloc_t a;
+        a.number = x.first;
+        a.addr = addr_of[x.first];
+        a.size = x.second->size();
+        CHECK(s.put(x.second->data(), a.size, a.chunks));
+        m.push_back(a);
+    }
+    CHECK(s.write_manifest(kernel_id, m));
+}
+
+static uint64_t load64(const std::vector<uint8_t> &v, size_t off) {
+    uint64_t x;
+    memcpy(&x, &v[off], 8);
+    return x;
+}
+
+static void store64(std::vector<uint8_t> &v, size_t off, uint64_t x) {
+    memcpy(&v[off], &x, 8);
+}
+
+/* three allocations, the third one holds pointers into the second */
+static void test_collect(const std::string &dir) {
+    std::vector<uint8_t> a(100000, 1), b(5000, 2), c(64, 0);
+    store64(c, 8, addr_of[1] + 16);
+    store64(c, 16, 5);
+
+    ChunkStore s;
+    CHECK(s.open(dir.c_str()));
+    /* kernel 0 has everything, 1 and 3 only what they wrote, no snapshot
+     * of kernel 2 */
+    snapshot(s, 0, {{0, &a}, {1, &b}, {2, &c}});
+    b[7] = 9;
+    snapshot(s, 1, {{1, &b}});
+    a[0] = 3;
+    snapshot(s, 3, {{0, &a}});
+    s.close();
+
+    ChunkStore r;
+    CHECK(r.open_read(dir.c_str()));
+    std::vector<manifest_alloc_t> m;
+    std::vector<uint8_t> out;
+    CHECK(!checkpoint_collect(r, dir.c_str(), 2, m));
+    CHECK(!checkpoint_collect(r, dir.c_str(), 4, m));
+    CHECK(!checkpoint_collect(r, (dir + "/none").c_str(), 1, m));
+
+    /* as of kernel 1: a from kernel 0, b from kernel 1 */
+    CHECK(checkpoint_collect(r, dir.c_str(), 1, m));
+    CHECK(m.size() == 3);
+    for (int i = 0; i < 3; i++) {
+        CHECK(m[i].number == i && m[i].addr == addr_of[i]);
+    }
+    CHECK(r.restore(m[0], out) && out.size() == a.size() && out[0] == 1);
+    CHECK(r.restore(m[1], out) && out == b);
+    CHECK(r.restore(m[2], out) && out == c);
+
+    /* as of kernel 3 */
+    CHECK(checkpoint_collect(r, dir.c_str(), 3, m));
+    CHECK(m.size() == 3);
+    CHECK(r.restore(m[0], out) && out == a);
+    CHECK(r.restore(m[1], out) && out == b);
+
+    /* an unreadable manifest fails the whole collection */
+    FILE *f = fopen(r.manifest_path(1).c_str(), "wb");
+    CHECK(f != NULL);
+    fputs("garbage", f);
+    fclose(f);
+    CHECK(!checkpoint_collect(r, dir.c_str(), 3, m));
+    r.close();
+}
+
+static void test_remap(const std::string &dir) {
+    ChunkStore r;
+    CHECK(r.open_read(dir.c_str()));
+    std::vector<manifest_alloc_t> m;
+    CHECK(r.read_manifest(0, m) && m.size() == 3);
+    r.close();
+
+    /* allocation 1 was freed in the new run */
+    AllocRemap remap;
+    int bad = 42;
+    std::vector<live_alloc_t> live = {{0, 0x100, 100000}, {2, 0x900000, 64}};
+    CHECK(remap.build(m, live, &bad));
+    uint64_t n;
+    CHECK(remap.translate(addr_of[0], &n) && n == 0x100);
+    CHECK(remap.translate(addr_of[0] + 99999, &n) && n == 0x100 + 99999);
+    CHECK(!remap.translate(addr_of[0] + 100000, &n));
+    CHECK(!remap.translate(addr_of[1] + 16, &n));
+    CHECK(!remap.translate(addr_of[0] - 1, &n));
+    CHECK(!remap.translate(1, &n));
+    CHECK(remap.translate(addr_of[2] + 63, &n) && n == 0x900000 + 63);
+
+    /* the allocation with the same number must have the same size */
+    std::vector<live_alloc_t> wrong = {{0, 0x100, 100000}, {1, 0x900000, 64}};
+    CHECK(!remap.build(m, wrong, &bad) && bad == 1);
+
+    /* overlapping allocations in the snapshot */
+    std::vector<manifest_alloc_t> overlap(m);
+    overlap[1].addr = addr_of[0] + 4096;
+    std::vector<live_alloc_t> all = {
+        {0, 0x100, 100000}, {1, 0x5000000, 5000}, {2, 0x900000, 64}};
+    CHECK(!remap.build(overlap, all, &bad) && bad == -1);
+
+    /* pointer patching: only aligned words inside a snapshot allocation */
+    CHECK(remap.build(m, all, &bad));
+    ChunkStore r2;
+    CHECK(r2.open_read(dir.c_str()));
+    std::vector<uint8_t> c;
+    CHECK(r2.restore(m[2], c));
+    r2.close();
+    /* an unaligned copy of the pointer is left alone */
+    c.resize(80);
+    store64(c, 32, addr_of[0]);
+    memcpy(&c[41], &c[8], 8);
+    std::vector<uint8_t> before(c);
+    CHECK(remap.patch_pointers(c.data(), c.size()) == 2);
+    CHECK(load64(c, 8) == 0x5000000 + 16);
+    CHECK(load64(c, 16) == 5);
+    CHECK(load64(c, 32) == 0x100);
+    CHECK(memcmp(&c[41], &before[41], 8) == 0);
+    /* a trailing partial word is not read */
+    CHECK(remap.patch_pointers(before.data(), 15) == 0);
+    CHECK(remap.patch_pointers(before.data(), 16) == 1);
+
+    AllocRemap empty;
+    CHECK(empty.build(std::vector<manifest_alloc_t>(), all, &bad));
+    CHECK(!empty.translate(addr_of[0], &n));
+    CHECK(empty.patch_pointers(c.data(), c.size()) == 0);
+}
+
+int main() {
+    char tmpl[] = "/tmp/test_checkpoint_restore_XXXXXX";
+    CHECK(mkdtemp(tmpl) != NULL);
+    std::string dir(tmpl);
+
+    test_collect(dir);
+    test_remap(dir);
+
+    for (int k = 0; k < 4; k++) {
+        unlink((dir + "/" + std::to_string(k) + ".manifest").c_str());
+    }
+    unlink((dir + "/chunks.pack").c_str());
+    CHECK(rmdir(tmpl) == 0);
+    return host_test_done("test_checkpoint_restore");
+}
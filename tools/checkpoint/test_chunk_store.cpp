@@ -0,0 +1,241 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host test of the deduplicated snapshot storage (chunk_store.h): content
+ * defined chunk boundaries, deduplication across snapshots when data is
+ * modified or shifted, the round trip of allocations through the pack and
+ * the manifests, and the removal of the manifests of an earlier run. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "chunk_store.h"
+#include "utils/host_test.h"
+
+static bool exists(const std::string &path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+static void remove_dir(const std::string &dir) {
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) {
+            unlink((dir + "/" + e->d_name).c_str());
+        }
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+}
+
+static std::vector<uint8_t> random_bytes(size_t n, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<uint8_t> v(n);
+    for (auto &b : v) b = rng();
+    return v;
+}
+
+static void test_chunking() {
+    std::vector<uint8_t> a = random_bytes(4 << 20, 1);
+    size_t off = 0, num = 0;
+    std::vector<size_t> cuts;
+    while (off < a.size()) {
+        size_t n = cdc_next_chunk(&a[off], a.size() - off);
+        CHECK(n > 0 && n <= CDC_MAX_SIZE);
+        CHECK(n >= CDC_MIN_SIZE || off + n == a.size());
+        off += n;
+        num++;
+        cuts.push_back(off);
+    }
+    /* the average chunk is around 1 << CDC_AVG_BITS past the minimum */
+    size_t avg = a.size() / num;
+    CHECK(avg > CDC_MIN_SIZE + (1 << CDC_AVG_BITS) / 2);
+    CHECK(avg < CDC_MIN_SIZE + 2 * (1 << CDC_AVG_BITS));
+
+    /* boundaries are content defined: after a few bytes are inserted at
+     * the front, the chunking resynchronizes on the same cuts */
+    std::vector<uint8_t> b(a);
+    b.insert(b.begin(), 13, 0x5a);
+    off = 0;
+    size_t same = 0;
+    while (off < b.size()) {
+        off += cdc_next_chunk(&b[off], b.size() - off);
+        for (size_t c : cuts) {
+            if (c + 13 == off) {
+                same++;
+                break;
+            }
+        }
+    }
+    CHECK(same + 3 >= num);
+
+    /* zeroes never hit the boundary condition, chunks are the maximum */
+    std::vector<uint8_t> z(3 * CDC_MAX_SIZE, 0);
+    CHECK(cdc_next_chunk(z.data(), z.size()) == CDC_MAX_SIZE);
+    CHECK(cdc_next_chunk(z.data(), 100) == 100);
+
+    /* the hash depends on every byte and on the length */
+    chunk_hash_t h = chunk_hash(a.data(), 4097);
+    CHECK(h == chunk_hash(a.data(), 4097));
+    CHECK(!(h == chunk_hash(a.data(), 4096)));
+    a[4000] ^= 1;
+    CHECK(!(h == chunk_hash(a.data(), 4097)));
+}
+
+static void snapshot(ChunkStore &s, uint32_t kernel_id,
+                     const std::vector<uint8_t> &data) {
+    std::vector<manifest_alloc_t> m(1);
+    m[0].number = 0;
+    m[0].addr = 0x7f0000000000;
+    m[0].size = data.size();
+    CHECK(s.put(data.data(), data.size(), m[0].chunks));
+    CHECK(s.write_manifest(kernel_id, m));
+}
+
+static void check_restore(ChunkStore &s, uint32_t kernel_id,
+                          const std::vector<uint8_t> &data) {
+    std::vector<manifest_alloc_t> m;
+    CHECK(s.read_manifest(kernel_id, m));
+    CHECK(m.size() == 1 && m[0].addr == 0x7f0000000000 &&
+          m[0].size == data.size());
+    std::vector<uint8_t> out;
+    CHECK(s.restore(m[0], out));
+    CHECK(out == data);
+}
+
+static void test_store(const std::string &dir) {
+    ChunkStore s;
+    CHECK(s.open(dir.c_str()));
+
+    /* 8 MB, a quarter zeroes (compressible) and the rest random */
+    std::vector<uint8_t> a = random_bytes(8 << 20, 2);
+    memset(a.data(), 0, 2 << 20);
+    snapshot(s, 0, a);
+    uint64_t first = s.get_bytes_out();
+    CHECK(first < a.size() * 3 / 4 + (1 << 20));
+
+    /* the same data again: nothing new is written */
+    snapshot(s, 1, a);
+    CHECK(s.get_bytes_out() == first);
+
+    /* a 1 KB change only rewrites the chunks around it */
+    std::vector<uint8_t> b(a);
+    for (int i = 0; i < 1024; i++) b[5000000 + i] ^= 0xff;
+    snapshot(s, 2, b);
+    uint64_t delta = s.get_bytes_out() - first;
+    CHECK(delta > 0 && delta <= 2 * CDC_MAX_SIZE);
+
+    /* 77 bytes inserted in the middle: the data after them moves but its
+     * chunks are found again */
+    std::vector<uint8_t> c(b);
+    c.insert(c.begin() + 3000000, 77, 5);
+    uint64_t before = s.get_bytes_out();
+    snapshot(s, 3, c);
+    CHECK(s.get_bytes_out() - before <= 2 * CDC_MAX_SIZE);
+
+    CHECK(s.get_bytes_in() == 3 * a.size() + c.size());
+
+    check_restore(s, 0, a);
+    check_restore(s, 2, b);
+    check_restore(s, 3, c);
+    s.close();
+
+    /* the snapshots can be read by another process */
+    ChunkStore r;
+    CHECK(r.open_read(dir.c_str()));
+    check_restore(r, 1, a);
+    check_restore(r, 3, c);
+    std::vector<manifest_alloc_t> m;
+    CHECK(!r.read_manifest(4, m));
+
+    /* a reference that does not match the pack is refused */
+    CHECK(r.read_manifest(2, m));
+    std::vector<uint8_t> out(m[0].chunks[0].size);
+    chunk_ref_t bad = m[0].chunks[0];
+    bad.hash.lo ^= 1;
+    CHECK(!r.get(bad, out.data()));
+    bad = m[0].chunks[0];
+    bad.size--;
+    CHECK(!r.get(bad, out.data()));
+    bad = m[0].chunks[0];
+    bad.offset += 1;
+    CHECK(!r.get(bad, out.data()));
+    CHECK(r.get(m[0].chunks[0], out.data()));
+    r.close();
+}
+
+/* a new run in the same directory truncates the pack, so the manifests of
+ * the earlier run must not survive */
+static void test_reopen(const std::string &dir) {
+    CHECK(exists(dir + "/0.manifest") && exists(dir + "/3.manifest"));
+    /* other files are left alone */
+    FILE *f = fopen((dir + "/notes.txt").c_str(), "w");
+    CHECK(f != NULL);
+    fclose(f);
+
+    ChunkStore s;
+    CHECK(s.open(dir.c_str()));
+    for (int k = 0; k < 4; k++) {
+        CHECK(!exists(s.manifest_path(k)));
+    }
+    CHECK(exists(dir + "/notes.txt"));
+
+    std::vector<uint8_t> a = random_bytes(1 << 20, 3);
+    snapshot(s, 7, a);
+    /* the index was reset with the pack, everything is written again */
+    CHECK(s.get_bytes_in() == a.size() && s.get_bytes_out() > a.size());
+    check_restore(s, 7, a);
+    s.close();
+
+    ChunkStore bad;
+    CHECK(!bad.open((dir + "/notes.txt/sub").c_str()));
+}
+
+int main() {
+    char tmpl[] = "/tmp/test_chunk_store_XXXXXX";
+    CHECK(mkdtemp(tmpl) != NULL);
+    std::string dir = std::string(tmpl) + "/ckpt";
+
+    test_chunking();
+    test_store(dir);
+    test_reopen(dir);
+
+    remove_dir(dir);
+    rmdir(tmpl);
+    return host_test_done("test_chunk_store");
+}
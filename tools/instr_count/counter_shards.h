@@ -0,0 +1,66 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "utils/host_device.h"
+
+/* Layout of a sharded instruction counter: num_shards uint64_t counters, each
+ * one on its own cache line so warps of different shards never hit the same
+ * line. Warps pick the shard of the SM they run on, and the host adds the
+ * shards up once the kernel is done. With a single shard the layout is just
+ * one counter, as it was before sharding. */
+
+/* bytes between two consecutive shards */
+#define COUNTER_SHARD_ALIGN 128
+#define COUNTER_SHARD_STRIDE (COUNTER_SHARD_ALIGN / sizeof(uint64_t))
+
+/* number of uint64_t taken by a counter made of num_shards shards */
+HOST_DEVICE_INLINE uint32_t counter_shards_words(uint32_t num_shards) {
+    return num_shards <= 1 ? 1 : num_shards * COUNTER_SHARD_STRIDE;
+}
+
+/* index of the uint64_t counting for the given SM */
+HOST_DEVICE_INLINE uint32_t counter_shard_index(uint32_t smid,
+                                                uint32_t num_shards) {
+    return num_shards <= 1 ? 0 : (smid % num_shards) * COUNTER_SHARD_STRIDE;
+}
+
+/* sum of all the shards of a counter */
+HOST_DEVICE_INLINE uint64_t counter_shards_reduce(const uint64_t *counter,
+                                                  uint32_t num_shards) {
+    if (num_shards <= 1) {
+        return counter[0];
+    }
+    uint64_t sum = 0;
+    for (uint32_t s = 0; s < num_shards; s++) {
+        sum += counter[s * COUNTER_SHARD_STRIDE];
+    }
+    return sum;
+}
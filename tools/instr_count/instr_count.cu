@@ -44,15 +44,48 @@
 /* provide some __device__ functions */
 #include "utils/utils.h"
 
+/* for in launch order reporting of asynchronously completed kernels */
+#include "utils/launch_collector.h"
+
+/* layout of the sharded kernel instruction counters */
+#include "counter_shards.h"
+
 /* kernel id counter, maintained in system memory */
 uint32_t kernel_id = 0;
 
 /* total instruction counter, maintained in system memory, incremented by
- * "counter" every time a kernel completes  */
+ * the kernel counter every time a kernel completes (only touched by the
+ * collector thread) */
 uint64_t tot_app_instrs = 0;
 
-/* kernel instruction counter, updated by the GPU */
-__managed__ uint64_t counter = 0;
+/* kernel instruction counters, updated by the GPU. Every launch in flight
+ * owns one slot, whose address is passed to the instrumentation function
+ * with nvbit_set_at_launch, so kernels running concurrently on different
+ * streams do not "corrupt" each other counter. When a kernel completes its
+ * slot is copied to host_counters on the launch stream. Each slot is made
+ * of num_shards cache line padded counters (see counter_shards.h), so the
+ * warps of different SMs do not all update the same address. */
+#define NUM_COUNTER_SLOTS 64
+uint64_t *dev_counters;
+uint64_t *host_counters;
+SlotPool counter_slots;
+uint32_t slot_words;
+
+/* per launch context, from the launch until it is reported */
+struct launch_t {
+    uint32_t kernel_id;
+    int slot;
+    int num_ctas;
+    std::string func_name;
+    LaunchCollector<launch_t>::handle_t handle;
+};
+
+/* reports completed launches in launch order */
+LaunchCollector<launch_t> collector;
+
+/* launch issued by the calling thread, between the entry and the exit
+ * callback of the launch */
+static __thread launch_t *curr_launch = NULL;
 
 /* global control variables for this tool */
 uint32_t instr_begin_interval = 0;
@@ -62,10 +95,14 @@ uint32_t ker_end_interval = UINT32_MAX;
 int verbose = 0;
 int count_warp_level = 1;
 int exclude_pred_off = 0;
+int num_shards = 0;
 
-/* a pthread mutex, used to prevent multiple kernels to run concurrently and
- * therefore to "corrupt" the counter variable */
-pthread_mutex_t mutex;
+/* a pthread mutex, held from the entry to the exit callback of a launch:
+ * nvbit_set_at_launch and nvbit_enable_instrumented are per function, so a
+ * launch of the same function from another thread must not change them
+ * before the launch happens. It also keeps the kernel ids and the collector
+ * submissions in the same order. The launches themselves stay asynchronous */
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* instrumentation function that we want to inject, please note the use of
  * 1. "extern "C" __device__ __noinline__" to prevent code elimination by the
@@ -73,7 +110,9 @@ pthread_mutex_t mutex;
  * 2. NVBIT_EXPORT_FUNC(count_instrs) to notify nvbit the name of the function
  * we want to inject. This name must match exactly the function name */
 extern "C" __device__ __noinline__ void count_instrs(int predicate,
-                                                     int count_warp_level) {
+                                                     int count_warp_level,
+                                                     int num_shards,
+                                                     uint64_t pcounter) {
     /* all the active threads will compute the active mask */
     const int active_mask = __ballot(1);
     /* compute the predicate mask */
@@ -84,13 +123,17 @@ extern "C" __device__ __noinline__ void count_instrs(int predicate,
     const int first_laneid = __ffs(active_mask) - 1;
     /* count all the active thread */
     const int num_threads = __popc(predicate_mask);
-    /* only the first active thread will perform the atomic */
+    /* only the first active thread will perform the atomic, on the shard
+     * of the SM it is running on */
     if (first_laneid == laneid) {
+        unsigned long long *counter =
+            (unsigned long long *)pcounter +
+            counter_shard_index(get_smid(), num_shards);
         if (count_warp_level) {
             /* num threads can be zero when accounting for predicates off */
-            if (num_threads > 0) atomicAdd((unsigned long long *)&counter, 1);
+            if (num_threads > 0) atomicAdd(counter, 1);
         } else {
-            atomicAdd((unsigned long long *)&counter, num_threads);
+            atomicAdd(counter, num_threads);
         }
     }
 }
@@ -122,6 +165,9 @@ void nvbit_at_init() {
                 "Count warp level or thread level instructions");
     GET_VAR_INT(exclude_pred_off, "EXCLUDE_PRED_OFF", 0,
                 "Exclude predicated off instruction from count");
+    GET_VAR_INT(num_shards, "COUNTER_SHARDS", 0,
+                "Number of cache line padded shards of the kernel counter, 0 "
+                "one per SM, 1 a single counter");
     GET_VAR_INT(verbose, "TOOL_VERBOSE", 0, "Enable verbosity inside the tool");
     std::string pad(100, '-');
     printf("%s\n", pad.c_str());
@@ -166,10 +212,50 @@ void nvbit_at_function_first_load(CUcontext ctx, CUfunction func) {
 
             /* add count warps option */
             nvbit_add_call_arg_const_val32(i, count_warp_level);
+
+            /* add number of counter shards */
+            nvbit_add_call_arg_const_val32(i, num_shards);
+
+            /* add pointer to the counter slot of the launch */
+            nvbit_add_call_arg_launch_val64(i, 0);
         }
     }
 }
 
+/* stream on which the launch described by cbid/params is issued */
+cudaStream_t get_launch_stream(nvbit_api_cuda_t cbid, void *params) {
+    if (cbid == API_CUDA_cuLaunchKernel_ptsz) {
+        cuLaunchKernel_ptsz_params *p = (cuLaunchKernel_ptsz_params *)params;
+        return p->hStream != NULL ? p->hStream : cudaStreamPerThread;
+    } else if (cbid == API_CUDA_cuLaunchKernel) {
+        return ((cuLaunchKernel_params *)params)->hStream;
+    } else if (cbid == API_CUDA_cuLaunchGridAsync) {
+        return ((cuLaunchGridAsync_params *)params)->hStream;
+    }
+    return 0;
+}
+
+/* stream callback, the kernel and the copy of its counter slot are done */
+void CUDART_CB launch_done(cudaStream_t stream, cudaError_t status,
+                           void *data) {
+    launch_t *l = (launch_t *)data;
+    collector.complete(l->handle);
+}
+
+/* called by the collector thread, in launch order */
+void report_launch(launch_t *l) {
+    uint64_t counter = counter_shards_reduce(
+        &host_counters[(size_t)l->slot * slot_words], num_shards);
+    tot_app_instrs += counter;
+    printf(
+        "kernel %d - %s - #thread-blocks %d,  kernel "
+        "instructions %ld, total instructions %ld\n",
+        l->kernel_id, l->func_name.c_str(), l->num_ctas, counter,
+        tot_app_instrs);
+    counter_slots.release(l->slot);
+    delete l;
+}
+
 /* This call-back is triggered every time a CUDA driver call is encountered.
  * Here we can look for a particular CUDA driver call by checking at the
  * call back ids  which are defined in tools_cuda_api_meta.h.
@@ -185,44 +271,81 @@ void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
         /* cast params to cuLaunch_params since if we are here we know these are
          * the right parameters type */
         cuLaunch_params *p = (cuLaunch_params *)params;
+        cudaStream_t stream = get_launch_stream(cbid, params);
 
         if (!is_exit) {
             /* if we are entering in a kernel launch:
-             * 1. Lock the mutex to prevent multiple kernels to run concurrently
-             * (overriding the counter) in case the user application does that
-             * 2. Select if we want to run the instrumented or original
+             * 1. Get a counter slot for this launch (waits if too many
+             * launches are in flight) and reset it on the launch stream
+             * 2. Lock the mutex until the exit callback
+             * 3. Select if we want to run the instrumented or original
              * version of the kernel
-             * 3. Reset the kernel instruction counter */
+             * 4. Pass the slot address to the instrumentation function
+             * 5. Assign the kernel id and submit the launch to the
+             * collector */
+            launch_t *l = new launch_t;
+            l->slot = counter_slots.acquire();
+            l->func_name = nvbit_get_func_name(ctx, p->f);
+            l->num_ctas = 0;
+            if (cbid == API_CUDA_cuLaunchKernel_ptsz ||
+                cbid == API_CUDA_cuLaunchKernel) {
+                cuLaunchKernel_params *p2 = (cuLaunchKernel_params *)params;
+                l->num_ctas = p2->gridDimX * p2->gridDimY * p2->gridDimZ;
+            }
+            uint64_t *pcounter = &dev_counters[(size_t)l->slot * slot_words];
+            CUDA_SAFECALL(cudaMemsetAsync(
+                pcounter, 0, sizeof(uint64_t) * slot_words, stream));
 
             pthread_mutex_lock(&mutex);
-            if (kernel_id >= ker_begin_interval &&
-                kernel_id < ker_end_interval) {
+            nvbit_set_at_launch(ctx, p->f, &pcounter, sizeof(pcounter));
+            l->kernel_id = kernel_id++;
+            if (l->kernel_id >= ker_begin_interval &&
+                l->kernel_id < ker_end_interval) {
                 nvbit_enable_instrumented(ctx, p->f, true);
             } else {
                 nvbit_enable_instrumented(ctx, p->f, false);
             }
-            counter = 0;
+            l->handle = collector.submit(l);
+            curr_launch = l;
         } else {
             /* if we are exiting a kernel launch:
-             * 1. Wait until the kernel is completed using
-             * cudaDeviceSynchronize()
-             * 2. Get number of thread blocks in the kernel
-             * 3. Print the thread instruction counters
-             * 4. Release the lock*/
-            CUDA_SAFECALL(cudaDeviceSynchronize());
-            tot_app_instrs += counter;
-            int num_ctas = 0;
-            if (cbid == API_CUDA_cuLaunchKernel_ptsz ||
-                cbid == API_CUDA_cuLaunchKernel) {
-                cuLaunchKernel_params *p2 = (cuLaunchKernel_params *)params;
-                num_ctas = p2->gridDimX * p2->gridDimY * p2->gridDimZ;
-            }
-            printf(
-                "kernel %d - %s - #thread-blocks %d,  kernel "
-                "instructions %ld, total instructions %ld\n",
-                kernel_id++, nvbit_get_func_name(ctx, p->f), num_ctas, counter,
-                tot_app_instrs);
+             * 1. Copy the counter slot back once the kernel is done, on the
+             * launch stream, so other streams keep running
+             * 2. Hand the launch to the collector thread when the copy is
+             * done, which prints the counters in launch order
+             * 3. Unlock the mutex */
+            launch_t *l = curr_launch;
+            curr_launch = NULL;
+            assert(l != NULL);
+            size_t offset = (size_t)l->slot * slot_words;
+            CUDA_SAFECALL(cudaMemcpyAsync(&host_counters[offset],
+                                          &dev_counters[offset],
+                                          sizeof(uint64_t) * slot_words,
+                                          cudaMemcpyDeviceToHost, stream));
+            CUDA_SAFECALL(cudaStreamAddCallback(stream, launch_done, l, 0));
             pthread_mutex_unlock(&mutex);
         }
     }
 }
+
+void nvbit_at_ctx_init(CUcontext ctx) {
+    /* one shard per SM by default, functions are instrumented after the
+     * context is created so num_shards is final by then */
+    if (num_shards == 0) {
+        int device;
+        CUDA_SAFECALL(cudaGetDevice(&device));
+        CUDA_SAFECALL(cudaDeviceGetAttribute(
+            &num_shards, cudaDevAttrMultiProcessorCount, device));
+    }
+    slot_words = counter_shards_words(num_shards);
+    size_t nbytes = sizeof(uint64_t) * slot_words * NUM_COUNTER_SLOTS;
+    CUDA_SAFECALL(cudaMalloc((void **)&dev_counters, nbytes));
+    CUDA_SAFECALL(cudaMallocHost((void **)&host_counters, nbytes));
+    counter_slots.init(NUM_COUNTER_SLOTS);
+    collector.start(report_launch);
+}
+
+void nvbit_at_ctx_term(CUcontext ctx) {
+    /* print whatever is still in flight */
+    collector.stop();
+}
@@ -0,0 +1,111 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host test of the sharded kernel counter layout (counter_shards.h): the
+ * size and placement of the shards, and the reduction of a counter updated
+ * concurrently by threads standing in for warps running on different SMs. */
+
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "counter_shards.h"
+#include "utils/host_test.h"
+
+static void test_layout() {
+    /* a single shard (or sharding disabled) is the plain counter */
+    for (uint32_t n = 0; n <= 1; n++) {
+        CHECK(counter_shards_words(n) == 1);
+        for (uint32_t smid = 0; smid < 100; smid++) {
+            CHECK(counter_shard_index(smid, n) == 0);
+        }
+    }
+
+    for (uint32_t n = 2; n <= 132; n++) {
+        uint32_t words = counter_shards_words(n);
+        CHECK(words * sizeof(uint64_t) == n * COUNTER_SHARD_ALIGN);
+        std::vector<int> hits(n, 0);
+        for (uint32_t smid = 0; smid < 3 * n; smid++) {
+            uint32_t idx = counter_shard_index(smid, n);
+            /* inside the counter and at the start of a cache line */
+            CHECK(idx < words);
+            CHECK(idx * sizeof(uint64_t) % COUNTER_SHARD_ALIGN == 0);
+            hits[idx / COUNTER_SHARD_STRIDE]++;
+        }
+        /* SMs past num_shards wrap around evenly */
+        for (uint32_t s = 0; s < n; s++) {
+            CHECK(hits[s] == 3);
+        }
+    }
+}
+
+static void test_reduce() {
+    uint64_t counter[1] = {42};
+    CHECK(counter_shards_reduce(counter, 0) == 42);
+    CHECK(counter_shards_reduce(counter, 1) == 42);
+
+    /* only the first word of each shard counts, the padding is ignored */
+    const uint32_t n = 5;
+    std::vector<uint64_t> c(counter_shards_words(n), 0xdeadbeef);
+    uint64_t expected = 0;
+    for (uint32_t s = 0; s < n; s++) {
+        c[counter_shard_index(s, n)] = s * 1000 + 1;
+        expected += s * 1000 + 1;
+    }
+    CHECK(counter_shards_reduce(c.data(), n) == expected);
+}
+
+/* threads stand in for warps, each one adding its instruction counts to the
+ * shard of "its" SM with an atomic, as count_instrs does */
+static void test_concurrent() {
+    const int num_sms = 16, num_warps = 64, iters = 20000;
+    for (uint32_t n = 1; n <= 32; n *= 2) {
+        std::vector<uint64_t> c(counter_shards_words(n), 0);
+        std::vector<std::thread> warps;
+        for (int w = 0; w < num_warps; w++) {
+            warps.emplace_back([&c, n, w]() {
+                uint32_t smid = w % num_sms;
+                uint64_t *shard = &c[counter_shard_index(smid, n)];
+                for (int i = 0; i < iters; i++) {
+                    __atomic_fetch_add(shard, (uint64_t)(w + 1),
+                                       __ATOMIC_RELAXED);
+                }
+            });
+        }
+        for (auto &t : warps) t.join();
+        uint64_t expected = (uint64_t)iters * num_warps * (num_warps + 1) / 2;
+        CHECK(counter_shards_reduce(c.data(), n) == expected);
+    }
+}
+
+int main() {
+    test_layout();
+    test_reduce();
+    test_concurrent();
+    return host_test_done("test_counter_shards");
+}
@@ -0,0 +1,250 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host test of the asynchronous launch reporting (utils/launch_collector.h)
+ * with threads as a fake completion source: launches completed in shuffled
+ * order from several threads are reported in submit order and only once
+ * they and all the earlier ones are done, stop() drains what is still in
+ * flight, and SlotPool::acquire() blocks until a slot is released. */
+
+#include <sched.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "utils/host_test.h"
+#include "utils/launch_collector.h"
+
+typedef struct {
+    uint32_t id;
+    int slot;
+    std::atomic<bool> completed;
+} launch_t;
+
+/* what the report function saw, only touched by the collector thread until
+ * stop() returns */
+static std::vector<uint32_t> reported;
+static bool reported_early = false;
+static std::vector<launch_t *> all_launches;
+
+/* slots in use, for the SlotPool cases */
+static SlotPool slots;
+static std::vector<std::atomic<int> > slot_users(4);
+
+static void report(launch_t *l) {
+    /* this launch and every one before it are completed */
+    for (uint32_t i = 0; i <= l->id; i++) {
+        if (!all_launches[i]->completed) reported_early = true;
+    }
+    reported.push_back(l->id);
+}
+
+static void report_release(launch_t *l) {
+    report(l);
+    slot_users[l->slot]--;
+    slots.release(l->slot);
+}
+
+static void reset(uint32_t n) {
+    for (auto l : all_launches) delete l;
+    all_launches.clear();
+    reported.clear();
+    reported_early = false;
+    for (uint32_t i = 0; i < n; i++) {
+        launch_t *l = new launch_t;
+        l->id = i;
+        l->slot = -1;
+        l->completed = false;
+        all_launches.push_back(l);
+    }
+}
+
+static void check_reported(uint32_t n) {
+    CHECK(!reported_early);
+    CHECK(reported.size() == n);
+    for (uint32_t i = 0; i < reported.size(); i++) {
+        CHECK(reported[i] == i);
+    }
+}
+
+/* all launches submitted up front, completed in shuffled order by
+ * num_threads threads */
+static void test_shuffled(uint32_t n, int num_threads) {
+    reset(n);
+    LaunchCollector<launch_t> collector;
+    collector.start(report);
+    std::vector<LaunchCollector<launch_t>::handle_t> handles;
+    for (auto l : all_launches) {
+        handles.push_back(collector.submit(l));
+    }
+    std::vector<uint32_t> order(n);
+    for (uint32_t i = 0; i < n; i++) order[i] = i;
+    std::shuffle(order.begin(), order.end(), std::mt19937(n));
+
+    std::vector<std::thread> completers;
+    for (int t = 0; t < num_threads; t++) {
+        completers.emplace_back([&, t]() {
+            for (uint32_t i = t; i < n; i += num_threads) {
+                all_launches[order[i]]->completed = true;
+                collector.complete(handles[order[i]]);
+                if (i % 16 == 0) sched_yield();
+            }
+        });
+    }
+    for (auto &c : completers) c.join();
+    collector.drain();
+    check_reported(n);
+    collector.stop();
+    check_reported(n);
+}
+
+/* nothing is reported while the first launch is still running */
+static void test_head_of_line() {
+    reset(3);
+    LaunchCollector<launch_t> collector;
+    collector.start(report);
+    std::vector<LaunchCollector<launch_t>::handle_t> h;
+    for (auto l : all_launches) h.push_back(collector.submit(l));
+    for (int i = 2; i >= 1; i--) {
+        all_launches[i]->completed = true;
+        collector.complete(h[i]);
+    }
+    for (int i = 0; i < 1000; i++) sched_yield();
+    CHECK(reported.empty());
+    all_launches[0]->completed = true;
+    collector.complete(h[0]);
+    collector.drain();
+    check_reported(3);
+    collector.stop();
+}
+
+/* stop() right after the launches are submitted waits for them */
+static void test_stop_drains() {
+    const uint32_t n = 50;
+    reset(n);
+    LaunchCollector<launch_t> collector;
+    collector.start(report);
+    std::vector<LaunchCollector<launch_t>::handle_t> h;
+    for (auto l : all_launches) h.push_back(collector.submit(l));
+    std::thread late([&]() {
+        for (int i = 0; i < 200; i++) sched_yield();
+        for (int i = n - 1; i >= 0; i--) {
+            all_launches[i]->completed = true;
+            collector.complete(h[i]);
+        }
+    });
+    collector.stop();
+    check_reported(n);
+    late.join();
+
+    /* stopping with nothing submitted, or twice, is fine */
+    LaunchCollector<launch_t> idle;
+    idle.start(report);
+    idle.stop();
+    idle.stop();
+}
+
+static void test_slot_pool() {
+    slots.init(2);
+    CHECK(slots.get_num_slots() == 2);
+    int a = slots.acquire(), b = slots.acquire();
+    CHECK(a != b && a >= 0 && a < 2 && b >= 0 && b < 2);
+
+    std::atomic<int> got(-1);
+    std::thread waiter([&]() { got = slots.acquire(); });
+    for (int i = 0; i < 1000; i++) sched_yield();
+    CHECK(got == -1);
+    slots.release(b);
+    waiter.join();
+    CHECK(got == b);
+    slots.release(a);
+    slots.release(b);
+}
+
+/* the tools' pattern: acquire a slot at launch, release it in the report,
+ * launches complete out of order on a fake stream thread */
+static void test_bounded_in_flight() {
+    const uint32_t n = 2000;
+    const int num_slots = 4;
+    reset(n);
+    slots.init(num_slots);
+    for (auto &u : slot_users) u = 0;
+    LaunchCollector<launch_t> collector;
+    collector.start(report_release);
+
+    std::mutex m;
+    std::vector<std::pair<launch_t *, LaunchCollector<launch_t>::handle_t> >
+        in_flight;
+    bool overused = false;
+    std::thread gpu([&]() {
+        std::mt19937 rng(3);
+        uint32_t done = 0;
+        while (done < n) {
+            std::unique_lock<std::mutex> g(m);
+            if (in_flight.empty()) {
+                g.unlock();
+                sched_yield();
+                continue;
+            }
+            size_t i = rng() % in_flight.size();
+            auto x = in_flight[i];
+            in_flight.erase(in_flight.begin() + i);
+            g.unlock();
+            x.first->completed = true;
+            collector.complete(x.second);
+            done++;
+        }
+    });
+    for (auto l : all_launches) {
+        l->slot = slots.acquire();
+        if (++slot_users[l->slot] != 1) overused = true;
+        auto h = collector.submit(l);
+        std::lock_guard<std::mutex> g(m);
+        in_flight.push_back(std::make_pair(l, h));
+    }
+    gpu.join();
+    collector.stop();
+    CHECK(!overused);
+    check_reported(n);
+    for (auto &u : slot_users) CHECK(u == 0);
+}
+
+int main() {
+    test_shuffled(1, 1);
+    test_shuffled(1000, 4);
+    test_shuffled(5000, 3);
+    test_head_of_line();
+    test_stop_drains();
+    test_slot_pool();
+    test_bounded_in_flight();
+    reset(0);
+    return host_test_done("test_launch_collector");
+}
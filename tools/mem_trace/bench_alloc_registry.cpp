@@ -0,0 +1,153 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host benchmark of the allocation registry (utils/alloc_registry.h) as
+ * mem_trace uses it: the addresses of the active lanes of every memory
+ * packet are looked up as a batch of up to 32. Measures lookup() one
+ * address at a time and lookup_many() per warp, for warps that access
+ * consecutive words of one allocation (what the one entry cache is for)
+ * and warps whose lanes hit random addresses, with a growing number of
+ * live allocations. The ids are checked against a binary search.
+ *
+ * usage: bench_alloc_registry [M lookups per run] */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "utils/alloc_registry.h"
+
+#define WARP_SIZE 32
+
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+} range_t;
+
+/* reference: id of the allocation holding addr in the sorted ranges,
+ * allocations are added in address order so the index is the id */
+static int32_t reference_id(const std::vector<range_t> &ranges,
+                            uint64_t addr) {
+    auto it = std::upper_bound(
+        ranges.begin(), ranges.end(), addr,
+        [](uint64_t a, const range_t &r) { return a < r.base; });
+    if (it == ranges.begin()) {
+        return ALLOC_ID_NONE;
+    }
+    --it;
+    return addr - it->base < it->size ? (int32_t)(it - ranges.begin())
+                                      : ALLOC_ID_NONE;
+}
+
+/* addresses of num_warps warp accesses, coalesced ones walk an allocation
+ * with consecutive 4 byte words, random ones spread their lanes over the
+ * whole address range (gaps between allocations included) */
+static std::vector<uint64_t> make_addrs(const std::vector<range_t> &ranges,
+                                        size_t num_warps, bool coalesced,
+                                        std::mt19937_64 &rng) {
+    std::vector<uint64_t> addrs(num_warps * WARP_SIZE);
+    uint64_t lo = ranges.front().base;
+    uint64_t hi = ranges.back().base + ranges.back().size;
+    for (size_t w = 0; w < num_warps; w++) {
+        /* a few consecutive warps work on the same allocation */
+        const range_t &r = ranges[(w / 16) % ranges.size()];
+        uint64_t start = r.base + (w * WARP_SIZE * 4) % r.size;
+        for (int l = 0; l < WARP_SIZE; l++) {
+            addrs[w * WARP_SIZE + l] =
+                coalesced ? r.base + (start - r.base + 4 * l) % r.size
+                          : lo + rng() % (hi - lo);
+        }
+    }
+    return addrs;
+}
+
+static bool run(int num_allocs, bool coalesced, size_t num_lookups) {
+    std::mt19937_64 rng(num_allocs);
+    AllocRegistry registry;
+    std::vector<range_t> ranges;
+    uint64_t p = 0x7f0000000000ull;
+    for (int i = 0; i < num_allocs; i++) {
+        range_t r = {p, (rng() % (1 << 20)) + 256};
+        ranges.push_back(r);
+        registry.add(r.base, r.size);
+        /* allocations are 512 byte aligned with gaps between them */
+        p = (p + r.size + rng() % 8192 + 511) & ~511ull;
+    }
+    std::vector<uint64_t> addrs =
+        make_addrs(ranges, num_lookups / WARP_SIZE, coalesced, rng);
+
+    /* one at a time */
+    std::vector<int32_t> ids(addrs.size());
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < addrs.size(); i++) {
+        alloc_info_t info;
+        ids[i] = registry.lookup(addrs[i], &info) ? info.id : ALLOC_ID_NONE;
+    }
+    auto t1 = std::chrono::steady_clock::now();
+
+    /* a warp at a time */
+    std::vector<int32_t> batch_ids(addrs.size());
+    for (size_t i = 0; i < addrs.size(); i += WARP_SIZE) {
+        registry.lookup_many(&addrs[i], WARP_SIZE, &batch_ids[i]);
+    }
+    auto t2 = std::chrono::steady_clock::now();
+
+    bool ok = ids == batch_ids;
+    size_t hits = 0;
+    for (size_t i = 0; ok && i < addrs.size(); i++) {
+        ok = ids[i] == reference_id(ranges, addrs[i]);
+        hits += ids[i] != ALLOC_ID_NONE;
+    }
+
+    double single = std::chrono::duration<double>(t1 - t0).count();
+    double batch = std::chrono::duration<double>(t2 - t1).count();
+    printf("%6d allocs %-9s: lookup %7.1f M/s, lookup_many %7.1f M/s, "
+           "%5.1f%% hits%s\n",
+           num_allocs, coalesced ? "coalesced" : "random",
+           addrs.size() / single / 1e6, addrs.size() / batch / 1e6,
+           100.0 * hits / addrs.size(), ok ? "" : "  ERROR");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    double m = argc > 1 ? atof(argv[1]) : 4;
+    if (m <= 0) {
+        fprintf(stderr, "usage: %s [M lookups per run]\n", argv[0]);
+        return 1;
+    }
+    size_t num_lookups = (size_t)(m * 1e6) / WARP_SIZE * WARP_SIZE;
+    bool ok = true;
+    for (int n = 16; n <= 65536; n *= 16) {
+        ok &= run(n, true, num_lookups);
+        ok &= run(n, false, num_lookups);
+    }
+    return ok ? 0 : 1;
+}
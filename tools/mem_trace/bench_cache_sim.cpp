@@ -0,0 +1,140 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* Host benchmark of the cache simulator of mem_trace (cache_sim.h) on the
+ * packet path the tool and mem_trace_cachesim use, with the default L1 and
+ * L2 configurations of the tool, LRU and PLRU. The warps are coalesced (4
+ * sectors per packet), scattered (32 sectors per packet) or a mix of both
+ * (one packet out of 8 scattered), over 16 SMs. Reports the lane accesses
+ * and the sector requests simulated per second and fails if the mix runs
+ * below CACHE_SIM_TARGET lane accesses/s, the rate the simulator is meant
+ * to keep up with (built with -O3).
+ *
+ * usage: bench_cache_sim [K packets] */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "cache_sim.h"
+#include "mem_packet.h"
+
+#define CACHE_SIM_TARGET 10e6
+#define NUM_SMS 16
+
+enum { COALESCED, SCATTERED, MIXED };
+
+static std::vector<uint8_t> generate(int pattern, uint64_t num_packets) {
+    std::mt19937_64 rng(pattern);
+    std::vector<uint8_t> data;
+    uint8_t buf[MEM_PACKET_MAX_SIZE];
+    mem_packet_t *p = (mem_packet_t *)buf;
+    for (uint64_t i = 0; i < num_packets; i++) {
+        memset(p, 0, sizeof(*p));
+        bool scattered =
+            pattern == SCATTERED || (pattern == MIXED && rng() % 8 == 0);
+        /* the coalesced warps reuse 1MB, which fits in the L2 only, the
+         * scattered ones touch 4MB */
+        uint64_t base = 0x7f0000000000ull + (rng() % (1 << 18)) * 4;
+        uint64_t addrs[32];
+        for (int lane = 0; lane < 32; lane++) {
+            addrs[lane] = scattered
+                              ? base + (rng() % (1 << 20)) * 4
+                              : (base & ~127ull) + 4 * lane;
+        }
+        p->active_mask = 0xffffffff;
+        p->sm_id = i % NUM_SMS;
+        p->instr_id = rng() % 64;
+        p->flags = MEM_SPACE_GLOBAL | (rng() % 4 == 0 ? MEM_PACKET_STORE : 0);
+        uint32_t size = mem_packet_encode(p, addrs);
+        data.insert(data.end(), buf, buf + size);
+    }
+    return data;
+}
+
+/* lane accesses per second */
+static double run(const char *name, const char *policy,
+                  const std::vector<uint8_t> &data, uint64_t num_packets) {
+    std::string l1 = std::string("131072:4:128:32:") + policy;
+    std::string l2 = std::string("4194304:16:128:32:") + policy + ":wa";
+    cache_config_t l1_config, l2_config;
+    if (!cache_parse_config(l1.c_str(), &l1_config) ||
+        !cache_parse_config(l2.c_str(), &l2_config)) {
+        return 0;
+    }
+    CacheSim sim;
+    sim.init(l1_config, l2_config);
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t off = 0;
+    while (off < data.size()) {
+        const mem_packet_t *p = (const mem_packet_t *)&data[off];
+        sim.add_packet(p);
+        off += mem_packet_size(p);
+    }
+    double s = std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - start)
+                   .count();
+    CacheSim::stats_t t = sim.get_kernel_stats();
+    double accesses = 32.0 * num_packets / s;
+    printf("%-10s %-4s %8.1f M accesses/s %8.1f M requests/s  L1 hits "
+           "%5.1f%%  L2 hits %5.1f%%\n",
+           name, policy, accesses / 1e6, t.l1_requests / s / 1e6,
+           100.0 * t.l1_hits / t.l1_requests,
+           100.0 * t.l2_hits / t.l2_requests);
+    return accesses;
+}
+
+int main(int argc, char **argv) {
+    uint64_t num_packets = (argc > 1 ? strtoull(argv[1], NULL, 0) : 512)
+                           << 10;
+    if (num_packets == 0) {
+        fprintf(stderr, "usage: %s [K packets]\n", argv[0]);
+        return 1;
+    }
+    printf("%lu packets per run, %d SMs\n", (unsigned long)num_packets,
+           NUM_SMS);
+
+    const char *names[] = {"coalesced", "scattered", "mixed"};
+    bool ok = true;
+    for (int pattern = COALESCED; pattern <= MIXED; pattern++) {
+        std::vector<uint8_t> data = generate(pattern, num_packets);
+        for (const char *policy : {"lru", "plru"}) {
+            double rate = run(names[pattern], policy, data, num_packets);
+            if (pattern == MIXED && rate < CACHE_SIM_TARGET) {
+                printf("ERROR: below %.0f M accesses/s\n",
+                       CACHE_SIM_TARGET / 1e6);
+                ok = false;
+            }
+        }
+    }
+    return ok ? 0 : 1;
+}
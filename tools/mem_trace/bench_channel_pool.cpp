@@ -0,0 +1,166 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host benchmark of ChannelConsumerPool: producer threads stand in for the
+ * GPU and fill HostChannels with variable size records, the main thread
+ * pops the batches, checks that each channel is received in order and
+ * releases them. Reports the throughput for a range of consumer thread
+ * counts, copying the batches out and in place.
+ *
+ * usage: bench_channel_pool [num_channels] [MB per channel] */
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "utils/channel_pool.h"
+#include "host_channel.h"
+
+#define BUFF_SIZE (64 * 1024)
+#define NUM_BUFFS 4
+
+/* record header, followed by size - sizeof(record_t) payload bytes */
+typedef struct {
+    uint32_t seq;
+    uint32_t size;
+} record_t;
+
+/* between a bare 8 byte header and a full mem_access_t sized packet */
+static uint32_t record_size(uint32_t seq) {
+    return sizeof(record_t) + 8 * ((seq * 2654435761u) >> 27);
+}
+
+static void produce(HostChannel *ch, uint64_t nbytes) {
+    uint8_t packet[512];
+    memset(packet, 0xab, sizeof(packet));
+    uint64_t sent = 0;
+    for (uint32_t seq = 0; sent < nbytes; seq++) {
+        record_t *r = (record_t *)packet;
+        r->seq = seq;
+        r->size = record_size(seq);
+        ch->push(packet, r->size);
+        sent += r->size;
+    }
+    ch->flush();
+}
+
+/* walks the records of a batch, returns false on a sequence error */
+static bool check_batch(const channel_batch_t *b, uint32_t *next_seq) {
+    uint32_t off = 0;
+    while (off < b->nbytes) {
+        record_t r;
+        memcpy(&r, b->data + off, sizeof(r));
+        if (r.seq != *next_seq || r.size != record_size(r.seq)) {
+            return false;
+        }
+        (*next_seq)++;
+        off += r.size;
+    }
+    return off == b->nbytes;
+}
+
+static bool run(int num_channels, int num_threads, bool in_place,
+                uint64_t nbytes_per_channel) {
+    std::vector<HostChannel> channels(num_channels);
+    std::vector<HostChannel *> ptrs(num_channels);
+    for (int c = 0; c < num_channels; c++) {
+        channels[c].init(BUFF_SIZE, NUM_BUFFS);
+        ptrs[c] = &channels[c];
+    }
+
+    ChannelConsumerPool<HostChannel> pool;
+    pool.init(ptrs.data(), num_channels, num_threads, BUFF_SIZE,
+              4 * num_channels, in_place);
+
+    auto start = std::chrono::steady_clock::now();
+    pool.start();
+    std::vector<std::thread> producers;
+    for (int c = 0; c < num_channels; c++) {
+        producers.emplace_back(produce, &channels[c], nbytes_per_channel);
+    }
+
+    /* each producer sends whole records until it reaches nbytes */
+    std::vector<uint64_t> received(num_channels, 0);
+    std::vector<uint32_t> next_seq(num_channels, 0);
+    int done = 0;
+    uint64_t total_bytes = 0, total_records = 0;
+    bool ok = true;
+    while (done < num_channels) {
+        channel_batch_t *b = pool.pop();
+        if (b == NULL) {
+            sched_yield();
+            continue;
+        }
+        int c = b->channel_id;
+        uint32_t first = next_seq[c];
+        ok &= check_batch(b, &next_seq[c]);
+        total_records += next_seq[c] - first;
+        total_bytes += b->nbytes;
+        bool was_done = received[c] >= nbytes_per_channel;
+        received[c] += b->nbytes;
+        if (!was_done && received[c] >= nbytes_per_channel) {
+            done++;
+        }
+        pool.release(b);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    for (auto &p : producers) p.join();
+    pool.destroy();
+
+    double s = std::chrono::duration<double>(end - start).count();
+    printf("%-8s channels %3d threads %2d: %8.1f MB/s %7.2f M records/s%s\n",
+           in_place ? "in place" : "copy", num_channels,
+           pool.get_num_threads(), total_bytes / s / 1e6,
+           total_records / s / 1e6, ok ? "" : "  ORDER ERROR");
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int num_channels = argc > 1 ? atoi(argv[1]) : 8;
+    uint64_t mb = argc > 2 ? strtoull(argv[2], NULL, 0) : 8;
+    if (num_channels <= 0 || mb == 0) {
+        fprintf(stderr, "usage: %s [num_channels] [MB per channel]\n",
+                argv[0]);
+        return 1;
+    }
+    printf("%d channels, %lu MB each, %d cpus\n", num_channels,
+           (unsigned long)mb, (int)std::thread::hardware_concurrency());
+
+    bool ok = true;
+    for (int in_place = 0; in_place < 2; in_place++) {
+        for (int t = 1; t <= num_channels; t *= 2) {
+            ok &= run(num_channels, t, in_place, mb << 20);
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,271 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* Host benchmark of what mem_trace does with the packets it receives. The
+ * consumer threads validate the packets and attribute them to the
+ * allocations (process_batch in mem_trace.cu), this part is run with a
+ * growing number of threads, each on its own channels. The stages that need
+ * the packets of every channel in one place (reuse distance, cache
+ * simulation, trace file, text output) run on the receiving thread only and
+ * are timed one by one on a single thread, so the per kernel throughput of
+ * the tool is bounded by the slowest enabled one of them.
+ *
+ * The packets mix coalesced warps (strided 4B words, the common case),
+ * warps hitting random words of one allocation and broadcasts, over 16 SMs.
+ *
+ * usage: bench_recv_stages [K packets] */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "utils/alloc_registry.h"
+#include "cache_sim.h"
+#include "mem_packet.h"
+#include "reuse_distance.h"
+#include "trace_file.h"
+
+#define NUM_CHANNELS 8
+#define NUM_SMS 16
+#define NUM_ALLOCS 64
+#define ALLOC_SIZE (16ull << 20)
+#define ALLOC_BASE 0x7f0000000000ull
+
+/* packets of one channel, back to back as in a received batch */
+typedef struct {
+    std::vector<uint8_t> data;
+    uint64_t num_packets;
+} stream_t;
+
+static void generate(std::vector<stream_t> &streams, uint64_t num_packets) {
+    std::mt19937_64 rng(42);
+    uint8_t buf[MEM_PACKET_MAX_SIZE];
+    mem_packet_t *p = (mem_packet_t *)buf;
+    for (uint64_t i = 0; i < num_packets; i++) {
+        memset(p, 0, sizeof(*p));
+        uint64_t base = ALLOC_BASE + (rng() % NUM_ALLOCS) * ALLOC_SIZE;
+        uint64_t offset = (rng() % (ALLOC_SIZE / 4 - 32)) * 4;
+        uint64_t addrs[32];
+        int kind = rng() % 8;
+        for (int lane = 0; lane < 32; lane++) {
+            if (kind < 6) {
+                addrs[lane] = base + offset + 4 * lane;
+            } else if (kind < 7) {
+                addrs[lane] = base + (rng() % (ALLOC_SIZE / 4)) * 4;
+            } else {
+                addrs[lane] = base + offset;
+            }
+        }
+        p->active_mask = 0xffffffff;
+        p->sm_id = i % NUM_SMS;
+        p->cta_id_x = i % 1024;
+        p->warp_id = i % 32;
+        p->instr_id = rng() % 64;
+        p->opcode_id = p->instr_id % 4;
+        p->flags = MEM_SPACE_GLOBAL | (rng() % 4 == 0 ? MEM_PACKET_STORE : 0);
+        uint32_t size = mem_packet_encode(p, addrs);
+        stream_t &s = streams[p->sm_id % NUM_CHANNELS];
+        s.data.insert(s.data.end(), buf, buf + size);
+        s.num_packets++;
+    }
+}
+
+/* calls f on every packet of the stream */
+template <typename F>
+static void walk(const stream_t &s, F f) {
+    uint64_t off = 0;
+    while (off < s.data.size()) {
+        const mem_packet_t *p = (const mem_packet_t *)&s.data[off];
+        f(p);
+        off += mem_packet_size(p);
+    }
+}
+
+/* the consumer side: validate and count the accesses per allocation in the
+ * shard of the channel */
+static uint64_t consume(const stream_t &s, AllocRegistry &registry,
+                        std::map<int32_t, uint64_t> &shard) {
+    uint64_t off = 0, num_packets = 0;
+    while (off < s.data.size()) {
+        const mem_packet_t *p = (const mem_packet_t *)&s.data[off];
+        uint32_t size = mem_packet_validate(p, s.data.size() - off);
+        if (size == 0) {
+            break;
+        }
+        uint64_t addrs[32];
+        mem_packet_decode(p, addrs);
+        int32_t ids[32];
+        registry.lookup_many(addrs, 32, ids);
+        for (int i = 0; i < 32; i++) {
+            shard[ids[i]]++;
+        }
+        num_packets++;
+        off += size;
+    }
+    return num_packets;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+}
+
+static void report(const char *stage, uint64_t num_packets, double s) {
+    printf("%-28s %8.2f M packets/s %8.1f M accesses/s\n", stage,
+           num_packets / s / 1e6, 32.0 * num_packets / s / 1e6);
+}
+
+int main(int argc, char **argv) {
+    uint64_t num_packets = (argc > 1 ? strtoull(argv[1], NULL, 0) : 256)
+                           << 10;
+    if (num_packets == 0) {
+        fprintf(stderr, "usage: %s [K packets]\n", argv[0]);
+        return 1;
+    }
+    std::vector<stream_t> streams(NUM_CHANNELS);
+    generate(streams, num_packets);
+    printf("%lu packets over %d channels, %d cpus\n",
+           (unsigned long)num_packets, NUM_CHANNELS,
+           (int)std::thread::hardware_concurrency());
+
+    AllocRegistry registry;
+    for (int i = 0; i < NUM_ALLOCS; i++) {
+        registry.add(ALLOC_BASE + i * ALLOC_SIZE, ALLOC_SIZE);
+    }
+
+    /* consumer threads, thread t owns channels t, t + n, ... */
+    bool ok = true;
+    for (int n = 1; n <= NUM_CHANNELS; n *= 2) {
+        std::vector<std::map<int32_t, uint64_t> > shards(NUM_CHANNELS);
+        std::vector<uint64_t> counts(n, 0);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (int t = 0; t < n; t++) {
+            threads.emplace_back([&, t]() {
+                for (int c = t; c < NUM_CHANNELS; c += n) {
+                    counts[t] += consume(streams[c], registry, shards[c]);
+                }
+            });
+        }
+        for (auto &t : threads) t.join();
+        double s = seconds_since(start);
+        uint64_t total = 0, attributed = 0;
+        for (int t = 0; t < n; t++) total += counts[t];
+        for (auto &shard : shards) {
+            for (auto &it : shard) {
+                ok &= it.first != ALLOC_ID_NONE;
+                attributed += it.second;
+            }
+        }
+        ok &= total == num_packets && attributed == 32 * num_packets;
+        std::string stage =
+            "validate+alloc, " + std::to_string(n) + " thread(s)";
+        report(stage.c_str(), total, s);
+    }
+
+    /* receiving thread stages, one at a time */
+    std::vector<ReuseDistance> reuse(3);
+    reuse[0].init(32, 65536);
+    reuse[1].init(128, 65536);
+    reuse[2].init(4096, 65536);
+    auto start = std::chrono::steady_clock::now();
+    for (auto &s : streams) {
+        walk(s, [&](const mem_packet_t *p) {
+            for (auto &r : reuse) r.add_packet(p);
+        });
+    }
+    report("reuse distance, 3 grains", num_packets, seconds_since(start));
+    for (auto &r : reuse) ok &= r.get_num_accesses() == 32 * num_packets;
+
+    cache_config_t l1, l2;
+    ok &= cache_parse_config("131072:4:128:32:lru", &l1);
+    ok &= cache_parse_config("4194304:16:128:32:lru:wa", &l2);
+    CacheSim cache;
+    cache.init(l1, l2);
+    start = std::chrono::steady_clock::now();
+    for (auto &s : streams) {
+        walk(s, [&](const mem_packet_t *p) { cache.add_packet(p); });
+    }
+    report("cache simulation", num_packets, seconds_since(start));
+    ok &= cache.get_kernel_stats().l1_requests > 0;
+    cache.end_kernel();
+
+    char path[] = "/tmp/bench_recv_stages_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        close(fd);
+        TraceFileWriter writer;
+        trace_kernel_t k;
+        memset(&k, 0, sizeof(k));
+        k.grid_dim[0] = 1024;
+        k.grid_dim[1] = 1;
+        k.grid_dim[2] = 1;
+        ok &= writer.open(path);
+        start = std::chrono::steady_clock::now();
+        writer.begin_kernel(k, "kernel");
+        for (auto &s : streams) {
+            walk(s, [&](const mem_packet_t *p) { writer.add_packet(p); });
+        }
+        ok &= writer.end_kernel();
+        report("trace file", num_packets, seconds_since(start));
+        std::map<int, std::string> opcodes;
+        std::vector<trace_instr_info_t> instrs;
+        for (int i = 0; i < 64; i++) {
+            opcodes[i % 4] = "LDG.E";
+            trace_instr_info_t info = {"kernel", 16u * i, i % 4u};
+            instrs.push_back(info);
+        }
+        ok &= writer.close(opcodes, instrs);
+        unlink(path);
+    }
+
+    FILE *f = fopen("/dev/null", "w");
+    if (f != NULL) {
+        start = std::chrono::steady_clock::now();
+        for (auto &s : streams) {
+            walk(s, [&](const mem_packet_t *p) {
+                trace_print_packet(f, p, "LDG.E");
+            });
+        }
+        fflush(f);
+        report("text output", num_packets, seconds_since(start));
+        fclose(f);
+    }
+
+    if (!ok) {
+        printf("ERROR: unexpected results\n");
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,371 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* Set associative cache simulator fed by the accesses traced by mem_trace:
+ * one L1 per SM (keyed by the sm_id of the packets) in front of a shared
+ * L2. Like trace_file.h it does not need CUDA, so it runs inline in the tool
+ * and offline on recorded traces (see mem_trace_cachesim.cpp).
+ *
+ * Lines are split in sectors with their own valid bit, a request for a
+ * missing sector of a present line is a sector miss. Every warp level
+ * instruction is first coalesced into the distinct sectors its active lanes
+ * touch, each sector is one request to its L1, the requests that do not hit
+ * go to the L2. Stores are write through and only allocate in a cache
+ * configured with write_allocate (the L2 by default), so every store also
+ * reaches the L2. Shared and constant memory accesses are ignored. L1s are
+ * invalidated at the end of every kernel, the L2 is kept.
+ *
+ * Tags, sector masks and replacement state of a set are contiguous so a
+ * lookup touches one or two cache lines of the host. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "mem_packet.h"
+
+enum { CACHE_LRU, CACHE_PLRU };
+
+enum { CACHE_HIT, CACHE_SECTOR_MISS, CACHE_MISS };
+
+typedef struct {
+    uint32_t size;
+    uint32_t assoc;
+    uint32_t line_size;
+    uint32_t sector_size;
+    int policy;
+    bool write_allocate;
+} cache_config_t;
+
+/* "size:assoc:line:sector:policy[:wa]", i.e. "32768:4:128:32:lru", sizes in
+ * bytes and powers of two, policy lru or plru, wa enables write allocate.
+ * Returns false if malformed. */
+static inline bool cache_parse_config(const char *s, cache_config_t *c) {
+    unsigned long v[4];
+    char policy[8];
+    char wa[4] = "";
+    int n = sscanf(s, "%lu:%lu:%lu:%lu:%7[a-z]:%3[a-z]", &v[0], &v[1], &v[2],
+                   &v[3], policy, wa);
+    if (n < 5) {
+        return false;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (v[i] == 0 || (v[i] & (v[i] - 1)) != 0 || v[i] > (1ul << 31)) {
+            return false;
+        }
+    }
+    c->size = v[0];
+    c->assoc = v[1];
+    c->line_size = v[2];
+    c->sector_size = v[3];
+    if (strcmp(policy, "lru") == 0) {
+        c->policy = CACHE_LRU;
+    } else if (strcmp(policy, "plru") == 0) {
+        c->policy = CACHE_PLRU;
+    } else {
+        return false;
+    }
+    if (n == 6 && strcmp(wa, "wa") != 0) {
+        return false;
+    }
+    c->write_allocate = n == 6;
+    return c->sector_size <= c->line_size &&
+           c->line_size / c->sector_size <= 32 && c->assoc <= 64 &&
+           (uint64_t)c->assoc * c->line_size <= c->size;
+}
+
+class SetAssocCache {
+  private:
+    cache_config_t cfg;
+    uint32_t num_sets;
+    int line_shift;
+    int sector_shift;
+    uint32_t sectors_per_line;
+
+    typedef struct {
+        /* line address + 1, 0 if the way is empty */
+        uint64_t tag;
+        /* LRU: time of the last use */
+        uint64_t stamp;
+        uint32_t sectors;
+        uint32_t reserved;
+    } way_t;
+
+    /* num_sets * assoc ways, set by set */
+    std::vector<way_t> ways;
+    /* PLRU: assoc - 1 tree bits per set, a bit set means the victim is in
+     * the right half */
+    std::vector<uint64_t> plru;
+    uint64_t clock;
+
+    static int log2(uint64_t v) {
+        int l = 0;
+        while ((1ull << l) < v) {
+            l++;
+        }
+        return l;
+    }
+
+    void touch(uint32_t set, uint32_t way) {
+        if (cfg.policy == CACHE_LRU) {
+            ways[(uint64_t)set * cfg.assoc + way].stamp = ++clock;
+            return;
+        }
+        /* point every node on the path away from way */
+        uint64_t bits = plru[set];
+        uint32_t node = 1;
+        for (uint32_t half = cfg.assoc / 2; half > 0; half /= 2) {
+            bool right = way & half;
+            if (right) {
+                bits &= ~(1ull << node);
+            } else {
+                bits |= 1ull << node;
+            }
+            node = 2 * node + right;
+        }
+        plru[set] = bits;
+    }
+
+    uint32_t victim(uint32_t set) const {
+        const way_t *w = &ways[(uint64_t)set * cfg.assoc];
+        for (uint32_t i = 0; i < cfg.assoc; i++) {
+            if (w[i].tag == 0) {
+                return i;
+            }
+        }
+        if (cfg.policy == CACHE_LRU) {
+            uint32_t v = 0;
+            for (uint32_t i = 1; i < cfg.assoc; i++) {
+                if (w[i].stamp < w[v].stamp) {
+                    v = i;
+                }
+            }
+            return v;
+        }
+        uint64_t bits = plru[set];
+        uint32_t node = 1;
+        uint32_t way = 0;
+        for (uint32_t half = cfg.assoc / 2; half > 0; half /= 2) {
+            bool right = (bits >> node) & 1;
+            way += right ? half : 0;
+            node = 2 * node + right;
+        }
+        return way;
+    }
+
+  public:
+    SetAssocCache() : num_sets(0) {}
+
+    void init(const cache_config_t &c) {
+        cfg = c;
+        num_sets = c.size / (c.assoc * c.line_size);
+        line_shift = log2(c.line_size);
+        sector_shift = log2(c.sector_size);
+        sectors_per_line = c.line_size / c.sector_size;
+        invalidate();
+    }
+
+    void invalidate() {
+        ways.assign((uint64_t)num_sets * cfg.assoc, way_t());
+        plru.assign(num_sets, 0);
+        clock = 0;
+    }
+
+    const cache_config_t &get_config() const { return cfg; }
+
+    /* returns CACHE_HIT, CACHE_SECTOR_MISS or CACHE_MISS */
+    int access(uint64_t addr, bool is_store) {
+        uint64_t line = addr >> line_shift;
+        uint32_t set = line & (num_sets - 1);
+        uint32_t sector = 1u << ((addr >> sector_shift) &
+                                 (sectors_per_line - 1));
+        way_t *w = &ways[(uint64_t)set * cfg.assoc];
+        bool allocate = !is_store || cfg.write_allocate;
+        for (uint32_t i = 0; i < cfg.assoc; i++) {
+            if (w[i].tag == line + 1) {
+                touch(set, i);
+                if (w[i].sectors & sector) {
+                    return CACHE_HIT;
+                }
+                if (allocate) {
+                    w[i].sectors |= sector;
+                }
+                return CACHE_SECTOR_MISS;
+            }
+        }
+        if (allocate) {
+            uint32_t v = victim(set);
+            w[v].tag = line + 1;
+            w[v].sectors = sector;
+            touch(set, v);
+        }
+        return CACHE_MISS;
+    }
+};
+
+class CacheSim {
+  public:
+    typedef struct {
+        uint64_t l1_requests;
+        uint64_t l1_hits;
+        uint64_t l2_requests;
+        uint64_t l2_hits;
+    } stats_t;
+
+  private:
+    cache_config_t l1_config;
+    std::vector<SetAssocCache> l1;
+    SetAssocCache l2;
+    int sector_shift;
+
+    /* indexed by instr_id */
+    std::vector<stats_t> instr_stats;
+
+    static double rate(uint64_t hits, uint64_t requests) {
+        return requests == 0 ? 0 : 100.0 * hits / requests;
+    }
+
+  public:
+    void init(const cache_config_t &l1_config,
+              const cache_config_t &l2_config) {
+        this->l1_config = l1_config;
+        l1.clear();
+        l2.init(l2_config);
+        sector_shift = 0;
+        while ((1u << sector_shift) < l1_config.sector_size) {
+            sector_shift++;
+        }
+        reset();
+    }
+
+    void add_packet(const mem_packet_t *p) {
+        int space = p->flags & MEM_PACKET_SPACE_MASK;
+        if (space == MEM_SPACE_SHARED || space == MEM_SPACE_CONSTANT ||
+            space == MEM_SPACE_NONE) {
+            return;
+        }
+        bool is_store = p->flags & MEM_PACKET_STORE;
+
+        /* distinct sectors touched by the active lanes */
+        uint64_t addrs[32];
+        mem_packet_decode(p, addrs);
+        uint64_t sectors[32];
+        int n = 0;
+        for (int lane = 0; lane < 32; lane++) {
+            if (!((p->active_mask >> lane) & 1)) {
+                continue;
+            }
+            uint64_t s = addrs[lane] >> sector_shift;
+            int i = 0;
+            while (i < n && sectors[i] != s) {
+                i++;
+            }
+            if (i == n) {
+                sectors[n++] = s;
+            }
+        }
+
+        if (p->sm_id >= l1.size()) {
+            size_t old = l1.size();
+            l1.resize(p->sm_id + 1);
+            for (size_t i = old; i < l1.size(); i++) {
+                l1[i].init(l1_config);
+            }
+        }
+        if (p->instr_id >= instr_stats.size()) {
+            instr_stats.resize(p->instr_id + 1, stats_t());
+        }
+        SetAssocCache &c = l1[p->sm_id];
+        stats_t &is = instr_stats[p->instr_id];
+        for (int i = 0; i < n; i++) {
+            uint64_t addr = sectors[i] << sector_shift;
+            bool l1_hit = c.access(addr, is_store) == CACHE_HIT;
+            is.l1_requests++;
+            is.l1_hits += l1_hit;
+            if (!l1_hit || is_store) {
+                bool l2_hit = l2.access(addr, is_store) == CACHE_HIT;
+                is.l2_requests++;
+                is.l2_hits += l2_hit;
+            }
+        }
+    }
+
+    /* end of a kernel: L1s are invalidated and the statistics reset, the L2
+     * keeps its content */
+    void end_kernel() {
+        for (auto &c : l1) {
+            c.invalidate();
+        }
+        reset();
+    }
+
+    void reset() { instr_stats.clear(); }
+
+    stats_t get_kernel_stats() const {
+        stats_t t;
+        memset(&t, 0, sizeof(t));
+        for (auto &s : instr_stats) {
+            t.l1_requests += s.l1_requests;
+            t.l1_hits += s.l1_hits;
+            t.l2_requests += s.l2_requests;
+            t.l2_hits += s.l2_hits;
+        }
+        return t;
+    }
+
+    const std::vector<stats_t> &get_instr_stats() const {
+        return instr_stats;
+    }
+
+    /* name(instr_id) returns a description of the static instruction */
+    template <typename F>
+    void print(FILE *f, uint32_t kernel_id, F name) const {
+        stats_t t = get_kernel_stats();
+        fprintf(f,
+                "kernel %u - cache - L1 requests %lu hits %lu (%.2f%%) - L2 "
+                "requests %lu hits %lu (%.2f%%)\n",
+                kernel_id, t.l1_requests, t.l1_hits,
+                rate(t.l1_hits, t.l1_requests), t.l2_requests, t.l2_hits,
+                rate(t.l2_hits, t.l2_requests));
+        for (size_t i = 0; i < instr_stats.size(); i++) {
+            const stats_t &s = instr_stats[i];
+            if (s.l1_requests == 0) {
+                continue;
+            }
+            fprintf(f,
+                    "kernel %u - cache - instr %zu %s - L1 requests %lu hits "
+                    "%.2f%% - L2 requests %lu hits %.2f%%\n",
+                    kernel_id, i, name(i).c_str(), s.l1_requests,
+                    rate(s.l1_hits, s.l1_requests), s.l2_requests,
+                    rate(s.l2_hits, s.l2_requests));
+        }
+    }
+};
@@ -0,0 +1,91 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "utils/host_device.h"
+
+/* Coalescing of warp level memory instructions: the number of distinct 32B
+ * sectors and 128B lines the active lanes of a warp touch. A perfectly
+ * coalesced 4 byte access of a full warp touches 4 sectors and 1 line, a
+ * fully scattered one touches 32 of each.
+ *
+ * Lanes are attributed to the block holding their address; accesses are
+ * assumed naturally aligned, so a lane never straddles two sectors. */
+
+#define COALESCE_SECTOR_SHIFT 5
+#define COALESCE_LINE_SHIFT 7
+
+/* per static instruction totals, accumulated on the device */
+typedef struct {
+    /* warp level executions */
+    uint64_t requests;
+    /* active lanes summed over the requests */
+    uint64_t threads;
+    uint64_t sectors;
+    uint64_t lines;
+} coalesce_counters_t;
+
+/* true if no active lane below lane touches the (1 << shift) bytes block of
+ * lane. Counting the lanes for which this holds gives the number of distinct
+ * blocks; on the device every lane evaluates it for itself and the warp
+ * counts with a ballot, which keeps the loop at 32 iterations per lane. */
+HOST_DEVICE_INLINE bool coalesce_is_first(const uint64_t *addrs, uint32_t mask,
+                                          int lane, int shift) {
+    uint64_t block = addrs[lane] >> shift;
+    for (int i = 0; i < lane; i++) {
+        if (((mask >> i) & 1) && (addrs[i] >> shift) == block) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* number of distinct (1 << shift) bytes blocks touched by the active lanes */
+HOST_DEVICE_INLINE int coalesce_count(const uint64_t *addrs, uint32_t mask,
+                                      int shift) {
+    int n = 0;
+    for (int lane = 0; lane < 32; lane++) {
+        if (((mask >> lane) & 1) &&
+            coalesce_is_first(addrs, mask, lane, shift)) {
+            n++;
+        }
+    }
+    return n;
+}
+
+/* fraction of the bytes moved in sectors that the lanes actually asked for,
+ * 1 for a perfectly coalesced access; lanes reading the same word are
+ * counted separately, so broadcasts go above 1 */
+inline double coalesce_efficiency(const coalesce_counters_t &c,
+                                  uint32_t access_size) {
+    if (c.sectors == 0) return 0;
+    return (double)(c.threads * access_size) /
+           (double)(c.sectors << COALESCE_SECTOR_SHIFT);
+}
@@ -0,0 +1,121 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* A channel living in host memory, for the host tests and benchmarks of the
+ * channel consumers. The producer side follows ChannelDev (fill the current
+ * buffer of the ring, ring its doorbell when full, wait for the next one to
+ * be drained) and is meant to be driven by a thread standing in for the GPU,
+ * the consumer side is the one of ChannelHost, over the same ChannelRing. */
+
+#include <assert.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils/channel_ring.h"
+
+class HostChannel {
+  private:
+    volatile int *doorbells;
+    uint8_t *buff;
+    uint32_t buff_size;
+    int num_buffs;
+    ChannelRing ring;
+
+    /* producer position */
+    int curr_buff;
+    uint32_t fill;
+
+  public:
+    HostChannel() : doorbells(NULL), buff(NULL) {}
+    ~HostChannel() {
+        delete[] doorbells;
+        free(buff);
+    }
+
+    void init(uint32_t buff_size, int num_buffs) {
+        this->buff_size = buff_size;
+        this->num_buffs = num_buffs;
+        doorbells = new int[num_buffs];
+        buff = (uint8_t *)malloc((size_t)buff_size * num_buffs);
+        ring.init(doorbells, num_buffs, buff_size);
+        curr_buff = 0;
+        fill = 0;
+    }
+
+    /* producer: appends a packet, flushing the current buffer if full */
+    void push(const void *packet, uint32_t nbytes) {
+        assert(nbytes <= buff_size);
+        if (fill + nbytes > buff_size) {
+            flush();
+        }
+        memcpy(buff + (size_t)curr_buff * buff_size + fill, packet, nbytes);
+        fill += nbytes;
+    }
+
+    /* producer: hands the current buffer to the consumer and moves to the
+     * next one, waiting for it to be drained */
+    void flush() {
+        if (fill == 0) {
+            return;
+        }
+        __sync_synchronize();
+        doorbells[curr_buff] = fill;
+        curr_buff = (curr_buff + 1) % num_buffs;
+        while (doorbells[curr_buff] != 0) {
+            sched_yield();
+        }
+        fill = 0;
+    }
+
+    /* consumer, as ChannelHost::recv */
+    uint32_t recv(void *data, uint32_t max_nbytes) {
+        uint64_t offset;
+        uint32_t nbytes = ring.poll(max_nbytes, &offset);
+        if (nbytes != 0) {
+            memcpy(data, buff + offset, nbytes);
+            ring.release(nbytes);
+        }
+        return nbytes;
+    }
+
+    /* consumer, as the zero copy ChannelHost: points data inside the ring,
+     * the bytes stay owned by the consumer until release() */
+    uint32_t recv_in_place(uint8_t **data, uint32_t max_nbytes) {
+        uint64_t offset;
+        uint32_t nbytes = ring.poll(max_nbytes, &offset);
+        if (nbytes != 0) {
+            *data = buff + offset;
+        }
+        return nbytes;
+    }
+
+    void release(uint32_t nbytes) { ring.release(nbytes); }
+};
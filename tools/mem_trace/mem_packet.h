@@ -0,0 +1,255 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils/host_device.h"
+
+/* Compact record describing the addresses generated by one warp level memory
+ * instruction. Instead of always shipping 32 64-bit addresses, the record
+ * holds the active mask, the address of the first active lane and a payload
+ * whose format depends on how the addresses relate to each other:
+ *
+ * MEM_PACKET_BROADCAST: all active lanes access the same address, no payload.
+ * MEM_PACKET_STRIDED:   addr[lane] = base_addr + stride * (lane - first_lane),
+ *                       payload is the 64-bit stride.
+ * MEM_PACKET_DELTA32:   payload is a 32-bit signed delta from base_addr for
+ *                       each active lane, in lane order.
+ * MEM_PACKET_FULL:      payload is the 64-bit address of each active lane, in
+ *                       lane order.
+ *
+ * The payload follows the header and is padded to a multiple of 8 bytes, so
+ * consecutive packets in the channel stay 8-byte aligned.
+ *
+ * The header also identifies the static instruction (instr_id, see the
+ * instruction table of trace_file.h), the SM the warp runs on and, in flags,
+ * the memory space and whether the instruction stores. */
+
+enum {
+    MEM_PACKET_BROADCAST = 0,
+    MEM_PACKET_STRIDED = 1,
+    MEM_PACKET_DELTA32 = 2,
+    MEM_PACKET_FULL = 3,
+    MEM_PACKET_NUM_ENCODINGS
+};
+
+/* memory space of an access, same values as Instr::memOpType */
+enum {
+    MEM_SPACE_NONE = 0,
+    MEM_SPACE_LOCAL = 1,
+    MEM_SPACE_GENERIC = 2,
+    MEM_SPACE_GLOBAL = 3,
+    MEM_SPACE_SHARED = 4,
+    MEM_SPACE_CONSTANT = 5
+};
+
+/* flags of mem_packet_t */
+#define MEM_PACKET_SPACE_MASK 0x0f
+#define MEM_PACKET_STORE 0x80
+
+typedef struct {
+    uint64_t base_addr;
+    int cta_id_x;
+    int cta_id_y;
+    int cta_id_z;
+    int warp_id;
+    uint32_t active_mask;
+    uint32_t instr_id;
+    uint16_t opcode_id;
+    uint16_t sm_id;
+    /* one of the MEM_PACKET_* encodings */
+    uint8_t encoding;
+    /* size of the payload following this header in 8-byte words */
+    uint8_t payload_words;
+    /* MEM_SPACE_* | MEM_PACKET_STORE */
+    uint8_t flags;
+    uint8_t reserved;
+} mem_packet_t;
+
+/* largest packet the encoder can produce (FULL encoding, 32 active lanes) */
+#define MEM_PACKET_MAX_SIZE (sizeof(mem_packet_t) + 32 * sizeof(uint64_t))
+
+HOST_DEVICE_INLINE uint32_t mem_packet_size(const mem_packet_t *p) {
+    return sizeof(mem_packet_t) + p->payload_words * sizeof(uint64_t);
+}
+
+HOST_DEVICE_INLINE uint64_t *mem_packet_payload(mem_packet_t *p) {
+    return (uint64_t *)(p + 1);
+}
+
+HOST_DEVICE_INLINE const uint64_t *mem_packet_payload(const mem_packet_t *p) {
+    return (const uint64_t *)(p + 1);
+}
+
+/* Pick the most compact encoding for addrs (only entries of the lanes set in
+ * p->active_mask are looked at) and fill base_addr, encoding, payload_words
+ * and the payload of p, which must have room for MEM_PACKET_MAX_SIZE bytes.
+ * The other header fields are left to the caller. Returns the packet size. */
+HOST_DEVICE_INLINE uint32_t mem_packet_encode(mem_packet_t *p,
+                                              const uint64_t *addrs) {
+    uint32_t mask = p->active_mask;
+    int first_lane = hd_ffs(mask);
+    uint64_t *payload = mem_packet_payload(p);
+
+    if (mask == 0) {
+        p->base_addr = 0;
+        p->encoding = MEM_PACKET_BROADCAST;
+        p->payload_words = 0;
+        return mem_packet_size(p);
+    }
+
+    uint64_t base = addrs[first_lane];
+    p->base_addr = base;
+
+    /* the stride candidate comes from the second active lane */
+    uint32_t rest = mask & ~(1u << first_lane);
+    int64_t stride = 0;
+    bool strided = true;
+    if (rest != 0) {
+        int second_lane = hd_ffs(rest);
+        int64_t delta = (int64_t)(addrs[second_lane] - base);
+        int64_t dist = second_lane - first_lane;
+        strided = (delta % dist) == 0;
+        stride = delta / dist;
+    }
+
+    bool fits32 = true;
+    for (int lane = first_lane; lane < 32; lane++) {
+        if (!((mask >> lane) & 1)) continue;
+        int64_t delta = (int64_t)(addrs[lane] - base);
+        /* unsigned arithmetic, address math is allowed to wrap */
+        if ((uint64_t)delta != (uint64_t)stride * (lane - first_lane)) {
+            strided = false;
+        }
+        if (delta != (int64_t)(int32_t)delta) {
+            fits32 = false;
+        }
+    }
+
+    if (strided && stride == 0) {
+        p->encoding = MEM_PACKET_BROADCAST;
+        p->payload_words = 0;
+    } else if (strided) {
+        p->encoding = MEM_PACKET_STRIDED;
+        p->payload_words = 1;
+        payload[0] = (uint64_t)stride;
+    } else if (fits32) {
+        int32_t *deltas = (int32_t *)payload;
+        int n = 0;
+        for (int lane = first_lane; lane < 32; lane++) {
+            if ((mask >> lane) & 1) {
+                deltas[n++] = (int32_t)(addrs[lane] - base);
+            }
+        }
+        /* keep padding deterministic */
+        if (n & 1) {
+            deltas[n] = 0;
+        }
+        p->encoding = MEM_PACKET_DELTA32;
+        p->payload_words = (n + 1) / 2;
+    } else {
+        int n = 0;
+        for (int lane = first_lane; lane < 32; lane++) {
+            if ((mask >> lane) & 1) {
+                payload[n++] = addrs[lane];
+            }
+        }
+        p->encoding = MEM_PACKET_FULL;
+        p->payload_words = n;
+    }
+    return mem_packet_size(p);
+}
+
+/* Number of payload words a packet with this encoding and mask must have,
+ * -1 for an unknown encoding */
+HOST_DEVICE_INLINE int mem_packet_expected_words(uint8_t encoding,
+                                                 uint32_t active_mask) {
+    int n = hd_popc(active_mask);
+    switch (encoding) {
+        case MEM_PACKET_BROADCAST:
+            return 0;
+        case MEM_PACKET_STRIDED:
+            return 1;
+        case MEM_PACKET_DELTA32:
+            return (n + 1) / 2;
+        case MEM_PACKET_FULL:
+            return n;
+        default:
+            return -1;
+    }
+}
+
+/* Check that the first avail bytes of buf start with a well formed packet,
+ * returns its size or 0 if it is truncated or malformed */
+HOST_DEVICE_INLINE uint32_t mem_packet_validate(const void *buf,
+                                                size_t avail) {
+    if (avail < sizeof(mem_packet_t)) {
+        return 0;
+    }
+    const mem_packet_t *p = (const mem_packet_t *)buf;
+    int words = mem_packet_expected_words(p->encoding, p->active_mask);
+    if (words < 0 || words != p->payload_words) {
+        return 0;
+    }
+    uint32_t size = mem_packet_size(p);
+    return size <= avail ? size : 0;
+}
+
+/* Expand a packet back to 32 addresses, lanes not in the active mask are set
+ * to zero. The packet must have been validated. */
+HOST_DEVICE_INLINE void mem_packet_decode(const mem_packet_t *p,
+                                          uint64_t *addrs) {
+    uint32_t mask = p->active_mask;
+    int first_lane = hd_ffs(mask);
+    const uint64_t *payload = mem_packet_payload(p);
+    const int32_t *deltas = (const int32_t *)payload;
+    int n = 0;
+    for (int lane = 0; lane < 32; lane++) {
+        if (!((mask >> lane) & 1)) {
+            addrs[lane] = 0;
+            continue;
+        }
+        switch (p->encoding) {
+            case MEM_PACKET_BROADCAST:
+                addrs[lane] = p->base_addr;
+                break;
+            case MEM_PACKET_STRIDED:
+                addrs[lane] = p->base_addr + payload[0] * (lane - first_lane);
+                break;
+            case MEM_PACKET_DELTA32:
+                addrs[lane] = p->base_addr + (int64_t)deltas[n];
+                break;
+            default:
+                addrs[lane] = payload[n];
+                break;
+        }
+        n++;
+    }
+}
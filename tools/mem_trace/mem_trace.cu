@@ -28,11 +28,13 @@
 /* Author: Oreste Villa, ovilla@nvidia.com - 2018 */
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string>
 #include <map>
+#include <algorithm>
 
 /* every tool needs to include this once */
 #include "nvbit_tool.h"
@@ -43,13 +45,62 @@
 /* for channel */
 #include "utils/channel.hpp"
 
+/* for the pool of threads draining the channels */
+#include "utils/channel_pool.h"
+
 /* for _cuda_safe and GET_VAR* macros */
 #include "macros.h"
 
-/* Channel used to communicate from GPU to CPU receiving thread */
+/* compact record format shared by the GPU encoder and the host decoder */
+#include "mem_packet.h"
+
+/* binary trace file writer */
+#include "trace_file.h"
+
+/* reuse distance and working set analysis */
+#include "reuse_distance.h"
+
+/* L1/L2 cache simulation */
+#include "cache_sim.h"
+
+/* live allocations, to attribute the accesses */
+#include "utils/alloc_hooks.h"
+
+/* sectors and lines touched per warp access */
+#include "coalescing.h"
+
+/* dynamic sampling of the traced warps */
+#include "trace_sample.h"
+
+/* Channels used to communicate from GPU to CPU, sharded by SM */
 #define CHANNEL_SIZE (1l << 20)
-static __managed__ ChannelDev channel_dev;
-static ChannelHost channel_host;
+int channel_num_buffs = 2;
+int num_channels = 8;
+static __managed__ MultiChannelDev channel_dev;
+static MultiChannelHost channel_host;
+
+/* threads draining the channels, they validate the received batches and
+ * attribute their accesses to the allocations (process_batch), then hand them
+ * to the receiving thread below, which runs the order dependent stages */
+int num_consumer_threads = 2;
+/* if set the channel buffers are in mapped pinned host memory and the
+ * packets are processed where the GPU wrote them */
+int channel_zero_copy = 0;
+/* what the GPU does when the host falls behind, one of CHANNEL_BLOCK,
+ * CHANNEL_DROP or CHANNEL_ADAPTIVE (see channel.hpp), the packets lost are
+ * reported per kernel */
+int channel_overflow = CHANNEL_BLOCK;
+/* if not 0, size of the per SM staging buffers in front of the channels */
+uint32_t channel_staging = 0;
+/* if set, channel telemetry is collected and dumped per kernel to this file
+ * as one JSON object per line */
+std::string channel_stats_file_name;
+FILE *channel_stats_file = NULL;
+/* start of the current kernel and its name, for the telemetry */
+struct timespec kernel_start;
+std::string kernel_name;
+static ChannelConsumerPool<ChannelHost> consumer_pool;
+std::vector<ChannelHost *> consumer_channels;
 
 /* receiving thread and its control variables */
 pthread_t recv_thread;
@@ -63,21 +114,72 @@ bool skip_flag = false;
 /* global control variables for this tool */
 uint32_t instr_begin_interval = 0;
 uint32_t instr_end_interval = UINT32_MAX;
+uint32_t ker_begin_interval = 0;
+uint32_t ker_end_interval = UINT32_MAX;
 int verbose = 0;
+std::string trace_file_name;
+uint32_t trace_chunk_size = TRACE_FILE_DEFAULT_CHUNK_SIZE;
+
+/* binary trace output, used instead of printf when TRACE_FILE is set */
+TraceFileWriter trace_writer;
+uint32_t kernel_id = 0;
+
+/* if set, the accesses of every kernel are attributed to the allocations
+ * they fall in and a per allocation count is printed at the end of the
+ * kernel */
+int alloc_stats = 0;
+AllocRegistry alloc_registry;
+/* accesses per allocation id of the current kernel, one shard per channel
+ * updated by the consumer thread of the channel only, merged by the
+ * receiving thread at the end of the kernel */
+std::vector<std::map<int32_t, uint64_t> > alloc_accesses;
+
+/* if set, comma separated granularities (in bytes) of the reuse distance
+ * and working set analysis, done by the receiving thread */
+std::string reuse_granularities;
+uint32_t reuse_window = 65536;
+
+/* if set, the receiving thread simulates the caches with these
+ * configurations (see cache_parse_config) */
+int cache_sim_enabled = 0;
+std::string cache_l1_config = "131072:4:128:32:lru";
+std::string cache_l2_config = "4194304:16:128:32:lru:wa";
+CacheSim cache_sim;
+
+/* the analyses above do not need the accesses to be printed */
+int print_trace = 1;
+std::vector<ReuseDistance> reuse_analyzers;
+
+/* if set, the sectors and lines touched by each memory instruction are
+ * counted on the device and reported per static instruction at the end of
+ * the kernel, nothing goes through the channel */
+int coalescing = 0;
+/* device counters indexed by instr_id, instructions past the capacity are not
+ * instrumented in this mode */
+#define COALESCE_MAX_INSTRS 65536
+coalesce_counters_t *coalesce_counters = NULL;
+/* access size and "file:line" of each static instruction, parallel to
+ * instr_infos */
+typedef struct {
+    uint32_t size;
+    std::string source;
+} instr_source_t;
+std::vector<instr_source_t> instr_sources;
+
+/* sampling policy of every launch (see trace_sample.h), the execution
+ * counters are indexed by instr_id, instructions past their capacity are
+ * not limited by max_execs */
+#define SAMPLE_MAX_INSTRS 65536
+trace_sample_t sample_policy = {0, 0, UINT32_MAX, 0, 0};
+uint32_t *sample_exec_counts = NULL;
 
 /* opcode to id map and reverse map  */
 std::map<std::string, int> opcode_to_id_map;
 std::map<int, std::string> id_to_opcode_map;
 
-/* information collected in the instrumentation function */
-typedef struct {
-    int cta_id_x;
-    int cta_id_y;
-    int cta_id_z;
-    int warp_id;
-    int opcode_id;
-    uint64_t addrs[32];
-} mem_access_t;
+/* static instructions instrumented so far, indexed by instr_id */
+std::vector<trace_instr_info_t> instr_infos;
+pthread_mutex_t instr_infos_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* Instrumentation function that we want to inject, please note the use of
  * 1. extern "C" __device__ __noinline__
@@ -89,11 +191,27 @@ typedef struct {
 extern "C" __device__ __noinline__ void instrument_mem(int pred, int opcode_id,
                                                        uint32_t reg_high,
                                                        uint32_t reg_low,
-                                                       int32_t imm) {
+                                                       int32_t imm,
+                                                       uint32_t instr_id,
+                                                       int flags,
+                                                       uint32_t warp_period,
+                                                       uint32_t cta_begin,
+                                                       uint32_t cta_end,
+                                                       uint32_t max_execs,
+                                                       uint64_t exec_counts) {
     if (!pred) {
         return;
     }
 
+    /* sampling, the decision is the same for the whole warp */
+    int4 cta = get_ctaid();
+    int4 ncta = get_nctaid();
+    uint32_t cta_id = cta.x + ncta.x * (cta.y + ncta.y * cta.z);
+    if (!sample_warp(warp_period, cta_begin, cta_end, cta_id,
+                     get_global_warp_id())) {
+        return;
+    }
+
     int64_t base_addr = (((uint64_t)reg_high) << 32) | ((uint64_t)reg_low);
     uint64_t addr = base_addr + imm;
 
@@ -101,25 +219,80 @@ extern "C" __device__ __noinline__ void instrument_mem(int pred, int opcode_id,
     const int laneid = get_laneid();
     const int first_laneid = __ffs(active_mask) - 1;
 
-    mem_access_t ma;
-    /* collect memory address information */
+    if (max_execs != 0 && instr_id < SAMPLE_MAX_INSTRS) {
+        uint32_t n;
+        if (first_laneid == laneid) {
+            n = atomicAdd((uint32_t *)exec_counts + instr_id, 1);
+        }
+        n = __shfl(n, first_laneid);
+        if (n >= max_execs) {
+            return;
+        }
+    }
+
+    /* collect memory address information, every lane has to take part in
+     * the shuffles */
+    uint64_t addrs[32];
     for (int i = 0; i < 32; i++) {
-        ma.addrs[i] = __shfl(addr, i);
+        addrs[i] = __shfl(addr, i);
     }
 
-    int4 cta = get_ctaid();
-    ma.cta_id_x = cta.x;
-    ma.cta_id_y = cta.y;
-    ma.cta_id_z = cta.z;
-    ma.warp_id = get_warpid();
-    ma.opcode_id = opcode_id;
+    /* every lane encodes the same packet from the shuffled addresses, then
+     * the warp pushes it together */
+    uint64_t buff[MEM_PACKET_MAX_SIZE / sizeof(uint64_t)];
+    mem_packet_t *p = (mem_packet_t *)buff;
+
+    p->cta_id_x = cta.x;
+    p->cta_id_y = cta.y;
+    p->cta_id_z = cta.z;
+    p->warp_id = get_warpid();
+    p->opcode_id = opcode_id;
+    p->active_mask = active_mask;
+    p->instr_id = instr_id;
+    p->sm_id = get_smid();
+    p->flags = flags;
+    p->reserved = 0;
+    uint32_t nbytes = mem_packet_encode(p, addrs);
+
+    channel_dev.push_warp(p, nbytes);
+}
+NVBIT_EXPORT_FUNC(instrument_mem);
+
+extern "C" __device__ __noinline__ void instrument_coalescing(
+    int pred, uint32_t reg_high, uint32_t reg_low, int32_t imm,
+    uint32_t instr_id, uint64_t pcounters) {
+    if (!pred) {
+        return;
+    }
+
+    int64_t base_addr = (((uint64_t)reg_high) << 32) | ((uint64_t)reg_low);
+    uint64_t addr = base_addr + imm;
+
+    int active_mask = __ballot(1);
+    const int laneid = get_laneid();
+    const int first_laneid = __ffs(active_mask) - 1;
+
+    uint64_t addrs[32];
+    for (int i = 0; i < 32; i++) {
+        addrs[i] = __shfl(addr, i);
+    }
+
+    /* each lane tells whether it is the first to touch its sector and line,
+     * the ballots count the distinct ones */
+    int sectors = __popc(__ballot(
+        coalesce_is_first(addrs, active_mask, laneid, COALESCE_SECTOR_SHIFT)));
+    int lines = __popc(__ballot(
+        coalesce_is_first(addrs, active_mask, laneid, COALESCE_LINE_SHIFT)));
 
-    /* first active lane pushes information on the channel */
     if (first_laneid == laneid) {
-        channel_dev.push(&ma, sizeof(mem_access_t));
+        coalesce_counters_t *c = (coalesce_counters_t *)pcounters + instr_id;
+        atomicAdd((unsigned long long *)&c->requests, 1);
+        atomicAdd((unsigned long long *)&c->threads, __popc(active_mask));
+        atomicAdd((unsigned long long *)&c->sectors, sectors);
+        atomicAdd((unsigned long long *)&c->lines, lines);
     }
 }
-NVBIT_EXPORT_FUNC(instrument_mem);
+NVBIT_EXPORT_FUNC(instrument_coalescing);
 
 void nvbit_at_init() {
     setenv("CUDA_MANAGED_FORCE_DEVICE_ALLOC", "1", 1);
@@ -129,9 +302,122 @@ void nvbit_at_init() {
     GET_VAR_INT(
         instr_end_interval, "INSTR_END", UINT32_MAX,
         "End of the instruction interval where to apply instrumentation");
+    GET_VAR_INT(ker_begin_interval, "KERNEL_BEGIN", 0,
+                "Beginning of the kernel launch interval where to apply "
+                "instrumentation");
+    GET_VAR_INT(
+        ker_end_interval, "KERNEL_END", UINT32_MAX,
+        "End of the kernel launch interval where to apply instrumentation");
+    GET_VAR_INT(sample_policy.warp_period, "SAMPLE_WARPS", 0,
+                "Trace about 1 warp out of this many (0 or 1 = all)");
+    GET_VAR_INT(sample_policy.cta_begin, "SAMPLE_CTA_BEGIN", 0,
+                "First linear CTA id traced");
+    GET_VAR_INT(sample_policy.cta_end, "SAMPLE_CTA_END", UINT32_MAX,
+                "End of the linear CTA id range traced");
+    GET_VAR_INT(sample_policy.max_execs, "SAMPLE_MAX_EXECS", 0,
+                "Trace at most this many executions of each instruction per "
+                "launch (0 = all)");
+    GET_VAR_INT(channel_num_buffs, "CHANNEL_NUM_BUFFS", 2,
+                "Number of buffers in the channel ring (1 = no overlap between "
+                "GPU and host)");
+    GET_VAR_INT(num_channels, "CHANNEL_NUM", 8,
+                "Number of channels, SMs are assigned round robin");
+    GET_VAR_INT(num_consumer_threads, "CONSUMER_THREADS", 2,
+                "Number of host threads draining the channels");
+    GET_VAR_INT(channel_zero_copy, "CHANNEL_ZERO_COPY", 0,
+                "The GPU writes the channels in pinned host memory, read in "
+                "place without a copy");
+    GET_VAR_INT(channel_overflow, "CHANNEL_OVERFLOW", CHANNEL_BLOCK,
+                "When the host falls behind: 0 the GPU waits, 1 drops the "
+                "packets, 2 samples them down adaptively");
+    GET_VAR_INT(channel_staging, "CHANNEL_STAGING", 0,
+                "Size of the per SM staging buffers in front of the channels, "
+                "0 for none");
+    GET_VAR_STR(channel_stats_file_name, "CHANNEL_STATS_FILE",
+                "Dump per kernel channel telemetry to this file (JSON lines)");
+    GET_VAR_STR(trace_file_name, "TRACE_FILE",
+                "Write a binary trace to this file instead of printing it "
+                "(see mem_trace_dump)");
+    GET_VAR_INT(trace_chunk_size, "TRACE_CHUNK_SIZE",
+                TRACE_FILE_DEFAULT_CHUNK_SIZE,
+                "Chunk size of the binary trace file, multiple of 4096");
+    GET_VAR_INT(alloc_stats, "ALLOC_STATS", 0,
+                "Print the number of accesses to each allocation per kernel");
+    GET_VAR_STR(reuse_granularities, "REUSE_GRANULARITY",
+                "Print per kernel reuse distance histograms and working set "
+                "at these comma separated granularities (i.e. 32,128,4096)");
+    GET_VAR_INT(reuse_window, "REUSE_WINDOW", 65536,
+                "Number of accesses of a working set window");
+    GET_VAR_INT(cache_sim_enabled, "CACHE_SIM", 0,
+                "Print per kernel and per instruction L1/L2 hit rates");
+    GET_VAR_STR(cache_l1_config, "CACHE_L1",
+                "Configuration of the per SM L1, size:assoc:line:sector:"
+                "lru|plru[:wa]");
+    GET_VAR_STR(cache_l2_config, "CACHE_L2",
+                "Configuration of the shared L2, size:assoc:line:sector:"
+                "lru|plru[:wa]");
+    GET_VAR_INT(coalescing, "COALESCING", 0,
+                "Count sectors and lines per memory instruction on the GPU "
+                "instead of tracing the addresses");
+    GET_VAR_INT(print_trace, "PRINT_TRACE", 1,
+                "Print every access when TRACE_FILE is not set");
     GET_VAR_INT(verbose, "TOOL_VERBOSE", 0, "Enable verbosity inside the tool");
     std::string pad(100, '-');
     printf("%s\n", pad.c_str());
+
+    if (channel_staging != 0 &&
+        (channel_staging % 8 != 0 || channel_staging < MEM_PACKET_MAX_SIZE ||
+         channel_staging > CHANNEL_SIZE)) {
+        fprintf(stderr,
+                "Error: CHANNEL_STAGING must be a multiple of 8 between %lu "
+                "and %lu\n",
+                MEM_PACKET_MAX_SIZE, CHANNEL_SIZE);
+        exit(1);
+    }
+
+    if (channel_overflow == CHANNEL_ADAPTIVE && channel_num_buffs < 2) {
+        fprintf(stderr,
+                "Error: CHANNEL_OVERFLOW=2 needs CHANNEL_NUM_BUFFS >= 2, with "
+                "a single buffer the host is always behind\n");
+        exit(1);
+    }
+
+    if (!channel_stats_file_name.empty()) {
+        channel_stats_file = fopen(channel_stats_file_name.c_str(), "w");
+        if (channel_stats_file == NULL) {
+            fprintf(stderr, "Error: can not open %s\n",
+                    channel_stats_file_name.c_str());
+            exit(1);
+        }
+    }
+
+    if (!reuse_granularities.empty()) {
+        std::vector<uint32_t> g;
+        if (!reuse_parse_granularities(reuse_granularities.c_str(), g) ||
+            reuse_window == 0) {
+            fprintf(stderr, "Error: bad REUSE_GRANULARITY or REUSE_WINDOW\n");
+            exit(1);
+        }
+        reuse_analyzers.resize(g.size());
+        for (size_t i = 0; i < g.size(); i++) {
+            reuse_analyzers[i].init(g[i], reuse_window);
+        }
+    }
+
+    if (cache_sim_enabled) {
+        cache_config_t l1, l2;
+        if (!cache_parse_config(cache_l1_config.c_str(), &l1) ||
+            !cache_parse_config(cache_l2_config.c_str(), &l2)) {
+            fprintf(stderr, "Error: bad CACHE_L1 or CACHE_L2\n");
+            exit(1);
+        }
+        cache_sim.init(l1, l2);
+    }
+
+    if (!trace_file_name.empty() &&
+        !trace_writer.open(trace_file_name.c_str(), trace_chunk_size)) {
+        exit(1);
+    }
 }
 
 /* instrument each memory instruction adding a call to the above instrumentation
@@ -144,6 +430,7 @@ void nvbit_at_function_first_load(CUcontext ctx, CUfunction f) {
     }
 
     uint32_t cnt = 0;
+    bool coalesce_full = false;
     /* iterate on all the static instructions in the function */
     for (auto instr : instrs) {
         if (cnt < instr_begin_interval || cnt >= instr_end_interval ||
@@ -151,6 +438,13 @@ void nvbit_at_function_first_load(CUcontext ctx, CUfunction f) {
             cnt++;
             continue;
         }
+        /* sectors and lines only mean something for the accesses going
+         * through the L1/L2, as in the cache simulation */
+        if (coalescing && instr->getMemOpType() != Instr::GLOBAL &&
+            instr->getMemOpType() != Instr::GENERIC) {
+            cnt++;
+            continue;
+        }
         if (verbose) {
             instr->printDecoded();
         }
@@ -163,12 +457,59 @@ void nvbit_at_function_first_load(CUcontext ctx, CUfunction f) {
         }
 
         int opcode_id = opcode_to_id_map[instr->getOpcode()];
+
+        trace_instr_info_t info;
+        info.func_name = nvbit_get_func_name(ctx, f);
+        info.offset = instr->getOffset();
+        info.opcode_id = opcode_id;
+        instr_source_t source;
+        source.size = instr->getSize();
+        char *file_name, *dir_name;
+        uint32_t line;
+        if (nvbit_get_line_info(ctx, f, instr->getOffset(), &file_name,
+                                &dir_name, &line)) {
+            source.source = std::string(file_name) + ":" +
+                            std::to_string(line);
+        } else {
+            source.source = "?";
+        }
+        pthread_mutex_lock(&instr_infos_mutex);
+        uint32_t instr_id = instr_infos.size();
+        instr_infos.push_back(info);
+        instr_sources.push_back(source);
+        pthread_mutex_unlock(&instr_infos_mutex);
+        int flags = (instr->getMemOpType() & MEM_PACKET_SPACE_MASK) |
+                    (instr->isStore() ? MEM_PACKET_STORE : 0);
         /* iterate on the operands */
         for (int i = 0; i < instr->getNumOperands(); i++) {
             /* get the operand "i" */
             const Instr::operand_t *op = instr->getOperand(i);
 
-            if (op->type == Instr::MREF) {
+            if (op->type == Instr::MREF && coalescing) {
+                if (instr_id >= COALESCE_MAX_INSTRS) {
+                    if (!coalesce_full) {
+                        printf("Warning: more than %d memory instructions, "
+                               "the rest of %s is not profiled for "
+                               "coalescing\n",
+                               COALESCE_MAX_INSTRS, info.func_name.c_str());
+                        coalesce_full = true;
+                    }
+                    continue;
+                }
+                nvbit_insert_call(instr, "instrument_coalescing",
+                                  IPOINT_BEFORE);
+                nvbit_add_call_arg_pred_val(instr);
+                if (instr->isExtended()) {
+                    nvbit_add_call_arg_reg_val(instr, (int)op->value[0] + 1);
+                } else {
+                    nvbit_add_call_arg_reg_val(instr, (int)Instr::RZ);
+                }
+                nvbit_add_call_arg_reg_val(instr, (int)op->value[0]);
+                nvbit_add_call_arg_const_val32(instr, (int)op->value[1]);
+                nvbit_add_call_arg_const_val32(instr, instr_id);
+                nvbit_add_call_arg_const_val64(instr,
+                                               (uint64_t)coalesce_counters);
+            } else if (op->type == Instr::MREF) {
                 /* insert call to the instrumentation function with its
                     * arguments */
                 nvbit_insert_call(instr, "instrument_mem", IPOINT_BEFORE);
@@ -181,6 +522,19 @@ void nvbit_at_function_first_load(CUcontext ctx, CUfunction f) {
                 }
                 nvbit_add_call_arg_reg_val(instr, (int)op->value[0]);
                 nvbit_add_call_arg_const_val32(instr, (int)op->value[1]);
+                nvbit_add_call_arg_const_val32(instr, instr_id);
+                nvbit_add_call_arg_const_val32(instr, flags);
+                /* sampling policy of the launch */
+                nvbit_add_call_arg_launch_val32(
+                    instr, offsetof(trace_sample_t, warp_period));
+                nvbit_add_call_arg_launch_val32(
+                    instr, offsetof(trace_sample_t, cta_begin));
+                nvbit_add_call_arg_launch_val32(
+                    instr, offsetof(trace_sample_t, cta_end));
+                nvbit_add_call_arg_launch_val32(
+                    instr, offsetof(trace_sample_t, max_execs));
+                nvbit_add_call_arg_launch_val64(
+                    instr, offsetof(trace_sample_t, exec_counts));
             }
         }
         cnt++;
@@ -188,20 +542,35 @@ void nvbit_at_function_first_load(CUcontext ctx, CUfunction f) {
 }
 
 __global__ void flush_channel() {
+    /* what is still staged goes before the markers */
+    channel_dev.flush_staging();
+
     /* push memory access with negative cta id to communicate the kernel is
      * completed */
-    mem_access_t ma;
-    ma.cta_id_x = -1;
-    channel_dev.push(&ma, sizeof(mem_access_t));
+    mem_packet_t p;
+    p.cta_id_x = -1;
+    p.active_mask = 0;
+    p.encoding = MEM_PACKET_BROADCAST;
+    p.payload_words = 0;
+    for (int i = 0; i < channel_dev.get_num_channels(); i++) {
+        channel_dev.push(i, &p, sizeof(mem_packet_t));
+    }
 
-    /* flush channel */
+    /* flush channels */
     channel_dev.flush();
 }
 
+void print_coalescing();
+void print_overflow_counts();
+void dump_channel_stats();
+
 void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
                          const char *name, void *params, CUresult *pStatus) {
     if (skip_flag) return;
 
+    alloc_hooks_cuda_event(alloc_registry, is_exit, cbid, params, pStatus,
+                           NULL);
+
     if (cbid == API_CUDA_cuLaunchKernel_ptsz ||
         cbid == API_CUDA_cuLaunchKernel) {
         cuLaunchKernel_params *p = (cuLaunchKernel_params *)params;
@@ -216,12 +585,41 @@ void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
                                           CU_FUNC_ATTRIBUTE_SHARED_SIZE_BYTES,
                                           p->f));
 
-            printf(
-                "Kernel %s - grid size %d,%d,%d - block size %d,%d,%d - nregs "
-                "%d - shmem %d - cuda stream id %ld\n",
-                nvbit_get_func_name(ctx, p->f), p->gridDimX, p->gridDimY,
-                p->gridDimZ, p->blockDimX, p->blockDimY, p->blockDimZ, nregs,
-                shmem_static_nbytes + p->sharedMemBytes, (uint64_t)p->hStream);
+            trace_kernel_t k;
+            memset(&k, 0, sizeof(k));
+            k.kernel_id = kernel_id++;
+            k.grid_dim[0] = p->gridDimX;
+            k.grid_dim[1] = p->gridDimY;
+            k.grid_dim[2] = p->gridDimZ;
+            k.block_dim[0] = p->blockDimX;
+            k.block_dim[1] = p->blockDimY;
+            k.block_dim[2] = p->blockDimZ;
+            k.nregs = nregs;
+            k.shmem_nbytes = shmem_static_nbytes + p->sharedMemBytes;
+            k.stream_id = (uint64_t)p->hStream;
+
+            const char *func_name = nvbit_get_func_name(ctx, p->f);
+            trace_print_kernel(stdout, func_name, k);
+            if (trace_writer.is_open()) {
+                trace_writer.begin_kernel(k, func_name);
+            }
+            nvbit_enable_instrumented(ctx, p->f,
+                                      k.kernel_id >= ker_begin_interval &&
+                                          k.kernel_id < ker_end_interval);
+            if (sample_policy.max_execs != 0) {
+                CUDA_SAFECALL(cudaMemset(sample_exec_counts, 0,
+                                         SAMPLE_MAX_INSTRS * sizeof(uint32_t)));
+            }
+            trace_sample_t policy = sample_policy;
+            policy.exec_counts = (uint64_t)sample_exec_counts;
+            nvbit_set_at_launch(ctx, p->f, &policy, sizeof(policy));
+            if (coalescing) {
+                CUDA_SAFECALL(cudaMemset(
+                    coalesce_counters, 0,
+                    COALESCE_MAX_INSTRS * sizeof(coalesce_counters_t)));
+            }
+            kernel_name = func_name;
+            clock_gettime(CLOCK_MONOTONIC, &kernel_start);
             recv_thread_receiving = true;
 
         } else {
@@ -247,48 +645,287 @@ void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
             while (recv_thread_receiving) {
                 pthread_yield();
             }
+
+            if (coalescing) {
+                print_coalescing();
+            }
+            if (channel_overflow != CHANNEL_BLOCK) {
+                print_overflow_counts();
+            }
+            if (channel_stats_file != NULL) {
+                dump_channel_stats();
+            }
+        }
+    }
+}
+
+/* count the accesses of the active lanes of a packet per allocation */
+void count_alloc_accesses(const mem_packet_t *p,
+                          std::map<int32_t, uint64_t> &accesses) {
+    uint64_t addrs[32];
+    mem_packet_decode(p, addrs);
+    int n = 0;
+    for (int lane = 0; lane < 32; lane++) {
+        if ((p->active_mask >> lane) & 1) {
+            addrs[n++] = addrs[lane];
+        }
+    }
+    int32_t ids[32];
+    alloc_registry.lookup_many(addrs, n, ids);
+    for (int i = 0; i < n; i++) {
+        accesses[ids[i]]++;
+    }
+}
+
+/* "function+offset opcode" of a static instruction */
+std::string instr_name(uint32_t instr_id) {
+    pthread_mutex_lock(&instr_infos_mutex);
+    std::string name = "?";
+    if (instr_id < instr_infos.size()) {
+        const trace_instr_info_t &i = instr_infos[instr_id];
+        char offset[32];
+        snprintf(offset, sizeof(offset), "+0x%x ", i.offset);
+        auto op = id_to_opcode_map.find(i.opcode_id);
+        name = i.func_name + offset +
+               (op != id_to_opcode_map.end() ? op->second : "");
+    }
+    pthread_mutex_unlock(&instr_infos_mutex);
+    return name;
+}
+
+/* one line per memory instruction the kernel executed */
+void print_coalescing() {
+    pthread_mutex_lock(&instr_infos_mutex);
+    uint32_t n = std::min<size_t>(instr_sources.size(), COALESCE_MAX_INSTRS);
+    pthread_mutex_unlock(&instr_infos_mutex);
+    std::vector<coalesce_counters_t> counters(n);
+    CUDA_SAFECALL(cudaMemcpy(counters.data(), coalesce_counters,
+                             n * sizeof(coalesce_counters_t),
+                             cudaMemcpyDeviceToHost));
+    for (uint32_t i = 0; i < n; i++) {
+        const coalesce_counters_t &c = counters[i];
+        if (c.requests == 0) continue;
+        pthread_mutex_lock(&instr_infos_mutex);
+        instr_source_t source = instr_sources[i];
+        pthread_mutex_unlock(&instr_infos_mutex);
+        printf("kernel %u - coalescing - %s - %s - requests %lu - "
+               "sectors/request %.2f - lines/request %.2f - "
+               "efficiency %.1f%%\n",
+               kernel_id - 1, instr_name(i).c_str(), source.source.c_str(),
+               c.requests, (double)c.sectors / c.requests,
+               (double)c.lines / c.requests,
+               100.0 * coalesce_efficiency(c, source.size));
+    }
+}
+
+/* packets the channel overflow policy did not deliver for the kernel, per
+ * SM, so that the analyses can be rescaled */
+void print_overflow_counts() {
+    std::vector<uint64_t> dropped(CHANNEL_MAX_SMS);
+    std::vector<uint64_t> sampled_out(CHANNEL_MAX_SMS);
+    channel_host.get_overflow_counts(dropped.data(), sampled_out.data());
+    uint64_t tot_dropped = 0, tot_sampled_out = 0;
+    for (int sm = 0; sm < CHANNEL_MAX_SMS; sm++) {
+        if (dropped[sm] == 0 && sampled_out[sm] == 0) continue;
+        printf("kernel %u - sm %d - dropped packets %lu - sampled out "
+               "packets %lu\n",
+               kernel_id - 1, sm, dropped[sm], sampled_out[sm]);
+        tot_dropped += dropped[sm];
+        tot_sampled_out += sampled_out[sm];
+    }
+    printf("kernel %u - dropped packets %lu - sampled out packets %lu\n",
+           kernel_id - 1, tot_dropped, tot_sampled_out);
+}
+
+/* one JSON object with the telemetry of the kernel that just completed: the
+ * device side per SM (SMs that did not push are left out) and the host side
+ * per channel, durations from the launch to the end of the reception */
+void dump_channel_stats() {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t kernel_ns = (end.tv_sec - kernel_start.tv_sec) * 1000000000ull +
+                         end.tv_nsec - kernel_start.tv_nsec;
+
+    FILE *f = channel_stats_file;
+    fprintf(f, "{\"kernel_id\": %u, \"name\": \"", kernel_id - 1);
+    for (const char *c = kernel_name.c_str(); *c; c++) {
+        if (*c == '"' || *c == '\\') fputc('\\', f);
+        fputc(*c, f);
+    }
+    fprintf(f, "\", \"elapsed_ns\": %lu, \"sms\": [", kernel_ns);
+
+    std::vector<channel_telemetry_t> t(CHANNEL_MAX_SMS);
+    channel_host.get_telemetry(t.data());
+    const char *sep = "";
+    for (int sm = 0; sm < CHANNEL_MAX_SMS; sm++) {
+        if (t[sm].pushes == 0 && t[sm].flushes == 0) continue;
+        fprintf(f,
+                "%s{\"sm\": %d, \"pushes\": %llu, \"bytes\": %llu, "
+                "\"flushes\": %llu, \"head_wait_cycles\": %llu, "
+                "\"tail_wait_cycles\": %llu, \"doorbell_wait_cycles\": %llu}",
+                sep, sm, t[sm].pushes, t[sm].bytes, t[sm].flushes,
+                t[sm].head_wait_cycles, t[sm].tail_wait_cycles,
+                t[sm].doorbell_wait_cycles);
+        sep = ", ";
+    }
+
+    fprintf(f, "], \"channels\": [");
+    sep = "";
+    for (int i = 0; i < num_channels; i++) {
+        channel_host_stats_t s = channel_host.get_channel(i)->get_stats();
+        fprintf(f,
+                "%s{\"channel\": %d, \"recvs\": %lu, \"bytes\": %lu, "
+                "\"recv_ns\": %lu, \"max_recv_ns\": %lu, "
+                "\"bytes_per_s\": %.0f}",
+                sep, i, s.recvs, s.bytes, s.recv_ns, s.max_recv_ns,
+                kernel_ns ? s.bytes * 1e9 / kernel_ns : 0.0);
+        sep = ", ";
+    }
+    fprintf(f, "]}\n");
+    fflush(f);
+}
+
+void print_alloc_accesses() {
+    std::map<int32_t, uint64_t> accesses;
+    for (auto &shard : alloc_accesses) {
+        for (auto &it : shard) {
+            accesses[it.first] += it.second;
+        }
+        shard.clear();
+    }
+    for (auto &it : accesses) {
+        if (it.first == ALLOC_ID_NONE) {
+            printf("kernel %u - no allocation - accesses %lu\n",
+                   kernel_id - 1, it.second);
+        } else {
+            printf("kernel %u - allocation %d - accesses %lu\n",
+                   kernel_id - 1, it.first, it.second);
+        }
+    }
+}
+
+/* set in batch->user by process_batch when the packets of the batch are
+ * followed by the end of kernel marker of the channel, the low 32 bits are
+ * the bytes of packets */
+#define BATCH_KERNEL_END (1ull << 32)
+
+/* called by the consumer thread of the channel of the batch, before the
+ * receiving thread gets it, so this part scales with CONSUMER_THREADS */
+void process_batch(channel_batch_t *batch, void *) {
+    uint32_t num_processed_bytes = 0;
+    while (num_processed_bytes < batch->nbytes) {
+        mem_packet_t *p = (mem_packet_t *)&batch->data[num_processed_bytes];
+
+        /* when we get this cta_id_x it means the kernel has completed */
+        if (p->cta_id_x == -1) {
+            batch->user = BATCH_KERNEL_END;
+            break;
         }
+
+        uint32_t packet_size =
+            mem_packet_validate(p, batch->nbytes - num_processed_bytes);
+        assert(packet_size != 0);
+
+        if (alloc_stats) {
+            count_alloc_accesses(p, alloc_accesses[batch->channel_id]);
+        }
+        num_processed_bytes += packet_size;
     }
+    batch->user |= num_processed_bytes;
 }
 
+/* The stages below need the packets of all the channels in one place (one
+ * trace file, reuse distances and caches shared by the SMs, stdout) so they
+ * run on this thread only, on packets already validated by process_batch */
 void *recv_thread_fun(void *) {
-    char *recv_buffer = (char *)malloc(CHANNEL_SIZE);
+    /* number of channels that have seen the end of the current kernel */
+    int num_done_channels = 0;
 
     while (recv_thread_started) {
-        uint32_t num_recv_bytes = 0;
-        if (recv_thread_receiving &&
-            (num_recv_bytes = channel_host.recv(recv_buffer, CHANNEL_SIZE)) >
-                0) {
-            uint32_t num_processed_bytes = 0;
-            while (num_processed_bytes < num_recv_bytes) {
-                mem_access_t *ma =
-                    (mem_access_t *)&recv_buffer[num_processed_bytes];
-
-                /* when we get this cta_id_x it means the kernel has completed
-                 */
-                if (ma->cta_id_x == -1) {
-                    recv_thread_receiving = false;
-                    break;
-                }
+        channel_batch_t *batch = consumer_pool.pop();
+        if (batch == NULL) {
+            continue;
+        }
 
-                printf("CTA %d,%d,%d - warp %d - %s - ", ma->cta_id_x,
-                       ma->cta_id_y, ma->cta_id_z, ma->warp_id,
-                       id_to_opcode_map[ma->opcode_id].c_str());
-                for (int i = 0; i < 32; i++) {
-                    printf("0x%016lx ", ma->addrs[i]);
-                }
-                printf("\n");
-                num_processed_bytes += sizeof(mem_access_t);
+        uint32_t num_packet_bytes = (uint32_t)batch->user;
+        uint32_t num_processed_bytes = 0;
+        while (num_processed_bytes < num_packet_bytes) {
+            mem_packet_t *p = (mem_packet_t *)&batch->data[num_processed_bytes];
+
+            for (auto &r : reuse_analyzers) {
+                r.add_packet(p);
             }
+            if (cache_sim_enabled) {
+                cache_sim.add_packet(p);
+            }
+
+            if (trace_writer.is_open()) {
+                /* after a write error the packets are dropped, it is
+                 * reported when the trace is closed */
+                trace_writer.add_packet(p);
+            } else if (print_trace) {
+                trace_print_packet(stdout, p,
+                                   id_to_opcode_map[p->opcode_id].c_str());
+            }
+            num_processed_bytes += mem_packet_size(p);
+        }
+
+        /* when every channel has seen the end of the kernel, all the
+         * batches of the kernel went through process_batch */
+        if ((batch->user & BATCH_KERNEL_END) &&
+            ++num_done_channels == num_channels) {
+            num_done_channels = 0;
+            if (trace_writer.is_open()) {
+                trace_writer.end_kernel();
+            }
+            if (alloc_stats) {
+                print_alloc_accesses();
+            }
+            for (auto &r : reuse_analyzers) {
+                r.print(stdout, kernel_id - 1);
+                r.reset();
+            }
+            if (cache_sim_enabled) {
+                cache_sim.print(stdout, kernel_id - 1, instr_name);
+                cache_sim.end_kernel();
+            }
+            recv_thread_receiving = false;
         }
+        consumer_pool.release(batch);
     }
-    free(recv_buffer);
     return NULL;
 }
 
 void nvbit_at_ctx_init(CUcontext ctx) {
+    if (sample_policy.max_execs != 0) {
+        CUDA_SAFECALL(cudaMalloc(&sample_exec_counts,
+                                 SAMPLE_MAX_INSTRS * sizeof(uint32_t)));
+    }
+    if (coalescing) {
+        CUDA_SAFECALL(
+            cudaMalloc(&coalesce_counters,
+                       COALESCE_MAX_INSTRS * sizeof(coalesce_counters_t)));
+    }
     recv_thread_started = true;
-    channel_host.init(0, CHANNEL_SIZE, &channel_dev, NULL);
+    channel_host.init(num_channels, CHANNEL_SIZE, &channel_dev, NULL,
+                      channel_num_buffs, channel_zero_copy, channel_overflow,
+                      channel_staging, channel_stats_file != NULL);
+
+    /* batches as large as a channel buffer so packets are never split */
+    for (int i = 0; i < num_channels; i++) {
+        consumer_channels.push_back(channel_host.get_channel(i));
+    }
+    consumer_pool.init(consumer_channels.data(), num_channels,
+                       num_consumer_threads, CHANNEL_SIZE,
+                       num_channels + 2 * num_consumer_threads,
+                       channel_zero_copy);
+    alloc_accesses.resize(num_channels);
+    consumer_pool.set_process(process_batch, NULL);
+    consumer_pool.start();
+    for (int i = 0; i < consumer_pool.get_num_threads(); i++) {
+        nvbit_set_tool_pthread(consumer_pool.get_thread(i));
+    }
+
     pthread_create(&recv_thread, NULL, recv_thread_fun, NULL);
 }
 
@@ -296,5 +933,17 @@ void nvbit_at_ctx_term(CUcontext ctx) {
     if (recv_thread_started) {
         recv_thread_started = false;
         pthread_join(recv_thread, NULL);
+        consumer_pool.destroy();
+    }
+    if (trace_writer.is_open() &&
+        !trace_writer.close(id_to_opcode_map, instr_infos)) {
+        fprintf(stderr,
+                "Error: writing %s failed, the trace is incomplete and was "
+                "not finalized\n",
+                trace_file_name.c_str());
+    }
+    if (channel_stats_file != NULL) {
+        fclose(channel_stats_file);
+        channel_stats_file = NULL;
     }
 }
@@ -0,0 +1,93 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host utility running the L1/L2 cache simulation of mem_trace (CACHE_SIM)
+ * on a binary trace written by mem_trace (TRACE_FILE), printing the same
+ * report.
+ *
+ * usage: mem_trace_cachesim <trace file> [l1 config [l2 config]]
+ *
+ * configurations are size:assoc:line:sector:lru|plru[:wa], the defaults
+ * are the ones of mem_trace. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+#include "cache_sim.h"
+#include "trace_file.h"
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s <trace file> [l1 config [l2 config]]\n",
+                argv[0]);
+        return 1;
+    }
+
+    cache_config_t l1, l2;
+    const char *l1_str = argc > 2 ? argv[2] : "131072:4:128:32:lru";
+    const char *l2_str = argc > 3 ? argv[3] : "4194304:16:128:32:lru:wa";
+    if (!cache_parse_config(l1_str, &l1) ||
+        !cache_parse_config(l2_str, &l2)) {
+        fprintf(stderr, "%s: bad cache configuration\n", argv[0]);
+        return 1;
+    }
+
+    TraceFileReader reader;
+    if (!reader.open(argv[1])) {
+        return 1;
+    }
+
+    CacheSim sim;
+    sim.init(l1, l2);
+    auto instr_name = [&](uint32_t instr_id) {
+        const trace_instr_t *i = reader.instr(instr_id);
+        if (i == NULL) {
+            return std::string("?");
+        }
+        char offset[32];
+        snprintf(offset, sizeof(offset), "+0x%x ", i->offset);
+        return reader.get_string(i->func_name_offset) + std::string(offset) +
+               reader.opcode_name(i->opcode_id);
+    };
+
+    for (uint32_t k = 0; k < reader.num_kernels(); k++) {
+        const trace_kernel_t &kern = reader.kernel(k);
+        trace_print_kernel(stdout, reader.kernel_name(k), kern);
+        bool ok = reader.for_each_packet(
+            k, [&](const mem_packet_t *p) { sim.add_packet(p); });
+        if (!ok) {
+            fprintf(stderr, "%s: kernel %u has malformed chunks\n", argv[0],
+                    kern.kernel_id);
+            return 1;
+        }
+        sim.print(stdout, kern.kernel_id, instr_name);
+        sim.end_kernel();
+    }
+    return 0;
+}
@@ -0,0 +1,79 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host utility converting a binary trace written by mem_trace (TRACE_FILE)
+ * back to the text output mem_trace prints by default.
+ *
+ * usage: mem_trace_dump <trace file> [kernel id [cta begin [cta end]]]
+ *
+ * If a kernel id is given only that launch is printed, optionally restricted
+ * to the linear CTA ids in [cta begin, cta end). */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace_file.h"
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 5) {
+        fprintf(stderr,
+                "usage: %s <trace file> [kernel id [cta begin [cta end]]]\n",
+                argv[0]);
+        return 1;
+    }
+
+    TraceFileReader reader;
+    if (!reader.open(argv[1])) {
+        return 1;
+    }
+
+    bool one_kernel = argc > 2;
+    uint32_t kernel_id = one_kernel ? strtoul(argv[2], NULL, 0) : 0;
+    uint32_t cta_begin = argc > 3 ? strtoul(argv[3], NULL, 0) : 0;
+    uint32_t cta_end = argc > 4 ? strtoul(argv[4], NULL, 0) : UINT32_MAX;
+
+    for (uint32_t k = 0; k < reader.num_kernels(); k++) {
+        const trace_kernel_t &kern = reader.kernel(k);
+        if (one_kernel && kern.kernel_id != kernel_id) {
+            continue;
+        }
+        trace_print_kernel(stdout, reader.kernel_name(k), kern);
+        bool ok = reader.for_each_packet(
+            k,
+            [&](const mem_packet_t *p) {
+                trace_print_packet(stdout, p, reader.opcode_name(p->opcode_id));
+            },
+            cta_begin, cta_end);
+        if (!ok) {
+            fprintf(stderr, "%s: kernel %u has malformed chunks\n", argv[0],
+                    kern.kernel_id);
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,93 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host utility running the reuse distance and working set analysis of
+ * mem_trace (REUSE_GRANULARITY) on a binary trace written by mem_trace
+ * (TRACE_FILE), printing the same report.
+ *
+ * usage: mem_trace_reuse <trace file> [granularities [window]]
+ *
+ * granularities is a comma separated list of powers of two in bytes
+ * (default 32,128,4096), window the number of accesses of a working set
+ * window (default 65536). */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "reuse_distance.h"
+#include "trace_file.h"
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s <trace file> [granularities [window]]\n",
+                argv[0]);
+        return 1;
+    }
+
+    std::vector<uint32_t> granularities;
+    if (!reuse_parse_granularities(argc > 2 ? argv[2] : "32,128,4096",
+                                   granularities)) {
+        fprintf(stderr, "%s: bad granularities %s\n", argv[0], argv[2]);
+        return 1;
+    }
+    uint64_t window = argc > 3 ? strtoull(argv[3], NULL, 0) : 65536;
+    if (window == 0) {
+        fprintf(stderr, "%s: bad window %s\n", argv[0], argv[3]);
+        return 1;
+    }
+
+    TraceFileReader reader;
+    if (!reader.open(argv[1])) {
+        return 1;
+    }
+
+    std::vector<ReuseDistance> analyzers(granularities.size());
+    for (size_t i = 0; i < granularities.size(); i++) {
+        analyzers[i].init(granularities[i], window);
+    }
+
+    for (uint32_t k = 0; k < reader.num_kernels(); k++) {
+        const trace_kernel_t &kern = reader.kernel(k);
+        trace_print_kernel(stdout, reader.kernel_name(k), kern);
+        bool ok = reader.for_each_packet(k, [&](const mem_packet_t *p) {
+            for (auto &r : analyzers) {
+                r.add_packet(p);
+            }
+        });
+        if (!ok) {
+            fprintf(stderr, "%s: kernel %u has malformed chunks\n", argv[0],
+                    kern.kernel_id);
+            return 1;
+        }
+        for (auto &r : analyzers) {
+            r.print(stdout, kern.kernel_id);
+            r.reset();
+        }
+    }
+    return 0;
+}
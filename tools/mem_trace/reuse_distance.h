@@ -0,0 +1,265 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* Streaming reuse distance and working set analysis of the accesses traced
+ * by mem_trace. Like trace_file.h it does not need CUDA, so the same code
+ * runs inline in the tool and offline on recorded traces (see
+ * mem_trace_reuse.cpp).
+ *
+ * Addresses are looked at in blocks of a power of two granularity (i.e. 32B
+ * sectors, 128B lines, 4KB pages). The reuse distance of an access is the
+ * number of distinct blocks touched since the previous access to the same
+ * block (0 for back to back accesses), the first access to a block is cold.
+ * Every access gets a timestamp and a Fenwick tree over the timestamps marks
+ * the last access of every block, so the distance is the number of marks
+ * between the previous access and now: O(log n) per access. Timestamps are
+ * renumbered when the tree is full, which keeps it proportional to the
+ * number of distinct blocks.
+ *
+ * The working set is the number of distinct blocks touched in each window
+ * of a fixed number of accesses. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "mem_packet.h"
+
+/* bin 0 is distance 0, bin i > 0 is [2^(i-1), 2^i) */
+#define REUSE_NUM_BINS 64
+#define REUSE_MIN_TREE_SIZE (1 << 16)
+
+class ReuseDistance {
+  private:
+    typedef struct {
+        uint64_t time;
+        uint64_t window;
+    } last_t;
+
+    int shift;
+    uint64_t window_size;
+
+    /* last access of every block */
+    std::unordered_map<uint64_t, last_t> last;
+    /* Fenwick tree, 1 based, over the timestamps [0, tree.size() - 1) */
+    std::vector<uint32_t> tree;
+    uint64_t now;
+
+    uint64_t num_accesses;
+    uint64_t num_cold;
+    uint64_t hist[REUSE_NUM_BINS];
+
+    uint64_t curr_window;
+    uint64_t window_accesses;
+    uint64_t window_blocks;
+    std::vector<uint64_t> working_set;
+
+    void tree_add(uint64_t t, int v) {
+        for (uint64_t i = t + 1; i < tree.size(); i += i & -i) {
+            tree[i] += v;
+        }
+    }
+
+    /* number of marks in [0, t] */
+    uint64_t tree_sum(uint64_t t) const {
+        uint64_t s = 0;
+        for (uint64_t i = t + 1; i > 0; i -= i & -i) {
+            s += tree[i];
+        }
+        return s;
+    }
+
+    /* renumber the last accesses 0 .. n-1 keeping their order */
+    void compact() {
+        std::vector<std::pair<uint64_t, last_t *> > order;
+        order.reserve(last.size());
+        for (auto &it : last) {
+            order.push_back(std::make_pair(it.second.time, &it.second));
+        }
+        std::sort(order.begin(), order.end(),
+                  [](const std::pair<uint64_t, last_t *> &a,
+                     const std::pair<uint64_t, last_t *> &b) {
+                      return a.first < b.first;
+                  });
+        size_t n = order.size();
+        for (size_t i = 0; i < n; i++) {
+            order[i].second->time = i;
+        }
+        size_t size = std::max<size_t>(REUSE_MIN_TREE_SIZE, 2 * n);
+        tree.assign(size + 1, 0);
+        /* linear time build of a tree with the first n timestamps set */
+        for (size_t i = 1; i <= size; i++) {
+            tree[i] += i <= n ? 1 : 0;
+            size_t parent = i + (i & -i);
+            if (parent <= size) {
+                tree[parent] += tree[i];
+            }
+        }
+        now = n;
+    }
+
+    static int bin(uint64_t d) {
+        int b = 0;
+        while (d != 0) {
+            b++;
+            d >>= 1;
+        }
+        return std::min(b, REUSE_NUM_BINS - 1);
+    }
+
+  public:
+    ReuseDistance() : shift(0), window_size(0) {}
+
+    /* granularity must be a power of two */
+    void init(uint32_t granularity, uint64_t window_size) {
+        shift = 0;
+        while ((1ull << shift) < granularity) {
+            shift++;
+        }
+        this->window_size = window_size;
+        reset();
+    }
+
+    /* start over, i.e. for a new kernel */
+    void reset() {
+        last.clear();
+        tree.assign(REUSE_MIN_TREE_SIZE + 1, 0);
+        now = 0;
+        num_accesses = 0;
+        num_cold = 0;
+        memset(hist, 0, sizeof(hist));
+        curr_window = 0;
+        window_accesses = 0;
+        window_blocks = 0;
+        working_set.clear();
+    }
+
+    void add(uint64_t addr) {
+        if (now + 1 >= tree.size()) {
+            compact();
+        }
+        uint64_t block = addr >> shift;
+        auto ins = last.insert(std::make_pair(block, last_t()));
+        last_t &l = ins.first->second;
+        if (ins.second) {
+            num_cold++;
+            window_blocks++;
+        } else {
+            /* every block has one mark, all before now */
+            hist[bin(last.size() - tree_sum(l.time))]++;
+            tree_add(l.time, -1);
+            if (l.window != curr_window) {
+                window_blocks++;
+            }
+        }
+        l.time = now;
+        l.window = curr_window;
+        tree_add(now, 1);
+        now++;
+        num_accesses++;
+
+        if (++window_accesses == window_size) {
+            working_set.push_back(window_blocks);
+            curr_window++;
+            window_accesses = 0;
+            window_blocks = 0;
+        }
+    }
+
+    /* the accesses of the active lanes of a packet, in lane order */
+    void add_packet(const mem_packet_t *p) {
+        uint64_t addrs[32];
+        mem_packet_decode(p, addrs);
+        for (int lane = 0; lane < 32; lane++) {
+            if ((p->active_mask >> lane) & 1) {
+                add(addrs[lane]);
+            }
+        }
+    }
+
+    uint32_t get_granularity() const { return 1u << shift; }
+    uint64_t get_num_accesses() const { return num_accesses; }
+    uint64_t get_num_cold() const { return num_cold; }
+    uint64_t get_num_blocks() const { return last.size(); }
+    const uint64_t *get_hist() const { return hist; }
+
+    /* distinct blocks of every window, the last one may be partial */
+    std::vector<uint64_t> get_working_set() const {
+        std::vector<uint64_t> ws = working_set;
+        if (window_accesses > 0) {
+            ws.push_back(window_blocks);
+        }
+        return ws;
+    }
+
+    void print(FILE *f, uint32_t kernel_id) const {
+        uint32_t g = get_granularity();
+        fprintf(f,
+                "kernel %u - reuse %uB - accesses %lu - blocks %lu - cold "
+                "%lu\n",
+                kernel_id, g, num_accesses, last.size(), num_cold);
+        for (int b = 0; b < REUSE_NUM_BINS; b++) {
+            if (hist[b] == 0) {
+                continue;
+            }
+            uint64_t lo = b == 0 ? 0 : 1ull << (b - 1);
+            uint64_t hi = b == 0 ? 0 : (1ull << b) - 1;
+            fprintf(f, "kernel %u - reuse %uB - distance %lu-%lu - %lu\n",
+                    kernel_id, g, lo, hi, hist[b]);
+        }
+        fprintf(f, "kernel %u - working set %uB - per %lu accesses -",
+                kernel_id, g, window_size);
+        for (auto n : get_working_set()) {
+            fprintf(f, " %lu", n);
+        }
+        fprintf(f, "\n");
+    }
+};
+
+/* parse a comma separated list of power of two granularities */
+static inline bool reuse_parse_granularities(const char *s,
+                                             std::vector<uint32_t> &g) {
+    g.clear();
+    while (*s != '\0') {
+        char *end;
+        unsigned long v = strtoul(s, &end, 0);
+        if (end == s || v == 0 || (v & (v - 1)) != 0 ||
+            (*end != ',' && *end != '\0')) {
+            return false;
+        }
+        g.push_back(v);
+        s = *end == ',' ? end + 1 : end;
+    }
+    return !g.empty();
+}
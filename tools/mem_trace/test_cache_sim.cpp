@@ -0,0 +1,327 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* Host test of the cache simulator of mem_trace (cache_sim.h): LRU and
+ * tree PLRU victim order, by hand and against reference models on random
+ * streams; sector versus line misses; write through stores with and
+ * without write allocate; one L1 per SM, invalidated at the end of a kernel
+ * while the L2 keeps its content; and the configurations cache_parse_config
+ * must reject. */
+
+#include <stdint.h>
+#include <string.h>
+#include <list>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "cache_sim.h"
+#include "utils/host_test.h"
+
+static cache_config_t config(const char *s) {
+    cache_config_t c;
+    bool ok = cache_parse_config(s, &c);
+    CHECK(ok);
+    return c;
+}
+
+/* one set of four 128B lines, one sector per line */
+static SetAssocCache one_set(const char *policy) {
+    std::string s = std::string("512:4:128:128:") + policy;
+    SetAssocCache c;
+    c.init(config(s.c_str()));
+    return c;
+}
+
+static bool hits(SetAssocCache &c, uint64_t line) {
+    return c.access(line * 128, false) == CACHE_HIT;
+}
+
+static void test_victim_order() {
+    /* A B C D fill the set, A is used again, E evicts the least recently
+     * used line B */
+    SetAssocCache lru = one_set("lru");
+    for (uint64_t l = 0; l < 4; l++) CHECK(!hits(lru, l));
+    CHECK(hits(lru, 0));
+    CHECK(!hits(lru, 4));
+    CHECK(hits(lru, 0) && hits(lru, 2) && hits(lru, 3) && hits(lru, 4));
+    CHECK(!hits(lru, 1));
+
+    /* tree PLRU: after A B C D and A the root points to the right pair,
+     * whose bit points away from D, so E evicts C and B stays */
+    SetAssocCache plru = one_set("plru");
+    for (uint64_t l = 0; l < 4; l++) CHECK(!hits(plru, l));
+    CHECK(hits(plru, 0));
+    CHECK(!hits(plru, 4));
+    CHECK(hits(plru, 1));
+    CHECK(!hits(plru, 2));
+}
+
+/* true LRU over one set */
+class ReferenceLRU {
+    std::list<uint64_t> lines;
+    uint32_t assoc;
+
+  public:
+    explicit ReferenceLRU(uint32_t assoc) : assoc(assoc) {}
+    bool access(uint64_t line) {
+        for (auto it = lines.begin(); it != lines.end(); ++it) {
+            if (*it == line) {
+                lines.erase(it);
+                lines.push_front(line);
+                return true;
+            }
+        }
+        if (lines.size() == assoc) lines.pop_back();
+        lines.push_front(line);
+        return false;
+    }
+};
+
+/* tree PLRU over one set, with the nodes as a bool array and empty ways
+ * filled first */
+class ReferencePLRU {
+    std::vector<int64_t> ways;
+    std::vector<bool> right;
+
+    void touch(uint32_t way) {
+        uint32_t lo = 0, hi = ways.size(), node = 1;
+        while (hi - lo > 1) {
+            uint32_t mid = (lo + hi) / 2;
+            bool in_right = way >= mid;
+            right[node] = !in_right;
+            node = 2 * node + in_right;
+            if (in_right) lo = mid; else hi = mid;
+        }
+    }
+
+  public:
+    explicit ReferencePLRU(uint32_t assoc)
+        : ways(assoc, -1), right(2 * assoc, false) {}
+    bool access(uint64_t line) {
+        for (uint32_t i = 0; i < ways.size(); i++) {
+            if (ways[i] == (int64_t)line) {
+                touch(i);
+                return true;
+            }
+        }
+        uint32_t v = ways.size();
+        for (uint32_t i = 0; i < ways.size() && v == ways.size(); i++) {
+            if (ways[i] < 0) v = i;
+        }
+        if (v == ways.size()) {
+            uint32_t lo = 0, hi = ways.size(), node = 1;
+            while (hi - lo > 1) {
+                uint32_t mid = (lo + hi) / 2;
+                if (right[node]) lo = mid; else hi = mid;
+                node = 2 * node + right[node];
+            }
+            v = lo;
+        }
+        ways[v] = line;
+        touch(v);
+        return false;
+    }
+};
+
+template <typename Reference>
+static void test_against_reference(const char *policy, uint32_t assoc) {
+    std::string s = "4096:" + std::to_string(assoc) + ":64:64:" + policy;
+    cache_config_t c = config(s.c_str());
+    uint32_t num_sets = c.size / (c.assoc * c.line_size);
+    SetAssocCache cache;
+    cache.init(c);
+    std::vector<Reference> sets(num_sets, Reference(assoc));
+    std::mt19937_64 rng(assoc);
+    uint64_t num_hits = 0;
+    for (int i = 0; i < 200000; i++) {
+        /* a few more lines than the cache holds, with a hot subset */
+        uint64_t line = rng() % 4 ? rng() % (num_sets * assoc)
+                                  : rng() % (2 * num_sets * assoc);
+        bool hit = sets[line % num_sets].access(line);
+        CHECK((cache.access(line * 64 + rng() % 64, false) == CACHE_HIT) ==
+              hit);
+        num_hits += hit;
+    }
+    /* both outcomes were exercised */
+    CHECK(num_hits > 1000 && num_hits < 199000);
+}
+
+static void test_sectors() {
+    /* one set of two 128B lines of four 32B sectors */
+    SetAssocCache c;
+    c.init(config("256:2:128:32:lru"));
+    CHECK(c.access(0x1000, false) == CACHE_MISS);
+    CHECK(c.access(0x1020, false) == CACHE_SECTOR_MISS);
+    CHECK(c.access(0x1020, false) == CACHE_HIT);
+    CHECK(c.access(0x101f, false) == CACHE_HIT);
+    CHECK(c.access(0x1060, false) == CACHE_SECTOR_MISS);
+    CHECK(c.access(0x1080, false) == CACHE_MISS);
+    /* the third line evicts the first one and all its sectors */
+    CHECK(c.access(0x1100, false) == CACHE_MISS);
+    CHECK(c.access(0x1020, false) == CACHE_MISS);
+    CHECK(c.access(0x1000, false) == CACHE_SECTOR_MISS);
+    c.invalidate();
+    CHECK(c.access(0x1020, false) == CACHE_MISS);
+}
+
+static void test_write_allocate() {
+    /* without wa a store allocates neither a line nor a sector */
+    SetAssocCache wt;
+    wt.init(config("256:2:128:32:lru"));
+    CHECK(wt.access(0x2000, true) == CACHE_MISS);
+    CHECK(wt.access(0x2000, false) == CACHE_MISS);
+    CHECK(wt.access(0x2020, true) == CACHE_SECTOR_MISS);
+    CHECK(wt.access(0x2020, false) == CACHE_SECTOR_MISS);
+    CHECK(wt.access(0x2020, true) == CACHE_HIT);
+
+    SetAssocCache wa;
+    wa.init(config("256:2:128:32:lru:wa"));
+    CHECK(wa.access(0x2000, true) == CACHE_MISS);
+    CHECK(wa.access(0x2000, false) == CACHE_HIT);
+    CHECK(wa.access(0x2020, true) == CACHE_SECTOR_MISS);
+    CHECK(wa.access(0x2020, false) == CACHE_HIT);
+}
+
+/* a warp level packet, lane i accesses base + stride * i */
+static const mem_packet_t *packet(uint8_t *buf, uint16_t sm_id,
+                                  uint32_t instr_id, uint64_t base,
+                                  uint64_t stride, uint8_t flags) {
+    mem_packet_t *p = (mem_packet_t *)buf;
+    memset(p, 0, sizeof(*p));
+    uint64_t addrs[32];
+    for (int lane = 0; lane < 32; lane++) addrs[lane] = base + stride * lane;
+    p->active_mask = 0xffffffff;
+    p->sm_id = sm_id;
+    p->instr_id = instr_id;
+    p->flags = flags;
+    mem_packet_encode(p, addrs);
+    return p;
+}
+
+static void check_stats(const CacheSim &sim, uint64_t l1_requests,
+                        uint64_t l1_hits, uint64_t l2_requests,
+                        uint64_t l2_hits) {
+    CacheSim::stats_t t = sim.get_kernel_stats();
+    CHECK(t.l1_requests == l1_requests && t.l1_hits == l1_hits);
+    CHECK(t.l2_requests == l2_requests && t.l2_hits == l2_hits);
+}
+
+static void test_cache_sim() {
+    uint8_t buf[MEM_PACKET_MAX_SIZE];
+    const uint8_t load = MEM_SPACE_GLOBAL;
+    const uint8_t store = MEM_SPACE_GLOBAL | MEM_PACKET_STORE;
+    CacheSim sim;
+    sim.init(config("16384:4:128:32:lru"), config("65536:8:128:32:lru:wa"));
+
+    /* 32 consecutive words are 4 sectors of one line */
+    sim.add_packet(packet(buf, 0, 0, 0x10000, 4, load));
+    check_stats(sim, 4, 0, 4, 0);
+    sim.add_packet(packet(buf, 0, 0, 0x10000, 4, load));
+    check_stats(sim, 8, 4, 4, 0);
+    /* broadcast: one sector */
+    sim.add_packet(packet(buf, 0, 1, 0x10000, 0, load));
+    check_stats(sim, 9, 5, 4, 0);
+
+    /* stores are written through even when they hit the L1 */
+    sim.add_packet(packet(buf, 0, 2, 0x10000, 4, store));
+    check_stats(sim, 13, 9, 8, 4);
+    /* the L1 does not allocate on stores, the L2 does */
+    sim.add_packet(packet(buf, 0, 2, 0x20000, 4, store));
+    check_stats(sim, 17, 9, 12, 4);
+    sim.add_packet(packet(buf, 0, 3, 0x20000, 4, load));
+    check_stats(sim, 21, 9, 16, 8);
+
+    /* another SM has its own L1 in front of the same L2 */
+    sim.add_packet(packet(buf, 5, 3, 0x10000, 4, load));
+    check_stats(sim, 25, 9, 20, 12);
+
+    /* shared and constant accesses are ignored */
+    sim.add_packet(packet(buf, 0, 4, 0x10000, 4, MEM_SPACE_SHARED));
+    sim.add_packet(packet(buf, 0, 4, 0x10000, 4, MEM_SPACE_CONSTANT));
+    check_stats(sim, 25, 9, 20, 12);
+
+    /* per instruction */
+    const std::vector<CacheSim::stats_t> &is = sim.get_instr_stats();
+    CHECK(is.size() == 4);
+    CHECK(is[0].l1_requests == 8 && is[0].l1_hits == 4);
+    CHECK(is[1].l1_requests == 1 && is[1].l1_hits == 1);
+    CHECK(is[2].l1_requests == 8 && is[2].l2_requests == 8);
+    CHECK(is[3].l1_requests == 8 && is[3].l2_hits == 8);
+
+    /* the end of the kernel resets the statistics and the L1s, the next
+     * kernel finds its data in the L2 only */
+    sim.end_kernel();
+    check_stats(sim, 0, 0, 0, 0);
+    CHECK(sim.get_instr_stats().empty());
+    sim.add_packet(packet(buf, 0, 0, 0x10000, 4, load));
+    check_stats(sim, 4, 0, 4, 4);
+    sim.add_packet(packet(buf, 0, 0, 0x10000, 4, load));
+    check_stats(sim, 8, 4, 4, 4);
+}
+
+static void test_parse_config() {
+    cache_config_t c;
+    CHECK(cache_parse_config("131072:4:128:32:lru", &c));
+    CHECK(c.size == 131072 && c.assoc == 4 && c.line_size == 128 &&
+          c.sector_size == 32 && c.policy == CACHE_LRU &&
+          !c.write_allocate);
+    CHECK(cache_parse_config("4194304:16:128:32:plru:wa", &c));
+    CHECK(c.policy == CACHE_PLRU && c.write_allocate);
+
+    const char *bad[] = {
+        "",
+        "131072:4:128:32",           /* no policy */
+        "131072:4:128:32:fifo",      /* unknown policy */
+        "131072:4:128:32:lru:wb",    /* unknown option */
+        "131072:3:128:32:lru",       /* not a power of two */
+        "100000:4:128:32:lru",       /* not a power of two */
+        "0:4:128:32:lru",            /* zero */
+        "131072:4:128:0:lru",        /* zero */
+        "131072:4:32:128:lru",       /* sector larger than the line */
+        "131072:4:4096:64:lru",      /* more than 32 sectors per line */
+        "1048576:128:128:32:lru",    /* more than 64 ways */
+        "256:4:128:32:lru",          /* one set does not hold the ways */
+        "4294967296:4:128:32:lru",   /* more than 2GB */
+        "131072,4,128,32,lru",
+    };
+    for (const char *s : bad) {
+        CHECK(!cache_parse_config(s, &c));
+    }
+}
+
+int main() {
+    test_victim_order();
+    for (uint32_t assoc = 1; assoc <= 16; assoc *= 2) {
+        test_against_reference<ReferenceLRU>("lru", assoc);
+        test_against_reference<ReferencePLRU>("plru", assoc);
+    }
+    test_sectors();
+    test_write_allocate();
+    test_cache_sim();
+    test_parse_config();
+    return host_test_done("test_cache_sim");
+}
@@ -0,0 +1,304 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host test of the channel consumer pool (utils/channel_pool.h) over host
+ * channels fed by producer threads: every record arrives once and in order
+ * per channel, copying the batches out and in place, for several thread
+ * counts; in place a channel never has two batches in flight; holding
+ * all the batches stops the consumers until one is released; and the
+ * process function sees every batch, in its channel's consumer thread,
+ * before it is popped. */
+
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "host_channel.h"
+#include "utils/channel_pool.h"
+#include "utils/host_test.h"
+
+#define BUFF_SIZE 4096
+#define NUM_BUFFS 3
+
+typedef struct {
+    uint32_t channel;
+    uint32_t seq;
+    uint32_t size;
+    uint32_t check;
+} record_t;
+
+static uint32_t record_size(uint32_t seq) {
+    return sizeof(record_t) + 8 * (seq % 13);
+}
+
+static void produce(HostChannel *ch, uint32_t channel, uint32_t num_records) {
+    uint8_t packet[256];
+    for (uint32_t seq = 0; seq < num_records; seq++) {
+        record_t *r = (record_t *)packet;
+        r->channel = channel;
+        r->seq = seq;
+        r->size = record_size(seq);
+        r->check = channel * 0x9e3779b9u ^ seq;
+        memset(packet + sizeof(record_t), seq & 0xff,
+               r->size - sizeof(record_t));
+        ch->push(packet, r->size);
+    }
+    ch->flush();
+}
+
+/* walks the records of a batch, they must follow next_seq */
+static void check_batch(const channel_batch_t *b, uint32_t *next_seq) {
+    uint32_t off = 0;
+    CHECK(b->nbytes > 0 && b->nbytes <= BUFF_SIZE);
+    while (off < b->nbytes) {
+        record_t r;
+        memcpy(&r, b->data + off, sizeof(r));
+        CHECK((int)r.channel == b->channel_id);
+        CHECK(r.seq == *next_seq);
+        CHECK(r.size == record_size(r.seq) && off + r.size <= b->nbytes);
+        CHECK(r.check == (r.channel * 0x9e3779b9u ^ r.seq));
+        for (uint32_t i = sizeof(record_t); i < r.size; i++) {
+            if (b->data[off + i] != (r.seq & 0xff)) {
+                CHECK(false);
+            }
+        }
+        (*next_seq)++;
+        off += r.size;
+    }
+}
+
+static void test_stream(int num_channels, int num_threads, bool in_place) {
+    const uint32_t num_records = 20000;
+    std::vector<HostChannel> channels(num_channels);
+    std::vector<HostChannel *> ptrs(num_channels);
+    for (int c = 0; c < num_channels; c++) {
+        channels[c].init(BUFF_SIZE, NUM_BUFFS);
+        ptrs[c] = &channels[c];
+    }
+    ChannelConsumerPool<HostChannel> pool;
+    pool.init(ptrs.data(), num_channels, num_threads, BUFF_SIZE, 8,
+              in_place);
+    CHECK(pool.get_num_threads() ==
+          (num_threads < num_channels ? num_threads : num_channels));
+    pool.start();
+    std::vector<std::thread> producers;
+    for (int c = 0; c < num_channels; c++) {
+        producers.emplace_back(produce, &channels[c], c, num_records);
+    }
+
+    /* hold a few batches at a time, released out of order */
+    std::vector<uint32_t> next_seq(num_channels, 0);
+    std::vector<int> in_flight(num_channels, 0);
+    std::vector<channel_batch_t *> held;
+    int done = 0;
+    while (done < num_channels || !held.empty()) {
+        channel_batch_t *b = done < num_channels ? pool.pop() : NULL;
+        if (b != NULL) {
+            int c = b->channel_id;
+            CHECK(c >= 0 && c < num_channels);
+            if (in_place) {
+                CHECK(in_flight[c] == 0);
+                in_flight[c]++;
+            }
+            check_batch(b, &next_seq[c]);
+            if (next_seq[c] == num_records) {
+                done++;
+            }
+            held.push_back(b);
+        }
+        if (held.size() >= 3 || (b == NULL && !held.empty())) {
+            channel_batch_t *r = held[held.size() / 2];
+            held.erase(held.begin() + held.size() / 2);
+            in_flight[r->channel_id]--;
+            pool.release(r);
+        } else if (b == NULL) {
+            sched_yield();
+        }
+    }
+    for (auto &p : producers) p.join();
+    pool.destroy();
+    for (int c = 0; c < num_channels; c++) {
+        CHECK(next_seq[c] == num_records);
+    }
+}
+
+/* with every batch held downstream the consumers stop draining, the
+ * producer then fills the ring and waits, until a batch is released */
+static void test_back_pressure() {
+    HostChannel ch;
+    ch.init(BUFF_SIZE, NUM_BUFFS);
+    HostChannel *ptr = &ch;
+    ChannelConsumerPool<HostChannel> pool;
+    pool.init(&ptr, 1, 1, BUFF_SIZE, 2);
+    pool.start();
+
+    const uint32_t num_records = 5000;
+    std::atomic<bool> finished(false);
+    std::thread producer([&]() {
+        produce(&ch, 0, num_records);
+        finished = true;
+    });
+
+    std::vector<channel_batch_t *> held;
+    while (held.size() < 2) {
+        channel_batch_t *b = pool.pop();
+        if (b != NULL) {
+            held.push_back(b);
+        } else {
+            sched_yield();
+        }
+    }
+    /* give the producer and the consumer time to run */
+    for (int i = 0; i < 2000; i++) {
+        sched_yield();
+    }
+    CHECK(pool.pop() == NULL);
+    CHECK(!finished);
+
+    uint32_t next_seq = 0;
+    for (auto b : held) {
+        check_batch(b, &next_seq);
+        pool.release(b);
+    }
+    while (next_seq < num_records) {
+        channel_batch_t *b = pool.pop();
+        if (b == NULL) {
+            sched_yield();
+            continue;
+        }
+        check_batch(b, &next_seq);
+        pool.release(b);
+    }
+    producer.join();
+    CHECK(finished);
+    pool.destroy();
+}
+
+/* per channel state of the process function, only touched by the consumer
+ * thread owning the channel (CHECK is not thread safe, errors are kept
+ * here) */
+typedef struct {
+    uint32_t next_seq;
+    uint32_t num_batches;
+    std::thread::id tid;
+    bool ok;
+} channel_state_t;
+
+/* follows the records where the pool receives the batch and counts them in
+ * batch->user */
+static void process_batch(channel_batch_t *b, void *arg) {
+    channel_state_t *st = &((channel_state_t *)arg)[b->channel_id];
+    if (st->num_batches++ == 0) {
+        st->tid = std::this_thread::get_id();
+    } else if (st->tid != std::this_thread::get_id()) {
+        st->ok = false;
+    }
+    uint32_t off = 0;
+    while (off < b->nbytes) {
+        record_t r;
+        memcpy(&r, b->data + off, sizeof(r));
+        if (r.seq != st->next_seq || r.size != record_size(r.seq)) {
+            st->ok = false;
+            break;
+        }
+        st->next_seq++;
+        b->user++;
+        off += r.size;
+    }
+}
+
+static void test_process(int num_channels, int num_threads, bool in_place) {
+    const uint32_t num_records = 10000;
+    std::vector<HostChannel> channels(num_channels);
+    std::vector<HostChannel *> ptrs(num_channels);
+    std::vector<channel_state_t> states(num_channels);
+    for (int c = 0; c < num_channels; c++) {
+        channels[c].init(BUFF_SIZE, NUM_BUFFS);
+        ptrs[c] = &channels[c];
+        states[c].next_seq = 0;
+        states[c].num_batches = 0;
+        states[c].ok = true;
+    }
+    ChannelConsumerPool<HostChannel> pool;
+    pool.init(ptrs.data(), num_channels, num_threads, BUFF_SIZE, 8,
+              in_place);
+    pool.set_process(process_batch, states.data());
+    pool.start();
+    std::vector<std::thread> producers;
+    for (int c = 0; c < num_channels; c++) {
+        producers.emplace_back(produce, &channels[c], c, num_records);
+    }
+
+    /* the records counted by the process function are the ones popped */
+    std::vector<uint32_t> next_seq(num_channels, 0);
+    std::vector<uint32_t> num_batches(num_channels, 0);
+    int done = 0;
+    while (done < num_channels) {
+        channel_batch_t *b = pool.pop();
+        if (b == NULL) {
+            sched_yield();
+            continue;
+        }
+        int c = b->channel_id;
+        uint32_t first = next_seq[c];
+        check_batch(b, &next_seq[c]);
+        CHECK(b->user == next_seq[c] - first);
+        num_batches[c]++;
+        if (next_seq[c] == num_records) {
+            done++;
+        }
+        pool.release(b);
+    }
+    for (auto &p : producers) p.join();
+    pool.destroy();
+    for (int c = 0; c < num_channels; c++) {
+        CHECK(states[c].next_seq == num_records);
+        CHECK(states[c].num_batches == num_batches[c]);
+        CHECK(states[c].ok);
+        CHECK(states[c].tid != std::this_thread::get_id());
+    }
+}
+
+int main() {
+    for (int in_place = 0; in_place < 2; in_place++) {
+        test_stream(1, 1, in_place);
+        test_stream(4, 1, in_place);
+        test_stream(4, 2, in_place);
+        test_stream(5, 3, in_place);
+        test_stream(3, 8, in_place);
+    }
+    test_back_pressure();
+    for (int in_place = 0; in_place < 2; in_place++) {
+        test_process(1, 1, in_place);
+        test_process(5, 2, in_place);
+        test_process(4, 4, in_place);
+    }
+    return host_test_done("test_channel_pool");
+}
@@ -0,0 +1,139 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host test of the doorbell protocol of the channels (utils/channel_ring.h):
+ * partial reads and buffer switches step by step, then a producer thread
+ * standing in for the GPU streams a sequence through rings of 1 to 4
+ * buffers and the consumer checks it arrives complete and in order. */
+
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "utils/channel_ring.h"
+#include "utils/host_test.h"
+
+#define BUFF_SIZE 64
+
+static void test_steps() {
+    volatile int doorbells[3] = {7, 7, 7};
+    ChannelRing ring;
+    ring.init(doorbells, 3, BUFF_SIZE);
+    CHECK(doorbells[0] == 0 && doorbells[1] == 0 && doorbells[2] == 0);
+
+    uint64_t offset;
+    CHECK(ring.poll(16, &offset) == 0);
+
+    /* 40 bytes in buffer 0, read 16 at a time */
+    doorbells[0] = 40;
+    CHECK(ring.poll(16, &offset) == 16 && offset == 0);
+    ring.release(16);
+    CHECK(doorbells[0] == 24);
+    CHECK(ring.poll(16, &offset) == 16 && offset == 16);
+    ring.release(16);
+    CHECK(ring.poll(16, &offset) == 8 && offset == 32);
+    ring.release(8);
+    /* buffer 0 is handed back, buffer 1 is next */
+    CHECK(doorbells[0] == 0);
+    CHECK(ring.poll(16, &offset) == 0);
+
+    doorbells[1] = BUFF_SIZE;
+    doorbells[2] = 4;
+    CHECK(ring.poll(1024, &offset) == BUFF_SIZE && offset == BUFF_SIZE);
+    ring.release(BUFF_SIZE);
+    CHECK(doorbells[1] == 0);
+    CHECK(ring.poll(1024, &offset) == 4 && offset == 2 * BUFF_SIZE);
+    ring.release(4);
+
+    /* and back to buffer 0 */
+    doorbells[0] = 8;
+    CHECK(ring.poll(1024, &offset) == 8 && offset == 0);
+    ring.release(8);
+    CHECK(doorbells[0] == 0 && doorbells[1] == 0 && doorbells[2] == 0);
+}
+
+/* the producer follows ChannelDev: fill the current buffer, ring its
+ * doorbell, wait for the next one to be free */
+static void test_stream(int num_buffs, int n) {
+    std::vector<int> doorbells_mem(num_buffs);
+    volatile int *doorbells = doorbells_mem.data();
+    std::vector<uint8_t> mem(num_buffs * BUFF_SIZE);
+    ChannelRing ring;
+    ring.init(doorbells, num_buffs, BUFF_SIZE);
+
+    std::thread producer([&] {
+        int curr = 0;
+        uint32_t off = 0;
+        for (int i = 0; i < n; i++) {
+            if (off + sizeof(i) > BUFF_SIZE) {
+                __sync_synchronize();
+                doorbells[curr] = off;
+                curr = (curr + 1) % num_buffs;
+                while (doorbells[curr] != 0) {
+                    std::this_thread::yield();
+                }
+                off = 0;
+            }
+            memcpy(&mem[curr * BUFF_SIZE + off], &i, sizeof(i));
+            off += sizeof(i);
+        }
+        __sync_synchronize();
+        doorbells[curr] = off;
+    });
+
+    /* reads of 24 bytes do not line up with the buffers */
+    int expected = 0;
+    bool in_order = true;
+    while (expected < n) {
+        uint64_t offset;
+        uint8_t buf[24];
+        uint32_t nbytes = ring.poll(sizeof(buf), &offset);
+        if (nbytes == 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        memcpy(buf, &mem[offset], nbytes);
+        ring.release(nbytes);
+        for (uint32_t k = 0; k < nbytes; k += sizeof(int)) {
+            int v;
+            memcpy(&v, buf + k, sizeof(v));
+            in_order &= v == expected++;
+        }
+    }
+    producer.join();
+    CHECK(in_order);
+    CHECK(expected == n);
+}
+
+int main() {
+    test_steps();
+    for (int num_buffs = 1; num_buffs <= 4; num_buffs++) {
+        test_stream(num_buffs, 100000);
+    }
+    return host_test_done("test_channel_ring");
+}
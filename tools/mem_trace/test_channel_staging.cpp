@@ -0,0 +1,228 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host test of the staging buffer protocol (utils/channel_staging.h), with
+ * threads standing in for the warps of an SM: the step by step outcomes of
+ * reserve/commit/flush/reset, including the packet larger than the buffer
+ * that MultiChannelDev::push_warp must send around the staging buffer, and
+ * a stress run where every packet reaches the channel once, in order per
+ * warp, in flushes that hold the packet count they claim. */
+
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "utils/channel_staging.h"
+#include "utils/host_test.h"
+
+#define STAGING_SIZE 4096
+
+static void test_steps() {
+    channel_staging_t s;
+    staging_init(&s);
+    uint64_t off;
+
+    /* packets fill the buffer back to back */
+    CHECK(staging_reserve(&s, STAGING_SIZE, 1024, &off) == STAGING_RESERVED);
+    CHECK(off == 0);
+    CHECK(staging_reserve(&s, STAGING_SIZE, 2048, &off) == STAGING_RESERVED);
+    CHECK(off == 1024);
+    staging_commit(&s, 2048);
+    staging_commit(&s, 1024);
+    CHECK(s.tail == 3072 && s.npackets == 2);
+    /* exactly up to the end still fits */
+    CHECK(staging_reserve(&s, STAGING_SIZE, 1024, &off) == STAGING_RESERVED);
+    CHECK(off == 3072);
+
+    /* the first reservation past the end owns the flush */
+    CHECK(staging_reserve(&s, STAGING_SIZE, 8, &off) == STAGING_FLUSH);
+    CHECK(off == STAGING_SIZE);
+
+    /* a warp that overflows while the flush is pending waits for the reset
+     * and retries */
+    std::atomic<int> status(-1);
+    std::thread late([&]() {
+        uint64_t o;
+        status = staging_reserve(&s, STAGING_SIZE, 16, &o);
+    });
+    /* the flush owner waits for the last writer */
+    std::thread writer([&]() {
+        for (int i = 0; i < 100; i++) sched_yield();
+        staging_commit(&s, 1024);
+    });
+    CHECK(staging_wait_writers(&s, off) == 3);
+    writer.join();
+    for (int i = 0; i < 100; i++) sched_yield();
+    CHECK(status == -1);
+    staging_reset(&s);
+    late.join();
+    CHECK(status == STAGING_RETRY);
+    CHECK(s.head == 0 && s.tail == 0 && s.npackets == 0);
+
+    /* after the reset a whole buffer sized packet fits */
+    CHECK(staging_reserve(&s, STAGING_SIZE, STAGING_SIZE, &off) ==
+          STAGING_RESERVED);
+    CHECK(off == 0);
+    staging_commit(&s, STAGING_SIZE);
+    CHECK(staging_reserve(&s, STAGING_SIZE, 8, &off) == STAGING_FLUSH);
+    CHECK(staging_wait_writers(&s, off) == 1 && off == STAGING_SIZE);
+    staging_reset(&s);
+
+    /* a larger packet on an empty buffer asks for a flush of nothing, and
+     * would again after every reset: the caller must not stage it */
+    CHECK(staging_reserve(&s, STAGING_SIZE, STAGING_SIZE + 8, &off) ==
+          STAGING_FLUSH);
+    CHECK(off == 0 && staging_wait_writers(&s, off) == 0);
+    staging_reset(&s);
+    CHECK(staging_reserve(&s, STAGING_SIZE, STAGING_SIZE + 8, &off) ==
+          STAGING_FLUSH);
+    CHECK(off == 0);
+    staging_reset(&s);
+}
+
+/* the channel behind the staging buffer, flushes are serialized */
+struct sink_t {
+    std::mutex m;
+    std::vector<uint8_t> data;
+    uint64_t pushes = 0;
+    uint64_t packets = 0;
+    uint64_t max_push = 0;
+
+    void push(const uint8_t *b, uint64_t n, uint32_t npackets) {
+        std::lock_guard<std::mutex> g(m);
+        data.insert(data.end(), b, b + n);
+        pushes++;
+        packets += npackets;
+        max_push = n > max_push ? n : max_push;
+    }
+};
+
+/* packet: size, warp, sequence number, then bytes of the sequence */
+typedef struct {
+    uint32_t size;
+    uint32_t warp;
+    uint32_t seq;
+    uint32_t pad;
+} packet_hdr_t;
+
+static uint32_t packet_size(uint32_t warp, uint32_t seq) {
+    return sizeof(packet_hdr_t) + 8 * ((seq * 7 + warp) % 37);
+}
+
+/* number of packets in the first nbytes of the buffer, 0 if they do not
+ * add up to exactly nbytes */
+static uint32_t count_packets(const uint8_t *b, uint64_t nbytes) {
+    uint64_t off = 0;
+    uint32_t n = 0;
+    while (off < nbytes) {
+        uint32_t size;
+        memcpy(&size, b + off, sizeof(size));
+        if (size < sizeof(packet_hdr_t)) return 0;
+        off += size;
+        n++;
+    }
+    return off == nbytes ? n : 0;
+}
+
+static void test_stress(int num_warps, uint32_t packets_per_warp) {
+    alignas(16) static uint8_t buff[STAGING_SIZE];
+    channel_staging_t s;
+    staging_init(&s);
+    sink_t sink;
+    std::atomic<bool> bad_flush(false);
+
+    std::vector<std::thread> warps;
+    for (int w = 0; w < num_warps; w++) {
+        warps.emplace_back([&, w]() {
+            for (uint32_t i = 0; i < packets_per_warp; i++) {
+                uint32_t nbytes = packet_size(w, i);
+                while (true) {
+                    uint64_t off;
+                    int r = staging_reserve(&s, STAGING_SIZE, nbytes, &off);
+                    if (r == STAGING_RESERVED) {
+                        packet_hdr_t h = {nbytes, (uint32_t)w, i, 0};
+                        memcpy(buff + off, &h, sizeof(h));
+                        memset(buff + off + sizeof(h), i & 0xff,
+                               nbytes - sizeof(h));
+                        staging_commit(&s, nbytes);
+                        break;
+                    }
+                    if (r == STAGING_FLUSH) {
+                        uint32_t n = staging_wait_writers(&s, off);
+                        if (n == 0 || count_packets(buff, off) != n) {
+                            bad_flush = true;
+                        }
+                        sink.push(buff, off, n);
+                        staging_reset(&s);
+                    } else {
+                        sched_yield();
+                    }
+                }
+            }
+        });
+    }
+    for (auto &t : warps) t.join();
+    /* what flush_staging() does at the end of the kernel */
+    if (s.tail != 0) {
+        CHECK(count_packets(buff, s.tail) == s.npackets);
+        sink.push(buff, s.tail, s.npackets);
+    }
+    CHECK(!bad_flush);
+
+    std::vector<uint32_t> next(num_warps, 0);
+    uint64_t off = 0, total = 0;
+    while (off < sink.data.size()) {
+        packet_hdr_t h;
+        memcpy(&h, &sink.data[off], sizeof(h));
+        CHECK(h.warp < (uint32_t)num_warps && h.seq == next[h.warp]);
+        CHECK(h.size == packet_size(h.warp, h.seq));
+        for (uint32_t k = sizeof(h); k < h.size; k++) {
+            if (sink.data[off + k] != (h.seq & 0xff)) CHECK(false);
+        }
+        next[h.warp]++;
+        off += h.size;
+        total++;
+    }
+    CHECK(off == sink.data.size());
+    CHECK(total == (uint64_t)num_warps * packets_per_warp);
+    CHECK(sink.packets == total);
+    CHECK(sink.max_push <= STAGING_SIZE);
+    /* the point of staging: many packets per channel push */
+    CHECK(sink.pushes * 8 < total);
+}
+
+int main() {
+    test_steps();
+    test_stress(1, 20000);
+    test_stress(4, 50000);
+    test_stress(16, 5000);
+    return host_test_done("test_channel_staging");
+}
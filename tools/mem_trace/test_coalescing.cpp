@@ -0,0 +1,176 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host test of the coalescing counters of mem_trace (coalescing.h): the
+ * sectors and lines of the usual warp access patterns, the per lane
+ * evaluation the device does with a ballot against a reference on random
+ * warps, and the efficiency derived from the accumulated counters. */
+
+#include <math.h>
+#include <stdint.h>
+#include <random>
+#include <set>
+
+#include "coalescing.h"
+#include "utils/host_test.h"
+
+static int reference_count(const uint64_t *addrs, uint32_t mask, int shift) {
+    std::set<uint64_t> blocks;
+    for (int lane = 0; lane < 32; lane++) {
+        if ((mask >> lane) & 1) {
+            blocks.insert(addrs[lane] >> shift);
+        }
+    }
+    return blocks.size();
+}
+
+/* what a warp adds to the counters of its instruction: every active lane
+ * evaluates coalesce_is_first() and the warp counts the ballot */
+static void warp_access(coalesce_counters_t *c, const uint64_t *addrs,
+                        uint32_t mask) {
+    uint32_t first_sector = 0, first_line = 0;
+    for (int lane = 0; lane < 32; lane++) {
+        if ((mask >> lane) & 1) {
+            first_sector |= (uint32_t)coalesce_is_first(
+                                addrs, mask, lane, COALESCE_SECTOR_SHIFT)
+                            << lane;
+            first_line |= (uint32_t)coalesce_is_first(addrs, mask, lane,
+                                                      COALESCE_LINE_SHIFT)
+                          << lane;
+        }
+    }
+    c->requests++;
+    c->threads += __builtin_popcount(mask);
+    c->sectors += __builtin_popcount(first_sector);
+    c->lines += __builtin_popcount(first_line);
+}
+
+static void strided(uint64_t *addrs, uint64_t base, uint64_t stride) {
+    for (int lane = 0; lane < 32; lane++) {
+        addrs[lane] = base + stride * lane;
+    }
+}
+
+static void test_patterns() {
+    uint64_t a[32];
+    const int S = COALESCE_SECTOR_SHIFT, L = COALESCE_LINE_SHIFT;
+
+    /* 4 byte words of a full warp, aligned: 4 sectors, 1 line */
+    strided(a, 0x1000, 4);
+    CHECK(coalesce_count(a, ~0u, S) == 4 && coalesce_count(a, ~0u, L) == 1);
+    /* the same, one word off: 5 sectors over 2 lines */
+    strided(a, 0x1004, 4);
+    CHECK(coalesce_count(a, ~0u, S) == 5 && coalesce_count(a, ~0u, L) == 2);
+    /* 8 byte words */
+    strided(a, 0x1000, 8);
+    CHECK(coalesce_count(a, ~0u, S) == 8 && coalesce_count(a, ~0u, L) == 2);
+    /* 16 byte words */
+    strided(a, 0x1000, 16);
+    CHECK(coalesce_count(a, ~0u, S) == 16 && coalesce_count(a, ~0u, L) == 4);
+    /* one word per line */
+    strided(a, 0x1000, 128);
+    CHECK(coalesce_count(a, ~0u, S) == 32 && coalesce_count(a, ~0u, L) == 32);
+    /* all lanes on the same word */
+    strided(a, 0x1000, 0);
+    CHECK(coalesce_count(a, ~0u, S) == 1 && coalesce_count(a, ~0u, L) == 1);
+
+    /* inactive lanes do not count, even when they are the first to touch
+     * a block */
+    strided(a, 0x1000, 128);
+    CHECK(coalesce_count(a, 0x1, S) == 1);
+    CHECK(coalesce_count(a, 0x80000001, L) == 2);
+    CHECK(coalesce_count(a, 0, S) == 0);
+    strided(a, 0x1000, 4);
+    CHECK(coalesce_count(a, 0xffff0000, S) == 2);
+    CHECK(coalesce_is_first(a, 0xfffffffe, 1, S));
+    CHECK(!coalesce_is_first(a, 0xffffffff, 1, S));
+    CHECK(coalesce_is_first(a, 0xffffff00, 8, S));
+    CHECK(coalesce_is_first(a, 0xffffffff, 0, L));
+}
+
+static void test_random() {
+    std::mt19937_64 rng(1);
+    uint64_t a[32];
+    for (int t = 0; t < 100000; t++) {
+        uint32_t mask = rng();
+        if (t % 4 == 0) mask |= 0xffff;
+        /* a small range so lanes often share blocks */
+        uint64_t range = t % 2 ? 4096 : 1 << 20;
+        for (int lane = 0; lane < 32; lane++) {
+            a[lane] = 0x7f0000000000 + (rng() % range & ~3ull);
+        }
+        for (int shift = COALESCE_SECTOR_SHIFT; shift <= COALESCE_LINE_SHIFT;
+             shift += COALESCE_LINE_SHIFT - COALESCE_SECTOR_SHIFT) {
+            CHECK(coalesce_count(a, mask, shift) ==
+                  reference_count(a, mask, shift));
+        }
+        coalesce_counters_t c = {0, 0, 0, 0};
+        warp_access(&c, a, mask);
+        CHECK((int)c.sectors ==
+              reference_count(a, mask, COALESCE_SECTOR_SHIFT));
+        CHECK((int)c.lines == reference_count(a, mask, COALESCE_LINE_SHIFT));
+        CHECK(c.lines <= c.sectors && c.sectors <= c.threads);
+    }
+}
+
+static void test_efficiency() {
+    coalesce_counters_t c = {0, 0, 0, 0};
+    CHECK(coalesce_efficiency(c, 4) == 0);
+
+    uint64_t a[32];
+    strided(a, 0x1000, 4);
+    for (int i = 0; i < 10; i++) warp_access(&c, a, ~0u);
+    CHECK(c.requests == 10 && c.threads == 320 && c.sectors == 40 &&
+          c.lines == 10);
+    CHECK(coalesce_efficiency(c, 4) == 1);
+
+    /* 4 byte accesses 8 bytes apart use half of each sector */
+    c = coalesce_counters_t{0, 0, 0, 0};
+    strided(a, 0x1000, 8);
+    warp_access(&c, a, ~0u);
+    CHECK(fabs(coalesce_efficiency(c, 4) - 0.5) < 1e-12);
+    CHECK(coalesce_efficiency(c, 8) == 1);
+
+    /* scattered 4 byte words: 4 of the 32 bytes of each sector are used */
+    c = coalesce_counters_t{0, 0, 0, 0};
+    strided(a, 0x1000, 128);
+    warp_access(&c, a, ~0u);
+    CHECK(fabs(coalesce_efficiency(c, 4) - 0.125) < 1e-12);
+
+    /* lanes sharing a word count each, a broadcast goes above 1 */
+    c = coalesce_counters_t{0, 0, 0, 0};
+    strided(a, 0x1000, 0);
+    warp_access(&c, a, ~0u);
+    CHECK(c.sectors == 1 && coalesce_efficiency(c, 4) == 4.0);
+}
+
+int main() {
+    test_patterns();
+    test_random();
+    test_efficiency();
+    return host_test_done("test_coalescing");
+}
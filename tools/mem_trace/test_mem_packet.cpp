@@ -0,0 +1,202 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host test of the mem_trace packet encoding (mem_packet.h): the encoding
+ * picked for the usual access patterns, the round trip of random address
+ * sets and masks, and the rejection of truncated and malformed packets. */
+
+#include <stdint.h>
+#include <string.h>
+#include <random>
+
+#include "mem_packet.h"
+#include "utils/host_test.h"
+
+/* large enough for any packet, 8 byte aligned */
+typedef struct {
+    uint64_t words[MEM_PACKET_MAX_SIZE / sizeof(uint64_t)];
+} packet_buf_t;
+
+static bool round_trips(mem_packet_t *p, const uint64_t *addrs) {
+    uint32_t size = mem_packet_encode(p, addrs);
+    if (mem_packet_validate(p, size) != size) {
+        return false;
+    }
+    uint64_t decoded[32];
+    mem_packet_decode(p, decoded);
+    for (int lane = 0; lane < 32; lane++) {
+        uint64_t expected = (p->active_mask >> lane) & 1 ? addrs[lane] : 0;
+        if (decoded[lane] != expected) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void test_encodings() {
+    packet_buf_t buf;
+    mem_packet_t *p = (mem_packet_t *)&buf;
+    uint64_t addrs[32];
+    const uint32_t hdr = sizeof(mem_packet_t);
+
+    memset(p, 0, sizeof(*p));
+    p->active_mask = 0xffffffff;
+    for (int l = 0; l < 32; l++) addrs[l] = 0x7f0000001000;
+    CHECK(round_trips(p, addrs));
+    CHECK(p->encoding == MEM_PACKET_BROADCAST && mem_packet_size(p) == hdr);
+
+    /* fully coalesced 4 byte accesses cost 40 bytes */
+    for (int l = 0; l < 32; l++) addrs[l] = 0x7f0000001000 + 4 * l;
+    CHECK(round_trips(p, addrs));
+    CHECK(p->encoding == MEM_PACKET_STRIDED && mem_packet_size(p) == hdr + 8);
+
+    /* negative strides and holes in the mask */
+    p->active_mask = 0x0f0f00f0;
+    for (int l = 0; l < 32; l++) addrs[l] = 0x7f0000100000 - 256 * l;
+    CHECK(round_trips(p, addrs));
+    CHECK(p->encoding == MEM_PACKET_STRIDED);
+
+    /* a gather within 2 GB, 32 bit deltas, padded to 8 bytes */
+    p->active_mask = 0x7;
+    addrs[0] = 0x7f0000000000;
+    addrs[1] = 0x7f0000000000 + 12345;
+    addrs[2] = 0x7f0000000000 - 999;
+    CHECK(round_trips(p, addrs));
+    CHECK(p->encoding == MEM_PACKET_DELTA32 && mem_packet_size(p) == hdr + 16);
+
+    /* anything else, one 64 bit address per active lane */
+    addrs[2] = 0x1000;
+    CHECK(round_trips(p, addrs));
+    CHECK(p->encoding == MEM_PACKET_FULL && mem_packet_size(p) == hdr + 24);
+
+    p->active_mask = 0;
+    CHECK(round_trips(p, addrs));
+    CHECK(mem_packet_size(p) == hdr);
+}
+
+static void test_random() {
+    std::mt19937_64 rng(1);
+    bool ok = true;
+    for (int it = 0; it < 500000 && ok; it++) {
+        packet_buf_t buf;
+        mem_packet_t *p = (mem_packet_t *)&buf;
+        memset(p, 0, sizeof(*p));
+        p->active_mask = rng() % 4 == 0 ? 0xffffffff : (uint32_t)rng();
+
+        uint64_t addrs[32];
+        uint64_t base = rng();
+        int mode = rng() % 5;
+        int64_t stride = mode == 3 ? (int64_t)(rng() % (1ull << 40))
+                                   : (int64_t)(rng() % 256) - 128;
+        for (int l = 0; l < 32; l++) {
+            switch (mode) {
+                case 0:
+                    addrs[l] = base;
+                    break;
+                case 1:
+                case 3:
+                    addrs[l] = base + stride * l;
+                    break;
+                case 2:
+                    addrs[l] = base + (int32_t)rng();
+                    break;
+                default:
+                    addrs[l] = rng();
+                    break;
+            }
+        }
+        ok = round_trips(p, addrs);
+    }
+    CHECK(ok);
+}
+
+static void test_validate() {
+    packet_buf_t buf;
+    mem_packet_t *p = (mem_packet_t *)&buf;
+    memset(p, 0, sizeof(*p));
+    p->active_mask = 0xff;
+    uint64_t addrs[32];
+    for (int l = 0; l < 32; l++) addrs[l] = (uint64_t)(l * l) << 40;
+    uint32_t size = mem_packet_encode(p, addrs);
+    CHECK(p->encoding == MEM_PACKET_FULL);
+
+    CHECK(mem_packet_validate(p, size) == size);
+    CHECK(mem_packet_validate(p, size + 100) == size);
+    CHECK(mem_packet_validate(p, size - 8) == 0);
+    CHECK(mem_packet_validate(p, sizeof(mem_packet_t) - 1) == 0);
+
+    p->payload_words--;
+    CHECK(mem_packet_validate(p, size) == 0);
+    p->payload_words++;
+    p->encoding = MEM_PACKET_NUM_ENCODINGS;
+    CHECK(mem_packet_validate(p, size) == 0);
+    p->encoding = MEM_PACKET_STRIDED;
+    CHECK(mem_packet_validate(p, size) == 0);
+}
+
+/* packets back to back, as in a channel buffer, walked with validate */
+static void test_stream() {
+    std::mt19937_64 rng(2);
+    uint64_t stream[4096];
+    uint8_t *bytes = (uint8_t *)stream;
+    size_t nbytes = 0;
+    int n = 0;
+    while (nbytes + MEM_PACKET_MAX_SIZE <= sizeof(stream)) {
+        mem_packet_t *p = (mem_packet_t *)(bytes + nbytes);
+        memset(p, 0, sizeof(*p));
+        p->active_mask = (uint32_t)rng();
+        p->instr_id = n++;
+        uint64_t addrs[32];
+        uint64_t base = rng();
+        for (int l = 0; l < 32; l++) {
+            addrs[l] = n % 2 ? base + 8 * l : base + (rng() % 4096);
+        }
+        nbytes += mem_packet_encode(p, addrs);
+        CHECK(nbytes % 8 == 0);
+    }
+
+    size_t off = 0;
+    int count = 0;
+    while (off < nbytes) {
+        uint32_t size = mem_packet_validate(bytes + off, nbytes - off);
+        if (size == 0) break;
+        if (((mem_packet_t *)(bytes + off))->instr_id != (uint32_t)count) {
+            break;
+        }
+        off += size;
+        count++;
+    }
+    CHECK(off == nbytes && count == n);
+}
+
+int main() {
+    test_encodings();
+    test_random();
+    test_validate();
+    test_stream();
+    return host_test_done("test_mem_packet");
+}
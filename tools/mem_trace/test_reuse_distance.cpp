@@ -0,0 +1,247 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* Host test of the reuse distance and working set analysis of mem_trace
+ * (reuse_distance.h) against a naive reference that rescans the accesses
+ * since the previous access to the same block. The streams mix a hot set,
+ * a warm set and never reused blocks, at several granularities, and are
+ * longer than REUSE_MIN_TREE_SIZE with more distinct blocks than half of
+ * it, so the timestamps are renumbered and the tree grows along the way.
+ * The working set is checked with and without a partial last window. */
+
+#include <stdint.h>
+#include <string.h>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "reuse_distance.h"
+#include "utils/host_test.h"
+
+typedef struct {
+    uint64_t hist[REUSE_NUM_BINS];
+    uint64_t num_cold;
+    uint64_t num_blocks;
+    std::vector<uint64_t> working_set;
+} reference_t;
+
+static int reference_bin(uint64_t d) {
+    int b = 0;
+    while ((1ull << b) <= d && b < REUSE_NUM_BINS - 1) {
+        b++;
+    }
+    return b;
+}
+
+/* O(n^2): the distance of an access is the number of distinct blocks seen
+ * since the previous access to its block */
+static reference_t reference(const std::vector<uint64_t> &addrs, int shift,
+                             uint64_t window_size) {
+    reference_t r;
+    memset(r.hist, 0, sizeof(r.hist));
+    r.num_cold = 0;
+
+    /* dense block ids, so the rescans can mark blocks in a vector */
+    std::unordered_map<uint64_t, uint32_t> ids;
+    std::vector<uint32_t> id(addrs.size());
+    for (size_t i = 0; i < addrs.size(); i++) {
+        auto ins = ids.insert(std::make_pair(addrs[i] >> shift, ids.size()));
+        id[i] = ins.first->second;
+    }
+    r.num_blocks = ids.size();
+
+    std::vector<int64_t> prev(ids.size(), -1);
+    std::vector<uint64_t> stamp(ids.size(), UINT64_MAX);
+    for (size_t i = 0; i < addrs.size(); i++) {
+        int64_t j = prev[id[i]];
+        if (j < 0) {
+            r.num_cold++;
+        } else {
+            uint64_t d = 0;
+            for (size_t k = j + 1; k < i; k++) {
+                if (stamp[id[k]] != i) {
+                    stamp[id[k]] = i;
+                    d++;
+                }
+            }
+            r.hist[reference_bin(d)]++;
+        }
+        prev[id[i]] = i;
+    }
+
+    for (size_t w = 0; w < addrs.size(); w += window_size) {
+        std::vector<bool> seen(ids.size(), false);
+        uint64_t n = 0;
+        for (size_t k = w; k < addrs.size() && k < w + window_size; k++) {
+            if (!seen[id[k]]) {
+                seen[id[k]] = true;
+                n++;
+            }
+        }
+        r.working_set.push_back(n);
+    }
+    return r;
+}
+
+/* n accesses at granularity g: hot and warm blocks are reused, the others
+ * are touched once, anywhere inside their block */
+static std::vector<uint64_t> make_stream(std::mt19937_64 &rng, size_t n,
+                                         uint64_t g, int hot_pct,
+                                         int warm_pct) {
+    const uint64_t base = 0x7f0000000000ull;
+    std::vector<uint64_t> addrs;
+    uint64_t next_fresh = 1 << 20;
+    for (size_t i = 0; i < n; i++) {
+        int pct = rng() % 100;
+        uint64_t block;
+        if (pct < hot_pct) {
+            block = rng() % 256;
+        } else if (pct < hot_pct + warm_pct) {
+            block = 256 + rng() % 512;
+        } else {
+            block = next_fresh++;
+        }
+        addrs.push_back(base + block * g + rng() % g);
+    }
+    return addrs;
+}
+
+static void check_against_reference(const ReuseDistance &rd,
+                                    const std::vector<uint64_t> &addrs,
+                                    int shift, uint64_t window_size) {
+    reference_t r = reference(addrs, shift, window_size);
+    CHECK(rd.get_num_accesses() == addrs.size());
+    CHECK(rd.get_num_cold() == r.num_cold);
+    CHECK(rd.get_num_blocks() == r.num_blocks);
+    for (int b = 0; b < REUSE_NUM_BINS; b++) {
+        CHECK(rd.get_hist()[b] == r.hist[b]);
+    }
+    CHECK(rd.get_working_set() == r.working_set);
+}
+
+static void test_random_streams() {
+    std::mt19937_64 rng(7);
+    const uint32_t granularities[] = {1, 32, 128, 4096};
+    for (uint32_t g : granularities) {
+        int shift = 0;
+        while ((1u << shift) < g) shift++;
+
+        /* the never reused blocks alone are more than half the minimum
+         * tree, and 100000 accesses is past it */
+        std::vector<uint64_t> addrs = make_stream(rng, 100000, g, 40, 20);
+        ReuseDistance rd;
+        rd.init(g, 4096);
+        CHECK(rd.get_granularity() == g);
+        for (uint64_t a : addrs) rd.add(a);
+        CHECK(rd.get_num_blocks() > REUSE_MIN_TREE_SIZE / 2);
+        /* 24 full windows and a partial one */
+        CHECK(rd.get_working_set().size() == 25);
+        check_against_reference(rd, addrs, shift, 4096);
+
+        /* the start of the same stream, with windows that divide it
+         * exactly */
+        std::vector<uint64_t> exact(addrs.begin(), addrs.begin() + 81920);
+        rd.init(g, 8192);
+        for (uint64_t a : exact) rd.add(a);
+        CHECK(rd.get_working_set().size() == 10);
+        check_against_reference(rd, exact, shift, 8192);
+
+        /* a shorter, mostly reused stream at a window larger than it */
+        std::vector<uint64_t> small = make_stream(rng, 20000, g, 80, 19);
+        rd.init(g, 32768);
+        for (uint64_t a : small) rd.add(a);
+        CHECK(rd.get_working_set().size() == 1);
+        check_against_reference(rd, small, shift, 32768);
+
+        /* reset() starts over with the same granularity and window */
+        rd.reset();
+        CHECK(rd.get_num_accesses() == 0 && rd.get_working_set().empty());
+        for (uint64_t a : small) rd.add(a);
+        check_against_reference(rd, small, shift, 32768);
+    }
+}
+
+/* distances by hand: a b c a b b d a */
+static void test_small() {
+    ReuseDistance rd;
+    rd.init(32, 3);
+    const uint64_t blocks[] = {0, 1, 2, 0, 1, 1, 3, 0};
+    for (uint64_t b : blocks) rd.add(b * 32 + 5);
+    const uint64_t *h = rd.get_hist();
+    /* b-b: 0, a: 2, b: 2, a: 3 (b, b, d count once each) */
+    CHECK(h[0] == 1);
+    CHECK(h[2] == 3);
+    CHECK(rd.get_num_cold() == 4 && rd.get_num_blocks() == 4);
+    std::vector<uint64_t> ws = rd.get_working_set();
+    /* {a b c} {a b} {d a} */
+    CHECK(ws.size() == 3 && ws[0] == 3 && ws[1] == 2 && ws[2] == 2);
+}
+
+/* a packet adds the accesses of its active lanes in lane order */
+static void test_packet() {
+    uint8_t buf[MEM_PACKET_MAX_SIZE];
+    mem_packet_t *p = (mem_packet_t *)buf;
+    memset(p, 0, sizeof(*p));
+    uint64_t addrs[32];
+    for (int lane = 0; lane < 32; lane++) {
+        addrs[lane] = 0x1000 + 96 * (lane % 7);
+    }
+    p->active_mask = 0xf0f0f0f0;
+    mem_packet_encode(p, addrs);
+
+    ReuseDistance a, b;
+    a.init(32, 16);
+    b.init(32, 16);
+    a.add_packet(p);
+    for (int lane = 0; lane < 32; lane++) {
+        if ((p->active_mask >> lane) & 1) b.add(addrs[lane]);
+    }
+    CHECK(a.get_num_accesses() == 16);
+    CHECK(a.get_num_accesses() == b.get_num_accesses());
+    CHECK(a.get_num_blocks() == b.get_num_blocks());
+    CHECK(memcmp(a.get_hist(), b.get_hist(),
+                 REUSE_NUM_BINS * sizeof(uint64_t)) == 0);
+    CHECK(a.get_working_set() == b.get_working_set());
+}
+
+static void test_parse() {
+    std::vector<uint32_t> g;
+    CHECK(reuse_parse_granularities("32,128,4096", g));
+    CHECK(g.size() == 3 && g[0] == 32 && g[1] == 128 && g[2] == 4096);
+    CHECK(reuse_parse_granularities("1", g) && g.size() == 1 && g[0] == 1);
+    CHECK(!reuse_parse_granularities("", g));
+    CHECK(!reuse_parse_granularities("48", g));
+    CHECK(!reuse_parse_granularities("0", g));
+    CHECK(!reuse_parse_granularities("32;128", g));
+}
+
+int main() {
+    test_small();
+    test_packet();
+    test_parse();
+    test_random_streams();
+    return host_test_done("test_reuse_distance");
+}
@@ -0,0 +1,505 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* Host test of the trace file writer and reader of mem_trace
+ * (trace_file.h). A few kernels of synthetic packets, with every encoding
+ * and partial warps, are written with a chunk size small enough for each
+ * kernel to span several chunks, mapped back and compared packet by packet,
+ * with and without a CTA filter. Truncated or corrupted copies of the file
+ * must be rejected, and a failed write must be reported by every later
+ * call of the writer. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "mem_packet.h"
+#include "trace_file.h"
+#include "utils/host_test.h"
+
+#define CHUNK_SIZE (2 * TRACE_FILE_ALIGN)
+#define NUM_OPCODES 4
+#define NUM_INSTRS 16
+
+typedef std::vector<uint8_t> packet_t;
+
+typedef struct {
+    trace_kernel_t info;
+    std::string name;
+    std::vector<packet_t> packets;
+} kernel_t;
+
+static packet_t make_packet(std::mt19937_64 &rng, const trace_kernel_t &k,
+                            uint32_t cta) {
+    uint8_t buf[MEM_PACKET_MAX_SIZE];
+    mem_packet_t *p = (mem_packet_t *)buf;
+    memset(p, 0, sizeof(*p));
+    p->cta_id_x = cta % k.grid_dim[0];
+    p->cta_id_y = cta / k.grid_dim[0] % k.grid_dim[1];
+    p->cta_id_z = cta / (k.grid_dim[0] * k.grid_dim[1]);
+    p->warp_id = rng() % 32;
+    p->instr_id = rng() % NUM_INSTRS;
+    p->opcode_id = p->instr_id % NUM_OPCODES;
+    p->sm_id = rng() % 80;
+    p->flags = MEM_SPACE_GLOBAL | (rng() % 2 ? MEM_PACKET_STORE : 0);
+    p->active_mask = rng() % 4 == 0 ? (uint32_t)rng() | 1 : 0xffffffff;
+
+    uint64_t base = 0x7f0000000000ull + (rng() % 1024) * 4096;
+    uint64_t addrs[32];
+    int kind = rng() % 4;
+    for (int lane = 0; lane < 32; lane++) {
+        switch (kind) {
+            case 0:
+                addrs[lane] = base;
+                break;
+            case 1:
+                addrs[lane] = base + 8 * lane;
+                break;
+            case 2:
+                addrs[lane] = base + (rng() % (1 << 20)) * 4;
+                break;
+            default:
+                addrs[lane] = rng();
+                break;
+        }
+    }
+    uint32_t size = mem_packet_encode(p, addrs);
+    return packet_t(buf, buf + size);
+}
+
+/* three launches: CTAs in order, an empty one, CTAs in random order */
+static std::vector<kernel_t> make_kernels() {
+    std::mt19937_64 rng(7);
+    std::vector<kernel_t> kernels(3);
+    uint32_t grids[3][3] = {{16, 2, 1}, {4, 1, 1}, {8, 1, 3}};
+    uint32_t num_packets[3] = {2000, 0, 500};
+    for (int i = 0; i < 3; i++) {
+        kernel_t &k = kernels[i];
+        memset(&k.info, 0, sizeof(k.info));
+        k.info.kernel_id = 10 + i;
+        k.info.stream_id = 0x1000 + i;
+        memcpy(k.info.grid_dim, grids[i], sizeof(grids[i]));
+        k.info.block_dim[0] = 128;
+        k.info.block_dim[1] = 1;
+        k.info.block_dim[2] = 1;
+        k.info.nregs = 32 + i;
+        k.info.shmem_nbytes = 1024 * i;
+        k.name = "kernel_" + std::to_string(i) + "(float*, int)";
+        uint32_t num_ctas = grids[i][0] * grids[i][1] * grids[i][2];
+        for (uint32_t j = 0; j < num_packets[i]; j++) {
+            uint32_t cta = i == 0 ? (uint64_t)j * num_ctas / num_packets[i]
+                                  : rng() % num_ctas;
+            k.packets.push_back(make_packet(rng, k.info, cta));
+        }
+    }
+    return kernels;
+}
+
+static std::map<int, std::string> make_opcodes() {
+    std::map<int, std::string> opcodes;
+    const char *names[NUM_OPCODES] = {"LDG.E", "STG.E", "LDS", "ATOMG.E.ADD"};
+    for (int i = 0; i < NUM_OPCODES; i++) {
+        opcodes[i] = names[i];
+    }
+    return opcodes;
+}
+
+static std::vector<trace_instr_info_t> make_instrs() {
+    std::vector<trace_instr_info_t> instrs;
+    for (int i = 0; i < NUM_INSTRS; i++) {
+        trace_instr_info_t in;
+        in.func_name = i < NUM_INSTRS / 2 ? "kernel_0" : "kernel_2";
+        in.offset = 16 * i;
+        in.opcode_id = i % NUM_OPCODES;
+        instrs.push_back(in);
+    }
+    return instrs;
+}
+
+static bool write_trace(const char *path, const std::vector<kernel_t> &ks) {
+    TraceFileWriter w;
+    if (!w.open(path, CHUNK_SIZE)) {
+        return false;
+    }
+    bool ok = true;
+    for (auto &k : ks) {
+        w.begin_kernel(k.info, k.name.c_str());
+        for (auto &p : k.packets) {
+            ok &= w.add_packet((const mem_packet_t *)p.data());
+        }
+        ok &= w.end_kernel();
+    }
+    return w.close(make_opcodes(), make_instrs()) && ok;
+}
+
+static uint32_t cta_of(const kernel_t &k, const packet_t &p) {
+    return trace_cta_linear_id(k.info, (const mem_packet_t *)p.data());
+}
+
+/* packets of kernel i read back with the CTA filter [begin, end) match the
+ * packets written, in order */
+static bool same_packets(const TraceFileReader &r, uint32_t i,
+                         const kernel_t &k, uint32_t begin, uint32_t end) {
+    std::vector<packet_t> got;
+    bool ok = r.for_each_packet(
+        i,
+        [&](const mem_packet_t *p) {
+            const uint8_t *b = (const uint8_t *)p;
+            got.push_back(packet_t(b, b + mem_packet_size(p)));
+        },
+        begin, end);
+    std::vector<packet_t> expected;
+    for (auto &p : k.packets) {
+        uint32_t cta = cta_of(k, p);
+        if (cta >= begin && cta < end) {
+            expected.push_back(p);
+        }
+    }
+    return ok && got == expected;
+}
+
+static void test_round_trip(const char *path,
+                            const std::vector<kernel_t> &ks) {
+    CHECK(write_trace(path, ks));
+    TraceFileReader r;
+    bool opened = r.open(path);
+    CHECK(opened);
+    if (!opened) {
+        return;
+    }
+
+    const trace_file_header_t &h = r.header();
+    CHECK(h.version == TRACE_FILE_VERSION);
+    CHECK(h.chunk_size == CHUNK_SIZE);
+    CHECK(r.num_kernels() == ks.size());
+
+    /* chunks: in file order, one kernel each, never straddled */
+    uint64_t total = 0;
+    for (uint64_t c = 0; c < r.num_chunks(); c++) {
+        const trace_chunk_t &ch = r.chunk(c);
+        CHECK(ch.offset == TRACE_FILE_ALIGN + c * CHUNK_SIZE);
+        CHECK(ch.nbytes <= CHUNK_SIZE);
+        CHECK(ch.num_packets > 0);
+        CHECK(ch.min_cta <= ch.max_cta);
+        CHECK(r.chunk_data(c) != NULL);
+        total += ch.num_packets;
+    }
+
+    uint64_t num_packets = 0;
+    for (uint32_t i = 0; i < ks.size(); i++) {
+        const trace_kernel_t &k = r.kernel(i);
+        const kernel_t &e = ks[i];
+        CHECK(strcmp(r.kernel_name(i), e.name.c_str()) == 0);
+        CHECK(k.kernel_id == e.info.kernel_id);
+        CHECK(k.stream_id == e.info.stream_id);
+        CHECK(memcmp(k.grid_dim, e.info.grid_dim, sizeof(k.grid_dim)) == 0);
+        CHECK(memcmp(k.block_dim, e.info.block_dim, sizeof(k.block_dim)) ==
+              0);
+        CHECK(k.nregs == e.info.nregs);
+        CHECK(k.shmem_nbytes == e.info.shmem_nbytes);
+        /* the bigger kernels span several chunks, the empty one none */
+        CHECK((k.num_chunks > 1) == (e.packets.size() > 200));
+        CHECK((k.num_chunks == 0) == e.packets.empty());
+        uint64_t bytes = 0;
+        for (uint64_t c = k.first_chunk; c < k.first_chunk + k.num_chunks;
+             c++) {
+            CHECK(r.chunk(c).kernel_idx == i);
+            bytes += r.chunk(c).nbytes;
+        }
+        uint64_t expected_bytes = 0;
+        for (auto &p : e.packets) {
+            expected_bytes += p.size();
+        }
+        CHECK(bytes == expected_bytes);
+        num_packets += e.packets.size();
+        CHECK(same_packets(r, i, e, 0, UINT32_MAX));
+    }
+    CHECK(total == num_packets);
+
+    /* CTA filters, including empty and out of grid ranges */
+    CHECK(same_packets(r, 0, ks[0], 5, 9));
+    CHECK(same_packets(r, 0, ks[0], 31, 32));
+    CHECK(same_packets(r, 0, ks[0], 7, 7));
+    CHECK(same_packets(r, 0, ks[0], 100, 200));
+    CHECK(same_packets(r, 2, ks[2], 3, 17));
+    CHECK(same_packets(r, 1, ks[1], 0, 4));
+
+    std::map<int, std::string> opcodes = make_opcodes();
+    for (auto &o : opcodes) {
+        CHECK(o.second == r.opcode_name(o.first));
+    }
+    CHECK(strcmp(r.opcode_name(NUM_OPCODES), "") == 0);
+    std::vector<trace_instr_info_t> instrs = make_instrs();
+    CHECK(r.num_instrs() == instrs.size());
+    for (uint32_t i = 0; i < instrs.size(); i++) {
+        const trace_instr_t *in = r.instr(i);
+        CHECK(in != NULL);
+        if (in != NULL) {
+            CHECK(instrs[i].func_name ==
+                  r.get_string(in->func_name_offset));
+            CHECK(in->offset == instrs[i].offset);
+            CHECK(in->opcode_id == instrs[i].opcode_id);
+        }
+    }
+    CHECK(r.instr(instrs.size()) == NULL);
+}
+
+/* a trace with no kernel, opcode nor instruction still reads back */
+static void test_empty(const char *path) {
+    TraceFileWriter w;
+    CHECK(w.open(path, CHUNK_SIZE));
+    CHECK(w.close(std::map<int, std::string>(),
+                  std::vector<trace_instr_info_t>()));
+    TraceFileReader r;
+    bool opened = r.open(path);
+    CHECK(opened);
+    if (opened) {
+        CHECK(r.num_kernels() == 0);
+        CHECK(r.num_chunks() == 0);
+        CHECK(r.num_instrs() == 0);
+    }
+}
+
+static std::vector<uint8_t> read_file(const char *path) {
+    std::vector<uint8_t> data;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return data;
+    }
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data.insert(data.end(), buf, buf + n);
+    }
+    fclose(f);
+    return data;
+}
+
+static void write_file(const char *path, const uint8_t *data, size_t n) {
+    FILE *f = fopen(path, "wb");
+    CHECK(f != NULL);
+    if (f != NULL) {
+        CHECK(fwrite(data, 1, n, f) == n);
+        fclose(f);
+    }
+}
+
+static bool opens(const char *path, const std::vector<uint8_t> &data) {
+    write_file(path, data.data(), data.size());
+    TraceFileReader r;
+    return r.open(path);
+}
+
+static void test_corrupt(const char *path, const char *copy,
+                         const std::vector<kernel_t> &ks) {
+    CHECK(write_trace(path, ks));
+    const std::vector<uint8_t> good = read_file(path);
+    CHECK(good.size() > 2 * TRACE_FILE_ALIGN);
+    if (good.size() <= 2 * TRACE_FILE_ALIGN) {
+        return;
+    }
+    CHECK(opens(copy, good));
+
+    /* truncated: shorter than a header, only the header, tables cut off,
+     * see below for the strings */
+    std::vector<uint8_t> d(good.begin(), good.begin() + 16);
+    CHECK(!opens(copy, d));
+    d.assign(good.begin(), good.begin() + TRACE_FILE_ALIGN);
+    CHECK(!opens(copy, d));
+    d.assign(good.begin(), good.end() - TRACE_FILE_ALIGN);
+    CHECK(!opens(copy, d));
+
+    /* header corruptions */
+    trace_file_header_t h;
+    memcpy(&h, good.data(), sizeof(h));
+    /* the last name cut off, the alignment padding after it may go */
+    d.assign(good.begin(), good.begin() + h.strings_offset + h.strings_size);
+    CHECK(opens(copy, d));
+    d.pop_back();
+    CHECK(!opens(copy, d));
+    auto with_header = [&](const trace_file_header_t &nh) {
+        std::vector<uint8_t> c = good;
+        memcpy(c.data(), &nh, sizeof(nh));
+        return c;
+    };
+    trace_file_header_t b = h;
+    b.magic[0] = 'X';
+    CHECK(!opens(copy, with_header(b)));
+    b = h;
+    b.version = TRACE_FILE_VERSION + 1;
+    CHECK(!opens(copy, with_header(b)));
+    b = h;
+    b.num_chunks = UINT64_MAX / sizeof(trace_chunk_t) + 1;
+    CHECK(!opens(copy, with_header(b)));
+    b = h;
+    b.kernel_table_offset = good.size();
+    CHECK(!opens(copy, with_header(b)));
+    b = h;
+    b.strings_size = good.size();
+    CHECK(!opens(copy, with_header(b)));
+    /* a file whose header was never written, as after a write error */
+    d = good;
+    memset(d.data(), 0, TRACE_FILE_ALIGN);
+    CHECK(!opens(copy, d));
+
+    /* a malformed packet in the last chunk of kernel 0 is found, unless
+     * the CTA filter skips the chunk */
+    uint64_t c = h.num_chunks;
+    {
+        TraceFileReader r;
+        CHECK(r.open(path));
+        c = r.kernel(0).first_chunk + r.kernel(0).num_chunks - 1;
+    }
+    trace_chunk_t ch;
+    memcpy(&ch, good.data() + h.index_offset + c * sizeof(ch), sizeof(ch));
+    d = good;
+    mem_packet_t *p = (mem_packet_t *)(d.data() + ch.offset);
+    p->payload_words++;
+    write_file(copy, d.data(), d.size());
+    {
+        TraceFileReader r;
+        CHECK(r.open(copy));
+        auto ignore = [](const mem_packet_t *) {};
+        CHECK(!r.for_each_packet(0, ignore));
+        CHECK(r.for_each_packet(0, ignore, 0, ch.min_cta));
+        CHECK(r.for_each_packet(2, ignore));
+    }
+
+    /* a chunk pointing out of the file or bigger than a chunk */
+    trace_chunk_t bad = ch;
+    bad.offset = good.size();
+    d = good;
+    memcpy(d.data() + h.index_offset + c * sizeof(bad), &bad, sizeof(bad));
+    write_file(copy, d.data(), d.size());
+    {
+        TraceFileReader r;
+        CHECK(r.open(copy));
+        CHECK(r.chunk_data(c) == NULL);
+        CHECK(!r.for_each_packet(0, [](const mem_packet_t *) {}));
+    }
+    bad = ch;
+    bad.nbytes = CHUNK_SIZE + 1;
+    d = good;
+    memcpy(d.data() + h.index_offset + c * sizeof(bad), &bad, sizeof(bad));
+    write_file(copy, d.data(), d.size());
+    {
+        TraceFileReader r;
+        CHECK(r.open(copy));
+        CHECK(r.chunk_data(c) == NULL);
+    }
+
+    /* a kernel whose chunks run past the index */
+    trace_kernel_t k;
+    memcpy(&k, good.data() + h.kernel_table_offset, sizeof(k));
+    k.num_chunks = h.num_chunks + 1;
+    d = good;
+    memcpy(d.data() + h.kernel_table_offset, &k, sizeof(k));
+    write_file(copy, d.data(), d.size());
+    {
+        TraceFileReader r;
+        CHECK(r.open(copy));
+        CHECK(!r.for_each_packet(0, [](const mem_packet_t *) {}));
+    }
+
+    /* a name without its terminator reads as "" */
+    d = good;
+    memset(d.data() + h.strings_offset, 'x', h.strings_size);
+    write_file(copy, d.data(), d.size());
+    {
+        TraceFileReader r;
+        CHECK(r.open(copy));
+        CHECK(strcmp(r.kernel_name(0), "") == 0);
+    }
+}
+
+/* /dev/full fails every write with ENOSPC: the first chunk flush fails and
+ * every later call reports it */
+static void test_write_error(const std::vector<kernel_t> &ks) {
+    TraceFileWriter w;
+    CHECK(!w.open("/dev/full", 1000));
+    if (!w.open("/dev/full", CHUNK_SIZE)) {
+        printf("skipping the write error test, cannot open /dev/full\n");
+        return;
+    }
+    CHECK(!w.has_failed());
+    w.begin_kernel(ks[0].info, ks[0].name.c_str());
+    size_t i = 0;
+    bool ok = true;
+    for (; i < ks[0].packets.size() && ok; i++) {
+        ok = w.add_packet((const mem_packet_t *)ks[0].packets[i].data());
+    }
+    /* the packets up to a full chunk are buffered, the next one fails */
+    CHECK(!ok);
+    CHECK(i > 1 && i < ks[0].packets.size());
+    CHECK(w.has_failed());
+    CHECK(!w.add_packet((const mem_packet_t *)ks[0].packets[0].data()));
+    CHECK(!w.end_kernel());
+    w.begin_kernel(ks[2].info, ks[2].name.c_str());
+    CHECK(!w.add_packet((const mem_packet_t *)ks[2].packets[0].data()));
+    CHECK(!w.end_kernel());
+    CHECK(!w.close(make_opcodes(), make_instrs()));
+    CHECK(!w.is_open());
+
+    /* a kernel that fits in one chunk fails on end_kernel */
+    CHECK(w.open("/dev/full", CHUNK_SIZE));
+    w.begin_kernel(ks[2].info, ks[2].name.c_str());
+    CHECK(w.add_packet((const mem_packet_t *)ks[2].packets[0].data()));
+    CHECK(!w.end_kernel());
+    CHECK(w.has_failed());
+    CHECK(!w.close(make_opcodes(), make_instrs()));
+
+    /* without any packet, the header write on close fails */
+    CHECK(w.open("/dev/full", CHUNK_SIZE));
+    CHECK(!w.close(make_opcodes(), make_instrs()));
+}
+
+int main() {
+    char path[] = "/tmp/test_trace_file_XXXXXX";
+    char copy[] = "/tmp/test_trace_file_copy_XXXXXX";
+    int fd = mkstemp(path);
+    int fd_copy = mkstemp(copy);
+    CHECK(fd >= 0 && fd_copy >= 0);
+    if (fd < 0 || fd_copy < 0) {
+        return host_test_done("test_trace_file");
+    }
+    close(fd);
+    close(fd_copy);
+
+    std::vector<kernel_t> ks = make_kernels();
+    test_round_trip(path, ks);
+    test_empty(path);
+    test_corrupt(path, copy, ks);
+    test_write_error(ks);
+
+    unlink(path);
+    unlink(copy);
+    return host_test_done("test_trace_file");
+}
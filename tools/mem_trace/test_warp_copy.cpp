@@ -0,0 +1,138 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host test of the warp cooperative packet copy (utils/warp_copy.h): for
+ * every destination alignment, packet size and number of active lanes, the
+ * lanes together write the packet exactly once and nothing around it, only
+ * rank 0 does 8 byte stores, the vector stores are 16 byte aligned and the
+ * chunks are spread evenly over the lanes. */
+
+#include <stdint.h>
+#include <string.h>
+#include <random>
+
+#include "utils/host_test.h"
+#include "utils/warp_copy.h"
+
+#define BUF_SIZE 512
+
+/* bytes written by the lane of the given rank, found by running it over
+ * two buffers filled with different values */
+static void written_by(int rank, int nactive, int offset,
+                       const uint64_t *src, uint32_t nbytes,
+                       bool *written, uint8_t *out) {
+    alignas(16) uint8_t a[BUF_SIZE], b[BUF_SIZE];
+    memset(a, 0x00, sizeof(a));
+    memset(b, 0xff, sizeof(b));
+    warp_copy_slice(a + offset, src, nbytes, rank, nactive);
+    warp_copy_slice(b + offset, src, nbytes, rank, nactive);
+    for (int i = 0; i < BUF_SIZE; i++) {
+        written[i] = a[i] != 0x00 || b[i] != 0xff;
+        if (written[i]) {
+            out[i] = a[i];
+        }
+    }
+}
+
+static void test_split() {
+    uint64_t src[BUF_SIZE / 8];
+    std::mt19937_64 rng(11);
+    for (auto &w : src) w = rng();
+
+    /* up to a whole mem_access_t sized packet and more */
+    for (int offset = 0; offset < 32; offset += 8) {
+        for (uint32_t nbytes = 0; nbytes <= 320; nbytes += 8) {
+            uint32_t words = nbytes / 8;
+            uint32_t head = offset % 16 != 0 && words > 0 ? 1 : 0;
+            uint32_t chunks = (words - head) / 2;
+            for (int nactive = 1; nactive <= 32; nactive++) {
+                int count[BUF_SIZE] = {0};
+                alignas(16) uint8_t out[BUF_SIZE];
+                for (int rank = 0; rank < nactive; rank++) {
+                    bool written[BUF_SIZE];
+                    written_by(rank, nactive, offset, src, nbytes, written,
+                               out);
+                    uint32_t lane_chunks = 0;
+                    for (int i = 0; i < BUF_SIZE; i++) {
+                        count[i] += written[i];
+                    }
+                    for (int i = 0; i < BUF_SIZE; i += 8) {
+                        if (!written[i]) continue;
+                        if (i % 16 == 0 && written[i + 8]) {
+                            /* a 16 byte store */
+                            lane_chunks++;
+                            i += 8;
+                        } else {
+                            /* 8 byte stores are the head and tail words */
+                            CHECK(rank == 0);
+                            CHECK(i == offset ||
+                                  i == offset + (int)nbytes - 8);
+                        }
+                    }
+                    /* round robin: ranks get chunks / nactive, rounded
+                     * up for the first ones */
+                    CHECK(lane_chunks ==
+                          chunks / nactive +
+                              ((uint32_t)rank < chunks % nactive ? 1 : 0));
+                }
+                for (int i = 0; i < BUF_SIZE; i++) {
+                    bool inside = i >= offset && i < offset + (int)nbytes;
+                    CHECK(count[i] == (inside ? 1 : 0));
+                }
+                CHECK(memcmp(out + offset, src, nbytes) == 0);
+            }
+        }
+    }
+}
+
+static void test_rank() {
+    CHECK(warp_rank(0xf0f0, 4) == 0);
+    CHECK(warp_rank(0xf0f0, 12) == 4);
+    CHECK(warp_rank(~0u, 31) == 31);
+    CHECK(warp_rank(0x80000000, 31) == 0);
+
+    /* a warp with random active lanes: ranks are 0 .. nactive - 1 in lane
+     * order, which is how push_warp deals the slices */
+    std::mt19937 rng(5);
+    for (int t = 0; t < 10000; t++) {
+        uint32_t mask = rng();
+        int next = 0;
+        for (int lane = 0; lane < 32; lane++) {
+            if ((mask >> lane) & 1) {
+                CHECK(warp_rank(mask, lane) == next);
+                next++;
+            }
+        }
+        CHECK(next == __builtin_popcount(mask));
+    }
+}
+
+int main() {
+    test_split();
+    test_rank();
+    return host_test_done("test_warp_copy");
+}
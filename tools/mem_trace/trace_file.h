@@ -0,0 +1,600 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/* Binary on-disk format of the traces written by mem_trace and the host side
+ * writer/reader for it. This file only depends on the C/C++ standard library
+ * and POSIX so that offline tools (see mem_trace_dump.cpp) can be built
+ * without CUDA.
+ *
+ * Layout (all integers little endian, all sections TRACE_FILE_ALIGN aligned):
+ *
+ *   trace_file_header_t            padded to TRACE_FILE_ALIGN
+ *   chunk 0 .. num_chunks-1        chunk_size bytes each
+ *   trace_chunk_t[num_chunks]      chunk index
+ *   trace_kernel_t[num_kernels]    kernel table
+ *   trace_opcode_t[num_opcodes]    opcode table
+ *   trace_instr_t[num_instrs]      static instruction table, by instr_id
+ *   strings                        '\0' terminated names
+ *
+ * Each chunk holds mem_packet_t records (see mem_packet.h) of a single kernel
+ * launch, packets never straddle two chunks. Since kernels and opcodes are
+ * only known once the application has run, the tables are written after the
+ * chunks and located through the header, which is rewritten on close. */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mem_packet.h"
+
+#define TRACE_FILE_MAGIC "NVBTRACE"
+#define TRACE_FILE_VERSION 2
+/* alignment of every section, also satisfies O_DIRECT requirements */
+#define TRACE_FILE_ALIGN 4096
+#define TRACE_FILE_DEFAULT_CHUNK_SIZE (1 << 20)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t num_chunks;
+    uint64_t index_offset;
+    uint64_t kernel_table_offset;
+    uint64_t opcode_table_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint32_t num_kernels;
+    uint32_t num_opcodes;
+    uint64_t instr_table_offset;
+    uint32_t num_instrs;
+    uint32_t reserved;
+} trace_file_header_t;
+
+/* chunk index entry */
+typedef struct {
+    /* file offset of the chunk */
+    uint64_t offset;
+    /* position of the kernel in the kernel table */
+    uint32_t kernel_idx;
+    /* number of valid bytes and packets in the chunk */
+    uint32_t nbytes;
+    uint32_t num_packets;
+    /* range of linear CTA ids of the packets in the chunk */
+    uint32_t min_cta;
+    uint32_t max_cta;
+    uint32_t reserved;
+} trace_chunk_t;
+
+/* kernel table entry, one per traced launch */
+typedef struct {
+    uint64_t name_offset;
+    uint64_t first_chunk;
+    uint64_t num_chunks;
+    uint64_t stream_id;
+    uint32_t kernel_id;
+    uint32_t grid_dim[3];
+    uint32_t block_dim[3];
+    int32_t nregs;
+    int32_t shmem_nbytes;
+    uint32_t reserved;
+} trace_kernel_t;
+
+/* opcode table entry */
+typedef struct {
+    uint64_t name_offset;
+    uint32_t opcode_id;
+    uint32_t reserved;
+} trace_opcode_t;
+
+/* static instruction table entry, entry i describes instr_id i */
+typedef struct {
+    uint64_t func_name_offset;
+    /* offset of the instruction in its function */
+    uint32_t offset;
+    uint32_t opcode_id;
+} trace_instr_t;
+
+/* static instruction as known by the tool, the writer turns them into
+ * trace_instr_t */
+typedef struct {
+    std::string func_name;
+    uint32_t offset;
+    uint32_t opcode_id;
+} trace_instr_info_t;
+
+static inline uint64_t trace_file_align(uint64_t n) {
+    return (n + TRACE_FILE_ALIGN - 1) / TRACE_FILE_ALIGN * TRACE_FILE_ALIGN;
+}
+
+static inline uint32_t trace_cta_linear_id(const trace_kernel_t &k,
+                                           const mem_packet_t *p) {
+    return p->cta_id_x + k.grid_dim[0] * p->cta_id_y +
+           k.grid_dim[0] * k.grid_dim[1] * p->cta_id_z;
+}
+
+/* text format of mem_trace, shared by the tool and mem_trace_dump */
+static inline void trace_print_kernel(FILE *f, const char *name,
+                                      const trace_kernel_t &k) {
+    fprintf(f,
+            "Kernel %s - grid size %d,%d,%d - block size %d,%d,%d - nregs "
+            "%d - shmem %d - cuda stream id %ld\n",
+            name, k.grid_dim[0], k.grid_dim[1], k.grid_dim[2], k.block_dim[0],
+            k.block_dim[1], k.block_dim[2], k.nregs, k.shmem_nbytes,
+            k.stream_id);
+}
+
+static inline void trace_print_packet(FILE *f, const mem_packet_t *p,
+                                      const char *opcode) {
+    uint64_t addrs[32];
+    mem_packet_decode(p, addrs);
+    fprintf(f, "CTA %d,%d,%d - warp %d - %s - ", p->cta_id_x, p->cta_id_y,
+            p->cta_id_z, p->warp_id, opcode);
+    for (int i = 0; i < 32; i++) {
+        fprintf(f, "0x%016lx ", addrs[i]);
+    }
+    fprintf(f, "\n");
+}
+
+/* Streams packets into fixed size chunks and writes each chunk with a
+ * single large write, using O_DIRECT when the file system supports it. After
+ * a write error nothing else is written, not even the header, so the file
+ * does not read back as a valid trace. */
+class TraceFileWriter {
+  private:
+    int fd;
+    bool direct;
+    bool failed;
+    uint32_t chunk_size;
+    uint8_t *chunk;
+    trace_chunk_t curr;
+    uint64_t file_offset;
+
+    std::vector<trace_chunk_t> index;
+    std::vector<trace_kernel_t> kernels;
+    std::string strings;
+
+    bool write_aligned(const void *buf, size_t nbytes, uint64_t offset) {
+        const uint8_t *p = (const uint8_t *)buf;
+        while (nbytes > 0) {
+            ssize_t n = pwrite(fd, p, nbytes, offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                fprintf(stderr, "TRACE FILE: write error: %s\n",
+                        n < 0 ? strerror(errno) : "no space written");
+                failed = true;
+                return false;
+            }
+            p += n;
+            offset += n;
+            nbytes -= n;
+        }
+        return true;
+    }
+
+    uint64_t add_string(const char *s) {
+        uint64_t off = strings.size();
+        strings.append(s);
+        strings.push_back('\0');
+        return off;
+    }
+
+    void reset_chunk() {
+        memset(&curr, 0, sizeof(curr));
+        curr.kernel_idx = kernels.size() - 1;
+        curr.min_cta = UINT32_MAX;
+    }
+
+    bool flush_chunk() {
+        if (failed) {
+            return false;
+        }
+        if (curr.num_packets == 0) {
+            return true;
+        }
+        /* chunks are always written in full to keep O_DIRECT happy */
+        memset(chunk + curr.nbytes, 0, chunk_size - curr.nbytes);
+        curr.offset = file_offset;
+        if (!write_aligned(chunk, chunk_size, file_offset)) {
+            return false;
+        }
+        file_offset += chunk_size;
+        index.push_back(curr);
+        kernels.back().num_chunks++;
+        reset_chunk();
+        return true;
+    }
+
+  public:
+    TraceFileWriter() : fd(-1), failed(false), chunk(NULL) {}
+
+    bool open(const char *path,
+              uint32_t chunk_size = TRACE_FILE_DEFAULT_CHUNK_SIZE) {
+        if (chunk_size == 0 || chunk_size % TRACE_FILE_ALIGN != 0) {
+            fprintf(stderr,
+                    "TRACE FILE: chunk size %u must be a multiple of %d\n",
+                    chunk_size, TRACE_FILE_ALIGN);
+            return false;
+        }
+        this->chunk_size = chunk_size;
+        direct = true;
+        fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if (fd < 0 && errno == EINVAL) {
+            /* file system without O_DIRECT support (i.e. tmpfs) */
+            direct = false;
+            fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+        if (fd < 0) {
+            fprintf(stderr, "TRACE FILE: cannot open %s: %s\n", path,
+                    strerror(errno));
+            return false;
+        }
+        if (posix_memalign((void **)&chunk, TRACE_FILE_ALIGN, chunk_size)) {
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        /* the header is written on close */
+        file_offset = TRACE_FILE_ALIGN;
+        failed = false;
+        index.clear();
+        kernels.clear();
+        strings.clear();
+        return true;
+    }
+
+    bool is_open() const { return fd >= 0; }
+
+    /* a write failed, the packets are not written anymore */
+    bool has_failed() const { return failed; }
+
+    /* info describes the launch, the chunk related fields are filled in by
+     * the writer */
+    void begin_kernel(const trace_kernel_t &info, const char *name) {
+        trace_kernel_t k = info;
+        k.name_offset = add_string(name);
+        k.first_chunk = index.size();
+        k.num_chunks = 0;
+        kernels.push_back(k);
+        reset_chunk();
+    }
+
+    /* false if the packet could not be written, now or earlier */
+    bool add_packet(const mem_packet_t *p) {
+        assert(!kernels.empty());
+        uint32_t size = mem_packet_size(p);
+        assert(size <= chunk_size);
+        if (failed) {
+            return false;
+        }
+        if (curr.nbytes + size > chunk_size && !flush_chunk()) {
+            return false;
+        }
+        memcpy(chunk + curr.nbytes, p, size);
+        curr.nbytes += size;
+        curr.num_packets++;
+
+        uint32_t cta = trace_cta_linear_id(kernels.back(), p);
+        if (cta < curr.min_cta) curr.min_cta = cta;
+        if (cta > curr.max_cta) curr.max_cta = cta;
+        return true;
+    }
+
+    bool end_kernel() { return flush_chunk(); }
+
+    /* write the tables and the header, id_to_opcode is the opcode map of
+     * the tool at the end of the run and instrs its static instructions,
+     * indexed by instr_id. Returns false if any write failed, in which
+     * case the file has no header */
+    bool close(const std::map<int, std::string> &id_to_opcode,
+               const std::vector<trace_instr_info_t> &instrs) {
+        if (fd < 0) {
+            return false;
+        }
+        if (!flush_chunk()) {
+            ::close(fd);
+            fd = -1;
+            free(chunk);
+            chunk = NULL;
+            return false;
+        }
+
+        std::vector<trace_opcode_t> opcodes;
+        for (auto &o : id_to_opcode) {
+            trace_opcode_t e;
+            memset(&e, 0, sizeof(e));
+            e.opcode_id = o.first;
+            e.name_offset = add_string(o.second.c_str());
+            opcodes.push_back(e);
+        }
+
+        std::vector<trace_instr_t> instr_table;
+        std::map<std::string, uint64_t> func_names;
+        for (auto &i : instrs) {
+            auto it = func_names.find(i.func_name);
+            if (it == func_names.end()) {
+                it = func_names
+                         .insert(std::make_pair(
+                             i.func_name, add_string(i.func_name.c_str())))
+                         .first;
+            }
+            trace_instr_t e;
+            e.func_name_offset = it->second;
+            e.offset = i.offset;
+            e.opcode_id = i.opcode_id;
+            instr_table.push_back(e);
+        }
+
+        trace_file_header_t h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, TRACE_FILE_MAGIC, sizeof(h.magic));
+        h.version = TRACE_FILE_VERSION;
+        h.chunk_size = chunk_size;
+        h.num_chunks = index.size();
+        h.num_kernels = kernels.size();
+        h.num_opcodes = opcodes.size();
+        h.num_instrs = instr_table.size();
+
+        /* lay out the tail sections and stage them in one aligned buffer */
+        uint64_t off = 0;
+        h.index_offset = file_offset + off;
+        off = trace_file_align(off + index.size() * sizeof(trace_chunk_t));
+        h.kernel_table_offset = file_offset + off;
+        off = trace_file_align(off + kernels.size() * sizeof(trace_kernel_t));
+        h.opcode_table_offset = file_offset + off;
+        off = trace_file_align(off + opcodes.size() * sizeof(trace_opcode_t));
+        h.instr_table_offset = file_offset + off;
+        off = trace_file_align(off +
+                               instr_table.size() * sizeof(trace_instr_t));
+        h.strings_offset = file_offset + off;
+        h.strings_size = strings.size();
+        off = trace_file_align(off + strings.size());
+
+        uint8_t *tail = NULL;
+        bool ok = off == 0 || posix_memalign((void **)&tail,
+                                             TRACE_FILE_ALIGN, off) == 0;
+        if (ok && off > 0) {
+            /* empty tables have no data() to copy from */
+            auto put = [&](uint64_t offset, const void *src, size_t n) {
+                if (n > 0) {
+                    memcpy(tail + (offset - file_offset), src, n);
+                }
+            };
+            memset(tail, 0, off);
+            put(h.index_offset, index.data(),
+                index.size() * sizeof(trace_chunk_t));
+            put(h.kernel_table_offset, kernels.data(),
+                kernels.size() * sizeof(trace_kernel_t));
+            put(h.opcode_table_offset, opcodes.data(),
+                opcodes.size() * sizeof(trace_opcode_t));
+            put(h.instr_table_offset, instr_table.data(),
+                instr_table.size() * sizeof(trace_instr_t));
+            put(h.strings_offset, strings.data(), strings.size());
+            ok = write_aligned(tail, off, file_offset);
+        }
+        free(tail);
+
+        memset(chunk, 0, TRACE_FILE_ALIGN);
+        memcpy(chunk, &h, sizeof(h));
+        ok = ok && write_aligned(chunk, TRACE_FILE_ALIGN, 0);
+
+        ::close(fd);
+        fd = -1;
+        free(chunk);
+        chunk = NULL;
+        return ok;
+    }
+};
+
+/* Read only, random access view of a trace file, the file is mmap'ed so
+ * only the chunks actually visited are paged in. */
+class TraceFileReader {
+  private:
+    const uint8_t *base;
+    size_t size;
+    const trace_file_header_t *h;
+    const trace_chunk_t *index;
+    const trace_kernel_t *kernels;
+    const trace_opcode_t *opcodes;
+    const trace_instr_t *instrs;
+    const char *strings;
+    std::map<uint32_t, const char *> opcode_names;
+
+    bool in_file(uint64_t offset, uint64_t nbytes) const {
+        return offset <= size && nbytes <= size - offset;
+    }
+
+    /* count entries of entry_size bytes at offset, count is checked first
+     * so that a corrupted one cannot wrap the size around */
+    bool table_in_file(uint64_t offset, uint64_t count,
+                       size_t entry_size) const {
+        return count <= size / entry_size &&
+               in_file(offset, count * entry_size);
+    }
+
+  public:
+    TraceFileReader() : base(NULL), size(0) {}
+    ~TraceFileReader() { close(); }
+
+    bool open(const char *path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "TRACE FILE: cannot open %s: %s\n", path,
+                    strerror(errno));
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(*h)) {
+            fprintf(stderr, "TRACE FILE: %s is too small\n", path);
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+        void *m = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (m == MAP_FAILED) {
+            fprintf(stderr, "TRACE FILE: cannot mmap %s: %s\n", path,
+                    strerror(errno));
+            return false;
+        }
+        base = (const uint8_t *)m;
+        h = (const trace_file_header_t *)base;
+
+        if (memcmp(h->magic, TRACE_FILE_MAGIC, sizeof(h->magic)) == 0 &&
+            h->version != TRACE_FILE_VERSION) {
+            fprintf(stderr, "TRACE FILE: %s has version %u, expected %u\n",
+                    path, h->version, TRACE_FILE_VERSION);
+            close();
+            return false;
+        }
+        if (memcmp(h->magic, TRACE_FILE_MAGIC, sizeof(h->magic)) != 0 ||
+            !table_in_file(h->index_offset, h->num_chunks,
+                           sizeof(trace_chunk_t)) ||
+            !table_in_file(h->kernel_table_offset, h->num_kernels,
+                           sizeof(trace_kernel_t)) ||
+            !table_in_file(h->opcode_table_offset, h->num_opcodes,
+                           sizeof(trace_opcode_t)) ||
+            !table_in_file(h->instr_table_offset, h->num_instrs,
+                           sizeof(trace_instr_t)) ||
+            !in_file(h->strings_offset, h->strings_size)) {
+            fprintf(stderr, "TRACE FILE: %s is not a valid trace file\n",
+                    path);
+            close();
+            return false;
+        }
+        index = (const trace_chunk_t *)(base + h->index_offset);
+        kernels = (const trace_kernel_t *)(base + h->kernel_table_offset);
+        opcodes = (const trace_opcode_t *)(base + h->opcode_table_offset);
+        instrs = (const trace_instr_t *)(base + h->instr_table_offset);
+        strings = (const char *)(base + h->strings_offset);
+        for (uint32_t i = 0; i < h->num_opcodes; i++) {
+            opcode_names[opcodes[i].opcode_id] =
+                get_string(opcodes[i].name_offset);
+        }
+        return true;
+    }
+
+    void close() {
+        if (base != NULL) {
+            munmap((void *)base, size);
+            base = NULL;
+        }
+        opcode_names.clear();
+    }
+
+    const trace_file_header_t &header() const { return *h; }
+
+    /* strings are bounds checked, a corrupted offset gives "" */
+    const char *get_string(uint64_t offset) const {
+        if (offset >= h->strings_size ||
+            memchr(strings + offset, '\0', h->strings_size - offset) == NULL) {
+            return "";
+        }
+        return strings + offset;
+    }
+
+    uint32_t num_kernels() const { return h->num_kernels; }
+    const trace_kernel_t &kernel(uint32_t i) const { return kernels[i]; }
+    const char *kernel_name(uint32_t i) const {
+        return get_string(kernels[i].name_offset);
+    }
+
+    const char *opcode_name(uint32_t opcode_id) const {
+        auto it = opcode_names.find(opcode_id);
+        return it == opcode_names.end() ? "" : it->second;
+    }
+
+    uint32_t num_instrs() const { return h->num_instrs; }
+    /* NULL for an unknown instr_id */
+    const trace_instr_t *instr(uint32_t instr_id) const {
+        return instr_id < h->num_instrs ? &instrs[instr_id] : NULL;
+    }
+
+    uint64_t num_chunks() const { return h->num_chunks; }
+    const trace_chunk_t &chunk(uint64_t i) const { return index[i]; }
+
+    /* returns NULL if the chunk does not lie within the file */
+    const uint8_t *chunk_data(uint64_t i) const {
+        const trace_chunk_t &c = index[i];
+        if (c.nbytes > h->chunk_size || !in_file(c.offset, c.nbytes)) {
+            return NULL;
+        }
+        return base + c.offset;
+    }
+
+    /* Call f(const mem_packet_t *) for every packet of kernel k (position
+     * in the kernel table) whose linear CTA id is in [cta_begin, cta_end).
+     * Chunks whose CTA range does not intersect are skipped without being
+     * touched. Returns false if a malformed chunk was found. */
+    template <typename F>
+    bool for_each_packet(uint32_t k, F f, uint32_t cta_begin = 0,
+                         uint32_t cta_end = UINT32_MAX) const {
+        const trace_kernel_t &kern = kernels[k];
+        if (kern.first_chunk > h->num_chunks ||
+            kern.num_chunks > h->num_chunks - kern.first_chunk) {
+            return false;
+        }
+        for (uint64_t c = kern.first_chunk;
+             c < kern.first_chunk + kern.num_chunks; c++) {
+            const trace_chunk_t &ch = index[c];
+            if (ch.max_cta < cta_begin || ch.min_cta >= cta_end) {
+                continue;
+            }
+            const uint8_t *data = chunk_data(c);
+            if (data == NULL) {
+                return false;
+            }
+            uint32_t off = 0;
+            while (off < ch.nbytes) {
+                uint32_t psize =
+                    mem_packet_validate(data + off, ch.nbytes - off);
+                if (psize == 0) {
+                    return false;
+                }
+                const mem_packet_t *p = (const mem_packet_t *)(data + off);
+                uint32_t cta = trace_cta_linear_id(kern, p);
+                if (cta >= cta_begin && cta < cta_end) {
+                    f(p);
+                }
+                off += psize;
+            }
+        }
+        return true;
+    }
+};
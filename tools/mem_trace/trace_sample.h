@@ -0,0 +1,66 @@
+/* Copyright (c) 2017, NVIDIA CORPORATION. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *  * Neither the name of NVIDIA CORPORATION nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "utils/host_device.h"
+
+/* Dynamic sampling policy of mem_trace, decided on the GPU before a warp
+ * pushes its packet. The policy is set with nvbit_set_at_launch at every
+ * launch, so it can change between launches without re-instrumenting; the
+ * instrumentation function receives the fields below as launch values at
+ * the offsets given by offsetof.
+ *
+ * A warp level execution is traced if:
+ * - the linear id of its CTA is in [cta_begin, cta_end)
+ * - warp_period is 0 or 1, or the hash of its global warp id is a multiple
+ *   of warp_period, so about 1 warp out of warp_period is traced, always
+ *   the same ones for the same launch configuration
+ * - max_execs is 0, or the instruction was traced less than max_execs times
+ *   in this launch; exec_counts points to the device counters, one per
+ *   instr_id, which are cleared at launch */
+typedef struct {
+    uint32_t warp_period;
+    uint32_t cta_begin;
+    uint32_t cta_end;
+    uint32_t max_execs;
+    uint64_t exec_counts;
+} trace_sample_t;
+
+HOST_DEVICE_INLINE uint32_t sample_hash(uint32_t x) { return hd_mix32(x); }
+
+/* the warp and CTA part of the policy, the same for every lane of a warp */
+HOST_DEVICE_INLINE bool sample_warp(uint32_t warp_period, uint32_t cta_begin,
+                                    uint32_t cta_end, uint32_t cta_id,
+                                    uint32_t global_warp_id) {
+    if (cta_id < cta_begin || cta_id >= cta_end) {
+        return false;
+    }
+    return warp_period <= 1 || sample_hash(global_warp_id) % warp_period == 0;
+}
@@ -180,15 +180,9 @@ void nvbit_at_function_first_load(CUcontext ctx, CUfunction func) {
     }
 }
 
+/* the replaced instructions do not produce any result the host needs to
+ * collect, so there is no need to synchronize at kernel exit and launches are
+ * left asynchronous */
 void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
-                         const char *name, void *params, CUresult *pStatus) {
-    /* Identify all the possible CUDA launch events */
-    if (cbid == API_CUDA_cuLaunch || cbid == API_CUDA_cuLaunchKernel_ptsz ||
-        cbid == API_CUDA_cuLaunchGrid || cbid == API_CUDA_cuLaunchGridAsync ||
-        cbid == API_CUDA_cuLaunchKernel) {
-        if (is_exit) {
-            CUDA_SAFECALL(cudaDeviceSynchronize());
-        }
-    }
-}
+                         const char *name, void *params, CUresult *pStatus) {}
 
@@ -32,6 +32,8 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <map>
+#include <utility>
+#include <vector>
 
 /* every tool needs to include this once */
 #include "nvbit_tool.h"
@@ -45,16 +47,64 @@
 /* provide some __device__ functions */
 #include "utils/utils.h"
 
+/* for in launch order reporting of asynchronously completed kernels */
+#include "utils/launch_collector.h"
+
 /* kernel id counter, maintained in system memory */
 uint32_t kernel_id = 0;
 
 /* total instruction counter, maintained in system memory, incremented by
- * "counter" every time a kernel completes  */
+ * "counter" every time a kernel completes (only touched by the collector
+ * thread) */
 uint64_t tot_app_instrs = 0;
 
-/* kernel instruction counter, updated by the GPU threads */
+/* Instead of counting every instruction, we count how many times each basic
+ * block is executed and rebuild the opcode histogram on the host from the
+ * static opcode histogram of the basic blocks. When predicated off
+ * instructions are excluded, the instructions with a predicate also count
+ * how many times they were predicated off, per opcode, and that is
+ * subtracted from the histogram.
+ *
+ * Kernel counters, updated by the GPU threads. Every launch in flight owns
+ * one slot, whose address is passed to the instrumentation functions with
+ * nvbit_set_at_launch, so kernels running concurrently on different streams
+ * do not "corrupt" each other counters. A slot holds MAX_BASIC_BLOCKS basic
+ * block execution counters followed by MAX_OPCODES predicated off
+ * counters. When a kernel completes the used part of its slot is copied to
+ * host_slots and then reset on the launch stream, so free slots are always
+ * zero (the function of a first launch is only instrumented after the entry
+ * callback, the used part is not known before the exit callback). */
 #define MAX_OPCODES (16 * 1024)
-__managed__ uint64_t histogram[MAX_OPCODES];
+#define MAX_BASIC_BLOCKS (64 * 1024)
+#define SLOT_WORDS (MAX_BASIC_BLOCKS + MAX_OPCODES)
+#define NUM_SLOTS 16
+uint64_t *dev_slots;
+uint64_t *host_slots;
+SlotPool slots;
+
+/* static opcode histogram of each instrumented basic block, as (opcode id,
+ * number of instructions) pairs, indexed by basic block id */
+std::vector<std::vector<std::pair<int, int> > > bb_opcodes;
+
+/* per launch context, from the launch until it is reported */
+struct launch_t {
+    uint32_t kernel_id;
+    int slot;
+    int num_ctas;
+    /* number of opcodes and basic blocks known at the end of the launch,
+     * i.e. counters to copy */
+    int num_opcodes;
+    int num_bbs;
+    std::string func_name;
+    LaunchCollector<launch_t>::handle_t handle;
+};
+
+/* reports completed launches in launch order */
+LaunchCollector<launch_t> collector;
+
+/* launch issued by the calling thread, between the entry and the exit
+ * callback of the launch */
+static __thread launch_t *curr_launch = NULL;
 
 /* global control variables for this tool */
 uint32_t instr_begin_interval = 0;
@@ -68,9 +118,15 @@ int exclude_pred_off = 0;
 /* instruction to opcode map, used for final print of the opcodes */
 std::map<std::string, int> instr_opcode_to_num_map;
 
-/* a pthread mutex, used to prevent multiple kernels to run concurrently and
- * therefore to "corrupt" the counter variable */
-pthread_mutex_t mutex;
+/* a pthread mutex, held from the entry to the exit callback of a launch:
+ * nvbit_set_at_launch and nvbit_enable_instrumented are per function, so a
+ * launch of the same function from another thread must not change them
+ * before the launch happens. It also keeps the kernel ids and the collector
+ * submissions in the same order. The launches themselves stay asynchronous */
+pthread_mutex_t launch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* a pthread mutex, protecting instr_opcode_to_num_map and bb_opcodes */
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* Instrumentation function that we want to inject, please note the use of
  * 1. extern "C" __device__ __noinline__ dev_func
@@ -79,32 +135,59 @@ pthread_mutex_t mutex;
  *    to notify nvbit the name of the function we want to inject.
  *    This name must match exactly the function name.
  */
-extern "C" __device__ __noinline__ void count_instrs(int predicate,
-                                                     int instr_type,
-                                                     int count_warp_level) {
+extern "C" __device__ __noinline__ void count_bb(int bb_id,
+                                                 int count_warp_level,
+                                                 uint64_t pslot) {
+    uint64_t *bb_counters = (uint64_t *)pslot;
     /* all the active threads will compute the active mask */
     const int active_mask = __ballot(1);
-    /* compute the predicate mask */
-    const int predicate_mask = __ballot(predicate);
     /* each thread will get a lane id (get_lane_id is in utils/utils.h) */
     const int laneid = get_laneid();
     /* get the id of the first active thread */
     const int first_laneid = __ffs(active_mask) - 1;
     /* count all the active thread */
-    const int num_threads = __popc(predicate_mask);
+    const int num_threads = __popc(active_mask);
     /* only the first active thread will perform the atomic */
     if (first_laneid == laneid) {
         if (count_warp_level) {
-            /* num threads can be zero when accounting for predicates off */
-            if (num_threads > 0)
-                atomicAdd((unsigned long long *)&histogram[instr_type], 1);
+            atomicAdd((unsigned long long *)&bb_counters[bb_id], 1);
         } else {
-            atomicAdd((unsigned long long *)&histogram[instr_type],
+            atomicAdd((unsigned long long *)&bb_counters[bb_id],
                       num_threads);
         }
     }
 }
-NVBIT_EXPORT_FUNC(count_instrs);
+NVBIT_EXPORT_FUNC(count_bb);
+
+extern "C" __device__ __noinline__ void count_pred_off(int predicate,
+                                                       int instr_type,
+                                                       int count_warp_level,
+                                                       uint64_t pslot) {
+    uint64_t *pred_off = (uint64_t *)pslot + MAX_BASIC_BLOCKS;
+
+    const int active_mask = __ballot(1);
+
+    const int laneid = get_laneid();
+
+    const int first_laneid = __ffs(active_mask) - 1;
+
+    const int predicate_mask = __ballot(predicate);
+
+    const int mask_off = active_mask ^ predicate_mask;
+
+    const int num_threads_off = __popc(mask_off);
+    if (first_laneid == laneid) {
+        if (count_warp_level) {
+            /* the instruction is not counted if the whole warp is off */
+            if (predicate_mask == 0)
+                atomicAdd((unsigned long long *)&pred_off[instr_type], 1);
+        } else if (num_threads_off > 0) {
+            atomicAdd((unsigned long long *)&pred_off[instr_type],
+                      num_threads_off);
+        }
+    }
+}
+NVBIT_EXPORT_FUNC(count_pred_off);
 
 /* nvbit_at_init() is executed as soon as the nvbit tool is loaded. We typically
  * do initializations in this call. In this case for instance we get some
@@ -144,63 +227,169 @@ void nvbit_at_init() {
  * and insert call to instrumentation functions before of after each one of
  * them. */
 void nvbit_at_function_first_load(CUcontext ctx, CUfunction func) {
-    /* Get the vector of instruction composing the loaded CUFunction "func" */
-    const std::vector<Instr *> &instrs = nvbit_get_instrs(ctx, func);
-
     /* Get kernel name */
     std::string kernel_name = nvbit_get_func_name(ctx, func);
 
-    /* If verbose we print function name and number of" static" instructions */
+    /* Get the basic blocks of the function, if the control flow graph can
+     * not be computed statically we fall back to one instruction per basic
+     * block, which is what counting every instruction amounts to */
+    std::vector<std::vector<Instr *> > blocks;
+    const CFG_t &cfg = nvbit_get_CFG(ctx, func);
+    if (cfg.is_degenerate) {
+        printf(
+            "Warning: Function %s is degenerated, counting every "
+            "instruction\n",
+            kernel_name.c_str());
+        for (auto i : nvbit_get_instrs(ctx, func)) {
+            blocks.push_back(std::vector<Instr *>(1, i));
+        }
+    } else {
+        for (auto &bb : cfg.bbs) {
+            blocks.push_back(bb->instrs);
+        }
+    }
+
+    /* If verbose we print function name and number of basic blocks */
     if (verbose) {
-        printf("inspecting %s - num instrs %ld\n", kernel_name.c_str(),
-               instrs.size());
+        printf("inspecting %s - number basic blocks %ld\n",
+               kernel_name.c_str(), blocks.size());
     }
 
-    /* We iterate on the vector of instruction */
-    for (auto i : instrs) {
-        /* Check if the instruction falls in the interval where we want to
-         * instrument */
-        if (i->getIdx() < instr_begin_interval ||
-            i->getIdx() >= instr_end_interval) {
-            continue;
-        }
-        /* If verbose we print which instruction we are instrumenting */
-        if (verbose) {
-            i->print();
+    pthread_mutex_lock(&mutex);
+    /* We iterate on the basic blocks */
+    for (auto &bb : blocks) {
+        if (bb_opcodes.size() >= MAX_BASIC_BLOCKS) {
+            printf("Error: more than %d basic blocks, %s is not counted\n",
+                   MAX_BASIC_BLOCKS, kernel_name.c_str());
+            break;
         }
 
-        std::string opcode = i->getOpcode();
-        if (instr_opcode_to_num_map.find(opcode) ==
-            instr_opcode_to_num_map.end()) {
-            size_t size = instr_opcode_to_num_map.size();
-            instr_opcode_to_num_map[opcode] = size;
-        }
-        int instr_type = instr_opcode_to_num_map[opcode];
+        std::map<int, int> hist;
+        for (auto i : bb) {
+            /* Check if the instruction falls in the interval where we want
+             * to instrument */
+            if (i->getIdx() < instr_begin_interval ||
+                i->getIdx() >= instr_end_interval) {
+                continue;
+            }
+            /* If verbose we print which instruction we are counting */
+            if (verbose) {
+                i->print();
+            }
 
-        /* Insert a call to "count_instrs" before the instruction "i" */
-        nvbit_insert_call(i, "count_instrs", IPOINT_BEFORE);
-        /* Add argument to the instrumentation function */
-        if (exclude_pred_off) {
-            /* pass predicate value */
-            nvbit_add_call_arg_pred_val(i);
-        } else {
-            /* pass always true */
-            nvbit_add_call_arg_const_val32(i, 1);
+            std::string opcode = i->getOpcode();
+            if (instr_opcode_to_num_map.find(opcode) ==
+                instr_opcode_to_num_map.end()) {
+                size_t size = instr_opcode_to_num_map.size();
+                assert(size < MAX_OPCODES);
+                instr_opcode_to_num_map[opcode] = size;
+            }
+            int instr_type = instr_opcode_to_num_map[opcode];
+            hist[instr_type]++;
+
+            if (exclude_pred_off && i->hasPred()) {
+                /* Insert a call to "count_pred_off" before the instruction */
+                nvbit_insert_call(i, "count_pred_off", IPOINT_BEFORE);
+                /* pass predicate value */
+                nvbit_add_call_arg_pred_val(i);
+                /* add instruction type id */
+                nvbit_add_call_arg_const_val32(i, instr_type);
+                /* add count warps option */
+                nvbit_add_call_arg_const_val32(i, count_warp_level);
+                /* add pointer to the counter slot of the launch */
+                nvbit_add_call_arg_launch_val64(i, 0);
+            }
         }
+        if (hist.empty()) {
+            continue;
+        }
+
+        int bb_id = bb_opcodes.size();
+        bb_opcodes.push_back(
+            std::vector<std::pair<int, int> >(hist.begin(), hist.end()));
 
-        /* add instruction type id */
-        nvbit_add_call_arg_const_val32(i, instr_type);
+        /* Insert a call to "count_bb" before the first instruction of the
+         * basic block */
+        Instr *i = bb[0];
+        nvbit_insert_call(i, "count_bb", IPOINT_BEFORE);
+        /* add basic block id */
+        nvbit_add_call_arg_const_val32(i, bb_id);
         /* add count warps option */
         nvbit_add_call_arg_const_val32(i, count_warp_level);
+        /* add pointer to the counter slot of the launch */
+        nvbit_add_call_arg_launch_val64(i, 0);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+/* stream on which the launch described by cbid/params is issued */
+cudaStream_t get_launch_stream(nvbit_api_cuda_t cbid, void *params) {
+    if (cbid == API_CUDA_cuLaunchKernel_ptsz) {
+        cuLaunchKernel_ptsz_params *p = (cuLaunchKernel_ptsz_params *)params;
+        return p->hStream != NULL ? p->hStream : cudaStreamPerThread;
+    } else if (cbid == API_CUDA_cuLaunchKernel) {
+        return ((cuLaunchKernel_params *)params)->hStream;
+    } else if (cbid == API_CUDA_cuLaunchGridAsync) {
+        return ((cuLaunchGridAsync_params *)params)->hStream;
     }
+    return 0;
+}
+
+/* stream callback, the kernel and the copy of its counter slot are done */
+void CUDART_CB launch_done(cudaStream_t stream, cudaError_t status,
+                           void *data) {
+    launch_t *l = (launch_t *)data;
+    collector.complete(l->handle);
+}
+
+/* called by the collector thread, in launch order */
+void report_launch(launch_t *l) {
+    uint64_t *bb_counters = &host_slots[(size_t)l->slot * SLOT_WORDS];
+    uint64_t *pred_off = bb_counters + MAX_BASIC_BLOCKS;
+
+    /* rebuild the opcode histogram from the basic block counters */
+    std::vector<uint64_t> histogram(l->num_opcodes, 0);
+    pthread_mutex_lock(&mutex);
+    for (int bb = 0; bb < l->num_bbs; bb++) {
+        if (bb_counters[bb] == 0) {
+            continue;
+        }
+        for (auto &op : bb_opcodes[bb]) {
+            histogram[op.first] += bb_counters[bb] * op.second;
+        }
+    }
+    uint64_t counter = 0;
+    for (int op = 0; op < l->num_opcodes; op++) {
+        if (exclude_pred_off) {
+            histogram[op] -= pred_off[op];
+        }
+        counter += histogram[op];
+    }
+    tot_app_instrs += counter;
+    printf(
+        "kernel %d - %s - #thread-blocks %d,  kernel "
+        "instructions %ld, total instructions %ld\n",
+        l->kernel_id, l->func_name.c_str(), l->num_ctas, counter,
+        tot_app_instrs);
+
+    for (auto a : instr_opcode_to_num_map) {
+        if (a.second < l->num_opcodes && histogram[a.second] != 0) {
+            printf("  %s = %ld\n", a.first.c_str(), histogram[a.second]);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+
+    slots.release(l->slot);
+    delete l;
 }
 
 /* This call-back is triggered every time a CUDA event is encountered.
- * Here, we identify CUDA kernel launch events and reset the "counter" before
- * th kernel is launched, and print the counter after the kernel has completed
- * (we make sure it has completed by using cudaDeviceSynchronize()). To
- * selectively run either the original or instrumented kernel we used
- * nvbit_enable_instrumented() before launching the kernel. */
+ * Here, we identify CUDA kernel launch events and copy the counter slot of
+ * the launch back after the kernel and reset it, both on the launch stream,
+ * so launches on different streams can still overlap. The histograms are
+ * printed in launch order by the collector thread. To selectively run either
+ * the original or instrumented kernel we used nvbit_enable_instrumented()
+ * before launching the kernel. */
 void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
                          const char *name, void *params, CUresult *pStatus) {
     /* Identify all the possible CUDA launch events */
@@ -210,57 +399,92 @@ void nvbit_at_cuda_event(CUcontext ctx, int is_exit, nvbit_api_cuda_t cbid,
         /* cast params to cuLaunch_params since if we are here we know these are
          * the right parameters type */
         cuLaunch_params *p = (cuLaunch_params *)params;
+        cudaStream_t stream = get_launch_stream(cbid, params);
 
         if (!is_exit) {
             /* if we are entering in a kernel launch:
-             * 1. Lock the mutex to prevent multiple kernels to run concurrently
-             * (overriding the counter) in case the user application does that
-             * 2. Select if we want to run the instrumented or original
+             * 1. Get a counter slot for this launch (waits if too many
+             * launches are in flight), it is already zero
+             * 2. Lock the launch mutex until the exit callback
+             * 3. Select if we want to run the instrumented or original
              * version of the kernel
-             * 3. Reset the kernel instruction counter */
+             * 4. Pass the slot address to the instrumentation function
+             * 5. Assign the kernel id and submit the launch to the
+             * collector */
+            launch_t *l = new launch_t;
+            l->slot = slots.acquire();
+            l->func_name = nvbit_get_func_name(ctx, p->f);
+            l->num_ctas = 0;
+            if (cbid == API_CUDA_cuLaunchKernel_ptsz ||
+                cbid == API_CUDA_cuLaunchKernel) {
+                cuLaunchKernel_params *p2 = (cuLaunchKernel_params *)params;
+                l->num_ctas = p2->gridDimX * p2->gridDimY * p2->gridDimZ;
+            }
 
-            pthread_mutex_lock(&mutex);
-            if (kernel_id >= ker_begin_interval &&
-                kernel_id < ker_end_interval) {
+            pthread_mutex_lock(&launch_mutex);
+            l->kernel_id = kernel_id++;
+            if (l->kernel_id >= ker_begin_interval &&
+                l->kernel_id < ker_end_interval) {
                 nvbit_enable_instrumented(ctx, p->f, true);
             } else {
                 nvbit_enable_instrumented(ctx, p->f, false);
             }
-            memset(histogram, 0, sizeof(uint64_t) * MAX_OPCODES);
+            uint64_t *pslot = &dev_slots[(size_t)l->slot * SLOT_WORDS];
+            nvbit_set_at_launch(ctx, p->f, &pslot, sizeof(pslot));
+            l->handle = collector.submit(l);
+            curr_launch = l;
         } else {
             /* if we are exiting a kernel launch:
-             * 1. Wait until the kernel is completed using
-             * cudaDeviceSynchronize()
-             * 2. Get number of thread blocks in the kernel
-             * 3. Print the thread instruction counters
-             * 4. Release the lock*/
-            CUDA_SAFECALL(cudaDeviceSynchronize());
-            int num_ctas = 0;
-            if (cbid == API_CUDA_cuLaunchKernel_ptsz ||
-                cbid == API_CUDA_cuLaunchKernel) {
-                cuLaunchKernel_params *p2 = (cuLaunchKernel_params *)params;
-                num_ctas = p2->gridDimX * p2->gridDimY * p2->gridDimZ;
-            }
-            uint64_t counter = 0;
-            for (auto a : instr_opcode_to_num_map) {
-                if (histogram[a.second] != 0) {
-                    counter += histogram[a.second];
-                }
-            }
-            tot_app_instrs += counter;
-            printf(
-                "kernel %d - %s - #thread-blocks %d,  kernel "
-                "instructions %ld, total instructions %ld\n",
-                kernel_id++, nvbit_get_func_name(ctx, p->f), num_ctas, counter,
-                tot_app_instrs);
-
-            for (auto a : instr_opcode_to_num_map) {
-                if (histogram[a.second] != 0) {
-                    printf("  %s = %ld\n", a.first.c_str(),
-                           histogram[a.second]);
-                }
-            }
+             * 1. Copy the used part of the counter slot back once the
+             * kernel is done and reset it, on the launch stream, so other
+             * streams keep running
+             * 2. Hand the launch to the collector thread when the copy is
+             * done, which prints the histogram in launch order
+             * 3. Unlock the launch mutex */
+            launch_t *l = curr_launch;
+            curr_launch = NULL;
+            assert(l != NULL);
+            /* the function is instrumented by now, even on its first
+             * launch */
+            pthread_mutex_lock(&mutex);
+            l->num_opcodes = instr_opcode_to_num_map.size();
+            l->num_bbs = bb_opcodes.size();
             pthread_mutex_unlock(&mutex);
+
+            size_t offset = (size_t)l->slot * SLOT_WORDS;
+            CUDA_SAFECALL(cudaMemcpyAsync(
+                &host_slots[offset], &dev_slots[offset],
+                sizeof(uint64_t) * l->num_bbs, cudaMemcpyDeviceToHost,
+                stream));
+            CUDA_SAFECALL(cudaMemsetAsync(
+                &dev_slots[offset], 0, sizeof(uint64_t) * l->num_bbs,
+                stream));
+            if (exclude_pred_off) {
+                offset += MAX_BASIC_BLOCKS;
+                CUDA_SAFECALL(cudaMemcpyAsync(
+                    &host_slots[offset], &dev_slots[offset],
+                    sizeof(uint64_t) * l->num_opcodes,
+                    cudaMemcpyDeviceToHost, stream));
+                CUDA_SAFECALL(cudaMemsetAsync(
+                    &dev_slots[offset], 0,
+                    sizeof(uint64_t) * l->num_opcodes, stream));
+            }
+            CUDA_SAFECALL(cudaStreamAddCallback(stream, launch_done, l, 0));
+            pthread_mutex_unlock(&launch_mutex);
         }
     }
 }
+
+void nvbit_at_ctx_init(CUcontext ctx) {
+    size_t nbytes = sizeof(uint64_t) * SLOT_WORDS * NUM_SLOTS;
+    CUDA_SAFECALL(cudaMalloc((void **)&dev_slots, nbytes));
+    CUDA_SAFECALL(cudaMemset(dev_slots, 0, nbytes));
+    CUDA_SAFECALL(cudaMallocHost((void **)&host_slots, nbytes));
+    slots.init(NUM_SLOTS);
+    collector.start(report_launch);
+}
+
+void nvbit_at_ctx_term(CUcontext ctx) {
+    /* print whatever is still in flight */
+    collector.stop();
+}